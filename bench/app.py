@@ -0,0 +1,23 @@
+#! /usr/bin/env python
+#-*- coding:utf-8 -*-
+
+# example/main.py plus the endpoints the bench scenarios need
+
+import os
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "example"))
+
+import main
+
+LARGE = b"x" * (1 << 20)
+
+
+def start(request, response):
+    if request.path == "/large":
+        response.end(LARGE)
+    elif request.path == "/upload":
+        response.end("%d" % len(request.raw))
+    else:
+        return main.start(request, response)
+    return True
@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+
+#include "core/sge.h"
+#include "core/list.h"
+#include "core/queue.h"
+#include "core/buffer.h"
+#include "core/accesslog.h"
+
+/*
+ * core-bench: microbenchmarks for the src/core primitives on the hot
+ * path. every case runs -r times and reports the median and the best
+ * run, so a replacement (a lock-free ring, another buffer layout) can be
+ * compared against the current implementation with -j output.
+ */
+
+#define NS_PER_SEC 1000000000ULL
+#define MAX_RUNS 64
+#define MAX_PRODUCERS 64
+
+typedef struct {
+	int runs;
+	uint64_t ops;
+	int producers;
+	const char* filter;
+	int json;
+} bench_option;
+
+typedef struct {
+	const char* name;
+	const char* param;
+	uint64_t param_value;
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t ns[MAX_RUNS];
+} bench_result;
+
+typedef struct {
+	sge_queue* queue;
+	uint64_t ops;
+	volatile int* start;
+} producer_arg;
+
+static bench_option OPT;
+
+static uint64_t now_ns();
+static int selected(const char* name);
+static void report(bench_result* r);
+static void bench_queue_single();
+static void bench_queue_mpsc(int producers);
+static void bench_buffer_append(size_t size);
+static void bench_buffer_consume(size_t size);
+static void bench_list_churn(size_t population);
+static void bench_access_log();
+
+uint64_t
+now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+int
+selected(const char* name) {
+	return NULL == OPT.filter || strstr(name, OPT.filter) != NULL;
+}
+
+static int
+compare_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+void
+report(bench_result* r) {
+	uint64_t sorted[MAX_RUNS];
+	double median, best;
+
+	memcpy(sorted, r->ns, sizeof(uint64_t) * OPT.runs);
+	qsort(sorted, OPT.runs, sizeof(uint64_t), compare_u64);
+	median = (double)sorted[OPT.runs / 2] / r->ops;
+	best = (double)sorted[0] / r->ops;
+
+	if (OPT.json) {
+		printf("{\"bench\":\"%s\",\"%s\":%lu,\"ops\":%lu,\"runs\":%d,"
+			"\"ns_per_op\":%.2f,\"best_ns_per_op\":%.2f,\"mops\":%.3f",
+			r->name, r->param, r->param_value, r->ops, OPT.runs,
+			median, best, 1e3 / median);
+		if (r->bytes) {
+			printf(",\"mb_per_sec\":%.1f", r->bytes * 1e9 / sorted[OPT.runs / 2] / 1048576);
+		}
+		printf("}\n");
+	} else {
+		printf("%-22s %-10s %-8lu %10.2f ns/op  best %8.2f  %9.3f Mops/s",
+			r->name, r->param, r->param_value, median, best, 1e3 / median);
+		if (r->bytes) {
+			printf("  %9.1f MB/s", r->bytes * 1e9 / sorted[OPT.runs / 2] / 1048576);
+		}
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+/*
+ * one thread, enqueue + dequeue per op: the uncontended cost of the lock
+ * and the ring.
+ */
+void
+bench_queue_single() {
+	bench_result r = {"queue_single", "depth", 64, OPT.ops, 0, {0}};
+	sge_queue* q = create_queue(1024);
+	uint64_t i, start;
+	void* data;
+	int run;
+
+	for (i = 0; i < r.param_value; ++i) {
+		enqueue(q, (void*)(uintptr_t)(i + 1));
+	}
+	for (run = 0; run < OPT.runs; ++run) {
+		start = now_ns();
+		for (i = 0; i < r.ops; ++i) {
+			enqueue(q, (void*)(uintptr_t)(i + 1));
+			dequeue(q, &data);
+		}
+		r.ns[run] = now_ns() - start;
+	}
+	destroy_queue(q);
+	report(&r);
+}
+
+static void*
+produce(void* arg) {
+	producer_arg* p = arg;
+	uint64_t i;
+
+	while (!*p->start) {
+	}
+	for (i = 0; i < p->ops; ++i) {
+		enqueue(p->queue, (void*)(uintptr_t)(i + 1));
+	}
+	return NULL;
+}
+
+/*
+ * n producers, one consumer spinning on dequeue, like the worker and
+ * server mailboxes. ops counts items through the queue in total.
+ */
+void
+bench_queue_mpsc(int producers) {
+	bench_result r = {"queue_mpsc", "producers", producers, 0, 0, {0}};
+	pthread_t tids[MAX_PRODUCERS];
+	producer_arg args[MAX_PRODUCERS];
+	volatile int go;
+	uint64_t received, start;
+	void* data;
+	int i, run;
+
+	r.ops = OPT.ops / producers * producers;
+	for (run = 0; run < OPT.runs; ++run) {
+		sge_queue* q = create_queue(1024);
+		go = 0;
+		for (i = 0; i < producers; ++i) {
+			args[i].queue = q;
+			args[i].ops = r.ops / producers;
+			args[i].start = &go;
+			pthread_create(&tids[i], NULL, produce, &args[i]);
+		}
+		start = now_ns();
+		go = 1;
+		for (received = 0; received < r.ops; ) {
+			dequeue(q, &data);
+			if (data) {
+				received++;
+			}
+		}
+		r.ns[run] = now_ns() - start;
+		for (i = 0; i < producers; ++i) {
+			pthread_join(tids[i], NULL);
+		}
+		destroy_queue(q);
+	}
+	report(&r);
+}
+
+/*
+ * grow one buffer from empty by appends of size bytes, like r_buf
+ * collecting a large request. ops is the number of appends.
+ */
+void
+bench_buffer_append(size_t size) {
+	bench_result r = {"buffer_append", "size", size, 0, 0, {0}};
+	char* chunk = sge_malloc(size);
+	uint64_t i, start;
+	int run;
+
+	// append_buffer grows by exactly len, so the copying is quadratic in
+	// the number of appends: keep the final buffer at 256KB
+	r.ops = (256 << 10) / size;
+	r.bytes = r.ops * size;
+	memset(chunk, 'x', size);
+	for (run = 0; run < OPT.runs; ++run) {
+		sge_buffer* buf = create_buffer(64);
+		start = now_ns();
+		for (i = 0; i < r.ops; ++i) {
+			buf = append_buffer(buf, chunk, size);
+		}
+		r.ns[run] = now_ns() - start;
+		destroy_buffer(buf);
+	}
+	sge_free(chunk);
+	report(&r);
+}
+
+/*
+ * steady state with 64KB pending: append size bytes at the tail and
+ * erase size bytes from the head, like a socket writing out a backlog.
+ */
+void
+bench_buffer_consume(size_t size) {
+	bench_result r = {"buffer_consume", "size", size, 0, 0, {0}};
+	char* chunk = sge_malloc(size);
+	size_t backlog = 64 * 1024;
+	uint64_t i, start;
+	int run;
+
+	r.ops = OPT.ops / 16;
+	r.bytes = r.ops * size;
+	memset(chunk, 'x', size);
+	for (run = 0; run < OPT.runs; ++run) {
+		sge_buffer* buf = create_buffer(backlog + size);
+		for (i = 0; i < backlog / size + 1; ++i) {
+			buf = append_buffer(buf, chunk, size);
+		}
+		start = now_ns();
+		for (i = 0; i < r.ops; ++i) {
+			buf = append_buffer(buf, chunk, size);
+			erase_buffer(buf, 0, size);
+		}
+		r.ns[run] = now_ns() - start;
+		destroy_buffer(buf);
+	}
+	sge_free(chunk);
+	report(&r);
+}
+
+/*
+ * a population of entries where every pass marks half of them removed,
+ * frees them with list_del and adds as many back, like the delayed close
+ * list. ops counts adds.
+ */
+void
+bench_list_churn(size_t population) {
+	bench_result r = {"list_churn", "population", population, 0, 0, {0}};
+	uint64_t i, start, added;
+	int run, n;
+
+	r.ops = OPT.ops / 4;
+	for (run = 0; run < OPT.runs; ++run) {
+		sge_list* list = list_create();
+		for (i = 0; i < population; ++i) {
+			list_add(list, (void*)(uintptr_t)(i + 1));
+		}
+		start = now_ns();
+		for (added = 0; added < r.ops; ) {
+			sge_list_iter* iter = list_iter_create(list);
+			for (n = 0; !list_iter_end(iter); list_iter_next(iter), ++n) {
+				if (n & 1) {
+					list_remove(iter);
+				}
+			}
+			list_iter_destroy(iter);
+			list_del(list);
+			for (i = 0; i < population / 2; ++i, ++added) {
+				list_add(list, (void*)(uintptr_t)(i + 1));
+			}
+		}
+		r.ns[run] = now_ns() - start;
+		list_destroy(list);
+	}
+	r.ops = added;
+	report(&r);
+}
+
+static void
+remove_dir(const char* dir) {
+	char path[512];
+	struct dirent* entry;
+	DIR* d = opendir(dir);
+
+	while (d && (entry = readdir(d)) != NULL) {
+		if (entry->d_name[0] != '.') {
+			snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+			unlink(path);
+		}
+	}
+	if (d) {
+		closedir(d);
+	}
+	rmdir(dir);
+}
+
+/*
+ * records written into one mapped segment large enough for the run, as
+ * the reactor does per request. rotation happens off this path.
+ */
+void
+bench_access_log() {
+	bench_result r = {"access_log", "record", ACCESS_RECORD_SIZE, 0, 0, {0}};
+	char dir[] = "/tmp/core-bench-XXXXXX", prefix[64];
+	sge_access_record record;
+	uint64_t i, start;
+	int run;
+
+	if (NULL == mkdtemp(dir)) {
+		perror("mkdtemp");
+		return;
+	}
+	snprintf(prefix, sizeof(prefix), "%s/access", dir);
+	r.ops = OPT.ops < 200000 ? OPT.ops : 200000;
+	r.bytes = r.ops * ACCESS_RECORD_SIZE;
+	memset(&record, 0, sizeof(record));
+	memcpy(record.method, "GET", 3);
+	record.path_len = snprintf(record.path, ACCESS_PATH_SIZE, "/api/v1/items/12345");
+	record.status = 200;
+	for (run = 0; run < OPT.runs; ++run) {
+		sge_access_log* log = create_access_log(prefix, (r.ops + 1) * ACCESS_RECORD_SIZE, 0);
+		if (NULL == log) {
+			remove_dir(dir);
+			return;
+		}
+		start = now_ns();
+		for (i = 0; i < r.ops; ++i) {
+			record.time = start + i;
+			record.bytes_out = i;
+			access_log_write(log, &record);
+		}
+		r.ns[run] = now_ns() - start;
+		destroy_access_log(log);
+	}
+	remove_dir(dir);
+	report(&r);
+}
+
+static void
+usage(const char* prog) {
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -r runs       runs per case, the median is reported (5)\n"
+		"  -n ops        operations per run (1000000)\n"
+		"  -p producers  max producer threads for queue_mpsc (cpus, up to 8)\n"
+		"  -f filter     only run cases whose name contains filter\n"
+		"  -j            one json object per case\n",
+		prog);
+}
+
+int
+main(int argc, char* argv[]) {
+	static const size_t buffer_sizes[] = {16, 256, 4096, 65536};
+	static const size_t populations[] = {16, 1024};
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t i;
+	int c, p;
+
+	OPT.runs = 5;
+	OPT.ops = 1000000;
+	OPT.producers = cpus > 8 ? 8 : (cpus > 1 ? cpus : 2);
+	while ((c = getopt(argc, argv, "r:n:p:f:jh")) != -1) {
+		switch (c) {
+			case 'r': OPT.runs = atoi(optarg); break;
+			case 'n': OPT.ops = strtoull(optarg, NULL, 10); break;
+			case 'p': OPT.producers = atoi(optarg); break;
+			case 'f': OPT.filter = optarg; break;
+			case 'j': OPT.json = 1; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if (OPT.runs < 1 || OPT.runs > MAX_RUNS || OPT.ops < 16
+		|| OPT.producers < 1 || OPT.producers > MAX_PRODUCERS) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (selected("queue_single")) {
+		bench_queue_single();
+	}
+	if (selected("queue_mpsc")) {
+		for (p = 1; p <= OPT.producers; ++p) {
+			bench_queue_mpsc(p);
+		}
+	}
+	for (i = 0; i < sizeof(buffer_sizes) / sizeof(buffer_sizes[0]); ++i) {
+		if (selected("buffer_append")) {
+			bench_buffer_append(buffer_sizes[i]);
+		}
+	}
+	for (i = 0; i < sizeof(buffer_sizes) / sizeof(buffer_sizes[0]); ++i) {
+		if (selected("buffer_consume")) {
+			bench_buffer_consume(buffer_sizes[i]);
+		}
+	}
+	for (i = 0; i < sizeof(populations) / sizeof(populations[0]); ++i) {
+		if (selected("list_churn")) {
+			bench_list_churn(populations[i]);
+		}
+	}
+	if (selected("access_log")) {
+		bench_access_log();
+	}
+	return 0;
+}
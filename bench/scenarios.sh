@@ -0,0 +1,118 @@
+#!/bin/sh
+# run the sge-bench scenarios against a freshly spawned sge-server that
+# serves the example app (bench/app.py).
+#
+# usage: bench/scenarios.sh [build_dir] [seconds]
+# set JSON=1 for one json object per scenario, e.g. to diff two builds.
+# the tls scenario listens on TLS_PORT (default 8443).
+
+BUILD=$(cd "${1:-build}" && pwd) || exit 1
+DURATION=${2:-5}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+TMP=$(mktemp -d)
+SOCK=$TMP/sge.sock
+TLS_PORT=${TLS_PORT:-8443}
+
+cat > "$TMP/bench_config.py" <<CONFIG
+config = {
+    "workdir": "$ROOT/bench",
+    "entry_file": "app",
+    "entry_func": "start",
+    "daemon": False,
+    "logfile": "$TMP/web.log",
+    "socket": "$SOCK",
+    "libdir": "$ROOT/src/python-lib"
+}
+CONFIG
+
+"$BUILD/sge-server" "$TMP/bench_config.py" > "$TMP/server.log" 2>&1 &
+PID=$!
+trap 'kill $PID $TLS_PID 2>/dev/null; wait 2>/dev/null; rm -rf "$TMP"' EXIT INT TERM
+
+# wait_for <socket> <pid> <log>
+wait_for() {
+    i=0
+    while [ ! -S "$1" ]; do
+        i=$((i + 1))
+        if [ $i -gt 50 ] || ! kill -0 "$2" 2>/dev/null; then
+            echo "sge-server did not start:" >&2
+            cat "$3" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+}
+
+run() {
+    name=$1
+    shift
+    "$BUILD/sge-bench" -u "$SOCK" -P $PID -d "$DURATION" -n "$name" ${JSON:+-j} "$@" || exit 1
+}
+
+# a counter from the admin socket of the tls server
+metric() {
+    curl -s --unix-socket "$TMP/tls_admin.sock" http://admin/metrics | awk -v name="$1" '$1 == name { print $2 }'
+}
+
+# sge-bench speaks plain http, so this one is a check rather than a
+# timing: a second server on a self-signed certificate answers curl over
+# http/1.1 and over h2 picked by ALPN, and the kernel either took the
+# records (sge_ktls_sessions_total moved) or OpenSSL wrote them. kTLS
+# wants `modprobe tls`.
+tls() {
+    if ! command -v openssl > /dev/null || ! command -v curl > /dev/null; then
+        echo "tls: skipped, needs openssl and curl"
+        return
+    fi
+    openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+        -keyout "$TMP/tls.key" -out "$TMP/tls.crt" > /dev/null 2>&1 || exit 1
+    cat > "$TMP/tls_config.py" <<CONFIG
+config = {
+    "workdir": "$ROOT/bench",
+    "entry_file": "app",
+    "entry_func": "start",
+    "daemon": False,
+    "logfile": "$TMP/tls_web.log",
+    "socket": "127.0.0.1:$TLS_PORT",
+    "tls_cert": "$TMP/tls.crt",
+    "tls_key": "$TMP/tls.key",
+    "http2": True,
+    "admin_socket": "$TMP/tls_admin.sock",
+    "libdir": "$ROOT/src/python-lib"
+}
+CONFIG
+    "$BUILD/sge-server" "$TMP/tls_config.py" > "$TMP/tls_server.log" 2>&1 &
+    TLS_PID=$!
+    wait_for "$TMP/tls_admin.sock" $TLS_PID "$TMP/tls_server.log"
+
+    before=$(metric sge_ktls_sessions_total)
+    http1=$(curl -sk --http1.1 -o /dev/null -w '%{http_code}' "https://127.0.0.1:$TLS_PORT/")
+    h2=$(curl -sk --http2 -o /dev/null -w '%{http_code} %{http_version}' "https://127.0.0.1:$TLS_PORT/")
+    after=$(metric sge_ktls_sessions_total)
+    ktls=false
+    if [ "${after:-0}" -gt "${before:-0}" ]; then
+        ktls=true
+    fi
+    kill $TLS_PID
+    wait $TLS_PID 2>/dev/null
+    TLS_PID=
+
+    if [ -n "$JSON" ]; then
+        echo "{\"name\": \"tls\", \"http1.1\": \"$http1\", \"h2\": \"$h2\", \"ktls\": $ktls}"
+    else
+        echo "tls: http/1.1 $http1, h2 $h2, kernel tls $ktls"
+    fi
+    if [ "$http1" != 200 ] || [ "$h2" != "200 2" ]; then
+        cat "$TMP/tls_server.log" >&2
+        exit 1
+    fi
+}
+
+wait_for "$SOCK" $PID "$TMP/server.log"
+
+run small-get -t 2 -c 32
+run small-get-open -t 2 -c 32 -R 2000
+run large-post -t 2 -c 8 -b 1048576 -p /upload
+run slow-reader -t 2 -c 16 -p /large -s 16384 -w 2
+run churn -t 2 -c 16 -C
+tls
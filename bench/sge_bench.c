@@ -0,0 +1,695 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <strings.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+
+#include "core/sge.h"
+#include "core/histogram.h"
+
+/*
+ * sge-bench: http load generator for sge-server.
+ *
+ * every thread runs its own epoll loop over a share of the connections.
+ * closed loop (default): a connection sends its next request as soon as
+ * the previous response is complete.
+ * open loop (-R rate): requests are due at a fixed rate whether or not
+ * the server keeps up, and latency is measured from the time a request
+ * was due rather than from when it was written, so a stalled server is
+ * not hidden by the client waiting for it (coordinated omission).
+ */
+
+#define MAX_EVENTS 256
+#define READ_SIZE 65536
+#define MAX_HEAD_SIZE 16384
+#define NS_PER_US 1000ULL
+#define NS_PER_MS 1000000ULL
+#define NS_PER_SEC 1000000000ULL
+
+typedef struct {
+	const char* unix_path;
+	const char* addr;
+	const char* method;
+	const char* path;
+	const char* name;
+	int threads;
+	int conns;
+	double duration;
+	double rate;
+	size_t body_size;
+	size_t slow;
+	int slow_wait;
+	int churn;
+	int json;
+	pid_t server_pid;
+	struct sockaddr_storage sa;
+	socklen_t sa_len;
+	char* request;
+	size_t request_len;
+} bench_option;
+
+typedef struct bench_thread bench_thread;
+
+typedef struct {
+	int fd;
+	int connecting;
+	int busy;
+	size_t sent;
+	char head[MAX_HEAD_SIZE];
+	size_t head_len;
+	int head_done;
+	int status;
+	int keep_alive;
+	int64_t body_left;
+	uint64_t due;
+	uint64_t start;
+	uint64_t resume;
+	bench_thread* thread;
+} bench_conn;
+
+struct bench_thread {
+	pthread_t tid;
+	int epfd;
+	int timerfd;
+	int nconn;
+	bench_conn* conns;
+	uint64_t interval;
+	uint64_t end;
+	sge_histogram* latency;
+	sge_histogram* service;
+	uint64_t requests;
+	uint64_t errors;
+	uint64_t non2xx;
+	uint64_t connects;
+	uint64_t bytes;
+};
+
+static bench_option OPT;
+
+static uint64_t now_ns();
+static int open_conn(bench_conn* conn, uint64_t now);
+static void close_conn(bench_conn* conn);
+static int send_request(bench_conn* conn, uint64_t now);
+static int on_writable(bench_conn* conn, uint64_t now);
+static int on_readable(bench_conn* conn, uint64_t now);
+static int parse_head(bench_conn* conn);
+static void finish_request(bench_conn* conn, uint64_t now);
+static void* run_thread(void* arg);
+static int resolve(bench_option* opt);
+static void build_request(bench_option* opt);
+static double proc_cpu_us(pid_t pid);
+static void report(bench_thread* threads, double elapsed, double client_cpu, double server_cpu);
+static void usage(const char* prog);
+
+uint64_t
+now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+int
+resolve(bench_option* opt) {
+	if (opt->unix_path) {
+		struct sockaddr_un* un = (struct sockaddr_un*)&opt->sa;
+		memset(un, 0, sizeof(*un));
+		un->sun_family = AF_UNIX;
+		strncpy(un->sun_path, opt->unix_path, sizeof(un->sun_path) - 1);
+		opt->sa_len = sizeof(*un);
+		return SGE_OK;
+	}
+
+	char host[256];
+	const char* p = strrchr(opt->addr, ':');
+	struct addrinfo hints, *res;
+	if (NULL == p || (size_t)(p - opt->addr) >= sizeof(host)) {
+		fprintf(stderr, "bad address %s, expect host:port\n", opt->addr);
+		return SGE_ERR;
+	}
+	memcpy(host, opt->addr, p - opt->addr);
+	host[p - opt->addr] = '\0';
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, p + 1, &hints, &res) != 0) {
+		fprintf(stderr, "can't resolve %s\n", opt->addr);
+		return SGE_ERR;
+	}
+	memcpy(&opt->sa, res->ai_addr, res->ai_addrlen);
+	opt->sa_len = res->ai_addrlen;
+	freeaddrinfo(res);
+	return SGE_OK;
+}
+
+void
+build_request(bench_option* opt) {
+	char head[1024];
+	int n = snprintf(head, sizeof(head),
+		"%s %s HTTP/1.1\r\nHost: sge-bench\r\n%s%s\r\n",
+		opt->method, opt->path,
+		opt->churn ? "Connection: close\r\n" : "",
+		opt->body_size ? "Content-Type: application/octet-stream\r\n" : "");
+	if (opt->body_size) {
+		n -= 2;
+		n += snprintf(head + n, sizeof(head) - n, "Content-Length: %zu\r\n\r\n", opt->body_size);
+	}
+	opt->request_len = n + opt->body_size;
+	opt->request = sge_malloc(opt->request_len);
+	memcpy(opt->request, head, n);
+	memset(opt->request + n, 'x', opt->body_size);
+}
+
+int
+open_conn(bench_conn* conn, uint64_t now) {
+	int fd = socket(OPT.sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return SGE_ERR;
+	}
+	if (OPT.sa.ss_family != AF_UNIX) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	if (OPT.slow) {
+		int size = (int)OPT.slow;
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+	conn->fd = fd;
+	conn->connecting = 1;
+	conn->thread->connects++;
+	if (connect(fd, (struct sockaddr*)&OPT.sa, OPT.sa_len) < 0 && errno != EINPROGRESS) {
+		close(fd);
+		conn->fd = -1;
+		return SGE_ERR;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLOUT | EPOLLIN;
+	ev.data.ptr = conn;
+	epoll_ctl(conn->thread->epfd, EPOLL_CTL_ADD, fd, &ev);
+	return SGE_OK;
+}
+
+void
+close_conn(bench_conn* conn) {
+	if (conn->fd >= 0) {
+		epoll_ctl(conn->thread->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+		close(conn->fd);
+	}
+	conn->fd = -1;
+	conn->busy = 0;
+	conn->connecting = 0;
+	conn->resume = 0;
+}
+
+int
+send_request(bench_conn* conn, uint64_t now) {
+	conn->busy = 1;
+	conn->sent = 0;
+	conn->head_len = 0;
+	conn->head_done = 0;
+	conn->start = now;
+	if (conn->fd < 0 && open_conn(conn, now) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (conn->connecting) {
+		return SGE_OK;
+	}
+	return on_writable(conn, now);
+}
+
+int
+on_writable(bench_conn* conn, uint64_t now) {
+	ssize_t n;
+	struct epoll_event ev;
+
+	if (conn->connecting) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err) {
+			errno = err;
+			return SGE_ERR;
+		}
+		conn->connecting = 0;
+	}
+
+	while (conn->sent < OPT.request_len) {
+		n = write(conn->fd, OPT.request + conn->sent, OPT.request_len - conn->sent);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				break;
+			}
+			return SGE_ERR;
+		}
+		conn->sent += n;
+	}
+	ev.events = conn->sent < OPT.request_len ? EPOLLOUT | EPOLLIN : EPOLLIN;
+	ev.data.ptr = conn;
+	epoll_ctl(conn->thread->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+	return SGE_OK;
+}
+
+static int
+header_is(const char* line, size_t len, const char* name) {
+	size_t n = strlen(name);
+	return len > n && line[n] == ':' && strncasecmp(line, name, n) == 0;
+}
+
+int
+parse_head(bench_conn* conn) {
+	char* end = memmem(conn->head, conn->head_len, "\r\n\r\n", 4);
+	char *line, *eol;
+	size_t head_size;
+
+	if (NULL == end) {
+		return conn->head_len >= MAX_HEAD_SIZE ? SGE_ERR : 0;
+	}
+	head_size = end - conn->head + 4;
+	if (conn->head_len < 12 || strncmp(conn->head, "HTTP/1.", 7)) {
+		return SGE_ERR;
+	}
+	conn->status = atoi(conn->head + 9);
+	conn->keep_alive = conn->head[7] == '1';
+	conn->body_left = -1;
+	for (line = memchr(conn->head, '\n', head_size) + 1; line < end; line = eol + 2) {
+		eol = memmem(line, end + 2 - line, "\r\n", 2);
+		if (header_is(line, eol - line, "Content-Length")) {
+			conn->body_left = strtoll(line + 15, NULL, 10);
+		} else if (header_is(line, eol - line, "Connection")) {
+			char* v = line + 11;
+			while (*v == ' ') {
+				v++;
+			}
+			conn->keep_alive = strncasecmp(v, "close", 5) != 0;
+		}
+	}
+	if (conn->body_left >= 0) {
+		conn->body_left -= conn->head_len - head_size;
+	} else {
+		conn->keep_alive = 0;
+	}
+	conn->head_done = 1;
+	return 1;
+}
+
+void
+finish_request(bench_conn* conn, uint64_t now) {
+	bench_thread* t = conn->thread;
+
+	t->requests++;
+	if (conn->status < 200 || conn->status >= 300) {
+		t->non2xx++;
+	}
+	histogram_record(t->service, (now - conn->start) / NS_PER_US);
+	histogram_record(t->latency, (now - (OPT.rate > 0 ? conn->due : conn->start)) / NS_PER_US);
+	conn->busy = 0;
+	if (!conn->keep_alive || OPT.churn) {
+		close_conn(conn);
+	}
+	if (OPT.rate > 0) {
+		conn->due += t->interval;
+	} else {
+		conn->due = now;
+	}
+}
+
+int
+on_readable(bench_conn* conn, uint64_t now) {
+	char buf[READ_SIZE];
+	ssize_t n;
+	size_t want, room;
+	int ret;
+
+	for (;;) {
+		want = OPT.slow ? OPT.slow : READ_SIZE;
+		if (!conn->head_done) {
+			room = MAX_HEAD_SIZE - conn->head_len;
+			n = read(conn->fd, conn->head + conn->head_len, want < room ? want : room);
+		} else {
+			n = read(conn->fd, buf, want);
+		}
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN ? SGE_OK : SGE_ERR;
+		}
+		if (n == 0) {
+			if (conn->busy && conn->head_done && conn->body_left < 0) {
+				finish_request(conn, now);
+				close_conn(conn);
+				return SGE_OK;
+			}
+			return conn->busy ? SGE_ERR : (close_conn(conn), SGE_OK);
+		}
+		conn->thread->bytes += n;
+		if (!conn->head_done) {
+			conn->head_len += n;
+			ret = parse_head(conn);
+			if (ret == SGE_ERR) {
+				return SGE_ERR;
+			}
+		} else if (conn->body_left > 0) {
+			conn->body_left -= n;
+		}
+		if (conn->head_done && conn->body_left == 0) {
+			finish_request(conn, now);
+			return SGE_OK;
+		}
+		if (OPT.slow) {
+			struct epoll_event ev;
+			ev.events = 0;
+			ev.data.ptr = conn;
+			epoll_ctl(conn->thread->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+			conn->resume = now + (uint64_t)OPT.slow_wait * NS_PER_MS;
+			return SGE_OK;
+		}
+	}
+}
+
+static void
+conn_error(bench_conn* conn) {
+	conn->thread->errors++;
+	close_conn(conn);
+	if (OPT.rate > 0) {
+		conn->due += conn->thread->interval;
+	}
+}
+
+void*
+run_thread(void* arg) {
+	bench_thread* t = arg;
+	struct epoll_event events[MAX_EVENTS];
+	bench_conn* conn;
+	struct itimerspec timer;
+	struct epoll_event ev;
+	uint64_t now, next;
+	int i, n;
+
+	memset(&timer, 0, sizeof(timer));
+	t->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->timerfd, &ev);
+
+	for (;;) {
+		now = now_ns();
+		if (now >= t->end) {
+			break;
+		}
+		next = t->end;
+		for (i = 0; i < t->nconn; ++i) {
+			conn = &t->conns[i];
+			if (conn->resume) {
+				if (conn->resume <= now) {
+					conn->resume = 0;
+					ev.events = EPOLLIN;
+					ev.data.ptr = conn;
+					epoll_ctl(t->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+				} else if (conn->resume < next) {
+					next = conn->resume;
+				}
+			}
+			if (conn->busy) {
+				continue;
+			}
+			if (conn->due <= now) {
+				if (send_request(conn, now) == SGE_ERR) {
+					conn_error(conn);
+				}
+			} else if (conn->due < next) {
+				next = conn->due;
+			}
+		}
+		// epoll_wait only has ms resolution, wake up on a timerfd instead
+		timer.it_value.tv_sec = next / NS_PER_SEC;
+		timer.it_value.tv_nsec = next % NS_PER_SEC;
+		timerfd_settime(t->timerfd, TFD_TIMER_ABSTIME, &timer, NULL);
+		n = epoll_wait(t->epfd, events, MAX_EVENTS, -1);
+		now = now_ns();
+		for (i = 0; i < n; ++i) {
+			conn = events[i].data.ptr;
+			if (NULL == conn) {
+				uint64_t expired;
+				if (read(t->timerfd, &expired, sizeof(expired)) < 0 && errno != EAGAIN) {
+					perror("timerfd");
+				}
+				continue;
+			}
+			if (conn->fd < 0) {
+				continue;
+			}
+			if ((events[i].events & (EPOLLOUT | EPOLLERR)) && (conn->connecting || conn->sent < OPT.request_len)) {
+				if (on_writable(conn, now) == SGE_ERR) {
+					conn_error(conn);
+					continue;
+				}
+			}
+			if (events[i].events & (EPOLLIN | EPOLLHUP) && conn->fd >= 0 && !conn->connecting) {
+				if (on_readable(conn, now) == SGE_ERR) {
+					conn_error(conn);
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < t->nconn; ++i) {
+		close_conn(&t->conns[i]);
+	}
+	close(t->timerfd);
+	return NULL;
+}
+
+/*
+ * utime + stime of a process from /proc, in microseconds.
+ */
+double
+proc_cpu_us(pid_t pid) {
+	char path[64], buf[1024];
+	unsigned long utime, stime;
+	FILE* f;
+	char* p;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	f = fopen(path, "r");
+	if (NULL == f) {
+		return -1;
+	}
+	if (NULL == fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	p = strrchr(buf, ')');
+	if (NULL == p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+		return -1;
+	}
+	return (double)(utime + stime) * 1e6 / sysconf(_SC_CLK_TCK);
+}
+
+static double
+self_cpu_us() {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec * 1e6 + ru.ru_utime.tv_usec + ru.ru_stime.tv_sec * 1e6 + ru.ru_stime.tv_usec;
+}
+
+void
+report(bench_thread* threads, double elapsed, double client_cpu, double server_cpu) {
+	sge_histogram* latency = create_histogram();
+	sge_histogram* service = create_histogram();
+	uint64_t requests = 0, errors = 0, non2xx = 0, connects = 0, bytes = 0;
+	int i;
+
+	for (i = 0; i < OPT.threads; ++i) {
+		histogram_merge(latency, threads[i].latency);
+		histogram_merge(service, threads[i].service);
+		requests += threads[i].requests;
+		errors += threads[i].errors;
+		non2xx += threads[i].non2xx;
+		connects += threads[i].connects;
+		bytes += threads[i].bytes;
+	}
+
+	double rps = requests / elapsed;
+	double client_per_req = requests ? client_cpu / requests : 0;
+	double server_per_req = requests && server_cpu >= 0 ? server_cpu / requests : -1;
+
+	if (OPT.json) {
+		printf("{\"name\":\"%s\",\"mode\":\"%s\",\"method\":\"%s\",\"path\":\"%s\","
+			"\"threads\":%d,\"connections\":%d,\"duration\":%.3f,\"rate\":%.1f,"
+			"\"body_size\":%zu,\"churn\":%d,\"slow\":%zu,"
+			"\"requests\":%lu,\"errors\":%lu,\"non2xx\":%lu,\"connects\":%lu,\"bytes_read\":%lu,"
+			"\"rps\":%.1f,"
+			"\"latency_us\":{\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu,\"mean\":%.1f},"
+			"\"service_us\":{\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu,\"mean\":%.1f},"
+			"\"client_cpu_us_per_req\":%.2f,\"server_cpu_us_per_req\":%.2f}\n",
+			OPT.name, OPT.rate > 0 ? "open" : "closed", OPT.method, OPT.path,
+			OPT.threads, OPT.conns, elapsed, OPT.rate,
+			OPT.body_size, OPT.churn, OPT.slow,
+			requests, errors, non2xx, connects, bytes,
+			rps,
+			histogram_percentile(latency, 50), histogram_percentile(latency, 90),
+			histogram_percentile(latency, 99), histogram_percentile(latency, 99.9),
+			histogram_max(latency), histogram_mean(latency),
+			histogram_percentile(service, 50), histogram_percentile(service, 90),
+			histogram_percentile(service, 99), histogram_percentile(service, 99.9),
+			histogram_max(service), histogram_mean(service),
+			client_per_req, server_per_req);
+	} else {
+		printf("%s: %s %s, %d threads, %d connections, %.1fs, %s",
+			OPT.name, OPT.method, OPT.path, OPT.threads, OPT.conns, elapsed,
+			OPT.rate > 0 ? "open loop" : "closed loop");
+		if (OPT.rate > 0) {
+			printf(" at %.0f req/s", OPT.rate);
+		}
+		printf("\n");
+		printf("  requests    %lu (%.1f req/s), %.2f MB/s read\n", requests, rps, bytes / elapsed / 1048576);
+		printf("  errors      %lu, non-2xx %lu, connects %lu\n", errors, non2xx, connects);
+		printf("  latency     p50 %luus  p90 %luus  p99 %luus  p99.9 %luus  max %luus  mean %.1fus%s\n",
+			histogram_percentile(latency, 50), histogram_percentile(latency, 90),
+			histogram_percentile(latency, 99), histogram_percentile(latency, 99.9),
+			histogram_max(latency), histogram_mean(latency),
+			OPT.rate > 0 ? " (from due time)" : "");
+		if (OPT.rate > 0) {
+			printf("  service     p50 %luus  p90 %luus  p99 %luus  p99.9 %luus  max %luus  mean %.1fus\n",
+				histogram_percentile(service, 50), histogram_percentile(service, 90),
+				histogram_percentile(service, 99), histogram_percentile(service, 99.9),
+				histogram_max(service), histogram_mean(service));
+		}
+		printf("  cpu/request client %.2fus", client_per_req);
+		if (server_per_req >= 0) {
+			printf("  server %.2fus", server_per_req);
+		}
+		printf("\n");
+	}
+	destroy_histogram(latency);
+	destroy_histogram(service);
+}
+
+void
+usage(const char* prog) {
+	fprintf(stderr,
+		"usage: %s (-u unix_path | -a host:port) [options]\n"
+		"  -t threads      worker threads (1)\n"
+		"  -c connections  total connections (16)\n"
+		"  -d seconds      duration (10)\n"
+		"  -R rate         open loop at rate req/s in total, 0 for closed loop (0)\n"
+		"  -m method       request method (GET, POST with -b)\n"
+		"  -p path         request path (/)\n"
+		"  -b bytes        request body size (0)\n"
+		"  -C              connection churn: one request per connection\n"
+		"  -s bytes        slow reader: read at most bytes at a time\n"
+		"  -w ms           slow reader: wait between reads (10)\n"
+		"  -P pid          server pid, report server cpu per request\n"
+		"  -n name         scenario name in the report\n"
+		"  -j              print one json object instead of text\n",
+		prog);
+}
+
+int
+main(int argc, char* argv[]) {
+	int c, i;
+
+	OPT.threads = 1;
+	OPT.conns = 16;
+	OPT.duration = 10;
+	OPT.path = "/";
+	OPT.name = "bench";
+	OPT.slow_wait = 10;
+	while ((c = getopt(argc, argv, "u:a:t:c:d:R:m:p:b:Cs:w:P:n:jh")) != -1) {
+		switch (c) {
+			case 'u': OPT.unix_path = optarg; break;
+			case 'a': OPT.addr = optarg; break;
+			case 't': OPT.threads = atoi(optarg); break;
+			case 'c': OPT.conns = atoi(optarg); break;
+			case 'd': OPT.duration = atof(optarg); break;
+			case 'R': OPT.rate = atof(optarg); break;
+			case 'm': OPT.method = optarg; break;
+			case 'p': OPT.path = optarg; break;
+			case 'b': OPT.body_size = strtoul(optarg, NULL, 10); break;
+			case 'C': OPT.churn = 1; break;
+			case 's': OPT.slow = strtoul(optarg, NULL, 10); break;
+			case 'w': OPT.slow_wait = atoi(optarg); break;
+			case 'P': OPT.server_pid = atoi(optarg); break;
+			case 'n': OPT.name = optarg; break;
+			case 'j': OPT.json = 1; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if ((!OPT.unix_path && !OPT.addr) || OPT.threads < 1 || OPT.conns < OPT.threads || OPT.duration <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (NULL == OPT.method) {
+		OPT.method = OPT.body_size ? "POST" : "GET";
+	}
+	if (resolve(&OPT) == SGE_ERR) {
+		return 1;
+	}
+	build_request(&OPT);
+
+	bench_thread* threads = calloc(OPT.threads, sizeof(bench_thread));
+	double client_cpu = self_cpu_us();
+	double server_cpu = OPT.server_pid ? proc_cpu_us(OPT.server_pid) : -1;
+	uint64_t start = now_ns();
+	uint64_t end = start + (uint64_t)(OPT.duration * NS_PER_SEC);
+
+	for (i = 0; i < OPT.threads; ++i) {
+		bench_thread* t = &threads[i];
+		int j;
+		t->nconn = OPT.conns / OPT.threads + (i < OPT.conns % OPT.threads);
+		t->conns = calloc(t->nconn, sizeof(bench_conn));
+		t->epfd = epoll_create1(EPOLL_CLOEXEC);
+		t->end = end;
+		t->latency = create_histogram();
+		t->service = create_histogram();
+		// every connection is due once per interval, staggered across it
+		t->interval = OPT.rate > 0 ? (uint64_t)(OPT.conns * (double)NS_PER_SEC / OPT.rate) : 0;
+		for (j = 0; j < t->nconn; ++j) {
+			bench_conn* conn = &t->conns[j];
+			conn->fd = -1;
+			conn->thread = t;
+			conn->due = start + (OPT.rate > 0 ? t->interval * (uint64_t)(j * OPT.threads + i) / OPT.conns : 0);
+		}
+		pthread_create(&t->tid, NULL, run_thread, t);
+	}
+	for (i = 0; i < OPT.threads; ++i) {
+		pthread_join(threads[i].tid, NULL);
+	}
+
+	double elapsed = (now_ns() - start) / (double)NS_PER_SEC;
+	client_cpu = self_cpu_us() - client_cpu;
+	if (server_cpu >= 0) {
+		double after = proc_cpu_us(OPT.server_pid);
+		server_cpu = after >= 0 ? after - server_cpu : -1;
+	}
+	report(threads, elapsed, client_cpu, server_cpu);
+
+	for (i = 0; i < OPT.threads; ++i) {
+		close(threads[i].epfd);
+		destroy_histogram(threads[i].latency);
+		destroy_histogram(threads[i].service);
+		free(threads[i].conns);
+	}
+	free(threads);
+	sge_free(OPT.request);
+	return 0;
+}
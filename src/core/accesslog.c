@@ -0,0 +1,275 @@
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "core/sge.h"
+#include "core/log.h"
+#include "core/spinlock.h"
+#include "core/accesslog.h"
+
+/*
+ * the access log is written by the reactor only, into a segment file
+ * that is pre-allocated and mapped (and pre-faulted) by a helper thread.
+ * a request costs a copy into the mapping; rotating swaps in the segment
+ * the helper prepared and hands the old one back to be unmapped and cut
+ * to its used size, so the reactor never waits for the file system.
+ * when no segment is ready records are dropped and counted.
+ */
+
+#define ROTATOR_TICK_NS 50000000
+
+_Static_assert(sizeof(sge_access_header) == ACCESS_RECORD_SIZE, "access log header size");
+_Static_assert(sizeof(sge_access_record) == ACCESS_RECORD_SIZE, "access log record size");
+
+typedef struct sge_access_segment {
+	int fd;
+	char* name;
+	uint64_t size;
+	sge_access_header* header;
+	sge_access_record* records;
+	uint64_t count;
+	uint64_t expire;
+	struct sge_access_segment* next;
+} sge_access_segment;
+
+struct sge_access_log {
+	char* prefix;
+	uint64_t segment_size;
+	uint64_t rotate_ns;
+	int run;
+	int failed;
+	uint64_t dropped;
+	pthread_t tid;
+	sge_spinlock lock;
+	sge_access_segment* current;
+	sge_access_segment* next;
+	sge_access_segment* retired;
+};
+
+static uint32_t SEGMENT_SEQ = 0;
+
+static sge_access_segment* open_segment(sge_access_log* log);
+static void close_segment(sge_access_segment* seg);
+static sge_access_segment* switch_segment(sge_access_log* log, uint64_t now);
+static void* rotator(void* arg);
+
+
+sge_access_segment*
+open_segment(sge_access_log* log) {
+	int fd, ret, n;
+	uint64_t off;
+	char name[PATH_MAX];
+	void* base;
+	time_t t = time(NULL);
+	struct tm tm;
+	sge_access_segment* seg;
+
+	localtime_r(&t, &tm);
+	n = snprintf(name, sizeof(name), "%s.", log->prefix);
+	n += strftime(name + n, sizeof(name) - n, "%Y%m%d-%H%M%S", &tm);
+	snprintf(name + n, sizeof(name) - n, ".%d.%u", (int)getpid(),
+		__atomic_fetch_add(&SEGMENT_SEQ, 1, __ATOMIC_RELAXED));
+
+	fd = open(name, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (fd < 0) {
+		goto ERR;
+	}
+	ret = posix_fallocate(fd, 0, log->segment_size);
+	if (ret != 0 && ftruncate(fd, log->segment_size) < 0) {
+		goto ERR_FD;
+	}
+	base = mmap(NULL, log->segment_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, 0);
+	if (base == MAP_FAILED) {
+		goto ERR_FD;
+	}
+
+	// the first write to a clean shared page faults even when populated:
+	// dirty every page here instead of in the reactor
+	for (off = 0; off < log->segment_size; off += 4096) {
+		((volatile char*)base)[off] = 0;
+	}
+
+	seg = sge_malloc(sizeof(*seg));
+	seg->fd = fd;
+	seg->name = strdup(name);
+	seg->size = log->segment_size;
+	seg->header = base;
+	seg->records = (sge_access_record*)(seg->header + 1);
+	seg->count = 0;
+	seg->expire = 0;
+	seg->next = NULL;
+	memset(seg->header, 0, sizeof(*seg->header));
+	memcpy(seg->header->magic, ACCESS_LOG_MAGIC, sizeof(ACCESS_LOG_MAGIC));
+	seg->header->version = ACCESS_LOG_VERSION;
+	seg->header->record_size = ACCESS_RECORD_SIZE;
+	seg->header->capacity = seg->size / ACCESS_RECORD_SIZE - 1;
+	log->failed = 0;
+	return seg;
+
+ERR_FD:
+	ret = errno;
+	close(fd);
+	unlink(name);
+	errno = ret;
+ERR:
+	if (!log->failed) {
+		ERROR("can't create access log segment %s: %s", name, strerror(errno));
+		log->failed = 1;
+	}
+	return NULL;
+}
+
+/*
+ * unmap a segment and cut the file to the records written. a segment
+ * that never got a record is removed.
+ */
+void
+close_segment(sge_access_segment* seg) {
+	uint64_t used = (seg->count + 1) * ACCESS_RECORD_SIZE;
+
+	munmap(seg->header, seg->size);
+	if (seg->count == 0) {
+		unlink(seg->name);
+	} else if (ftruncate(seg->fd, used) < 0) {
+		ERROR("can't truncate %s: %s", seg->name, strerror(errno));
+	}
+	close(seg->fd);
+	sge_free(seg->name);
+	sge_free(seg);
+}
+
+/*
+ * take the prepared segment, if any. without one a full segment is
+ * retired anyway and an expired one keeps being written.
+ */
+sge_access_segment*
+switch_segment(sge_access_log* log, uint64_t now) {
+	sge_access_segment* cur = log->current, *next;
+
+	SPIN_LOCK(log);
+	next = log->next;
+	log->next = NULL;
+	if (cur && (next || cur->count == cur->header->capacity)) {
+		cur->next = log->retired;
+		log->retired = cur;
+		log->current = NULL;
+	}
+	SPIN_UNLOCK(log);
+
+	if (next) {
+		next->header->created = now;
+		next->expire = now + log->rotate_ns;
+		log->current = next;
+	}
+	return log->current;
+}
+
+void*
+rotator(void* arg) {
+	sge_access_log* log = arg;
+	sge_access_segment* retired, *seg;
+	struct timespec tick = {0, ROTATOR_TICK_NS};
+	int need;
+
+	while (__atomic_load_n(&log->run, __ATOMIC_ACQUIRE)) {
+		SPIN_LOCK(log);
+		need = NULL == log->next;
+		retired = log->retired;
+		log->retired = NULL;
+		SPIN_UNLOCK(log);
+
+		for (; retired; retired = seg) {
+			seg = retired->next;
+			close_segment(retired);
+		}
+		if (need && (seg = open_segment(log)) != NULL) {
+			SPIN_LOCK(log);
+			log->next = seg;
+			SPIN_UNLOCK(log);
+		}
+		nanosleep(&tick, NULL);
+	}
+	return NULL;
+}
+
+sge_access_log*
+create_access_log(const char* prefix, uint64_t segment_size, uint32_t rotate_sec) {
+	sge_access_log* log = sge_malloc(sizeof(*log));
+
+	memset(log, 0, sizeof(*log));
+	SPIN_INIT(log);
+	log->prefix = strdup(prefix);
+	log->segment_size = segment_size / ACCESS_RECORD_SIZE * ACCESS_RECORD_SIZE;
+	if (log->segment_size < 2 * ACCESS_RECORD_SIZE) {
+		log->segment_size = 2 * ACCESS_RECORD_SIZE;
+	}
+	log->rotate_ns = (uint64_t)rotate_sec * 1000000000ULL;
+
+	// the first segment is opened here so a bad path fails the start
+	log->next = open_segment(log);
+	if (NULL == log->next) {
+		goto ERR;
+	}
+	log->run = 1;
+	if (pthread_create(&log->tid, NULL, rotator, log) != 0) {
+		log->run = 0;
+		goto ERR;
+	}
+	return log;
+
+ERR:
+	if (log->next) {
+		close_segment(log->next);
+	}
+	sge_free(log->prefix);
+	sge_free(log);
+	return NULL;
+}
+
+void
+destroy_access_log(sge_access_log* log) {
+	sge_access_segment* seg, *next;
+
+	__atomic_store_n(&log->run, 0, __ATOMIC_RELEASE);
+	pthread_join(log->tid, NULL);
+	if (log->current) {
+		close_segment(log->current);
+	}
+	if (log->next) {
+		close_segment(log->next);
+	}
+	for (seg = log->retired; seg; seg = next) {
+		next = seg->next;
+		close_segment(seg);
+	}
+	SPIN_DESTROY(log);
+	sge_free(log->prefix);
+	sge_free(log);
+}
+
+int
+access_log_write(sge_access_log* log, const sge_access_record* record) {
+	sge_access_segment* seg = log->current;
+
+	if (NULL == seg || seg->count == seg->header->capacity
+		|| (log->rotate_ns && record->time >= seg->expire)) {
+		seg = switch_segment(log, record->time);
+		if (NULL == seg || seg->count == seg->header->capacity) {
+			__atomic_store_n(&log->dropped, log->dropped + 1, __ATOMIC_RELAXED);
+			return SGE_ERR;
+		}
+	}
+	memcpy(&seg->records[seg->count++], record, sizeof(*record));
+	__atomic_store_n(&seg->header->count, seg->count, __ATOMIC_RELEASE);
+	return SGE_OK;
+}
+
+uint64_t
+access_log_dropped(sge_access_log* log) {
+	return __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+}
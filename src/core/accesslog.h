@@ -0,0 +1,57 @@
+#ifndef ACCESSLOG_H_
+#define ACCESSLOG_H_
+
+#include <stdint.h>
+
+#define ACCESS_LOG_MAGIC "SGEALOG"
+#define ACCESS_LOG_VERSION 1
+#define ACCESS_RECORD_SIZE 256
+#define ACCESS_METHOD_SIZE 8
+#define ACCESS_PATH_SIZE 176
+
+/*
+ * on-disk layout of a segment: one header followed by fixed size
+ * records, all in host byte order. `count` is updated after every
+ * record, so a segment cut short by a crash is still readable.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t created;
+	uint64_t count;
+	uint64_t capacity;
+	uint8_t reserved[ACCESS_RECORD_SIZE - 40];
+} sge_access_header;
+
+/*
+ * one request, from its first read to its response written out. time
+ * is wall clock ns since the epoch, the durations are monotonic ns:
+ * wait ends when the first response byte is queued, write when the
+ * output is drained. peer is the ipv4/ipv6 address, zero for unix
+ * sockets; path is truncated to ACCESS_PATH_SIZE bytes.
+ */
+typedef struct sge_access_record {
+	uint64_t time;
+	uint64_t wait_ns;
+	uint64_t write_ns;
+	uint64_t total_ns;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint16_t family;
+	uint16_t port;
+	uint16_t status;
+	uint16_t path_len;
+	uint8_t peer[16];
+	char method[ACCESS_METHOD_SIZE];
+	char path[ACCESS_PATH_SIZE];
+} sge_access_record;
+
+typedef struct sge_access_log sge_access_log;
+
+sge_access_log* create_access_log(const char* prefix, uint64_t segment_size, uint32_t rotate_sec);
+void destroy_access_log(sge_access_log* log);
+int access_log_write(sge_access_log* log, const sge_access_record* record);
+uint64_t access_log_dropped(sge_access_log* log);
+
+#endif
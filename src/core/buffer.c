@@ -40,10 +40,28 @@ append_buffer(sge_buffer* buf, const char* str, size_t len) {
 	return buf;
 }
 
+/*
+ * like append_buffer(), but the `len` new bytes are left for the
+ * caller to fill in through `tail`.
+ */
+sge_buffer*
+extend_buffer(sge_buffer* buf, size_t len, char** tail) {
+	if (buf->cap - buf->used < len) {
+		sge_buffer* new = create_buffer(buf->cap + len);
+		memcpy(new->data, buf->data, buf->used);
+		new->used = buf->used;
+		destroy_buffer(buf);
+		buf = new;
+	}
+	*tail = buf->data + buf->used;
+	buf->used += len;
+	return buf;
+}
+
 size_t
 erase_buffer(sge_buffer* buf, size_t start, size_t len) {
 	int remain = buf->used - start - len;
-	memcpy(buf->data + start, buf->data + start + len, remain);
+	memmove(buf->data + start, buf->data + start + len, remain);
 	buf->used -= len;
 	return buf->used;
 }
@@ -64,6 +82,11 @@ empty_buffer(sge_buffer* buf) {
 	return buf->used == 0;
 }
 
+size_t
+buffer_size(sge_buffer* buf) {
+	return buf->used;
+}
+
 int
 clear_buffer(sge_buffer* buf) {
 	buf->used = 0;
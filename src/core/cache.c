@@ -0,0 +1,139 @@
+#include "core/sge.h"
+#include "core/hash.h"
+#include "core/cache.h"
+
+/*
+ * a byte-capped LRU of shared buffers with a per-entry deadline.
+ * not thread safe, the owner serializes access.
+ */
+
+typedef struct sge_cache_entry {
+	struct sge_cache_entry* prev;
+	struct sge_cache_entry* next;
+	sge_shared* value;
+	uint64_t expire;
+	size_t size;
+	size_t len;
+	char key[0];
+} sge_cache_entry;
+
+struct sge_cache {
+	sge_hash* index;
+	sge_cache_entry lru;
+	size_t max_bytes;
+	size_t bytes;
+};
+
+
+static void
+unlink_entry(sge_cache_entry* entry) {
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+}
+
+static void
+link_entry(sge_cache* cache, sge_cache_entry* entry) {
+	entry->next = cache->lru.next;
+	entry->prev = &(cache->lru);
+	cache->lru.next->prev = entry;
+	cache->lru.next = entry;
+}
+
+static void
+remove_entry(sge_cache* cache, sge_cache_entry* entry) {
+	unlink_entry(entry);
+	hash_del(cache->index, entry->key, entry->len);
+	cache->bytes -= entry->size;
+	release_shared(entry->value);
+	sge_free(entry);
+}
+
+static void
+evict(sge_cache* cache, size_t need) {
+	while (cache->bytes + need > cache->max_bytes && cache->lru.prev != &(cache->lru)) {
+		remove_entry(cache, cache->lru.prev);
+	}
+}
+
+
+sge_cache*
+create_cache(size_t max_bytes) {
+	sge_cache* cache = sge_malloc(sizeof(*cache));
+	cache->index = create_hash(1024);
+	cache->lru.prev = cache->lru.next = &(cache->lru);
+	cache->max_bytes = max_bytes;
+	cache->bytes = 0;
+	return cache;
+}
+
+void
+destroy_cache(sge_cache* cache) {
+	while (cache->lru.next != &(cache->lru)) {
+		remove_entry(cache, cache->lru.next);
+	}
+	destroy_hash(cache->index, NULL);
+	sge_free(cache);
+}
+
+sge_shared*
+cache_get(sge_cache* cache, const char* key, size_t len, uint64_t now) {
+	sge_cache_entry* entry = hash_get(cache->index, key, len);
+	if (NULL == entry) {
+		return NULL;
+	}
+	if (entry->expire <= now) {
+		remove_entry(cache, entry);
+		return NULL;
+	}
+	unlink_entry(entry);
+	link_entry(cache, entry);
+	return entry->value;
+}
+
+int
+cache_set(sge_cache* cache, const char* key, size_t len, sge_shared* value, uint64_t expire) {
+	size_t value_len;
+	sge_cache_entry* entry = hash_get(cache->index, key, len);
+
+	if (entry) {
+		remove_entry(cache, entry);
+	}
+
+	shared_data(value, &value_len);
+	size_t size = sizeof(*entry) + len + value_len;
+	if (size > cache->max_bytes) {
+		return SGE_ERR;
+	}
+	evict(cache, size);
+
+	entry = sge_malloc(sizeof(*entry) + len);
+	entry->value = retain_shared(value);
+	entry->expire = expire;
+	entry->size = size;
+	entry->len = len;
+	memcpy(entry->key, key, len);
+	link_entry(cache, entry);
+	hash_set(cache->index, entry->key, len, entry);
+	cache->bytes += size;
+	return SGE_OK;
+}
+
+int
+cache_del(sge_cache* cache, const char* key, size_t len) {
+	sge_cache_entry* entry = hash_get(cache->index, key, len);
+	if (NULL == entry) {
+		return SGE_ERR;
+	}
+	remove_entry(cache, entry);
+	return SGE_OK;
+}
+
+size_t
+cache_bytes(sge_cache* cache) {
+	return cache->bytes;
+}
+
+size_t
+cache_count(sge_cache* cache) {
+	return hash_size(cache->index);
+}
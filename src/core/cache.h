@@ -0,0 +1,17 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stdint.h>
+#include "core/chunk.h"
+
+typedef struct sge_cache sge_cache;
+
+sge_cache* create_cache(size_t max_bytes);
+void destroy_cache(sge_cache* cache);
+sge_shared* cache_get(sge_cache* cache, const char* key, size_t len, uint64_t now);
+int cache_set(sge_cache* cache, const char* key, size_t len, sge_shared* value, uint64_t expire);
+int cache_del(sge_cache* cache, const char* key, size_t len);
+size_t cache_bytes(sge_cache* cache);
+size_t cache_count(sge_cache* cache);
+
+#endif
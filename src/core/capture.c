@@ -0,0 +1,228 @@
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "core/sge.h"
+#include "core/log.h"
+#include "core/queue.h"
+#include "core/buffer.h"
+#include "core/capture.h"
+
+/*
+ * capture of the inbound byte streams of a sample of connections, for
+ * sge-replay. the reactor appends records to a batch in memory and hands
+ * full (or old) batches to a writer thread, so it never waits for the
+ * file system. a connection is either captured whole or not at all: every
+ * `sample`th accepted connection is. capturing stops for good once the
+ * file would grow past `max_size`.
+ */
+
+#define CAPTURE_BATCH_SIZE 65536
+#define CAPTURE_BATCH_NS 200000000ULL
+#define WRITER_TICK_NS 50000000
+
+struct sge_capture {
+	int fd;
+	char* path;
+	uint32_t sample;
+	uint32_t accepted;
+	uint32_t next_id;
+	int full;
+	int run;
+	uint64_t start;
+	uint64_t size;
+	uint64_t max_size;
+	uint64_t batch_start;
+	sge_buffer* batch;
+	sge_queue* queue;
+	pthread_t tid;
+};
+
+static uint64_t now_ns();
+static int write_batch(sge_capture* capture, sge_buffer* batch);
+static void hand_off(sge_capture* capture, uint64_t now);
+static void* writer(void* arg);
+
+
+uint64_t
+now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int
+write_batch(sge_capture* capture, sge_buffer* batch) {
+	size_t len;
+	ssize_t n;
+	const char* data = buffer_data(batch, &len);
+
+	while (len > 0) {
+		n = write(capture->fd, data, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			ERROR("can't write capture %s: %s", capture->path, strerror(errno));
+			destroy_buffer(batch);
+			return SGE_ERR;
+		}
+		data += n;
+		len -= n;
+	}
+	destroy_buffer(batch);
+	return SGE_OK;
+}
+
+void
+hand_off(sge_capture* capture, uint64_t now) {
+	if (buffer_size(capture->batch) == 0) {
+		capture->batch_start = now;
+		return;
+	}
+	enqueue(capture->queue, capture->batch);
+	capture->batch = create_buffer(CAPTURE_BATCH_SIZE);
+	capture->batch_start = now;
+}
+
+void*
+writer(void* arg) {
+	sge_capture* capture = arg;
+	sge_buffer* batch;
+	struct timespec tick = {0, WRITER_TICK_NS};
+	int run = 1;
+
+	while (run) {
+		run = __atomic_load_n(&capture->run, __ATOMIC_ACQUIRE);
+		for (dequeue(capture->queue, (void**)&batch); batch; dequeue(capture->queue, (void**)&batch)) {
+			write_batch(capture, batch);
+		}
+		if (run) {
+			nanosleep(&tick, NULL);
+		}
+	}
+	return NULL;
+}
+
+sge_capture*
+create_capture(const char* path, uint32_t sample, uint64_t max_size) {
+	sge_capture_header header;
+	sge_capture* capture;
+	struct timespec ts;
+	int fd;
+
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (fd < 0) {
+		ERROR("can't open capture %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	capture = sge_malloc(sizeof(*capture));
+	memset(capture, 0, sizeof(*capture));
+	capture->fd = fd;
+	capture->path = strdup(path);
+	capture->sample = sample ? sample : 1;
+	capture->max_size = max_size;
+	capture->start = capture->batch_start = now_ns();
+	capture->batch = create_buffer(CAPTURE_BATCH_SIZE);
+	capture->queue = create_queue(16);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+	header.version = CAPTURE_VERSION;
+	header.sample = capture->sample;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	header.created = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	capture->batch = append_buffer(capture->batch, (const char*)&header, sizeof(header));
+	capture->size = sizeof(header);
+
+	capture->run = 1;
+	if (pthread_create(&capture->tid, NULL, writer, capture) != 0) {
+		ERROR("can't start the capture writer");
+		capture->run = 0;
+		destroy_capture(capture);
+		return NULL;
+	}
+	INFO("capturing 1 in %u connections to %s", capture->sample, path);
+	return capture;
+}
+
+void
+destroy_capture(sge_capture* capture) {
+	if (capture->run) {
+		hand_off(capture, 0);
+		__atomic_store_n(&capture->run, 0, __ATOMIC_RELEASE);
+		pthread_join(capture->tid, NULL);
+	}
+	destroy_buffer(capture->batch);
+	destroy_queue(capture->queue);
+	close(capture->fd);
+	sge_free(capture->path);
+	sge_free(capture);
+}
+
+/*
+ * the id of a sampled connection, 0 for one that is not captured.
+ */
+uint32_t
+capture_open(sge_capture* capture) {
+	if (capture->full || capture->accepted++ % capture->sample != 0) {
+		return 0;
+	}
+	capture_record(capture, ++capture->next_id, CAPTURE_OPEN, NULL, 0);
+	return capture->full ? 0 : capture->next_id;
+}
+
+void
+capture_record(sge_capture* capture, uint32_t conn, CAPTURE_TYPE type, const char* data, uint32_t len) {
+	sge_capture_record r;
+	uint64_t now = now_ns();
+	size_t need = sizeof(r) + (type == CAPTURE_DATA ? len : 0);
+
+	if (capture->full) {
+		return;
+	}
+	if (capture->size + need > capture->max_size) {
+		capture->full = 1;
+		WARNING("capture %s reached %lu bytes, stopped.", capture->path, (unsigned long)capture->size);
+		return;
+	}
+	r.time = now - capture->start;
+	r.conn = conn;
+	r.type = type;
+	r.reserved = 0;
+	r.len = len;
+	capture->batch = append_buffer(capture->batch, (const char*)&r, sizeof(r));
+	if (type == CAPTURE_DATA) {
+		capture->batch = append_buffer(capture->batch, data, len);
+	}
+	capture->size += need;
+	if (buffer_size(capture->batch) >= CAPTURE_BATCH_SIZE || now - capture->batch_start >= CAPTURE_BATCH_NS) {
+		hand_off(capture, now);
+	}
+}
+
+/*
+ * called by the reactor once per loop, so a quiet connection's records
+ * reach the file too.
+ */
+void
+capture_flush(sge_capture* capture) {
+	uint64_t now;
+
+	if (buffer_size(capture->batch) == 0) {
+		return;
+	}
+	now = now_ns();
+	if (now - capture->batch_start >= CAPTURE_BATCH_NS) {
+		hand_off(capture, now);
+	}
+}
+
+uint64_t
+capture_bytes(sge_capture* capture) {
+	return capture->size;
+}
@@ -0,0 +1,46 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "SGECAP"
+#define CAPTURE_VERSION 1
+
+typedef enum {
+	CAPTURE_OPEN = 1,
+	CAPTURE_DATA,
+	CAPTURE_WRITE,
+	CAPTURE_CLOSE
+} CAPTURE_TYPE;
+
+/*
+ * file layout: one header, then records in the order they happened,
+ * all in host byte order. `time` is monotonic ns since `created`;
+ * DATA records are followed by the `len` bytes read from the client,
+ * WRITE records carry only the number of bytes written back.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t sample;
+	uint64_t created;
+} sge_capture_header;
+
+typedef struct {
+	uint64_t time;
+	uint32_t conn;
+	uint16_t type;
+	uint16_t reserved;
+	uint32_t len;
+} __attribute__((packed)) sge_capture_record;
+
+typedef struct sge_capture sge_capture;
+
+sge_capture* create_capture(const char* path, uint32_t sample, uint64_t max_size);
+void destroy_capture(sge_capture* capture);
+uint32_t capture_open(sge_capture* capture);
+void capture_record(sge_capture* capture, uint32_t conn, CAPTURE_TYPE type, const char* data, uint32_t len);
+void capture_flush(sge_capture* capture);
+uint64_t capture_bytes(sge_capture* capture);
+
+#endif
@@ -0,0 +1,82 @@
+#include "core/sge.h"
+#include "core/chunk.h"
+
+struct sge_shared {
+	int ref;
+	size_t len;
+	char data[0];
+};
+
+sge_chunk*
+create_chunk(const char* data, size_t len, void (*release)(void*), void* ud) {
+	sge_chunk* chunk = sge_malloc(sizeof(*chunk));
+	chunk->next = NULL;
+	chunk->data = data;
+	chunk->len = len;
+	chunk->offset = 0;
+	chunk->release = release;
+	chunk->ud = ud;
+	return chunk;
+}
+
+sge_chunk*
+create_chunk_buffer(sge_buffer* buf) {
+	size_t len;
+	const char* data = buffer_data(buf, &len);
+	return create_chunk(data, len, destroy_buffer, buf);
+}
+
+sge_chunk*
+create_chunk_shared(sge_shared* shared) {
+	retain_shared(shared);
+	return create_chunk(shared->data, shared->len, release_shared, shared);
+}
+
+void
+destroy_chunk(void* p) {
+	sge_chunk* chunk = p;
+	if (NULL == chunk) {
+		return;
+	}
+	if (chunk->release) {
+		chunk->release(chunk->ud);
+	}
+	sge_free(chunk);
+}
+
+sge_shared*
+create_shared(const char* data, size_t len) {
+	char* p;
+	sge_shared* shared = create_shared_ex(len, &p);
+	memcpy(p, data, len);
+	return shared;
+}
+
+sge_shared*
+create_shared_ex(size_t len, char** data) {
+	sge_shared* shared = sge_malloc(sizeof(*shared) + len);
+	shared->ref = 1;
+	shared->len = len;
+	*data = shared->data;
+	return shared;
+}
+
+sge_shared*
+retain_shared(sge_shared* shared) {
+	__sync_add_and_fetch(&(shared->ref), 1);
+	return shared;
+}
+
+void
+release_shared(void* p) {
+	sge_shared* shared = p;
+	if (__sync_sub_and_fetch(&(shared->ref), 1) == 0) {
+		sge_free(shared);
+	}
+}
+
+const char*
+shared_data(sge_shared* shared, size_t* len) {
+	*len = shared->len;
+	return shared->data;
+}
@@ -0,0 +1,38 @@
+#ifndef CHUNK_H_
+#define CHUNK_H_
+
+#include "core/buffer.h"
+
+typedef struct sge_chunk sge_chunk;
+typedef struct sge_shared sge_shared;
+
+/*
+ * a slice of output data that is not owned by the socket.
+ * `release` is called with `ud` once the data has been written
+ * (or dropped), so the owner can free or unpin the memory.
+ */
+struct sge_chunk {
+	sge_chunk* next;
+	const char* data;
+	size_t len;
+	size_t offset;
+	void (*release)(void*);
+	void* ud;
+};
+
+sge_chunk* create_chunk(const char* data, size_t len, void (*release)(void*), void* ud);
+sge_chunk* create_chunk_buffer(sge_buffer* buf);
+sge_chunk* create_chunk_shared(sge_shared* shared);
+void destroy_chunk(void* chunk);
+
+/*
+ * immutable refcounted bytes that can sit in many sockets' output
+ * queues at once. the count is atomic, any thread may retain/release.
+ */
+sge_shared* create_shared(const char* data, size_t len);
+sge_shared* create_shared_ex(size_t len, char** data);
+sge_shared* retain_shared(sge_shared* shared);
+void release_shared(void* shared);
+const char* shared_data(sge_shared* shared, size_t* len);
+
+#endif
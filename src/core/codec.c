@@ -0,0 +1,195 @@
+#include "core/sge.h"
+#include "core/codec.h"
+
+/*
+ * framing for listeners that don't speak http, without the socket:
+ * bytes read go in through codec_feed(), each complete frame comes out
+ * of the callback once. length prefixed payloads are read straight into
+ * a buffer of their size. frames over max_size fail the feed before
+ * they are buffered, so a peer can't make the server hold more.
+ */
+
+struct sge_codec {
+	int type;
+	cb_codec_frame cb;
+	void* ud;
+	size_t max_size;
+	sge_buffer* frame;
+	uint8_t head[CODEC_MAX_HEAD];
+	size_t head_len;
+	size_t left;
+};
+
+static int feed_line(sge_codec* codec, const char* data, size_t len);
+static int feed_prefixed(sge_codec* codec, const char* data, size_t len);
+static void emit(sge_codec* codec);
+
+static const char* CODEC_NAMES[] = {"http", "raw", "line", "u16", "u32"};
+
+
+int
+codec_type(const char* name) {
+	int i;
+
+	for (i = 0; i < sizeof(CODEC_NAMES) / sizeof(CODEC_NAMES[0]); ++i) {
+		if (strcmp(name, CODEC_NAMES[i]) == 0) {
+			return i;
+		}
+	}
+	return SGE_ERR;
+}
+
+sge_codec*
+create_codec(int type, size_t max_size, cb_codec_frame cb, void* ud) {
+	sge_codec* codec = sge_malloc(sizeof(*codec));
+
+	memset(codec, 0, sizeof(*codec));
+	codec->type = type;
+	codec->cb = cb;
+	codec->ud = ud;
+	codec->max_size = max_size;
+	return codec;
+}
+
+void
+destroy_codec(sge_codec* codec) {
+	if (codec->frame) {
+		destroy_buffer(codec->frame);
+	}
+	sge_free(codec);
+}
+
+int
+codec_feed(sge_codec* codec, const char* data, size_t len) {
+	switch (codec->type) {
+		case CODEC_RAW:
+			if (len > 0) {
+				codec->cb(codec->ud, create_buffer_ex(data, len));
+			}
+			return SGE_OK;
+		case CODEC_LINE:
+			return feed_line(codec, data, len);
+		case CODEC_U16:
+		case CODEC_U32:
+			return feed_prefixed(codec, data, len);
+		default:
+			return SGE_ERR;
+	}
+}
+
+// big endian, SGE_ERR when len doesn't fit the prefix
+int
+codec_frame_head(sge_codec* codec, size_t len, char* head) {
+	uint8_t* p = (uint8_t*)head;
+
+	switch (codec->type) {
+		case CODEC_U16:
+			if (len > 0xffff) {
+				return SGE_ERR;
+			}
+			p[0] = len >> 8;
+			p[1] = len;
+			return 2;
+		case CODEC_U32:
+			if ((uint64_t)len > 0xffffffff) {
+				return SGE_ERR;
+			}
+			p[0] = len >> 24;
+			p[1] = len >> 16;
+			p[2] = len >> 8;
+			p[3] = len;
+			return 4;
+		default:
+			return 0;
+	}
+}
+
+const char*
+codec_frame_tail(sge_codec* codec, size_t* len) {
+	*len = codec->type == CODEC_LINE ? 1 : 0;
+	return "\n";
+}
+
+// "\n" or "\r\n" ends a line, neither is part of the frame
+int
+feed_line(sge_codec* codec, const char* data, size_t len) {
+	const char* nl;
+	size_t n, size;
+
+	while (len > 0) {
+		nl = memchr(data, '\n', len);
+		n = nl ? (size_t)(nl - data) : len;
+		size = codec->frame ? buffer_size(codec->frame) : 0;
+		// the '\r' may still be in the frame
+		if (size + n > codec->max_size + 1) {
+			return SGE_ERR;
+		}
+		if (NULL == codec->frame) {
+			codec->frame = create_buffer_ex(data, n);
+		} else {
+			codec->frame = append_buffer(codec->frame, data, n);
+		}
+		if (NULL == nl) {
+			break;
+		}
+		size = buffer_size(codec->frame);
+		if (size > 0 && buffer_data(codec->frame, &size)[size - 1] == '\r') {
+			erase_buffer(codec->frame, size - 1, 1);
+		}
+		if (buffer_size(codec->frame) > codec->max_size) {
+			return SGE_ERR;
+		}
+		emit(codec);
+		data += n + 1;
+		len -= n + 1;
+	}
+	return SGE_OK;
+}
+
+int
+feed_prefixed(sge_codec* codec, const char* data, size_t len) {
+	size_t i, n, head = codec->type == CODEC_U16 ? 2 : 4;
+	char* tail;
+
+	while (len > 0) {
+		if (NULL == codec->frame) {
+			n = head - codec->head_len < len ? head - codec->head_len : len;
+			memcpy(codec->head + codec->head_len, data, n);
+			codec->head_len += n;
+			data += n;
+			len -= n;
+			if (codec->head_len < head) {
+				break;
+			}
+			codec->left = 0;
+			for (i = 0; i < head; ++i) {
+				codec->left = (codec->left << 8) | codec->head[i];
+			}
+			codec->head_len = 0;
+			if (codec->left > codec->max_size) {
+				return SGE_ERR;
+			}
+			codec->frame = create_buffer(codec->left);
+		}
+		n = codec->left < len ? codec->left : len;
+		if (n > 0) {
+			codec->frame = extend_buffer(codec->frame, n, &tail);
+			memcpy(tail, data, n);
+			codec->left -= n;
+			data += n;
+			len -= n;
+		}
+		if (codec->left == 0) {
+			emit(codec);
+		}
+	}
+	return SGE_OK;
+}
+
+void
+emit(sge_codec* codec) {
+	sge_buffer* frame = codec->frame;
+
+	codec->frame = NULL;
+	codec->cb(codec->ud, frame);
+}
@@ -0,0 +1,30 @@
+#ifndef CODEC_H_
+#define CODEC_H_
+
+#include <stdint.h>
+
+#include "core/buffer.h"
+
+// how a listener cuts its byte stream, CODEC_HTTP being no codec at all
+#define CODEC_HTTP 0
+#define CODEC_RAW 1
+#define CODEC_LINE 2
+#define CODEC_U16 3
+#define CODEC_U32 4
+
+// the longest prefix codec_frame_head() writes
+#define CODEC_MAX_HEAD 4
+
+typedef struct sge_codec sge_codec;
+
+// a complete frame without its prefix or line ending, the callee owns `frame`
+typedef void (*cb_codec_frame)(void* ud, sge_buffer* frame);
+
+int codec_type(const char* name);
+sge_codec* create_codec(int type, size_t max_size, cb_codec_frame cb, void* ud);
+void destroy_codec(sge_codec* codec);
+int codec_feed(sge_codec* codec, const char* data, size_t len);
+int codec_frame_head(sge_codec* codec, size_t len, char* head);
+const char* codec_frame_tail(sge_codec* codec, size_t* len);
+
+#endif
@@ -0,0 +1,495 @@
+#include <zlib.h>
+#include <stdio.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "core/sge.h"
+#include "core/log.h"
+#include "core/http.h"
+#include "core/cache.h"
+#include "core/metrics.h"
+#include "core/compress.h"
+
+/*
+ * gzip/deflate for response bodies on a few threads of their own. the
+ * encoded bodies are kept in a byte-capped LRU keyed by encoding and a
+ * digest of the plain body, so a payload that keeps coming back is
+ * encoded once. a body that did not get smaller is kept as an empty
+ * entry, it is not tried again either.
+ */
+
+#define KEY_LEN (1 + sizeof(uint64_t) * 3)
+
+struct sge_compressor {
+	pthread_t* tids;
+	int nthread;
+	int level;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	sge_compress_job* head;
+	sge_compress_job* tail;
+	int stop;
+	pthread_mutex_t cache_lock;
+	sge_cache* cache;
+	cb_compressed cb;
+	void* ud;
+};
+
+static void* compress_thread(void* arg);
+static sge_compress_job* next_job(sge_compressor* compressor);
+static void encode(sge_compressor* compressor, sge_compress_job* job);
+static sge_shared* deflate_body(int level, int encoding, const char* data, size_t len);
+static sge_buffer* encoded_head(sge_buffer* head, int encoding, size_t len);
+static void body_key(int encoding, const char* data, size_t len, char* key);
+static int type_listed(const char* types, const char* type, size_t len);
+static int q_zero(const char* params, size_t len);
+
+
+sge_compressor*
+create_compressor(int threads, int level, size_t cache_size, cb_compressed cb, void* ud) {
+	int i;
+	sge_compressor* compressor = sge_malloc(sizeof(*compressor));
+
+	memset(compressor, 0, sizeof(*compressor));
+	compressor->level = level;
+	compressor->cb = cb;
+	compressor->ud = ud;
+	pthread_mutex_init(&compressor->lock, NULL);
+	pthread_cond_init(&compressor->cond, NULL);
+	pthread_mutex_init(&compressor->cache_lock, NULL);
+	if (cache_size > 0) {
+		compressor->cache = create_cache(cache_size);
+	}
+	compressor->tids = sge_malloc(sizeof(pthread_t) * threads);
+	for (i = 0; i < threads; ++i) {
+		if (pthread_create(&compressor->tids[i], NULL, compress_thread, compressor) != 0) {
+			ERROR("can not start compression thread %d.", i);
+			break;
+		}
+		compressor->nthread++;
+	}
+	if (compressor->nthread == 0) {
+		destroy_compressor(compressor);
+		return NULL;
+	}
+	return compressor;
+}
+
+// jobs still queued are dropped without their callback
+void
+destroy_compressor(sge_compressor* compressor) {
+	int i;
+	sge_compress_job* job;
+
+	pthread_mutex_lock(&compressor->lock);
+	compressor->stop = 1;
+	pthread_cond_broadcast(&compressor->cond);
+	pthread_mutex_unlock(&compressor->lock);
+	for (i = 0; i < compressor->nthread; ++i) {
+		pthread_join(compressor->tids[i], NULL);
+	}
+	while (compressor->head) {
+		job = compressor->head;
+		compressor->head = job->next;
+		destroy_compress_job(job);
+	}
+	if (compressor->cache) {
+		destroy_cache(compressor->cache);
+	}
+	pthread_mutex_destroy(&compressor->lock);
+	pthread_cond_destroy(&compressor->cond);
+	pthread_mutex_destroy(&compressor->cache_lock);
+	sge_free(compressor->tids);
+	sge_free(compressor);
+}
+
+int
+compress_submit(sge_compressor* compressor, sge_compress_job* job) {
+	job->next = NULL;
+	pthread_mutex_lock(&compressor->lock);
+	if (compressor->tail) {
+		compressor->tail->next = job;
+	} else {
+		compressor->head = job;
+	}
+	compressor->tail = job;
+	pthread_cond_signal(&compressor->cond);
+	pthread_mutex_unlock(&compressor->lock);
+	return SGE_OK;
+}
+
+size_t
+compress_cache_bytes(sge_compressor* compressor) {
+	size_t bytes = 0;
+
+	if (compressor->cache) {
+		pthread_mutex_lock(&compressor->cache_lock);
+		bytes = cache_bytes(compressor->cache);
+		pthread_mutex_unlock(&compressor->cache_lock);
+	}
+	return bytes;
+}
+
+sge_compress_job*
+create_compress_job(int id, int encoding, const char* head, size_t head_len, const char* body, size_t body_len) {
+	sge_compress_job* job = sge_malloc(sizeof(*job));
+
+	job->next = NULL;
+	job->id = id;
+	job->encoding = encoding;
+	job->head = create_buffer_ex(head, head_len);
+	job->body = create_shared(body, body_len);
+	job->ud = NULL;
+	return job;
+}
+
+void
+destroy_compress_job(void* ud) {
+	sge_compress_job* job = ud;
+
+	if (NULL == job) {
+		return;
+	}
+	if (job->head) {
+		destroy_buffer(job->head);
+	}
+	if (job->body) {
+		release_shared(job->body);
+	}
+	sge_free(job);
+}
+
+/*
+ * the encoding to use for an Accept-Encoding value: gzip over deflate,
+ * "*" stands for either, q=0 rules one out.
+ */
+int
+compress_negotiate(const char* accept, size_t len) {
+	const char* end = accept + len, *comma, *semi;
+	size_t n;
+	int gzip = -1, deflate = -1, any = -1, ok;
+
+	while (accept < end) {
+		comma = memchr(accept, ',', end - accept);
+		n = (comma ? comma : end) - accept;
+		while (n > 0 && (*accept == ' ' || *accept == '\t')) {
+			accept++;
+			n--;
+		}
+		semi = memchr(accept, ';', n);
+		ok = semi ? !q_zero(semi + 1, accept + n - semi - 1) : 1;
+		if (semi) {
+			n = semi - accept;
+		}
+		while (n > 0 && (accept[n - 1] == ' ' || accept[n - 1] == '\t')) {
+			n--;
+		}
+		if (http_token_equal(accept, n, "gzip") || http_token_equal(accept, n, "x-gzip")) {
+			gzip = ok;
+		} else if (http_token_equal(accept, n, "deflate")) {
+			deflate = ok;
+		} else if (http_token_equal(accept, n, "*")) {
+			any = ok;
+		}
+		accept = comma ? comma + 1 : end;
+	}
+	if (gzip == 1 || (gzip == -1 && any == 1)) {
+		return COMPRESS_GZIP;
+	}
+	if (deflate == 1 || (deflate == -1 && any == 1)) {
+		return COMPRESS_DEFLATE;
+	}
+	return COMPRESS_IDENTITY;
+}
+
+/*
+ * whether a response head allows encoding its body: a status with a
+ * whole body, a Content-Type in `types`, not encoded already and no
+ * Cache-Control: no-transform. `types` is a comma separated list, an
+ * entry ending in '/' takes the whole top level type.
+ */
+int
+compress_allowed(const char* types, const char* head, size_t len) {
+	const char* end = head + len, *p, *eol, *colon, *value;
+	size_t value_len;
+	int status, allowed = 0;
+
+	if (len < 12 || memcmp(head, "HTTP/1.", 7) != 0) {
+		return 0;
+	}
+	status = (head[9] - '0') * 100 + (head[10] - '0') * 10 + (head[11] - '0');
+	if (status < 200 || status == 204 || status == 206 || status == 304) {
+		return 0;
+	}
+	for (p = memchr(head, '\n', len); p && ++p < end; p = eol) {
+		eol = memchr(p, '\n', end - p);
+		if (NULL == eol) {
+			break;
+		}
+		colon = memchr(p, ':', eol - p);
+		if (NULL == colon) {
+			continue;
+		}
+		value = colon + 1;
+		value_len = eol - value;
+		while (value_len > 0 && (*value == ' ' || *value == '\t')) {
+			value++;
+			value_len--;
+		}
+		while (value_len > 0 && (value[value_len - 1] == '\r' || value[value_len - 1] == ' ')) {
+			value_len--;
+		}
+		if (http_token_equal(p, colon - p, "Content-Encoding")) {
+			return 0;
+		}
+		if (http_token_equal(p, colon - p, "Cache-Control") && http_has_token(value, value_len, "no-transform")) {
+			return 0;
+		}
+		if (http_token_equal(p, colon - p, "Content-Type")) {
+			allowed = type_listed(types, value, value_len);
+		}
+	}
+	return allowed;
+}
+
+void*
+compress_thread(void* arg) {
+	sge_compressor* compressor = arg;
+	sge_compress_job* job;
+
+	while ((job = next_job(compressor))) {
+		encode(compressor, job);
+		compressor->cb(job, compressor->ud);
+	}
+	return NULL;
+}
+
+sge_compress_job*
+next_job(sge_compressor* compressor) {
+	sge_compress_job* job = NULL;
+
+	pthread_mutex_lock(&compressor->lock);
+	while (NULL == compressor->head && !compressor->stop) {
+		pthread_cond_wait(&compressor->cond, &compressor->lock);
+	}
+	if (!compressor->stop) {
+		job = compressor->head;
+		compressor->head = job->next;
+		if (NULL == compressor->head) {
+			compressor->tail = NULL;
+		}
+	}
+	pthread_mutex_unlock(&compressor->lock);
+	return job;
+}
+
+void
+encode(sge_compressor* compressor, sge_compress_job* job) {
+	char key[KEY_LEN];
+	size_t len, out_len;
+	sge_shared* out = NULL;
+	const char* body = shared_data(job->body, &len);
+
+	if (compressor->cache) {
+		body_key(job->encoding, body, len, key);
+		pthread_mutex_lock(&compressor->cache_lock);
+		out = cache_get(compressor->cache, key, KEY_LEN, 0);
+		if (out) {
+			retain_shared(out);
+		}
+		pthread_mutex_unlock(&compressor->cache_lock);
+		if (out) {
+			metrics_add(METRIC_COMPRESS_HITS, 1);
+		}
+	}
+	if (NULL == out) {
+		out = deflate_body(compressor->level, job->encoding, body, len);
+		if (NULL == out) {
+			return;
+		}
+		if (compressor->cache) {
+			pthread_mutex_lock(&compressor->cache_lock);
+			cache_set(compressor->cache, key, KEY_LEN, out, UINT64_MAX);
+			pthread_mutex_unlock(&compressor->cache_lock);
+		}
+	}
+
+	shared_data(out, &out_len);
+	if (out_len == 0) {
+		release_shared(out);
+		return;
+	}
+	metrics_add(METRIC_COMPRESSED, 1);
+	metrics_add(METRIC_COMPRESS_SAVED, len - out_len);
+	job->head = encoded_head(job->head, job->encoding, out_len);
+	release_shared(job->body);
+	job->body = out;
+}
+
+// the encoded body, empty when it is not smaller, NULL on failure
+sge_shared*
+deflate_body(int level, int encoding, const char* data, size_t len) {
+	int ret;
+	z_stream zs;
+	sge_shared* out;
+	char* dst = sge_malloc(len);
+
+	memset(&zs, 0, sizeof(zs));
+	// windowBits + 16 writes a gzip wrapper, HTTP's deflate is the zlib one
+	if (deflateInit2(&zs, level, Z_DEFLATED, encoding == COMPRESS_GZIP ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		ERROR("deflateInit2 failed: %s", zs.msg ? zs.msg : "");
+		sge_free(dst);
+		return NULL;
+	}
+	zs.next_in = (Bytef*)data;
+	zs.avail_in = len;
+	zs.next_out = (Bytef*)dst;
+	zs.avail_out = len;
+	ret = deflate(&zs, Z_FINISH);
+	out = create_shared(dst, ret == Z_STREAM_END ? zs.total_out : 0);
+	deflateEnd(&zs);
+	sge_free(dst);
+	return out;
+}
+
+/*
+ * the head with Content-Length replaced and Content-Encoding added. a
+ * strong ETag is weakened, as the encoded body is not the one it names,
+ * and Accept-Encoding joins the handler's Vary rather than adding one.
+ */
+sge_buffer*
+encoded_head(sge_buffer* head, int encoding, size_t len) {
+	size_t size, value_len, line_len;
+	char tail[128];
+	int vary = 0;
+	const char* p, *eol, *end, *colon, *value, *more, *data = buffer_data(head, &size);
+	sge_buffer* buf = create_buffer(size + sizeof(tail) + 32);
+
+	// leave off the blank line that ends the head
+	for (p = data, end = data + size - 2; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (NULL == eol) {
+			break;
+		}
+		line_len = eol + 1 - p;
+		colon = memchr(p, ':', eol - p);
+		if (NULL == colon) {
+			buf = append_buffer(buf, p, line_len);
+			continue;
+		}
+		value = colon + 1;
+		while (value < eol && (*value == ' ' || *value == '\t')) {
+			value++;
+		}
+		value_len = eol - value;
+		while (value_len > 0 && (value[value_len - 1] == '\r' || value[value_len - 1] == ' ')) {
+			value_len--;
+		}
+		if (http_token_equal(p, colon - p, "Content-Length")) {
+			continue;
+		}
+		if (http_token_equal(p, colon - p, "ETag") && value_len > 0 && value[0] == '"') {
+			buf = append_buffer(buf, "ETag: W/", 8);
+			buf = append_buffer(buf, value, value_len);
+			buf = append_buffer(buf, "\r\n", 2);
+			continue;
+		}
+		if (http_token_equal(p, colon - p, "Vary") && !vary) {
+			vary = 1;
+			if (!http_has_token(value, value_len, "Accept-Encoding") && !http_has_token(value, value_len, "*")) {
+				more = value_len ? ", Accept-Encoding\r\n" : "Accept-Encoding\r\n";
+				buf = append_buffer(buf, p, value + value_len - p);
+				buf = append_buffer(buf, more, strlen(more));
+				continue;
+			}
+		}
+		buf = append_buffer(buf, p, line_len);
+	}
+	snprintf(tail, sizeof(tail), "Content-Encoding: %s\r\n%sContent-Length: %zu\r\n\r\n",
+		encoding == COMPRESS_GZIP ? "gzip" : "deflate", vary ? "" : "Vary: Accept-Encoding\r\n", len);
+	buf = append_buffer(buf, tail, strlen(tail));
+	destroy_buffer(head);
+	return buf;
+}
+
+/*
+ * encoding, length and two independent 64 bit hashes of the body, wide
+ * enough that a collision serving the wrong body is not a concern.
+ */
+void
+body_key(int encoding, const char* data, size_t len, char* key) {
+	size_t i;
+	uint64_t w, a = 0xcbf29ce484222325ULL ^ len, b = 0x9e3779b97f4a7c15ULL + len, n = len;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, data + i, 8);
+		a = (a ^ w) * 0x100000001b3ULL;
+		b += w * 0xc2b2ae3d27d4eb4fULL;
+		b = ((b << 31) | (b >> 33)) * 0x9e3779b185ebca87ULL;
+	}
+	w = 0;
+	memcpy(&w, data + i, len - i);
+	a = (a ^ w) * 0x100000001b3ULL;
+	b = ((b + w * 0xc2b2ae3d27d4eb4fULL) ^ (b >> 29)) * 0x9e3779b185ebca87ULL;
+	a ^= a >> 33;
+	a *= 0xff51afd7ed558ccdULL;
+	a ^= a >> 33;
+	b ^= b >> 32;
+
+	key[0] = encoding;
+	memcpy(key + 1, &n, sizeof(n));
+	memcpy(key + 1 + sizeof(n), &a, sizeof(a));
+	memcpy(key + 1 + sizeof(n) * 2, &b, sizeof(b));
+}
+
+int
+type_listed(const char* types, const char* type, size_t len) {
+	const char* p, *q, *semi = memchr(type, ';', len);
+	size_t n;
+
+	if (semi) {
+		len = semi - type;
+	}
+	while (len > 0 && type[len - 1] == ' ') {
+		len--;
+	}
+	for (p = types; p && *p; p = q) {
+		while (*p == ',' || *p == ' ') {
+			p++;
+		}
+		q = p;
+		while (*q && *q != ',' && *q != ' ') {
+			q++;
+		}
+		n = q - p;
+		if (n == 0) {
+			continue;
+		}
+		if (p[n - 1] == '/') {
+			if (len > n && strncasecmp(type, p, n) == 0) {
+				return 1;
+			}
+		} else if (len == n && strncasecmp(type, p, n) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// whether parameters like " q=0.000" rule the coding out
+int
+q_zero(const char* params, size_t len) {
+	const char* end = params + len;
+
+	while (params < end && (*params == ' ' || *params == '\t')) {
+		params++;
+	}
+	if (end - params < 3 || (params[0] != 'q' && params[0] != 'Q') || params[1] != '=') {
+		return 0;
+	}
+	params += 2;
+	while (params < end && (*params == '0' || *params == '.')) {
+		params++;
+	}
+	return params == end || *params == ' ' || *params == ';';
+}
@@ -0,0 +1,45 @@
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stdint.h>
+
+#include "core/buffer.h"
+#include "core/chunk.h"
+
+#define COMPRESS_IDENTITY 0
+#define COMPRESS_GZIP 1
+#define COMPRESS_DEFLATE 2
+
+typedef struct sge_compressor sge_compressor;
+typedef struct sge_compress_job sge_compress_job;
+
+/*
+ * a response to encode: `head` as the handler built it, Content-Length
+ * included, and its body. once done `head` is the one to send and
+ * `body` the encoded body, or both are left as they were when encoding
+ * would not make the body smaller. `id` and `ud` are the caller's.
+ */
+struct sge_compress_job {
+	sge_compress_job* next;
+	int id;
+	int encoding;
+	sge_buffer* head;
+	sge_shared* body;
+	void* ud;
+};
+
+// called on a compression thread once a job is done
+typedef void (*cb_compressed)(sge_compress_job* job, void* ud);
+
+sge_compressor* create_compressor(int threads, int level, size_t cache_size, cb_compressed cb, void* ud);
+void destroy_compressor(sge_compressor* compressor);
+int compress_submit(sge_compressor* compressor, sge_compress_job* job);
+size_t compress_cache_bytes(sge_compressor* compressor);
+
+sge_compress_job* create_compress_job(int id, int encoding, const char* head, size_t head_len, const char* body, size_t body_len);
+void destroy_compress_job(void* job);
+
+int compress_negotiate(const char* accept, size_t len);
+int compress_allowed(const char* types, const char* head, size_t len);
+
+#endif
@@ -1,6 +1,23 @@
 #ifndef CONFIG_H_
 #define CONFIG_H_
 
+#define MAX_LISTENERS 16
+#define DEFAULT_BACKLOG 512
+
+// one entry of config.listeners, 0 leaves a socket option to the kernel
+typedef struct {
+	const char* socket;
+	const char* codec;
+	size_t backlog;
+	size_t defer_accept;
+	size_t fastopen;
+	size_t rcvbuf;
+	size_t sndbuf;
+	size_t busy_poll;
+	int nodelay;
+	int tls;
+} sge_listen_config;
+
 typedef struct {
 	const char* workdir;
 	const char* logfile;
@@ -9,8 +26,49 @@ typedef struct {
 	const char* socket;
 	const char* user;
 	const char* libdir;
+	const char* cache_vary;
+	const char* admin_socket;
+	const char* access_log;
+	const char* capture;
+	const char* compress_types;
+	const char* tls_cert;
+	const char* tls_key;
+	const char* codec;
+	const char* exe;
+	const char* config_file;
+	size_t cache_size;
+	size_t shutdown_timeout;
+	size_t access_log_size;
+	size_t access_log_rotate;
+	size_t overload_target;
+	size_t overload_interval;
+	size_t capture_sample;
+	size_t capture_size;
+	size_t websocket_max_size;
+	size_t websocket_ping;
+	size_t compress_min_size;
+	size_t compress_threads;
+	size_t compress_level;
+	size_t compress_cache_size;
+	size_t codec_max_size;
+	size_t upstream_connect_timeout;
+	size_t upstream_read_timeout;
+	size_t upstream_idle_timeout;
+	size_t upstream_pool_size;
+	size_t kv_size;
+	sge_listen_config listeners[MAX_LISTENERS];
+	int nlistener;
 	cb_worker cb;
+	cb_runner runner;
+	cb_admin admin;
+	int log_level;
 	int daemon;
+	int async;
+	int http2;
+	int websocket;
+	int compress;
+	int coalesce;
+	int ktls;
 } sge_config;
 
 #endif
@@ -0,0 +1,1091 @@
+#include <stdio.h>
+#include <strings.h>
+
+#include "core/sge.h"
+#include "core/hpack.h"
+#include "core/h2.h"
+
+/*
+ * the server side of an http/2 connection without the socket: bytes
+ * read go in through h2_feed(), frames to write come out of
+ * h2_output(). a stream's request is collected until the peer ends
+ * it and handed over as an HTTP/1.1 message, so the worker parses it
+ * like any other; the HTTP/1.1 response it writes back is turned into
+ * HEADERS and DATA frames, as far as the peer's windows allow.
+ * no server push, priorities are ignored, streams are served in the
+ * order their windows open up.
+ */
+
+#define FRAME_HEADER_LEN 9
+// ours, SETTINGS_MAX_FRAME_SIZE is left at its default
+#define MAX_FRAME_SIZE 16384
+#define WINDOW_SIZE 65535
+#define MAX_WINDOW 0x7fffffff
+#define MAX_BLOCK_SIZE 65536
+#define MAX_BODY_HINT (1 << 20)
+#define MAX_NAME_LEN 128
+
+#define FLAG_END_STREAM 0x01
+#define FLAG_ACK 0x01
+#define FLAG_END_HEADERS 0x04
+#define FLAG_PADDED 0x08
+#define FLAG_PRIORITY 0x20
+
+typedef enum {
+	FRAME_DATA,
+	FRAME_HEADERS,
+	FRAME_PRIORITY,
+	FRAME_RST_STREAM,
+	FRAME_SETTINGS,
+	FRAME_PUSH_PROMISE,
+	FRAME_PING,
+	FRAME_GOAWAY,
+	FRAME_WINDOW_UPDATE,
+	FRAME_CONTINUATION
+} FRAME_TYPE;
+
+typedef enum {
+	NO_ERROR,
+	PROTOCOL_ERROR,
+	INTERNAL_ERROR,
+	FLOW_CONTROL_ERROR,
+	SETTINGS_TIMEOUT,
+	STREAM_CLOSED,
+	FRAME_SIZE_ERROR,
+	REFUSED_STREAM,
+	CANCEL,
+	COMPRESSION_ERROR,
+	CONNECT_ERROR,
+	ENHANCE_YOUR_CALM
+} ERROR_CODE;
+
+typedef enum {
+	SETTINGS_HEADER_TABLE_SIZE = 1,
+	SETTINGS_ENABLE_PUSH,
+	SETTINGS_MAX_CONCURRENT_STREAMS,
+	SETTINGS_INITIAL_WINDOW_SIZE,
+	SETTINGS_MAX_FRAME_SIZE,
+	SETTINGS_MAX_HEADER_LIST_SIZE
+} SETTINGS_KEY;
+
+/*
+ * a stream is receiving until the peer ends it, then sending: `resp`
+ * holds the response head until it is complete, after that the body
+ * not yet framed, from `resp_off`. `vid` is the id on_request gave,
+ * -1 before and after the caller is done with the stream.
+ */
+typedef enum {
+	STREAM_RECV,
+	STREAM_SEND
+} STREAM_STATE;
+
+typedef struct {
+	uint32_t id;
+	int vid;
+	int state;
+	int end;
+	int headers;
+	int64_t window;
+	int64_t recv_window;
+	sge_buffer* req;
+	sge_buffer* body;
+	sge_buffer* resp;
+	size_t resp_off;
+} sge_h2_stream;
+
+struct sge_h2 {
+	const sge_h2_callbacks* cbs;
+	void* ud;
+	sge_hpack* decoder;
+	sge_buffer* in;
+	sge_buffer* out;
+	sge_buffer* block;
+	uint32_t block_stream;
+	uint8_t block_flags;
+	uint8_t block_new;
+	uint8_t preface;
+	uint32_t last_stream;
+	uint32_t nstreams;
+	int64_t send_window;
+	int64_t recv_window;
+	uint32_t initial_window;
+	uint32_t max_frame;
+	sge_h2_stream* streams[H2_MAX_STREAMS];
+};
+
+// a request header block on its way to HTTP/1.1
+typedef struct {
+	sge_buffer* fields;
+	sge_buffer* cookie;
+	char* method;
+	char* path;
+	char* authority;
+	size_t length;
+	int host;
+	int regular;
+	int malformed;
+} sge_h2_request;
+
+static const char* HOP_HEADERS[] = {"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", NULL};
+
+static uint32_t get_u32(const uint8_t* p);
+static void write_frame(sge_h2* h2, FRAME_TYPE type, uint8_t flags, uint32_t stream, const char* payload, size_t len);
+static void write_u32_frame(sge_h2* h2, FRAME_TYPE type, uint32_t stream, uint32_t value);
+static void write_headers(sge_h2* h2, uint32_t stream, sge_buffer* block, uint8_t flags);
+static int connection_error(sge_h2* h2, ERROR_CODE code);
+static sge_h2_stream* find_stream(sge_h2* h2, uint32_t id);
+static sge_h2_stream* create_stream(sge_h2* h2, uint32_t id);
+static void remove_stream(sge_h2* h2, sge_h2_stream* s);
+static void reset_stream(sge_h2* h2, sge_h2_stream* s, ERROR_CODE code);
+static ERROR_CODE apply_settings(sge_h2* h2, const uint8_t* p, size_t len);
+static int parse_frames(sge_h2* h2, const uint8_t* p, size_t len);
+static int on_frame(sge_h2* h2, uint8_t type, uint8_t flags, uint32_t id, const uint8_t* p, size_t len);
+static int on_data(sge_h2* h2, uint8_t flags, uint32_t id, const uint8_t* p, size_t len);
+static int on_headers(sge_h2* h2, uint8_t flags, uint32_t id, const uint8_t* p, size_t len);
+static int on_settings(sge_h2* h2, uint8_t flags, uint32_t id, const uint8_t* p, size_t len);
+static int on_window_update(sge_h2* h2, uint32_t id, const uint8_t* p, size_t len);
+static int append_block(sge_h2* h2, uint8_t flags, const uint8_t* p, size_t len);
+static int end_block(sge_h2* h2);
+static void request_field(void* ud, const char* name, size_t name_len, const char* value, size_t value_len);
+static void ignore_field(void* ud, const char* name, size_t name_len, const char* value, size_t value_len);
+static sge_buffer* compose_request(sge_h2_request* req);
+static void free_request(sge_h2_request* req);
+static int end_request(sge_h2* h2, sge_h2_stream* s);
+static void dispatch(sge_h2* h2, sge_h2_stream* s, sge_buffer* request);
+static int send_head(sge_h2* h2, sge_h2_stream* s, const char* data, size_t len);
+static void flush_stream(sge_h2* h2, sge_h2_stream* s);
+static void flush_streams(sge_h2* h2);
+static int base64url_decode(const char* in, size_t len, uint8_t* out, size_t* out_len);
+
+
+uint32_t
+get_u32(const uint8_t* p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void
+write_frame(sge_h2* h2, FRAME_TYPE type, uint8_t flags, uint32_t stream, const char* payload, size_t len) {
+	uint8_t head[FRAME_HEADER_LEN] = {
+		len >> 16, len >> 8, len, type, flags,
+		(stream >> 24) & 0x7f, stream >> 16, stream >> 8, stream
+	};
+
+	h2->out = append_buffer(h2->out, (const char*)head, FRAME_HEADER_LEN);
+	if (len > 0) {
+		h2->out = append_buffer(h2->out, payload, len);
+	}
+}
+
+void
+write_u32_frame(sge_h2* h2, FRAME_TYPE type, uint32_t stream, uint32_t value) {
+	uint8_t payload[4] = {value >> 24, value >> 16, value >> 8, value};
+	write_frame(h2, type, 0, stream, (const char*)payload, 4);
+}
+
+// a header block in a HEADERS frame and as many CONTINUATIONs as it takes
+void
+write_headers(sge_h2* h2, uint32_t stream, sge_buffer* block, uint8_t flags) {
+	size_t len, n;
+	const char* data = buffer_data(block, &len);
+	FRAME_TYPE type = FRAME_HEADERS;
+
+	do {
+		n = len < h2->max_frame ? len : h2->max_frame;
+		write_frame(h2, type, (n == len ? FLAG_END_HEADERS : 0) | flags, stream, data, n);
+		data += n;
+		len -= n;
+		type = FRAME_CONTINUATION;
+		flags = 0;
+	} while (len > 0);
+	destroy_buffer(block);
+}
+
+int
+connection_error(sge_h2* h2, ERROR_CODE code) {
+	uint8_t payload[8] = {
+		h2->last_stream >> 24, h2->last_stream >> 16, h2->last_stream >> 8, h2->last_stream,
+		0, 0, 0, code
+	};
+	write_frame(h2, FRAME_GOAWAY, 0, 0, (const char*)payload, 8);
+	return SGE_ERR;
+}
+
+sge_h2_stream*
+find_stream(sge_h2* h2, uint32_t id) {
+	int i;
+
+	for (i = 0; i < H2_MAX_STREAMS; ++i) {
+		if (h2->streams[i] && h2->streams[i]->id == id) {
+			return h2->streams[i];
+		}
+	}
+	return NULL;
+}
+
+sge_h2_stream*
+create_stream(sge_h2* h2, uint32_t id) {
+	int i;
+	sge_h2_stream* s = sge_malloc(sizeof(*s));
+
+	memset(s, 0, sizeof(*s));
+	s->id = id;
+	s->vid = -1;
+	s->state = STREAM_RECV;
+	s->window = h2->initial_window;
+	s->recv_window = WINDOW_SIZE;
+	for (i = 0; h2->streams[i]; ++i);
+	h2->streams[i] = s;
+	h2->nstreams++;
+	return s;
+}
+
+void
+remove_stream(sge_h2* h2, sge_h2_stream* s) {
+	int i;
+
+	for (i = 0; h2->streams[i] != s; ++i);
+	h2->streams[i] = NULL;
+	h2->nstreams--;
+	if (s->req) {
+		destroy_buffer(s->req);
+	}
+	if (s->body) {
+		destroy_buffer(s->body);
+	}
+	if (s->resp) {
+		destroy_buffer(s->resp);
+	}
+	sge_free(s);
+}
+
+void
+reset_stream(sge_h2* h2, sge_h2_stream* s, ERROR_CODE code) {
+	int vid = s->vid;
+
+	write_u32_frame(h2, FRAME_RST_STREAM, s->id, code);
+	remove_stream(h2, s);
+	if (vid >= 0) {
+		h2->cbs->on_reset(h2->ud, vid);
+	}
+}
+
+ERROR_CODE
+apply_settings(sge_h2* h2, const uint8_t* p, size_t len) {
+	size_t i;
+	int j;
+	uint16_t key;
+	uint32_t value;
+
+	for (i = 0; i + 6 <= len; i += 6) {
+		key = p[i] << 8 | p[i + 1];
+		value = get_u32(p + i + 2);
+		switch (key) {
+			case SETTINGS_ENABLE_PUSH:
+				if (value > 1) {
+					return PROTOCOL_ERROR;
+				}
+			break;
+			case SETTINGS_INITIAL_WINDOW_SIZE:
+				if (value > MAX_WINDOW) {
+					return FLOW_CONTROL_ERROR;
+				}
+				for (j = 0; j < H2_MAX_STREAMS; ++j) {
+					if (h2->streams[j]) {
+						h2->streams[j]->window += (int64_t)value - h2->initial_window;
+					}
+				}
+				h2->initial_window = value;
+			break;
+			case SETTINGS_MAX_FRAME_SIZE:
+				if (value < 16384 || value > 16777215) {
+					return PROTOCOL_ERROR;
+				}
+				h2->max_frame = value;
+			break;
+			default:
+				// our encoder never indexes, the peer's table size does not matter
+			break;
+		}
+	}
+	return NO_ERROR;
+}
+
+int
+parse_frames(sge_h2* h2, const uint8_t* p, size_t len) {
+	size_t flen, off = 0;
+
+	if (!h2->preface) {
+		if (memcmp(p, H2_PREFACE, len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN) != 0) {
+			return connection_error(h2, PROTOCOL_ERROR);
+		}
+		if (len < H2_PREFACE_LEN) {
+			return 0;
+		}
+		h2->preface = 1;
+		off = H2_PREFACE_LEN;
+	}
+
+	while (len - off >= FRAME_HEADER_LEN) {
+		flen = (size_t)p[off] << 16 | p[off + 1] << 8 | p[off + 2];
+		if (flen > MAX_FRAME_SIZE) {
+			return connection_error(h2, FRAME_SIZE_ERROR);
+		}
+		if (len - off - FRAME_HEADER_LEN < flen) {
+			break;
+		}
+		if (on_frame(h2, p[off + 3], p[off + 4], get_u32(p + off + 5) & MAX_WINDOW, p + off + FRAME_HEADER_LEN, flen) == SGE_ERR) {
+			return SGE_ERR;
+		}
+		off += FRAME_HEADER_LEN + flen;
+	}
+	return off;
+}
+
+int
+on_frame(sge_h2* h2, uint8_t type, uint8_t flags, uint32_t id, const uint8_t* p, size_t len) {
+	sge_h2_stream* s;
+
+	// nothing may come between a HEADERS and its CONTINUATIONs
+	if (h2->block_stream && (type != FRAME_CONTINUATION || id != h2->block_stream)) {
+		return connection_error(h2, PROTOCOL_ERROR);
+	}
+
+	switch (type) {
+		case FRAME_DATA:
+			return on_data(h2, flags, id, p, len);
+		case FRAME_HEADERS:
+			return on_headers(h2, flags, id, p, len);
+		case FRAME_CONTINUATION:
+			if (0 == h2->block_stream) {
+				return connection_error(h2, PROTOCOL_ERROR);
+			}
+			return append_block(h2, flags, p, len);
+		case FRAME_PRIORITY:
+			if (id == 0 || len != 5) {
+				return connection_error(h2, PROTOCOL_ERROR);
+			}
+		break;
+		case FRAME_RST_STREAM:
+			if (id == 0 || id > h2->last_stream || len != 4) {
+				return connection_error(h2, PROTOCOL_ERROR);
+			}
+			s = find_stream(h2, id);
+			if (s) {
+				int vid = s->vid;
+				remove_stream(h2, s);
+				if (vid >= 0) {
+					h2->cbs->on_reset(h2->ud, vid);
+				}
+			}
+		break;
+		case FRAME_SETTINGS:
+			return on_settings(h2, flags, id, p, len);
+		case FRAME_PUSH_PROMISE:
+			return connection_error(h2, PROTOCOL_ERROR);
+		case FRAME_PING:
+			if (id != 0 || len != 8) {
+				return connection_error(h2, PROTOCOL_ERROR);
+			}
+			if (!(flags & FLAG_ACK)) {
+				write_frame(h2, FRAME_PING, FLAG_ACK, 0, (const char*)p, 8);
+			}
+		break;
+		case FRAME_GOAWAY:
+			// the peer opens no more streams, those open are still answered
+		break;
+		case FRAME_WINDOW_UPDATE:
+			return on_window_update(h2, id, p, len);
+		default:
+			// unknown frame types are ignored
+		break;
+	}
+	return SGE_OK;
+}
+
+int
+on_data(sge_h2* h2, uint8_t flags, uint32_t id, const uint8_t* p, size_t len) {
+	sge_h2_stream* s;
+	size_t pad = 0, total = len;
+
+	if (id == 0 || id > h2->last_stream) {
+		return connection_error(h2, PROTOCOL_ERROR);
+	}
+	// the whole payload counts against the windows, padding included
+	h2->recv_window -= total;
+	if (h2->recv_window < 0) {
+		return connection_error(h2, FLOW_CONTROL_ERROR);
+	}
+	if (h2->recv_window <= WINDOW_SIZE / 2) {
+		write_u32_frame(h2, FRAME_WINDOW_UPDATE, 0, WINDOW_SIZE - h2->recv_window);
+		h2->recv_window = WINDOW_SIZE;
+	}
+	if (flags & FLAG_PADDED) {
+		if (len < 1 || p[0] > len - 1) {
+			return connection_error(h2, PROTOCOL_ERROR);
+		}
+		pad = p[0];
+		p++;
+		len -= pad + 1;
+	}
+
+	s = find_stream(h2, id);
+	if (NULL == s) {
+		write_u32_frame(h2, FRAME_RST_STREAM, id, STREAM_CLOSED);
+		return SGE_OK;
+	}
+	if (s->state != STREAM_RECV) {
+		reset_stream(h2, s, STREAM_CLOSED);
+		return SGE_OK;
+	}
+	s->recv_window -= total;
+	if (s->recv_window < 0) {
+		reset_stream(h2, s, FLOW_CONTROL_ERROR);
+		return SGE_OK;
+	}
+	if (len > 0) {
+		if (NULL == s->body) {
+			s->body = create_buffer(len);
+		}
+		s->body = append_buffer(s->body, (const char*)p, len);
+	}
+	if (flags & FLAG_END_STREAM) {
+		return end_request(h2, s);
+	}
+	if (s->recv_window <= WINDOW_SIZE / 2) {
+		write_u32_frame(h2, FRAME_WINDOW_UPDATE, id, WINDOW_SIZE - s->recv_window);
+		s->recv_window = WINDOW_SIZE;
+	}
+	return SGE_OK;
+}
+
+int
+on_headers(sge_h2* h2, uint8_t flags, uint32_t id, const uint8_t* p, size_t len) {
+	size_t pad = 0;
+
+	if (id == 0 || id % 2 == 0) {
+		return connection_error(h2, PROTOCOL_ERROR);
+	}
+	if (flags & FLAG_PADDED) {
+		if (len < 1) {
+			return connection_error(h2, PROTOCOL_ERROR);
+		}
+		pad = p[0];
+		p++;
+		len--;
+	}
+	if (flags & FLAG_PRIORITY) {
+		if (len < 5) {
+			return connection_error(h2, PROTOCOL_ERROR);
+		}
+		p += 5;
+		len -= 5;
+	}
+	if (pad > len) {
+		return connection_error(h2, PROTOCOL_ERROR);
+	}
+	len -= pad;
+
+	// trailers, or a block for a stream that is gone: decoded all the same for the table
+	h2->block_new = id > h2->last_stream;
+	if (h2->block_new) {
+		h2->last_stream = id;
+	}
+	h2->block_stream = id;
+	h2->block_flags = flags;
+	return append_block(h2, flags, p, len);
+}
+
+int
+on_settings(sge_h2* h2, uint8_t flags, uint32_t id, const uint8_t* p, size_t len) {
+	ERROR_CODE code;
+
+	if (id != 0) {
+		return connection_error(h2, PROTOCOL_ERROR);
+	}
+	if (flags & FLAG_ACK) {
+		return len == 0 ? SGE_OK : connection_error(h2, FRAME_SIZE_ERROR);
+	}
+	if (len % 6 != 0) {
+		return connection_error(h2, FRAME_SIZE_ERROR);
+	}
+	code = apply_settings(h2, p, len);
+	if (code != NO_ERROR) {
+		return connection_error(h2, code);
+	}
+	write_frame(h2, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+	flush_streams(h2);
+	return SGE_OK;
+}
+
+int
+on_window_update(sge_h2* h2, uint32_t id, const uint8_t* p, size_t len) {
+	sge_h2_stream* s;
+	uint32_t inc;
+
+	if (len != 4) {
+		return connection_error(h2, FRAME_SIZE_ERROR);
+	}
+	inc = get_u32(p) & MAX_WINDOW;
+	if (id == 0) {
+		h2->send_window += inc;
+		if (inc == 0 || h2->send_window > MAX_WINDOW) {
+			return connection_error(h2, inc == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+		}
+		flush_streams(h2);
+		return SGE_OK;
+	}
+
+	s = find_stream(h2, id);
+	if (NULL == s) {
+		return SGE_OK;
+	}
+	s->window += inc;
+	if (inc == 0 || s->window > MAX_WINDOW) {
+		reset_stream(h2, s, inc == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+		return SGE_OK;
+	}
+	flush_stream(h2, s);
+	return SGE_OK;
+}
+
+int
+append_block(sge_h2* h2, uint8_t flags, const uint8_t* p, size_t len) {
+	if (buffer_size(h2->block) + len > MAX_BLOCK_SIZE) {
+		return connection_error(h2, ENHANCE_YOUR_CALM);
+	}
+	h2->block = append_buffer(h2->block, (const char*)p, len);
+	if (flags & FLAG_END_HEADERS) {
+		return end_block(h2);
+	}
+	return SGE_OK;
+}
+
+int
+end_block(sge_h2* h2) {
+	uint32_t id = h2->block_stream;
+	int ret, end = h2->block_flags & FLAG_END_STREAM;
+	sge_h2_stream* s = find_stream(h2, id);
+	sge_h2_request req;
+	const uint8_t* data;
+	size_t len;
+
+	h2->block_stream = 0;
+	data = (const uint8_t*)buffer_data(h2->block, &len);
+	if (!h2->block_new) {
+		ret = hpack_decode(h2->decoder, data, len, ignore_field, NULL);
+		clear_buffer(h2->block);
+		if (ret == SGE_ERR) {
+			return connection_error(h2, COMPRESSION_ERROR);
+		}
+		if (NULL == s) {
+			return SGE_OK;
+		}
+		if (s->state != STREAM_RECV || !end) {
+			reset_stream(h2, s, s->state != STREAM_RECV ? STREAM_CLOSED : PROTOCOL_ERROR);
+			return SGE_OK;
+		}
+		// trailers end the request and are dropped
+		return end_request(h2, s);
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.fields = create_buffer(len * 2 + 64);
+	ret = hpack_decode(h2->decoder, data, len, request_field, &req);
+	clear_buffer(h2->block);
+	if (ret == SGE_ERR) {
+		free_request(&req);
+		return connection_error(h2, COMPRESSION_ERROR);
+	}
+	if (req.malformed || NULL == req.method || NULL == req.path) {
+		write_u32_frame(h2, FRAME_RST_STREAM, id, PROTOCOL_ERROR);
+	} else if (h2->nstreams >= H2_MAX_STREAMS) {
+		write_u32_frame(h2, FRAME_RST_STREAM, id, REFUSED_STREAM);
+	} else {
+		s = create_stream(h2, id);
+		s->req = compose_request(&req);
+		if (req.length > 0) {
+			s->body = create_buffer(req.length < MAX_BODY_HINT ? req.length : MAX_BODY_HINT);
+		}
+	}
+	free_request(&req);
+	if (s && end) {
+		return end_request(h2, s);
+	}
+	return SGE_OK;
+}
+
+static int
+pseudo_field(char** field, const char* value, size_t value_len) {
+	if (*field) {
+		return SGE_ERR;
+	}
+	*field = strndup(value, value_len);
+	return SGE_OK;
+}
+
+/*
+ * collect one field of a request. a malformed request still has to be
+ * decoded to the end, so this only takes note of what is wrong.
+ * header names are written back in the usual HTTP/1.1 case, which is
+ * how handlers look them up.
+ */
+void
+request_field(void* ud, const char* name, size_t name_len, const char* value, size_t value_len) {
+	sge_h2_request* req = ud;
+	char canonical[MAX_NAME_LEN];
+	size_t i;
+	int j, upper = 1;
+
+	for (i = 0; i < value_len; ++i) {
+		if (value[i] == '\r' || value[i] == '\n' || value[i] == '\0') {
+			req->malformed = 1;
+			return;
+		}
+	}
+	if (name_len == 0 || name_len >= MAX_NAME_LEN) {
+		req->malformed = 1;
+		return;
+	}
+
+	if (name[0] == ':') {
+		int ret = SGE_OK;
+		if (req->regular) {
+			ret = SGE_ERR;
+		} else if (value_len == 0 || memchr(value, ' ', value_len)) {
+			// the request line is split on spaces
+			ret = name_len == 10 && memcmp(name, ":authority", 10) == 0 ? SGE_OK : SGE_ERR;
+		} else if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+			ret = pseudo_field(&req->method, value, value_len);
+		} else if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+			ret = pseudo_field(&req->path, value, value_len);
+		} else if (name_len == 10 && memcmp(name, ":authority", 10) == 0) {
+			ret = pseudo_field(&req->authority, value, value_len);
+		} else if (!(name_len == 7 && memcmp(name, ":scheme", 7) == 0)) {
+			ret = SGE_ERR;
+		}
+		if (ret == SGE_ERR) {
+			req->malformed = 1;
+		}
+		return;
+	}
+
+	req->regular = 1;
+	for (i = 0; i < name_len; ++i) {
+		if ((name[i] >= 'A' && name[i] <= 'Z') || name[i] <= ' ' || name[i] == ':' || name[i] == 0x7f) {
+			req->malformed = 1;
+			return;
+		}
+		canonical[i] = upper && name[i] >= 'a' && name[i] <= 'z' ? name[i] - 'a' + 'A' : name[i];
+		upper = name[i] == '-';
+	}
+	for (j = 0; HOP_HEADERS[j]; ++j) {
+		if (strlen(HOP_HEADERS[j]) == name_len && memcmp(HOP_HEADERS[j], name, name_len) == 0) {
+			req->malformed = 1;
+			return;
+		}
+	}
+	if (name_len == 2 && memcmp(name, "te", 2) == 0) {
+		if (!(value_len == 8 && memcmp(value, "trailers", 8) == 0)) {
+			req->malformed = 1;
+		}
+		return;
+	}
+	if (name_len == 14 && memcmp(name, "content-length", 14) == 0) {
+		// replaced by the length of the body received
+		req->length = strtoul(value, NULL, 10);
+		return;
+	}
+	if (name_len == 6 && memcmp(name, "cookie", 6) == 0) {
+		// split into crumbs for compression, one header again for HTTP/1.1
+		if (NULL == req->cookie) {
+			req->cookie = create_buffer(value_len + 16);
+		} else {
+			req->cookie = append_buffer(req->cookie, "; ", 2);
+		}
+		req->cookie = append_buffer(req->cookie, value, value_len);
+		return;
+	}
+	if (name_len == 4 && memcmp(name, "host", 4) == 0) {
+		req->host = 1;
+	}
+	req->fields = append_buffer(req->fields, canonical, name_len);
+	req->fields = append_buffer(req->fields, ": ", 2);
+	req->fields = append_buffer(req->fields, value, value_len);
+	req->fields = append_buffer(req->fields, "\r\n", 2);
+}
+
+void
+ignore_field(void* ud, const char* name, size_t name_len, const char* value, size_t value_len) {
+}
+
+// the request line and headers, without the blank line that ends them
+sge_buffer*
+compose_request(sge_h2_request* req) {
+	size_t len;
+	const char* fields = buffer_data(req->fields, &len);
+	sge_buffer* buf = create_buffer(len + strlen(req->method) + strlen(req->path) + 64);
+
+	buf = append_buffer(buf, req->method, strlen(req->method));
+	buf = append_buffer(buf, " ", 1);
+	buf = append_buffer(buf, req->path, strlen(req->path));
+	buf = append_buffer(buf, " HTTP/2.0\r\n", 11);
+	if (req->authority && !req->host) {
+		buf = append_buffer(buf, "Host: ", 6);
+		buf = append_buffer(buf, req->authority, strlen(req->authority));
+		buf = append_buffer(buf, "\r\n", 2);
+	}
+	buf = append_buffer(buf, fields, len);
+	if (req->cookie) {
+		fields = buffer_data(req->cookie, &len);
+		buf = append_buffer(buf, "Cookie: ", 8);
+		buf = append_buffer(buf, fields, len);
+		buf = append_buffer(buf, "\r\n", 2);
+	}
+	return buf;
+}
+
+void
+free_request(sge_h2_request* req) {
+	destroy_buffer(req->fields);
+	if (req->cookie) {
+		destroy_buffer(req->cookie);
+	}
+	sge_free(req->method);
+	sge_free(req->path);
+	sge_free(req->authority);
+}
+
+int
+end_request(sge_h2* h2, sge_h2_stream* s) {
+	char line[64];
+	int n = 0;
+	size_t head_len, body_len = 0;
+	const char* head = buffer_data(s->req, &head_len);
+	const char* body = s->body ? buffer_data(s->body, &body_len) : NULL;
+	sge_buffer* request;
+
+	if (body_len > 0) {
+		n = snprintf(line, sizeof(line), "Content-Length: %zu\r\n", body_len);
+	}
+	request = create_buffer(head_len + n + 2 + body_len);
+	request = append_buffer(request, head, head_len);
+	request = append_buffer(request, line, n);
+	request = append_buffer(request, "\r\n", 2);
+	if (body_len > 0) {
+		request = append_buffer(request, body, body_len);
+	}
+	destroy_buffer(s->req);
+	s->req = NULL;
+	if (s->body) {
+		destroy_buffer(s->body);
+		s->body = NULL;
+	}
+	dispatch(h2, s, request);
+	return SGE_OK;
+}
+
+void
+dispatch(sge_h2* h2, sge_h2_stream* s, sge_buffer* request) {
+	sge_buffer* block;
+	int vid;
+
+	s->state = STREAM_SEND;
+	vid = h2->cbs->on_request(h2->ud, s->id, request);
+	if (vid == H2_REFUSED) {
+		reset_stream(h2, s, REFUSED_STREAM);
+	} else if (vid == H2_UNAVAILABLE) {
+		block = hpack_encode_status(create_buffer(16), 503);
+		block = hpack_encode(block, "retry-after", 11, "1", 1);
+		write_headers(h2, s->id, block, FLAG_END_STREAM);
+		remove_stream(h2, s);
+	} else {
+		s->vid = vid;
+	}
+}
+
+static const char*
+find_line(const char* p, const char* end) {
+	for (; p + 1 < end; ++p) {
+		if (p[0] == '\r' && p[1] == '\n') {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * the head of the HTTP/1.1 response as a HEADERS frame: status line to
+ * :status, names to lower case, connection specific headers dropped.
+ */
+int
+send_head(sge_h2* h2, sge_h2_stream* s, const char* data, size_t len) {
+	char name[MAX_NAME_LEN];
+	const char* p = data, *end = data + len, *eol, *colon, *value, *value_end;
+	size_t i, name_len;
+	int j, status;
+	sge_buffer* block;
+
+	if (len < 12 || memcmp(p, "HTTP/1.", 7) != 0 || p[8] != ' '
+		|| p[9] < '1' || p[9] > '9' || p[10] < '0' || p[10] > '9' || p[11] < '0' || p[11] > '9') {
+		return SGE_ERR;
+	}
+	status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+	block = hpack_encode_status(create_buffer(len), status);
+
+	for (p = find_line(p, end) + 2; (eol = find_line(p, end)) && eol > p; p = eol + 2) {
+		colon = memchr(p, ':', eol - p);
+		name_len = colon ? colon - p : 0;
+		if (name_len == 0 || name_len >= MAX_NAME_LEN) {
+			continue;
+		}
+		for (i = 0; i < name_len; ++i) {
+			name[i] = p[i] >= 'A' && p[i] <= 'Z' ? p[i] - 'A' + 'a' : p[i];
+		}
+		for (j = 0; HOP_HEADERS[j]; ++j) {
+			if (strlen(HOP_HEADERS[j]) == name_len && memcmp(HOP_HEADERS[j], name, name_len) == 0) {
+				break;
+			}
+		}
+		if (HOP_HEADERS[j]) {
+			continue;
+		}
+		for (value = colon + 1; value < eol && (*value == ' ' || *value == '\t'); ++value);
+		for (value_end = eol; value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'); --value_end);
+		block = hpack_encode(block, name, name_len, value, value_end - value);
+	}
+	write_headers(h2, s->id, block, 0);
+	return SGE_OK;
+}
+
+void
+flush_stream(sge_h2* h2, sge_h2_stream* s) {
+	size_t size, n;
+	const char* data;
+	uint8_t flags;
+
+	if (!s->headers) {
+		return;
+	}
+	data = buffer_data(s->resp, &size);
+	while (s->resp_off < size && s->window > 0 && h2->send_window > 0) {
+		n = size - s->resp_off;
+		n = n < s->window ? n : s->window;
+		n = n < h2->send_window ? n : h2->send_window;
+		n = n < h2->max_frame ? n : h2->max_frame;
+		flags = s->end && s->resp_off + n == size ? FLAG_END_STREAM : 0;
+		write_frame(h2, FRAME_DATA, flags, s->id, data + s->resp_off, n);
+		s->resp_off += n;
+		s->window -= n;
+		h2->send_window -= n;
+		if (flags) {
+			remove_stream(h2, s);
+			return;
+		}
+	}
+	if (s->resp_off < size) {
+		return;
+	}
+	clear_buffer(s->resp);
+	s->resp_off = 0;
+	if (s->end) {
+		write_frame(h2, FRAME_DATA, FLAG_END_STREAM, s->id, NULL, 0);
+		remove_stream(h2, s);
+	}
+}
+
+void
+flush_streams(sge_h2* h2) {
+	int i;
+
+	for (i = 0; i < H2_MAX_STREAMS && h2->send_window > 0; ++i) {
+		if (h2->streams[i]) {
+			flush_stream(h2, h2->streams[i]);
+		}
+	}
+}
+
+int
+base64url_decode(const char* in, size_t len, uint8_t* out, size_t* out_len) {
+	uint32_t acc = 0;
+	int v, bits = 0;
+	size_t i, n = 0;
+
+	for (i = 0; i < len && in[i] != '='; ++i) {
+		char c = in[i];
+		if (c >= 'A' && c <= 'Z') {
+			v = c - 'A';
+		} else if (c >= 'a' && c <= 'z') {
+			v = c - 'a' + 26;
+		} else if (c >= '0' && c <= '9') {
+			v = c - '0' + 52;
+		} else if (c == '-' || c == '+') {
+			v = 62;
+		} else if (c == '_' || c == '/') {
+			v = 63;
+		} else {
+			return SGE_ERR;
+		}
+		acc = (acc << 6) | v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			out[n++] = acc >> bits;
+		}
+	}
+	*out_len = n;
+	return SGE_OK;
+}
+
+sge_h2*
+create_h2(const sge_h2_callbacks* cbs, void* ud) {
+	static const uint8_t settings[] = {0, SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_MAX_STREAMS};
+	sge_h2* h2 = sge_malloc(sizeof(*h2));
+
+	memset(h2, 0, sizeof(*h2));
+	h2->cbs = cbs;
+	h2->ud = ud;
+	h2->decoder = create_hpack(HPACK_TABLE_SIZE);
+	h2->in = create_buffer(MAX_FRAME_SIZE);
+	h2->out = create_buffer(MAX_FRAME_SIZE + FRAME_HEADER_LEN);
+	h2->block = create_buffer(1024);
+	h2->send_window = h2->recv_window = WINDOW_SIZE;
+	h2->initial_window = WINDOW_SIZE;
+	h2->max_frame = MAX_FRAME_SIZE;
+	write_frame(h2, FRAME_SETTINGS, 0, 0, (const char*)settings, sizeof(settings));
+	return h2;
+}
+
+void
+destroy_h2(sge_h2* h2) {
+	int i, vid;
+
+	for (i = 0; i < H2_MAX_STREAMS; ++i) {
+		if (h2->streams[i]) {
+			vid = h2->streams[i]->vid;
+			remove_stream(h2, h2->streams[i]);
+			if (vid >= 0) {
+				h2->cbs->on_reset(h2->ud, vid);
+			}
+		}
+	}
+	destroy_hpack(h2->decoder);
+	destroy_buffer(h2->in);
+	destroy_buffer(h2->out);
+	destroy_buffer(h2->block);
+	sge_free(h2);
+}
+
+/*
+ * switch from an HTTP/1.1 request with "Upgrade: h2c": apply the
+ * HTTP2-Settings it carried and make the request itself stream 1.
+ * on error nothing has changed and `request` is still the caller's.
+ */
+int
+h2_upgrade(sge_h2* h2, const char* settings, size_t len, sge_buffer* request) {
+	uint8_t payload[256];
+	size_t n;
+	sge_h2_stream* s;
+
+	if (len > 340 || base64url_decode(settings, len, payload, &n) == SGE_ERR
+		|| n % 6 != 0 || apply_settings(h2, payload, n) != NO_ERROR) {
+		return SGE_ERR;
+	}
+	s = create_stream(h2, 1);
+	h2->last_stream = 1;
+	dispatch(h2, s, request);
+	return SGE_OK;
+}
+
+/*
+ * SGE_ERR when the connection has to be closed, after the GOAWAY that
+ * says why is written.
+ */
+int
+h2_feed(sge_h2* h2, const char* data, size_t len) {
+	int n;
+
+	if (buffer_size(h2->in) > 0) {
+		h2->in = append_buffer(h2->in, data, len);
+		data = buffer_data(h2->in, &len);
+	}
+	n = parse_frames(h2, (const uint8_t*)data, len);
+	if (n == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (buffer_size(h2->in) > 0) {
+		erase_buffer(h2->in, 0, n);
+	} else if ((size_t)n < len) {
+		h2->in = append_buffer(h2->in, data + n, len - n);
+	}
+	return SGE_OK;
+}
+
+/*
+ * HTTP/1.1 response bytes for a stream. the head goes out once it is
+ * complete, the body as DATA frames while the windows allow.
+ */
+int
+h2_respond(sge_h2* h2, uint32_t stream, const char* data, size_t len) {
+	sge_h2_stream* s = find_stream(h2, stream);
+	const char* str, *p;
+	size_t size;
+
+	if (NULL == s || s->state != STREAM_SEND) {
+		return SGE_OK;
+	}
+	if (NULL == s->resp) {
+		s->resp = create_buffer(len);
+	} else if (s->resp_off > 0) {
+		erase_buffer(s->resp, 0, s->resp_off);
+		s->resp_off = 0;
+	}
+	s->resp = append_buffer(s->resp, data, len);
+	if (!s->headers) {
+		str = buffer_data(s->resp, &size);
+		for (p = str; p + 3 < str + size && memcmp(p, "\r\n\r\n", 4) != 0; ++p);
+		if (p + 3 >= str + size) {
+			return SGE_OK;
+		}
+		if (send_head(h2, s, str, p + 4 - str) == SGE_ERR) {
+			reset_stream(h2, s, INTERNAL_ERROR);
+			return SGE_ERR;
+		}
+		s->headers = 1;
+		s->resp_off = p + 4 - str;
+	}
+	flush_stream(h2, s);
+	return SGE_OK;
+}
+
+/*
+ * the response is complete: END_STREAM goes out after the last of it.
+ * the stream's id is the caller's to reuse from here on.
+ */
+int
+h2_finish(sge_h2* h2, uint32_t stream) {
+	sge_h2_stream* s = find_stream(h2, stream);
+
+	if (NULL == s) {
+		return SGE_OK;
+	}
+	s->vid = -1;
+	if (!s->headers) {
+		reset_stream(h2, s, INTERNAL_ERROR);
+		return SGE_OK;
+	}
+	s->end = 1;
+	flush_stream(h2, s);
+	return SGE_OK;
+}
+
+sge_buffer*
+h2_output(sge_h2* h2) {
+	sge_buffer* out;
+
+	if (buffer_size(h2->out) == 0) {
+		return NULL;
+	}
+	out = h2->out;
+	h2->out = create_buffer(MAX_FRAME_SIZE + FRAME_HEADER_LEN);
+	return out;
+}
@@ -0,0 +1,39 @@
+#ifndef H2_H_
+#define H2_H_
+
+#include <stdint.h>
+
+#include "core/buffer.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_MAX_STREAMS 100
+
+// what on_request returns instead of an id to decline a stream
+#define H2_REFUSED -1
+#define H2_UNAVAILABLE -2
+
+typedef struct sge_h2 sge_h2;
+
+/*
+ * on_request gets a stream's request, complete with its body, as an
+ * HTTP/1.1 message it then owns, and returns the id the stream goes by
+ * from now on. H2_REFUSED resets the stream with REFUSED_STREAM,
+ * H2_UNAVAILABLE answers it with a bare 503.
+ * on_reset tells that a stream with an id was dropped before
+ * h2_finish(), by the peer or with the session.
+ */
+typedef struct {
+	int (*on_request)(void* ud, uint32_t stream, sge_buffer* request);
+	void (*on_reset)(void* ud, int id);
+} sge_h2_callbacks;
+
+sge_h2* create_h2(const sge_h2_callbacks* cbs, void* ud);
+void destroy_h2(sge_h2* h2);
+int h2_upgrade(sge_h2* h2, const char* settings, size_t len, sge_buffer* request);
+int h2_feed(sge_h2* h2, const char* data, size_t len);
+int h2_respond(sge_h2* h2, uint32_t stream, const char* data, size_t len);
+int h2_finish(sge_h2* h2, uint32_t stream);
+sge_buffer* h2_output(sge_h2* h2);
+
+#endif
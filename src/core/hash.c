@@ -0,0 +1,171 @@
+#include "core/sge.h"
+#include "core/hash.h"
+
+#define MIN_HASH_SIZE 16
+
+typedef struct sge_hash_node {
+	struct sge_hash_node* next;
+	uint64_t code;
+	size_t len;
+	void* value;
+	char key[0];
+} sge_hash_node;
+
+struct sge_hash {
+	size_t cap;
+	size_t used;
+	sge_hash_node** slots;
+};
+
+
+static sge_hash_node**
+create_slots(size_t cap) {
+	size_t s = sizeof(sge_hash_node*) * cap;
+	sge_hash_node** slots = sge_malloc(s);
+	memset(slots, 0, s);
+	return slots;
+}
+
+static void
+expand(sge_hash* hash) {
+	size_t i, cap = hash->cap * 2;
+	sge_hash_node** slots = create_slots(cap);
+	sge_hash_node* node, *next;
+
+	for (i = 0; i < hash->cap; ++i) {
+		for (node = hash->slots[i]; node; node = next) {
+			next = node->next;
+			node->next = slots[node->code & (cap - 1)];
+			slots[node->code & (cap - 1)] = node;
+		}
+	}
+	sge_free(hash->slots);
+	hash->slots = slots;
+	hash->cap = cap;
+}
+
+static sge_hash_node**
+find_node(sge_hash* hash, uint64_t code, const char* key, size_t len) {
+	sge_hash_node** p = &(hash->slots[code & (hash->cap - 1)]);
+
+	for (; *p; p = &((*p)->next)) {
+		if ((*p)->code == code && (*p)->len == len && memcmp((*p)->key, key, len) == 0) {
+			break;
+		}
+	}
+	return p;
+}
+
+
+// FNV-1a
+uint64_t
+hash_string(const char* key, size_t len) {
+	size_t i;
+	uint64_t code = 14695981039346656037ULL;
+
+	for (i = 0; i < len; ++i) {
+		code ^= (unsigned char)key[i];
+		code *= 1099511628211ULL;
+	}
+	return code;
+}
+
+sge_hash*
+create_hash(size_t size) {
+	size_t cap = MIN_HASH_SIZE;
+	sge_hash* hash = sge_malloc(sizeof(*hash));
+
+	while (cap < size) {
+		cap <<= 1;
+	}
+	hash->cap = cap;
+	hash->used = 0;
+	hash->slots = create_slots(cap);
+	return hash;
+}
+
+void
+destroy_hash(sge_hash* hash, void (*cb_free)(void*)) {
+	size_t i;
+	sge_hash_node* node, *next;
+
+	for (i = 0; i < hash->cap; ++i) {
+		for (node = hash->slots[i]; node; node = next) {
+			next = node->next;
+			if (cb_free) {
+				cb_free(node->value);
+			}
+			sge_free(node);
+		}
+	}
+	sge_free(hash->slots);
+	sge_free(hash);
+}
+
+void*
+hash_get(sge_hash* hash, const char* key, size_t len) {
+	sge_hash_node* node = *find_node(hash, hash_string(key, len), key, len);
+	return node ? node->value : NULL;
+}
+
+int
+hash_set(sge_hash* hash, const char* key, size_t len, void* value) {
+	uint64_t code = hash_string(key, len);
+	sge_hash_node** p = find_node(hash, code, key, len);
+
+	if (*p) {
+		(*p)->value = value;
+		return SGE_OK;
+	}
+
+	sge_hash_node* node = sge_malloc(sizeof(*node) + len);
+	node->next = NULL;
+	node->code = code;
+	node->len = len;
+	node->value = value;
+	memcpy(node->key, key, len);
+	*p = node;
+
+	if (++hash->used > hash->cap) {
+		expand(hash);
+	}
+	return SGE_OK;
+}
+
+void*
+hash_del(sge_hash* hash, const char* key, size_t len) {
+	void* value;
+	sge_hash_node* node;
+	sge_hash_node** p = find_node(hash, hash_string(key, len), key, len);
+
+	if (NULL == *p) {
+		return NULL;
+	}
+	node = *p;
+	*p = node->next;
+	value = node->value;
+	sge_free(node);
+	hash->used--;
+	return value;
+}
+
+size_t
+hash_size(sge_hash* hash) {
+	return hash->used;
+}
+
+int
+hash_foreach(sge_hash* hash, int (*cb)(const char* key, size_t len, void* value, void* ud), void* ud) {
+	size_t i;
+	sge_hash_node* node, *next;
+
+	for (i = 0; i < hash->cap; ++i) {
+		for (node = hash->slots[i]; node; node = next) {
+			next = node->next;
+			if (cb(node->key, node->len, node->value, ud) == SGE_ERR) {
+				return SGE_ERR;
+			}
+		}
+	}
+	return SGE_OK;
+}
@@ -0,0 +1,17 @@
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <stdint.h>
+
+typedef struct sge_hash sge_hash;
+
+sge_hash* create_hash(size_t size);
+void destroy_hash(sge_hash* hash, void (*cb_free)(void*));
+void* hash_get(sge_hash* hash, const char* key, size_t len);
+int hash_set(sge_hash* hash, const char* key, size_t len, void* value);
+void* hash_del(sge_hash* hash, const char* key, size_t len);
+size_t hash_size(sge_hash* hash);
+int hash_foreach(sge_hash* hash, int (*cb)(const char* key, size_t len, void* value, void* ud), void* ud);
+uint64_t hash_string(const char* key, size_t len);
+
+#endif
@@ -0,0 +1,165 @@
+#include "core/sge.h"
+#include "core/histogram.h"
+
+/*
+ * log-linear buckets: values below 64 are exact, above that every power
+ * of two is split into 32 buckets, so a bucket is at most ~3% wide.
+ * one thread records, any thread may merge or read it concurrently: the
+ * fields are updated with relaxed atomics, so a reader sees a slightly
+ * stale but never torn snapshot.
+ */
+
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+
+#define SUB_BITS 5
+#define SUB_COUNT (1 << SUB_BITS)
+#define LINEAR_MAX (SUB_COUNT << 1)
+#define BUCKET_NUM ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+struct sge_histogram {
+	uint64_t count;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[BUCKET_NUM];
+};
+
+static int
+bucket_index(uint64_t value) {
+	int exp;
+
+	if (value < LINEAR_MAX) {
+		return (int)value;
+	}
+	exp = 63 - __builtin_clzll(value) - SUB_BITS;
+	return exp * SUB_COUNT + (int)(value >> exp);
+}
+
+static uint64_t
+bucket_upper(int idx) {
+	int exp;
+	uint64_t m;
+
+	if (idx < LINEAR_MAX) {
+		return idx;
+	}
+	exp = idx / SUB_COUNT - 1;
+	m = idx % SUB_COUNT + SUB_COUNT;
+	return ((m + 1) << exp) - 1;
+}
+
+sge_histogram*
+create_histogram() {
+	sge_histogram* h = sge_malloc(sizeof(*h));
+	histogram_reset(h);
+	return h;
+}
+
+void
+destroy_histogram(void* h) {
+	sge_free(h);
+}
+
+void
+histogram_record(sge_histogram* h, uint64_t value) {
+	uint64_t* bucket = &h->buckets[bucket_index(value)];
+
+	STORE(bucket, LOAD(bucket) + 1);
+	STORE(&h->count, h->count + 1);
+	STORE(&h->total, h->total + value);
+	if (value < h->min) {
+		STORE(&h->min, value);
+	}
+	if (value > h->max) {
+		STORE(&h->max, value);
+	}
+}
+
+/*
+ * coordinated omission correction for a closed loop that expects one
+ * sample every interval: a stalled sample also stands for the samples
+ * that could not be taken while it stalled.
+ */
+void
+histogram_record_corrected(sge_histogram* h, uint64_t value, uint64_t interval) {
+	uint64_t missing;
+
+	histogram_record(h, value);
+	if (interval == 0) {
+		return;
+	}
+	for (missing = value - interval; missing >= interval && missing < value; missing -= interval) {
+		histogram_record(h, missing);
+	}
+}
+
+void
+histogram_merge(sge_histogram* dst, const sge_histogram* src) {
+	int i;
+	uint64_t min = LOAD(&src->min), max = LOAD(&src->max);
+
+	for (i = 0; i < BUCKET_NUM; ++i) {
+		dst->buckets[i] += LOAD(&src->buckets[i]);
+	}
+	dst->count += LOAD(&src->count);
+	dst->total += LOAD(&src->total);
+	if (min < dst->min) {
+		dst->min = min;
+	}
+	if (max > dst->max) {
+		dst->max = max;
+	}
+}
+
+void
+histogram_reset(sge_histogram* h) {
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+uint64_t
+histogram_count(const sge_histogram* h) {
+	return h->count;
+}
+
+uint64_t
+histogram_min(const sge_histogram* h) {
+	return h->count ? h->min : 0;
+}
+
+uint64_t
+histogram_max(const sge_histogram* h) {
+	return h->max;
+}
+
+double
+histogram_mean(const sge_histogram* h) {
+	return h->count ? (double)h->total / h->count : 0;
+}
+
+/*
+ * p in [0, 100]. returns the upper bound of the bucket holding the
+ * sample, clamped to the recorded max.
+ */
+uint64_t
+histogram_percentile(const sge_histogram* h, double p) {
+	int i;
+	uint64_t rank, seen = 0, upper;
+
+	if (h->count == 0) {
+		return 0;
+	}
+	rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+	if (rank < 1) {
+		rank = 1;
+	}
+	for (i = 0; i < BUCKET_NUM; ++i) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			upper = bucket_upper(i);
+			return upper < h->max ? upper : h->max;
+		}
+	}
+	return h->max;
+}
@@ -0,0 +1,20 @@
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <stdint.h>
+
+typedef struct sge_histogram sge_histogram;
+
+sge_histogram* create_histogram();
+void destroy_histogram(void* h);
+void histogram_record(sge_histogram* h, uint64_t value);
+void histogram_record_corrected(sge_histogram* h, uint64_t value, uint64_t interval);
+void histogram_merge(sge_histogram* dst, const sge_histogram* src);
+void histogram_reset(sge_histogram* h);
+uint64_t histogram_count(const sge_histogram* h);
+uint64_t histogram_min(const sge_histogram* h);
+uint64_t histogram_max(const sge_histogram* h);
+double histogram_mean(const sge_histogram* h);
+uint64_t histogram_percentile(const sge_histogram* h, double p);
+
+#endif
@@ -0,0 +1,509 @@
+#include <stdio.h>
+
+#include "core/sge.h"
+#include "core/hpack.h"
+
+/*
+ * HPACK (RFC 7541) for the http/2 sessions. the decoder keeps the
+ * dynamic table the peer's encoder fills. the encoder never indexes:
+ * responses are written as literals, with the name taken from the
+ * static table when it is there, so there is no table state to keep
+ * in sync on our side and a size update from the peer costs nothing.
+ */
+
+#define ENTRY_OVERHEAD 32
+
+typedef struct {
+	const char* name;
+	const char* value;
+} sge_hpack_static;
+
+typedef struct {
+	size_t name_len;
+	size_t value_len;
+	char data[0];
+} sge_hpack_entry;
+
+/*
+ * the dynamic table is a ring of entries, the newest at `first`.
+ * it can never hold more than max_size / 32 entries.
+ */
+struct sge_hpack {
+	sge_hpack_entry** entries;
+	size_t cap;
+	size_t first;
+	size_t count;
+	size_t size;
+	size_t max_size;
+	size_t limit;
+	char* scratch;
+	size_t scratch_cap;
+};
+
+static void build_huffman();
+static int huffman_decode(const uint8_t* p, size_t len, char* out, size_t* out_len);
+static int decode_int(const uint8_t** p, const uint8_t* end, int prefix, uint32_t* value);
+static int decode_string(const uint8_t** p, const uint8_t* end, char* out, size_t* len);
+static int lookup(sge_hpack* hpack, uint32_t index, const char** name, size_t* name_len, const char** value, size_t* value_len);
+static sge_hpack_entry* create_entry(const char* name, size_t name_len, const char* value, size_t value_len);
+static void evict(sge_hpack* hpack, size_t size);
+static void insert(sge_hpack* hpack, sge_hpack_entry* entry);
+static sge_buffer* encode_int(sge_buffer* buf, uint8_t first, int prefix, uint32_t value);
+
+
+static const uint32_t HUFFMAN_CODES[257] = {
+	0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+	0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+	0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+	0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+	0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+	0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+	0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+	0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+	0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+	0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+	0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+	0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+	0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+	0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+	0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+	0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+	0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+	0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+	0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+	0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+	0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+	0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+	0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+	0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+	0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+	0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+	0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+	0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+	0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+	0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+	0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+	0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+	0x3fffffff
+};
+
+static const uint8_t HUFFMAN_BITS[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30
+};
+
+static const sge_hpack_static STATIC_TABLE[61] = {
+	{":authority", ""},
+	{":method", "GET"},
+	{":method", "POST"},
+	{":path", "/"},
+	{":path", "/index.html"},
+	{":scheme", "http"},
+	{":scheme", "https"},
+	{":status", "200"},
+	{":status", "204"},
+	{":status", "206"},
+	{":status", "304"},
+	{":status", "400"},
+	{":status", "404"},
+	{":status", "500"},
+	{"accept-charset", ""},
+	{"accept-encoding", "gzip, deflate"},
+	{"accept-language", ""},
+	{"accept-ranges", ""},
+	{"accept", ""},
+	{"access-control-allow-origin", ""},
+	{"age", ""},
+	{"allow", ""},
+	{"authorization", ""},
+	{"cache-control", ""},
+	{"content-disposition", ""},
+	{"content-encoding", ""},
+	{"content-language", ""},
+	{"content-length", ""},
+	{"content-location", ""},
+	{"content-range", ""},
+	{"content-type", ""},
+	{"cookie", ""},
+	{"date", ""},
+	{"etag", ""},
+	{"expect", ""},
+	{"expires", ""},
+	{"from", ""},
+	{"host", ""},
+	{"if-match", ""},
+	{"if-modified-since", ""},
+	{"if-none-match", ""},
+	{"if-range", ""},
+	{"if-unmodified-since", ""},
+	{"last-modified", ""},
+	{"link", ""},
+	{"location", ""},
+	{"max-forwards", ""},
+	{"proxy-authenticate", ""},
+	{"proxy-authorization", ""},
+	{"range", ""},
+	{"referer", ""},
+	{"refresh", ""},
+	{"retry-after", ""},
+	{"server", ""},
+	{"set-cookie", ""},
+	{"strict-transport-security", ""},
+	{"transfer-encoding", ""},
+	{"user-agent", ""},
+	{"vary", ""},
+	{"via", ""},
+	{"www-authenticate", ""}
+};
+
+// a binary tree over the codes: a child >= 0 is another node, < 0 is -(symbol + 1)
+static int16_t HUFFMAN_TREE[256][2];
+static int HUFFMAN_NODES = 0;
+
+
+void
+build_huffman() {
+	int sym, bit, node, next;
+
+	HUFFMAN_NODES = 1;
+	for (sym = 0; sym < 257; ++sym) {
+		node = 0;
+		for (bit = HUFFMAN_BITS[sym] - 1; bit > 0; --bit) {
+			next = HUFFMAN_TREE[node][(HUFFMAN_CODES[sym] >> bit) & 1];
+			if (next == 0) {
+				next = HUFFMAN_NODES++;
+				HUFFMAN_TREE[node][(HUFFMAN_CODES[sym] >> bit) & 1] = next;
+			}
+			node = next;
+		}
+		HUFFMAN_TREE[node][HUFFMAN_CODES[sym] & 1] = -(sym + 1);
+	}
+}
+
+/*
+ * one bit at a time. the padding after the last symbol must be a
+ * prefix of EOS, i.e. up to 7 one bits, and EOS itself is an error.
+ */
+int
+huffman_decode(const uint8_t* p, size_t len, char* out, size_t* out_len) {
+	int bit, next, node = 0, depth = 0, ones = 1;
+	size_t i, n = 0;
+
+	for (i = 0; i < len; ++i) {
+		for (bit = 7; bit >= 0; --bit) {
+			int b = (p[i] >> bit) & 1;
+			next = HUFFMAN_TREE[node][b];
+			depth++;
+			ones = ones && b;
+			if (next < 0) {
+				if (next == -257) {
+					return SGE_ERR;
+				}
+				out[n++] = (char)(-next - 1);
+				node = depth = 0;
+				ones = 1;
+			} else {
+				node = next;
+			}
+		}
+	}
+	if (depth > 7 || !ones) {
+		return SGE_ERR;
+	}
+	*out_len = n;
+	return SGE_OK;
+}
+
+int
+decode_int(const uint8_t** p, const uint8_t* end, int prefix, uint32_t* value) {
+	uint32_t max = (1 << prefix) - 1;
+	uint32_t v = **p & max;
+	int shift = 0;
+	uint8_t b;
+
+	(*p)++;
+	if (v < max) {
+		*value = v;
+		return SGE_OK;
+	}
+	while (*p < end && shift <= 21) {
+		b = *(*p)++;
+		v += (uint32_t)(b & 0x7f) << shift;
+		shift += 7;
+		if (!(b & 0x80)) {
+			*value = v;
+			return SGE_OK;
+		}
+	}
+	return SGE_ERR;
+}
+
+/*
+ * literal strings go to the scratch space, which hpack_decode() sized
+ * for the whole block, so a name stays valid while its value is read.
+ */
+int
+decode_string(const uint8_t** p, const uint8_t* end, char* out, size_t* len) {
+	uint32_t n;
+	int huffman;
+
+	if (*p >= end) {
+		return SGE_ERR;
+	}
+	huffman = **p & 0x80;
+	if (decode_int(p, end, 7, &n) == SGE_ERR || n > (size_t)(end - *p)) {
+		return SGE_ERR;
+	}
+	if (huffman) {
+		if (huffman_decode(*p, n, out, len) == SGE_ERR) {
+			return SGE_ERR;
+		}
+	} else {
+		memcpy(out, *p, n);
+		*len = n;
+	}
+	*p += n;
+	return SGE_OK;
+}
+
+int
+lookup(sge_hpack* hpack, uint32_t index, const char** name, size_t* name_len, const char** value, size_t* value_len) {
+	sge_hpack_entry* entry;
+
+	if (index == 0) {
+		return SGE_ERR;
+	}
+	if (index <= 61) {
+		*name = STATIC_TABLE[index - 1].name;
+		*name_len = strlen(*name);
+		*value = STATIC_TABLE[index - 1].value;
+		*value_len = strlen(*value);
+		return SGE_OK;
+	}
+	index -= 62;
+	if (index >= hpack->count) {
+		return SGE_ERR;
+	}
+	entry = hpack->entries[(hpack->first + index) % hpack->cap];
+	*name = entry->data;
+	*name_len = entry->name_len;
+	*value = entry->data + entry->name_len;
+	*value_len = entry->value_len;
+	return SGE_OK;
+}
+
+sge_hpack_entry*
+create_entry(const char* name, size_t name_len, const char* value, size_t value_len) {
+	sge_hpack_entry* entry = sge_malloc(sizeof(*entry) + name_len + value_len);
+	entry->name_len = name_len;
+	entry->value_len = value_len;
+	memcpy(entry->data, name, name_len);
+	memcpy(entry->data + name_len, value, value_len);
+	return entry;
+}
+
+// drop the oldest entries until `size` more bytes fit
+void
+evict(sge_hpack* hpack, size_t size) {
+	sge_hpack_entry* entry;
+	size_t last;
+
+	while (hpack->count > 0 && hpack->size + size > hpack->max_size) {
+		last = (hpack->first + hpack->count - 1) % hpack->cap;
+		entry = hpack->entries[last];
+		hpack->size -= entry->name_len + entry->value_len + ENTRY_OVERHEAD;
+		hpack->entries[last] = NULL;
+		hpack->count--;
+		sge_free(entry);
+	}
+}
+
+/*
+ * the entry was copied before anything is evicted: its name may have
+ * come from one of the entries that make room for it.
+ */
+void
+insert(sge_hpack* hpack, sge_hpack_entry* entry) {
+	size_t size = entry->name_len + entry->value_len + ENTRY_OVERHEAD;
+
+	evict(hpack, size);
+	if (hpack->size + size > hpack->max_size) {
+		sge_free(entry);
+		return;
+	}
+	hpack->first = (hpack->first + hpack->cap - 1) % hpack->cap;
+	hpack->entries[hpack->first] = entry;
+	hpack->count++;
+	hpack->size += size;
+}
+
+sge_hpack*
+create_hpack(size_t max_size) {
+	sge_hpack* hpack = sge_malloc(sizeof(*hpack));
+
+	if (HUFFMAN_NODES == 0) {
+		build_huffman();
+	}
+	memset(hpack, 0, sizeof(*hpack));
+	hpack->max_size = hpack->limit = max_size;
+	hpack->cap = max_size / ENTRY_OVERHEAD + 1;
+	hpack->entries = sge_malloc(sizeof(sge_hpack_entry*) * hpack->cap);
+	memset(hpack->entries, 0, sizeof(sge_hpack_entry*) * hpack->cap);
+	return hpack;
+}
+
+void
+destroy_hpack(sge_hpack* hpack) {
+	hpack->max_size = 0;
+	evict(hpack, 0);
+	sge_free(hpack->entries);
+	sge_free(hpack->scratch);
+	sge_free(hpack);
+}
+
+/*
+ * decode a complete header block and call `cb` for every field in
+ * order. an error is a COMPRESSION_ERROR: the table can no longer be
+ * trusted and the connection has to go.
+ */
+int
+hpack_decode(sge_hpack* hpack, const uint8_t* data, size_t len, cb_hpack_field cb, void* ud) {
+	const uint8_t* p = data, *end = data + len;
+	const char* name, *value;
+	size_t name_len, value_len;
+	char* name_buf, *value_buf;
+	uint32_t index;
+	int fields = 0;
+	uint8_t c;
+
+	// huffman gets at most 8 symbols out of 5 bytes
+	if (hpack->scratch_cap < len * 2) {
+		sge_free(hpack->scratch);
+		hpack->scratch_cap = len * 2;
+		hpack->scratch = sge_malloc(hpack->scratch_cap);
+	}
+
+	while (p < end) {
+		c = *p;
+		if (c & 0x80) {
+			if (decode_int(&p, end, 7, &index) == SGE_ERR
+				|| lookup(hpack, index, &name, &name_len, &value, &value_len) == SGE_ERR) {
+				return SGE_ERR;
+			}
+			cb(ud, name, name_len, value, value_len);
+			fields++;
+			continue;
+		}
+		if ((c & 0xe0) == 0x20) {
+			// a table size update is only allowed before the first field
+			if (fields > 0 || decode_int(&p, end, 5, &index) == SGE_ERR || index > hpack->limit) {
+				return SGE_ERR;
+			}
+			hpack->max_size = index;
+			evict(hpack, 0);
+			continue;
+		}
+
+		// a literal: with incremental indexing, without or never indexed
+		if (decode_int(&p, end, (c & 0x40) ? 6 : 4, &index) == SGE_ERR) {
+			return SGE_ERR;
+		}
+		name_buf = hpack->scratch;
+		if (index == 0) {
+			if (decode_string(&p, end, name_buf, &name_len) == SGE_ERR) {
+				return SGE_ERR;
+			}
+			name = name_buf;
+			name_buf += name_len;
+		} else if (lookup(hpack, index, &name, &name_len, &value, &value_len) == SGE_ERR) {
+			return SGE_ERR;
+		}
+		value_buf = name_buf;
+		if (decode_string(&p, end, value_buf, &value_len) == SGE_ERR) {
+			return SGE_ERR;
+		}
+		value = value_buf;
+		if (c & 0x40) {
+			sge_hpack_entry* entry = create_entry(name, name_len, value, value_len);
+			cb(ud, entry->data, name_len, entry->data + name_len, value_len);
+			insert(hpack, entry);
+		} else {
+			cb(ud, name, name_len, value, value_len);
+		}
+		fields++;
+	}
+	return SGE_OK;
+}
+
+sge_buffer*
+encode_int(sge_buffer* buf, uint8_t first, int prefix, uint32_t value) {
+	uint8_t out[8];
+	uint32_t max = (1 << prefix) - 1;
+	int n = 0;
+
+	if (value < max) {
+		out[n++] = first | value;
+		return append_buffer(buf, (const char*)out, n);
+	}
+	out[n++] = first | max;
+	value -= max;
+	while (value >= 0x80) {
+		out[n++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	out[n++] = value;
+	return append_buffer(buf, (const char*)out, n);
+}
+
+/*
+ * a literal field without indexing. `name` must be lower case already.
+ */
+sge_buffer*
+hpack_encode(sge_buffer* buf, const char* name, size_t name_len, const char* value, size_t value_len) {
+	int i;
+
+	for (i = 0; i < 61; ++i) {
+		if (strlen(STATIC_TABLE[i].name) == name_len && memcmp(STATIC_TABLE[i].name, name, name_len) == 0) {
+			break;
+		}
+	}
+	if (i < 61) {
+		buf = encode_int(buf, 0x00, 4, i + 1);
+	} else {
+		buf = encode_int(buf, 0x00, 4, 0);
+		buf = encode_int(buf, 0x00, 7, name_len);
+		buf = append_buffer(buf, name, name_len);
+	}
+	buf = encode_int(buf, 0x00, 7, value_len);
+	return append_buffer(buf, value, value_len);
+}
+
+sge_buffer*
+hpack_encode_status(sge_buffer* buf, int status) {
+	char value[8];
+	int i;
+
+	// :status has entries 8 to 14 in the static table
+	for (i = 7; i < 14; ++i) {
+		if (atoi(STATIC_TABLE[i].value) == status) {
+			return encode_int(buf, 0x80, 7, i + 1);
+		}
+	}
+	snprintf(value, sizeof(value), "%03d", status % 1000);
+	return hpack_encode(buf, ":status", 7, value, 3);
+}
@@ -0,0 +1,21 @@
+#ifndef HPACK_H_
+#define HPACK_H_
+
+#include <stdint.h>
+
+#include "core/buffer.h"
+
+// SETTINGS_HEADER_TABLE_SIZE, the protocol default
+#define HPACK_TABLE_SIZE 4096
+
+typedef struct sge_hpack sge_hpack;
+
+typedef void (*cb_hpack_field)(void* ud, const char* name, size_t name_len, const char* value, size_t value_len);
+
+sge_hpack* create_hpack(size_t max_size);
+void destroy_hpack(sge_hpack* hpack);
+int hpack_decode(sge_hpack* hpack, const uint8_t* data, size_t len, cb_hpack_field cb, void* ud);
+sge_buffer* hpack_encode(sge_buffer* buf, const char* name, size_t name_len, const char* value, size_t value_len);
+sge_buffer* hpack_encode_status(sge_buffer* buf, int status);
+
+#endif
@@ -0,0 +1,232 @@
+#include <ctype.h>
+#include <strings.h>
+
+#include "core/sge.h"
+#include "core/http.h"
+
+/*
+ * just enough of HTTP/1.x for the reactor to look at a request head
+ * before deciding where it goes. full parsing stays in python.
+ */
+
+static const char*
+find_line(const char* p, const char* end) {
+	for (; p + 1 < end; ++p) {
+		if (p[0] == '\r' && p[1] == '\n') {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static const char*
+trim_left(const char* p, const char* end) {
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+	return p;
+}
+
+static int
+parse_request_line(const char* p, const char* end, sge_http_request* req) {
+	const char* sp1 = memchr(p, ' ', end - p);
+	if (NULL == sp1 || sp1 == p) {
+		return SGE_ERR;
+	}
+	const char* sp2 = memchr(sp1 + 1, ' ', end - sp1 - 1);
+	if (NULL == sp2 || sp2 == sp1 + 1) {
+		return SGE_ERR;
+	}
+	if (end - sp2 - 1 != 8 || memcmp(sp2 + 1, "HTTP/1.", 7) != 0 || !isdigit(sp2[8])) {
+		return SGE_ERR;
+	}
+
+	req->method = p;
+	req->method_len = sp1 - p;
+	req->path = sp1 + 1;
+	req->path_len = sp2 - sp1 - 1;
+	req->query = memchr(req->path, '?', req->path_len);
+	if (req->query) {
+		req->query_len = req->path + req->path_len - req->query - 1;
+		req->path_len = req->query - req->path;
+		req->query++;
+	} else {
+		req->query_len = 0;
+	}
+	req->minor_version = sp2[8] - '0';
+	return SGE_OK;
+}
+
+int
+parse_http_request(const char* data, size_t len, sge_http_request* req) {
+	const char* p = data, *end = data + len;
+	const char* eol, *colon, *value_end;
+	sge_http_header* header;
+
+	// tolerate empty lines between pipelined requests
+	while (p + 1 < end && p[0] == '\r' && p[1] == '\n') {
+		p += 2;
+	}
+
+	eol = find_line(p, end);
+	if (NULL == eol) {
+		return HTTP_AGAIN;
+	}
+	if (parse_request_line(p, eol, req) == SGE_ERR) {
+		return SGE_ERR;
+	}
+
+	req->nheaders = 0;
+	for (p = eol + 2; ; p = eol + 2) {
+		eol = find_line(p, end);
+		if (NULL == eol) {
+			return HTTP_AGAIN;
+		}
+		if (eol == p) {
+			break;
+		}
+		if (req->nheaders == MAX_HTTP_HEADERS) {
+			return SGE_ERR;
+		}
+		colon = memchr(p, ':', eol - p);
+		if (NULL == colon || colon == p) {
+			return SGE_ERR;
+		}
+		header = &(req->headers[req->nheaders++]);
+		header->name = p;
+		header->name_len = colon - p;
+		header->value = trim_left(colon + 1, eol);
+		value_end = eol;
+		while (value_end > header->value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+			value_end--;
+		}
+		header->value_len = value_end - header->value;
+	}
+
+	req->head_len = eol + 2 - data;
+	return SGE_OK;
+}
+
+const sge_http_header*
+http_header(const sge_http_request* req, const char* name) {
+	int i;
+	size_t len = strlen(name);
+
+	for (i = 0; i < req->nheaders; ++i) {
+		const sge_http_header* header = &(req->headers[i]);
+		if (header->name_len == len && strncasecmp(header->name, name, len) == 0) {
+			return header;
+		}
+	}
+	return NULL;
+}
+
+int
+http_has_body(const sge_http_request* req) {
+	const sge_http_header* header = http_header(req, "Transfer-Encoding");
+	if (header) {
+		return 1;
+	}
+	header = http_header(req, "Content-Length");
+	if (NULL == header) {
+		return 0;
+	}
+	return !(header->value_len == 1 && header->value[0] == '0');
+}
+
+/*
+ * the size of the body from Content-Length, 0 without one. SGE_ERR when
+ * the head does not tell where the body ends, that is for a
+ * Transfer-Encoding or a Content-Length that is not a number.
+ */
+int
+http_body_length(const sge_http_request* req, size_t* len) {
+	size_t i, n = 0;
+	const sge_http_header* header;
+
+	if (http_header(req, "Transfer-Encoding")) {
+		return SGE_ERR;
+	}
+	header = http_header(req, "Content-Length");
+	if (header && header->value_len == 0) {
+		return SGE_ERR;
+	}
+	for (i = 0; header && i < header->value_len; ++i) {
+		if (header->value[i] < '0' || header->value[i] > '9' || n > (SIZE_MAX - 9) / 10) {
+			return SGE_ERR;
+		}
+		n = n * 10 + (header->value[i] - '0');
+	}
+	*len = n;
+	return SGE_OK;
+}
+
+int
+http_keep_alive(const sge_http_request* req) {
+	const sge_http_header* header = http_header(req, "Connection");
+	if (header && http_token_equal(header->value, header->value_len, "close")) {
+		return 0;
+	}
+	if (req->minor_version == 0) {
+		return header && http_token_equal(header->value, header->value_len, "keep-alive");
+	}
+	return 1;
+}
+
+int
+http_token_equal(const char* s, size_t len, const char* token) {
+	return strlen(token) == len && strncasecmp(s, token, len) == 0;
+}
+
+// `token` is one of the comma separated values, e.g. "keep-alive, Upgrade"
+int
+http_has_token(const char* s, size_t len, const char* token) {
+	const char* end = s + len, *comma;
+	size_t n;
+
+	while (s < end) {
+		comma = memchr(s, ',', end - s);
+		n = (comma ? comma : end) - s;
+		while (n > 0 && (*s == ' ' || *s == '\t')) {
+			s++;
+			n--;
+		}
+		while (n > 0 && (s[n - 1] == ' ' || s[n - 1] == '\t')) {
+			n--;
+		}
+		if (http_token_equal(s, n, token)) {
+			return 1;
+		}
+		s = comma ? comma + 1 : end;
+	}
+	return 0;
+}
+
+/*
+ * the value of `name` in a response head as the worker built it, NULL
+ * when the head has none. the value is trimmed, `*value_len` long.
+ */
+const char*
+http_response_header(const char* head, size_t len, const char* name, size_t* value_len) {
+	const char* end = head + len, *p, *eol, *colon, *value;
+	size_t n;
+
+	for (p = memchr(head, '\n', len); p && ++p < end; p = eol) {
+		eol = memchr(p, '\n', end - p);
+		if (NULL == eol) {
+			break;
+		}
+		colon = memchr(p, ':', eol - p);
+		if (NULL == colon || !http_token_equal(p, colon - p, name)) {
+			continue;
+		}
+		value = trim_left(colon + 1, eol);
+		n = eol - value;
+		while (n > 0 && (value[n - 1] == '\r' || value[n - 1] == ' ' || value[n - 1] == '\t')) {
+			n--;
+		}
+		*value_len = n;
+		return value;
+	}
+	return NULL;
+}
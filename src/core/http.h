@@ -0,0 +1,41 @@
+#ifndef HTTP_H_
+#define HTTP_H_
+
+#define MAX_HTTP_HEADERS 64
+
+#define HTTP_AGAIN 1
+
+typedef struct {
+	const char* name;
+	size_t name_len;
+	const char* value;
+	size_t value_len;
+} sge_http_header;
+
+/*
+ * a parsed request head. all pointers refer into the input data,
+ * `head_len` is the size of the head including the blank line.
+ */
+typedef struct {
+	const char* method;
+	size_t method_len;
+	const char* path;
+	size_t path_len;
+	const char* query;
+	size_t query_len;
+	int minor_version;
+	size_t head_len;
+	int nheaders;
+	sge_http_header headers[MAX_HTTP_HEADERS];
+} sge_http_request;
+
+int parse_http_request(const char* data, size_t len, sge_http_request* req);
+const sge_http_header* http_header(const sge_http_request* req, const char* name);
+int http_has_body(const sge_http_request* req);
+int http_body_length(const sge_http_request* req, size_t* len);
+int http_keep_alive(const sge_http_request* req);
+int http_token_equal(const char* s, size_t len, const char* token);
+int http_has_token(const char* s, size_t len, const char* token);
+const char* http_response_header(const char* head, size_t len, const char* name, size_t* value_len);
+
+#endif
@@ -0,0 +1,272 @@
+#include "core/sge.h"
+#include "core/hash.h"
+#include "core/spinlock.h"
+#include "core/kv.h"
+
+/*
+ * a byte-capped key-value store for handlers, split into shards by key
+ * hash. each shard has its own lock, bucket array and CLOCK ring: a hit
+ * sets an entry's reference bit, eviction moves the hand round the ring
+ * clearing set bits and drops the first entry found without one, or
+ * past its deadline. keys and values are copied in, so nothing is
+ * shared with the caller.
+ */
+
+#define KV_SHARDS 16
+#define KV_MIN_SIZE 64
+
+typedef struct sge_kv_entry {
+	struct sge_kv_entry* next;
+	uint64_t code;
+	uint64_t expire;
+	size_t slot;
+	uint32_t len;
+	uint32_t value_len;
+	int referenced;
+	char data[0];
+} sge_kv_entry;
+
+typedef struct {
+	sge_spinlock lock;
+	sge_kv_entry** buckets;
+	sge_kv_entry** ring;
+	size_t cap;
+	size_t count;
+	size_t hand;
+	size_t bytes;
+	size_t max_bytes;
+} sge_kv_shard;
+
+struct sge_kv {
+	sge_kv_shard shards[KV_SHARDS];
+};
+
+
+static void
+init_shard(sge_kv_shard* shard, size_t max_bytes) {
+	SPIN_INIT(shard);
+	shard->cap = KV_MIN_SIZE;
+	shard->buckets = sge_malloc(sizeof(sge_kv_entry*) * shard->cap);
+	shard->ring = sge_malloc(sizeof(sge_kv_entry*) * shard->cap);
+	memset(shard->buckets, 0, sizeof(sge_kv_entry*) * shard->cap);
+	shard->count = 0;
+	shard->hand = 0;
+	shard->bytes = 0;
+	shard->max_bytes = max_bytes;
+}
+
+// bucket and ring grow together, so there is about one entry per bucket
+static void
+expand(sge_kv_shard* shard) {
+	size_t i, cap = shard->cap * 2;
+	sge_kv_entry** buckets = sge_malloc(sizeof(sge_kv_entry*) * cap);
+	sge_kv_entry* entry, *next;
+
+	memset(buckets, 0, sizeof(sge_kv_entry*) * cap);
+	for (i = 0; i < shard->cap; ++i) {
+		for (entry = shard->buckets[i]; entry; entry = next) {
+			next = entry->next;
+			entry->next = buckets[entry->code & (cap - 1)];
+			buckets[entry->code & (cap - 1)] = entry;
+		}
+	}
+	sge_free(shard->buckets);
+	shard->buckets = buckets;
+	shard->ring = realloc(shard->ring, sizeof(sge_kv_entry*) * cap);
+	shard->cap = cap;
+}
+
+static sge_kv_entry**
+find_entry(sge_kv_shard* shard, uint64_t code, const char* key, size_t len) {
+	sge_kv_entry** p = &shard->buckets[code & (shard->cap - 1)];
+
+	while (*p && ((*p)->code != code || (*p)->len != len || memcmp((*p)->data, key, len) != 0)) {
+		p = &(*p)->next;
+	}
+	return p;
+}
+
+static size_t
+entry_size(const sge_kv_entry* entry) {
+	return sizeof(*entry) + entry->len + entry->value_len;
+}
+
+// the last entry of the ring takes the slot of the removed one
+static void
+remove_entry(sge_kv_shard* shard, sge_kv_entry** p) {
+	sge_kv_entry* entry = *p;
+
+	*p = entry->next;
+	shard->count--;
+	if (entry->slot != shard->count) {
+		shard->ring[entry->slot] = shard->ring[shard->count];
+		shard->ring[entry->slot]->slot = entry->slot;
+	}
+	if (shard->hand >= shard->count) {
+		shard->hand = 0;
+	}
+	shard->bytes -= entry_size(entry);
+	sge_free(entry);
+}
+
+static int
+evict(sge_kv_shard* shard, size_t need, uint64_t now) {
+	int evicted = 0;
+	sge_kv_entry* entry;
+
+	while (shard->count > 0 && shard->bytes + need > shard->max_bytes) {
+		entry = shard->ring[shard->hand];
+		if (entry->referenced && (entry->expire == 0 || entry->expire > now)) {
+			entry->referenced = 0;
+			shard->hand = (shard->hand + 1) % shard->count;
+			continue;
+		}
+		remove_entry(shard, find_entry(shard, entry->code, entry->data, entry->len));
+		evicted++;
+	}
+	return evicted;
+}
+
+static sge_kv_shard*
+shard_of(sge_kv* kv, uint64_t code) {
+	// the bucket takes the low bits of the hash, the shard the high ones
+	return &kv->shards[(code >> 56) % KV_SHARDS];
+}
+
+
+// max_bytes is split evenly between the shards
+sge_kv*
+create_kv(size_t max_bytes) {
+	int i;
+	sge_kv* kv = sge_malloc(sizeof(*kv));
+
+	for (i = 0; i < KV_SHARDS; ++i) {
+		init_shard(&kv->shards[i], max_bytes / KV_SHARDS);
+	}
+	return kv;
+}
+
+void
+destroy_kv(sge_kv* kv) {
+	int i;
+	size_t j;
+	sge_kv_shard* shard;
+
+	for (i = 0; i < KV_SHARDS; ++i) {
+		shard = &kv->shards[i];
+		for (j = 0; j < shard->count; ++j) {
+			sge_free(shard->ring[j]);
+		}
+		sge_free(shard->ring);
+		sge_free(shard->buckets);
+		SPIN_DESTROY(shard);
+	}
+	sge_free(kv);
+}
+
+// NULL when missing or expired, what `copy` made of the value otherwise
+void*
+kv_get(sge_kv* kv, const char* key, size_t len, uint64_t now, cb_kv_copy copy) {
+	void* value = NULL;
+	uint64_t code = hash_string(key, len);
+	sge_kv_shard* shard = shard_of(kv, code);
+	sge_kv_entry** p;
+
+	SPIN_LOCK(shard);
+	p = find_entry(shard, code, key, len);
+	if (*p && (*p)->expire && (*p)->expire <= now) {
+		remove_entry(shard, p);
+	} else if (*p) {
+		(*p)->referenced = 1;
+		value = copy((*p)->data + len, (*p)->value_len);
+	}
+	SPIN_UNLOCK(shard);
+	return value;
+}
+
+/*
+ * `now` and `ttl` in milliseconds, a ttl of 0 never expires. returns
+ * how many entries were evicted to make room, SGE_ERR when the entry is
+ * bigger than a shard.
+ */
+int
+kv_set(sge_kv* kv, const char* key, size_t len, const char* value, size_t value_len, uint64_t now, uint64_t ttl) {
+	int evicted;
+	uint64_t code = hash_string(key, len);
+	sge_kv_shard* shard = shard_of(kv, code);
+	sge_kv_entry** p, *entry;
+	size_t size = sizeof(*entry) + len + value_len;
+
+	if (size > shard->max_bytes || len > UINT32_MAX || value_len > UINT32_MAX) {
+		return SGE_ERR;
+	}
+	entry = sge_malloc(size);
+	entry->code = code;
+	entry->expire = ttl ? now + ttl : 0;
+	entry->len = len;
+	entry->value_len = value_len;
+	entry->referenced = 0;
+	memcpy(entry->data, key, len);
+	memcpy(entry->data + len, value, value_len);
+
+	SPIN_LOCK(shard);
+	p = find_entry(shard, code, key, len);
+	if (*p) {
+		remove_entry(shard, p);
+	}
+	evicted = evict(shard, size, now);
+	if (shard->count == shard->cap) {
+		expand(shard);
+	}
+	p = &shard->buckets[code & (shard->cap - 1)];
+	entry->next = *p;
+	*p = entry;
+	entry->slot = shard->count;
+	shard->ring[shard->count++] = entry;
+	shard->bytes += size;
+	SPIN_UNLOCK(shard);
+	return evicted;
+}
+
+int
+kv_del(sge_kv* kv, const char* key, size_t len) {
+	int ret = SGE_ERR;
+	uint64_t code = hash_string(key, len);
+	sge_kv_shard* shard = shard_of(kv, code);
+	sge_kv_entry** p;
+
+	SPIN_LOCK(shard);
+	p = find_entry(shard, code, key, len);
+	if (*p) {
+		remove_entry(shard, p);
+		ret = SGE_OK;
+	}
+	SPIN_UNLOCK(shard);
+	return ret;
+}
+
+size_t
+kv_bytes(sge_kv* kv) {
+	int i;
+	size_t bytes = 0;
+
+	for (i = 0; i < KV_SHARDS; ++i) {
+		SPIN_LOCK(&kv->shards[i]);
+		bytes += kv->shards[i].bytes;
+		SPIN_UNLOCK(&kv->shards[i]);
+	}
+	return bytes;
+}
+
+size_t
+kv_count(sge_kv* kv) {
+	int i;
+	size_t count = 0;
+
+	for (i = 0; i < KV_SHARDS; ++i) {
+		SPIN_LOCK(&kv->shards[i]);
+		count += kv->shards[i].count;
+		SPIN_UNLOCK(&kv->shards[i]);
+	}
+	return count;
+}
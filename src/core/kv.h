@@ -0,0 +1,20 @@
+#ifndef KV_H_
+#define KV_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct sge_kv sge_kv;
+
+// makes what kv_get() returns out of the value, called with the shard locked
+typedef void* (*cb_kv_copy)(const char* data, size_t len);
+
+sge_kv* create_kv(size_t max_bytes);
+void destroy_kv(sge_kv* kv);
+void* kv_get(sge_kv* kv, const char* key, size_t len, uint64_t now, cb_kv_copy copy);
+int kv_set(sge_kv* kv, const char* key, size_t len, const char* value, size_t value_len, uint64_t now, uint64_t ttl);
+int kv_del(sge_kv* kv, const char* key, size_t len);
+size_t kv_bytes(sge_kv* kv);
+size_t kv_count(sge_kv* kv);
+
+#endif
@@ -82,6 +82,7 @@ list_del(sge_list* list) {
 		next = node->next;
 		_list_del(node->data);
 		_list_del(node);
+		list->size--;
 		node = next;
 	}
 
@@ -105,6 +106,11 @@ RET:
 	return SGE_OK;
 }
 
+size_t
+list_size(sge_list* list) {
+	return list->size;
+}
+
 sge_list_iter*
 list_iter_create(sge_list* list) {
 	sge_list_iter* iter = sge_malloc(sizeof(*iter));
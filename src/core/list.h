@@ -1,6 +1,8 @@
 #ifndef LIST_H
 #define LIST_H
 
+#include <stddef.h>
+
 
 typedef struct sge_list sge_list;
 typedef struct sge_list_iter sge_list_iter;
@@ -11,6 +13,7 @@ int list_add(sge_list* list, void* data);
 int list_del(sge_list* list);
 int list_remove(sge_list_iter* iter);
 int list_destroy(sge_list* list);
+size_t list_size(sge_list* list);
 
 sge_list_iter* list_iter_create(sge_list* list);
 int list_iter_next(sge_list_iter* iter);
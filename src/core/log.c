@@ -1,60 +1,295 @@
 #include <time.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include "core/sge.h"
 #include "core/log.h"
+#include "core/spinlock.h"
+
+/*
+ * every thread that logs gets its own ring of records, filled by that
+ * thread only and drained by the flusher thread, so logging never locks
+ * and never blocks on the file: the caller formats its message into a
+ * free record, and the flusher adds the date and level and writes whole
+ * batches with writev. a full ring drops the record and counts it.
+ * before start_log() and after stop_log() lines are written directly.
+ */
 
 #define MAX_LINE_SIZE 1024
+#define LOG_RING_SIZE 256
+#define LOG_TICK_NS 10000000
+#define DATE_SIZE 32
+#define MAX_LOG_IOV 768
+
+typedef struct {
+	time_t sec;
+	log_level lv;
+	size_t len;
+	char text[MAX_LINE_SIZE];
+} log_record;
+
+typedef struct log_ring {
+	uint32_t head;
+	uint32_t tail;
+	uint64_t dropped;
+	struct log_ring* next;
+	log_record records[LOG_RING_SIZE];
+} log_ring;
+
+struct sge_logger {
+	int run;
+	int level;
+	time_t now;
+	pthread_t tid;
+	sge_spinlock lock;
+	log_ring* rings;
+	time_t date_sec;
+	char date[DATE_SIZE];
+	size_t date_len;
+};
 
-static const char* log_level_en[] = {"UNKNOWN", "DEBUG", "INFO", "WARN", "ERROR", "SYS_ERROR"};
+static struct sge_logger LOGGER = {0, LEVEL_DEBUG, 0};
+static __thread log_ring* LOCAL = NULL;
+
+static const char* log_level_en[] = {"[UNKNOWN] ", "[DEBUG] ", "[INFO] ", "[WARN] ", "[ERROR] ", "[SYS_ERROR] "};
 
 
 static size_t
-format_date(char *buf, size_t maxlen) {
+format_date(char *buf, size_t maxlen, time_t t) {
     struct tm lt;
-    time_t t = time(NULL);
 
     localtime_r(&t, &lt);
-    return strftime(buf, maxlen, "[%Y-%m-%d %H:%M:%d] ", &lt);
+    return strftime(buf, maxlen, "[%Y-%m-%d %H:%M:%S] ", &lt);
 }
 
 static size_t
-format_level(char* buf, log_level lv, size_t maxlen) {
-    const char* s = log_level_en[lv];
-    return snprintf(buf, maxlen, "[%s] ", s);
+format_message(char* buf, const char* strerr, const char* fmt, va_list ap) {
+    int n;
+    size_t len = 0, max = MAX_LINE_SIZE - 1;
+
+    if (fmt) {
+        n = vsnprintf(buf, max, fmt, ap);
+        len = n < 0 ? 0 : ((size_t)n < max ? (size_t)n : max - 1);
+    }
+    if (strerr && len < max) {
+        n = snprintf(buf + len, max - len, ": %s", strerr);
+        len += n < 0 ? 0 : ((size_t)n < max - len ? (size_t)n : max - len - 1);
+    }
+    buf[len++] = '\n';
+    return len;
+}
+
+static log_ring*
+local_ring() {
+    log_ring* ring;
+
+    if (LOCAL) {
+        return LOCAL;
+    }
+    ring = sge_malloc(sizeof(*ring));
+    ring->head = ring->tail = 0;
+    ring->dropped = 0;
+    SPIN_LOCK(&LOGGER);
+    ring->next = LOGGER.rings;
+    LOGGER.rings = ring;
+    SPIN_UNLOCK(&LOGGER);
+    LOCAL = ring;
+    return ring;
+}
+
+static int
+write_direct(log_level lv, const char* strerr, const char* fmt, va_list ap) {
+    char buf[DATE_SIZE + 16 + MAX_LINE_SIZE];
+    size_t len;
+
+    len = format_date(buf, DATE_SIZE, time(NULL));
+    len += snprintf(buf + len, 16, "%s", log_level_en[lv]);
+    len += format_message(buf + len, strerr, fmt, ap);
+    if (write(STDERR_FILENO, buf, len) < 0) {
+        return SGE_ERR;
+    }
+    return SGE_OK;
 }
 
 static int
 write_log(log_level lv, const char* strerr, const char* fmt, va_list ap) {
-    char buf[MAX_LINE_SIZE];
-    size_t len = 0;
+    log_ring* ring;
+    log_record* record;
+    uint32_t head;
 
-    len = format_date(buf, MAX_LINE_SIZE);
-    len += format_level(buf + len, lv, MAX_LINE_SIZE - len);
+    if ((int)lv < __atomic_load_n(&LOGGER.level, __ATOMIC_RELAXED)) {
+        return SGE_OK;
+    }
+    if (!__atomic_load_n(&LOGGER.run, __ATOMIC_ACQUIRE)) {
+        return write_direct(lv, strerr, fmt, ap);
+    }
 
-    if (fmt) {
-        len += vsnprintf(buf + len, sizeof(buf), fmt, ap);
+    ring = local_ring();
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return SGE_ERR;
     }
+    record = &ring->records[head % LOG_RING_SIZE];
+    record->sec = __atomic_load_n(&LOGGER.now, __ATOMIC_RELAXED);
+    record->lv = lv;
+    record->len = format_message(record->text, strerr, fmt, ap);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return SGE_OK;
+}
+
+static void
+flush_iov(struct iovec* iov, int* iovcnt) {
+    int i = 0;
+    ssize_t n;
 
-    if (strerr) {
-        len += snprintf(buf + len, MAX_LINE_SIZE - len, ": %s", strerr);
+    while (i < *iovcnt) {
+        n = writev(STDERR_FILENO, iov + i, *iovcnt - i);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        while (i < *iovcnt && (size_t)n >= iov[i].iov_len) {
+            n -= iov[i].iov_len;
+            i++;
+        }
+        if (i < *iovcnt) {
+            iov[i].iov_base = (char*)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+        }
     }
-    buf[len] = '\0';
+    *iovcnt = 0;
+}
+
+/*
+ * write out everything queued in one ring. the cached date only changes
+ * between batches, so every iovec of a batch can point at it.
+ */
+static void
+drain_ring(log_ring* ring) {
+    struct iovec iov[MAX_LOG_IOV];
+    char dropped[96];
+    int iovcnt = 0;
+    uint32_t tail = ring->tail, head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t lost = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    log_record* record;
+
+    for (; tail != head; ++tail) {
+        record = &ring->records[tail % LOG_RING_SIZE];
+        if (record->sec != LOGGER.date_sec || iovcnt + 3 > MAX_LOG_IOV) {
+            flush_iov(iov, &iovcnt);
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+            if (record->sec != LOGGER.date_sec) {
+                LOGGER.date_sec = record->sec;
+                LOGGER.date_len = format_date(LOGGER.date, DATE_SIZE, record->sec);
+            }
+        }
+        iov[iovcnt].iov_base = LOGGER.date;
+        iov[iovcnt++].iov_len = LOGGER.date_len;
+        iov[iovcnt].iov_base = (void*)log_level_en[record->lv];
+        iov[iovcnt++].iov_len = strlen(log_level_en[record->lv]);
+        iov[iovcnt].iov_base = record->text;
+        iov[iovcnt++].iov_len = record->len;
+    }
+    if (lost) {
+        if (LOGGER.date_len == 0) {
+            LOGGER.date_sec = LOGGER.now;
+            LOGGER.date_len = format_date(LOGGER.date, DATE_SIZE, LOGGER.now);
+        }
+        int n = snprintf(dropped, sizeof(dropped), "%s[WARN] log ring full, %lu messages dropped\n",
+            LOGGER.date, (unsigned long)lost);
+        iov[iovcnt].iov_base = dropped;
+        iov[iovcnt++].iov_len = n;
+    }
+    flush_iov(iov, &iovcnt);
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void
+drain_all() {
+    log_ring* ring;
+
+    SPIN_LOCK(&LOGGER);
+    ring = LOGGER.rings;
+    SPIN_UNLOCK(&LOGGER);
+    // rings are only ever prepended, the ones after the first never move
+    for (; ring; ring = ring->next) {
+        drain_ring(ring);
+    }
+}
+
+static void*
+flusher(void* arg) {
+    struct timespec tick = {0, LOG_TICK_NS};
+
+    while (__atomic_load_n(&LOGGER.run, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&LOGGER.now, time(NULL), __ATOMIC_RELAXED);
+        drain_all();
+        nanosleep(&tick, NULL);
+    }
+    drain_all();
+    return NULL;
+}
 
-    fprintf(stderr, "%s\n", buf);
+int
+start_log() {
+    if (LOGGER.run) {
+        return SGE_OK;
+    }
+    SPIN_INIT(&LOGGER);
+    LOGGER.now = time(NULL);
+    LOGGER.date_sec = 0;
+    __atomic_store_n(&LOGGER.run, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&LOGGER.tid, NULL, flusher, NULL) != 0) {
+        LOGGER.run = 0;
+        return SGE_ERR;
+    }
     return SGE_OK;
 }
 
+/*
+ * stop the flusher after it wrote everything queued. records logged
+ * while stopping are written directly.
+ */
+void
+stop_log() {
+    log_ring* ring, *next;
+
+    if (!LOGGER.run) {
+        return;
+    }
+    __atomic_store_n(&LOGGER.run, 0, __ATOMIC_RELEASE);
+    pthread_join(LOGGER.tid, NULL);
+    drain_all();
+    for (ring = LOGGER.rings; ring; ring = next) {
+        next = ring->next;
+        sge_free(ring);
+    }
+    LOGGER.rings = NULL;
+    LOCAL = NULL;
+}
+
+void
+set_log_level(log_level lv) {
+    __atomic_store_n(&LOGGER.level, (int)lv, __ATOMIC_RELAXED);
+}
+
 int
 sys_error(log_level lv, const char* fmt, ...) {
     va_list ap;
+    const char* strerr = strerror(errno);
 
     va_start(ap, fmt);
-    write_log(lv, strerror(errno), fmt, ap);
+    write_log(lv, strerr, fmt, ap);
     va_end(ap);
     return SGE_OK;
 }
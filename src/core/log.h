@@ -1,6 +1,8 @@
 #ifndef LOG_H_
 #define LOG_H_
 
+#include <libgen.h>
+
 typedef enum {
     LEVEL_DEBUG = 1,
     LEVEL_INFO,
@@ -12,12 +14,24 @@ typedef enum {
 
 int sys_error(log_level lv, const char* fmt, ...);
 int error(log_level lv, const char* fmt, ...);
+int start_log();
+void stop_log();
+void set_log_level(log_level lv);
+
+/*
+ * levels below SGE_LOG_LEVEL are compiled out, e.g. -DSGE_LOG_LEVEL=3
+ * drops DEBUG and INFO. set_log_level() filters the rest at runtime.
+ */
+#ifndef SGE_LOG_LEVEL
+#define SGE_LOG_LEVEL LEVEL_DEBUG
+#endif
 
+#define LOG_AT(lv, fmt, ...) ((lv) >= SGE_LOG_LEVEL ? error(lv, "[%s:%d] "fmt, basename(__FILE__), __LINE__, ##__VA_ARGS__) : 0)
 
-#define DEBUG(fmt, ...) error(LEVEL_DEBUG, "[%s:%d] "fmt, basename(__FILE__), __LINE__, ##__VA_ARGS__)
-#define INFO(fmt, ...) error(LEVEL_INFO, "[%s:%d] "fmt, basename(__FILE__), __LINE__, ##__VA_ARGS__)
-#define WARNING(fmt, ...) error(LEVEL_WARN, "[%s:%d] "fmt, basename(__FILE__), __LINE__, ##__VA_ARGS__)
-#define ERROR(fmt, ...) error(LEVEL_ERROR, "[%s:%d] "fmt, basename(__FILE__), __LINE__, ##__VA_ARGS__)
+#define DEBUG(fmt, ...) LOG_AT(LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#define INFO(fmt, ...) LOG_AT(LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define WARNING(fmt, ...) LOG_AT(LEVEL_WARN, fmt, ##__VA_ARGS__)
+#define ERROR(fmt, ...) LOG_AT(LEVEL_ERROR, fmt, ##__VA_ARGS__)
 #define SYS_ERROR(...) sys_error(LEVEL_SYS_ERROR, "[%s:%d] ", basename(__FILE__), __LINE__, ##__VA_ARGS__)
 
 #endif
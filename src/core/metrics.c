@@ -0,0 +1,147 @@
+#include <stdio.h>
+
+#include "core/sge.h"
+#include "core/spinlock.h"
+#include "core/metrics.h"
+
+/*
+ * counters are kept per thread, each thread on its own cache lines so
+ * the reactor and the workers never share one, and summed on scrape.
+ * a thread registers its slot the first time it counts something.
+ */
+
+#define MAX_METRICS_THREADS 64
+#define CACHE_LINE 64
+
+typedef struct {
+	uint64_t values[METRIC_MAX];
+} __attribute__((aligned(CACHE_LINE))) sge_metrics_local;
+
+struct sge_metrics {
+	int nthread;
+	sge_spinlock lock;
+	sge_metrics_local* threads[MAX_METRICS_THREADS];
+};
+
+static struct sge_metrics METRICS = {0, {0}, {NULL}};
+static __thread sge_metrics_local* LOCAL = NULL;
+
+static const struct {
+	const char* name;
+	const char* help;
+} METRIC_NAMES[METRIC_MAX] = {
+	{"sge_accepted_connections_total", "Connections accepted."},
+	{"sge_rejected_connections_total", "Connections closed at accept because MAX_SOCK_NUM was reached."},
+	{"sge_read_bytes_total", "Bytes read from client connections."},
+	{"sge_written_bytes_total", "Bytes written to client connections."},
+	{"sge_worker_messages_total", "Reads handed to the worker."},
+	{"sge_cache_hits_total", "Requests answered from the response cache."},
+	{"sge_cache_misses_total", "Cacheable requests that missed the response cache."},
+	{"sge_python_exceptions_total", "Exceptions raised by Python code."},
+	{"sge_bad_gateway_total", "502 responses sent for failed handlers."},
+	{"sge_shed_requests_total", "Requests answered 503 by the reactor while the worker queue was overloaded."},
+	{"sge_published_messages_total", "Messages published with sge.publish()."},
+	{"sge_delivered_messages_total", "Published messages queued to subscribers."},
+	{"sge_compressed_responses_total", "Responses sent with their body gzip or deflate encoded."},
+	{"sge_compress_cache_hits_total", "Encoded bodies taken from the compression cache."},
+	{"sge_compress_saved_bytes_total", "Body bytes saved by encoding."},
+	{"sge_tls_handshakes_total", "TLS handshakes completed."},
+	{"sge_ktls_sessions_total", "TLS sessions whose records the kernel writes."},
+	{"sge_tls_failed_total", "TLS handshakes that failed."},
+	{"sge_frames_in_total", "Frames cut by the listener codec and handed to the worker."},
+	{"sge_frames_out_total", "Frames written with conn.send_frame()."},
+	{"sge_upstream_connects_total", "Outbound connections opened for sge.connect()."},
+	{"sge_upstream_reused_total", "sge.connect() calls served from a keep-alive pool."},
+	{"sge_upstream_failed_total", "Outbound connects that failed or timed out."},
+	{"sge_coalesced_total", "GETs answered with the response of an identical one in flight."},
+	{"sge_kv_hits_total", "sge.cache.get() calls that found the key."},
+	{"sge_kv_misses_total", "sge.cache.get() calls that didn't."},
+	{"sge_kv_evictions_total", "sge.cache entries evicted to make room."}
+};
+
+static sge_metrics_local*
+local_metrics() {
+	sge_metrics_local* local;
+
+	if (LOCAL) {
+		return LOCAL;
+	}
+	SPIN_LOCK(&METRICS);
+	if (METRICS.nthread == MAX_METRICS_THREADS) {
+		SPIN_UNLOCK(&METRICS);
+		return NULL;
+	}
+	if (posix_memalign((void**)&local, CACHE_LINE, sizeof(*local))) {
+		SPIN_UNLOCK(&METRICS);
+		return NULL;
+	}
+	memset(local, 0, sizeof(*local));
+	METRICS.threads[METRICS.nthread++] = local;
+	SPIN_UNLOCK(&METRICS);
+	LOCAL = local;
+	return local;
+}
+
+void
+metrics_add(METRIC_TYPE metric, uint64_t n) {
+	sge_metrics_local* local = LOCAL ? LOCAL : local_metrics();
+	uint64_t* p;
+
+	if (NULL == local) {
+		return;
+	}
+	// single writer: a relaxed load + store, no locked instruction
+	p = &local->values[metric];
+	__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+uint64_t
+metrics_get(METRIC_TYPE metric) {
+	uint64_t total = 0;
+	int i;
+
+	SPIN_LOCK(&METRICS);
+	for (i = 0; i < METRICS.nthread; ++i) {
+		total += __atomic_load_n(&METRICS.threads[i]->values[metric], __ATOMIC_RELAXED);
+	}
+	SPIN_UNLOCK(&METRICS);
+	return total;
+}
+
+static sge_buffer*
+format_metric(sge_buffer* buf, const char* name, const char* help, const char* type, uint64_t value) {
+	char line[512];
+	int n = snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %lu\n",
+		name, help, name, type, name, value);
+	return append_buffer(buf, line, n);
+}
+
+/*
+ * prometheus text exposition format 0.0.4. gauges are sampled by the
+ * caller, which owns the state they describe.
+ */
+sge_buffer*
+format_metrics(sge_buffer* buf, const sge_gauge* gauges, int ngauge) {
+	int i;
+
+	for (i = 0; i < METRIC_MAX; ++i) {
+		buf = format_metric(buf, METRIC_NAMES[i].name, METRIC_NAMES[i].help, "counter", metrics_get(i));
+	}
+	for (i = 0; i < ngauge; ++i) {
+		buf = format_metric(buf, gauges[i].name, gauges[i].help, "gauge", gauges[i].value);
+	}
+	return buf;
+}
+
+void
+destroy_metrics() {
+	int i;
+
+	SPIN_LOCK(&METRICS);
+	for (i = 0; i < METRICS.nthread; ++i) {
+		sge_free(METRICS.threads[i]);
+	}
+	METRICS.nthread = 0;
+	SPIN_UNLOCK(&METRICS);
+	LOCAL = NULL;
+}
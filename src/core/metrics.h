@@ -0,0 +1,49 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+#include "core/buffer.h"
+
+typedef enum {
+	METRIC_ACCEPTS,
+	METRIC_REJECTS,
+	METRIC_BYTES_IN,
+	METRIC_BYTES_OUT,
+	METRIC_REQUESTS,
+	METRIC_CACHE_HITS,
+	METRIC_CACHE_MISSES,
+	METRIC_PY_EXCEPTIONS,
+	METRIC_BAD_GATEWAY,
+	METRIC_SHED,
+	METRIC_PUBLISHED,
+	METRIC_DELIVERED,
+	METRIC_COMPRESSED,
+	METRIC_COMPRESS_HITS,
+	METRIC_COMPRESS_SAVED,
+	METRIC_TLS_HANDSHAKES,
+	METRIC_TLS_OFFLOADED,
+	METRIC_TLS_FAILED,
+	METRIC_FRAMES_IN,
+	METRIC_FRAMES_OUT,
+	METRIC_UPSTREAM_CONNECTS,
+	METRIC_UPSTREAM_REUSED,
+	METRIC_UPSTREAM_FAILED,
+	METRIC_COALESCED,
+	METRIC_KV_HITS,
+	METRIC_KV_MISSES,
+	METRIC_KV_EVICTIONS,
+	METRIC_MAX
+} METRIC_TYPE;
+
+typedef struct {
+	const char* name;
+	const char* help;
+	uint64_t value;
+} sge_gauge;
+
+void metrics_add(METRIC_TYPE metric, uint64_t n);
+uint64_t metrics_get(METRIC_TYPE metric);
+sge_buffer* format_metrics(sge_buffer* buf, const sge_gauge* gauges, int ngauge);
+void destroy_metrics();
+
+#endif
@@ -0,0 +1,148 @@
+#include "core/sge.h"
+#include "core/hash.h"
+#include "core/pubsub.h"
+
+/*
+ * channel name -> the fds subscribed to it, as a bitmap over the fd
+ * range: subscribing and dropping are a bit flip, a fan-out walks 16
+ * words. a channel goes away with its last subscriber.
+ */
+
+#define WORD_BITS 64
+#define WORDS ((MAX_SOCK_NUM + WORD_BITS - 1) / WORD_BITS)
+
+typedef struct {
+	uint64_t fds[WORDS];
+	uint32_t count;
+} sge_channel;
+
+struct sge_pubsub {
+	sge_hash* channels;
+	// channels per fd, so closing an fd that never subscribed is free
+	uint16_t subscriptions[MAX_SOCK_NUM];
+};
+
+typedef struct {
+	sge_pubsub* pubsub;
+	int fd;
+	sge_channel* empty;
+	const char* empty_key;
+	size_t empty_len;
+} sge_drop_ctx;
+
+static int drop_fd(const char* key, size_t len, void* value, void* ud);
+
+
+sge_pubsub*
+create_pubsub() {
+	sge_pubsub* pubsub = sge_malloc(sizeof(*pubsub));
+
+	memset(pubsub, 0, sizeof(*pubsub));
+	pubsub->channels = create_hash(64);
+	return pubsub;
+}
+
+void
+destroy_pubsub(sge_pubsub* pubsub) {
+	destroy_hash(pubsub->channels, sge_free);
+	sge_free(pubsub);
+}
+
+int
+pubsub_subscribe(sge_pubsub* pubsub, const char* channel, size_t len, int fd) {
+	uint64_t bit = 1ULL << (fd % WORD_BITS);
+	sge_channel* c;
+
+	if (fd < 0 || fd >= MAX_SOCK_NUM) {
+		return SGE_ERR;
+	}
+	c = hash_get(pubsub->channels, channel, len);
+	if (NULL == c) {
+		c = sge_malloc(sizeof(*c));
+		memset(c, 0, sizeof(*c));
+		hash_set(pubsub->channels, channel, len, c);
+	}
+	if (c->fds[fd / WORD_BITS] & bit) {
+		return SGE_OK;
+	}
+	c->fds[fd / WORD_BITS] |= bit;
+	c->count++;
+	pubsub->subscriptions[fd]++;
+	return SGE_OK;
+}
+
+int
+pubsub_unsubscribe(sge_pubsub* pubsub, const char* channel, size_t len, int fd) {
+	uint64_t bit = 1ULL << (fd % WORD_BITS);
+	sge_channel* c;
+
+	if (fd < 0 || fd >= MAX_SOCK_NUM) {
+		return SGE_ERR;
+	}
+	c = hash_get(pubsub->channels, channel, len);
+	if (NULL == c || !(c->fds[fd / WORD_BITS] & bit)) {
+		return SGE_OK;
+	}
+	c->fds[fd / WORD_BITS] &= ~bit;
+	pubsub->subscriptions[fd]--;
+	if (--c->count == 0) {
+		sge_free(hash_del(pubsub->channels, channel, len));
+	}
+	return SGE_OK;
+}
+
+// an fd closed, out of every channel it was in
+void
+pubsub_drop(sge_pubsub* pubsub, int fd) {
+	sge_drop_ctx ctx = {pubsub, fd, NULL, NULL, 0};
+
+	if (fd < 0 || fd >= MAX_SOCK_NUM || pubsub->subscriptions[fd] == 0) {
+		return;
+	}
+	hash_foreach(pubsub->channels, drop_fd, &ctx);
+}
+
+// calls cb for every fd subscribed to the channel, returns how many
+size_t
+pubsub_foreach(sge_pubsub* pubsub, const char* channel, size_t len, cb_subscriber cb, void* ud) {
+	int i;
+	uint64_t word;
+	size_t n = 0;
+	sge_channel* c = hash_get(pubsub->channels, channel, len);
+
+	if (NULL == c) {
+		return 0;
+	}
+	for (i = 0; i < WORDS; ++i) {
+		for (word = c->fds[i]; word; word &= word - 1) {
+			cb(i * WORD_BITS + __builtin_ctzll(word), ud);
+			n++;
+		}
+	}
+	return n;
+}
+
+size_t
+pubsub_channels(sge_pubsub* pubsub) {
+	return hash_size(pubsub->channels);
+}
+
+int
+drop_fd(const char* key, size_t len, void* value, void* ud) {
+	sge_drop_ctx* ctx = ud;
+	sge_channel* c = value;
+	uint64_t bit = 1ULL << (ctx->fd % WORD_BITS);
+
+	if (!(c->fds[ctx->fd / WORD_BITS] & bit)) {
+		return SGE_OK;
+	}
+	c->fds[ctx->fd / WORD_BITS] &= ~bit;
+	if (--c->count == 0) {
+		// hash_foreach() holds on to the next node, this one may go
+		sge_free(hash_del(ctx->pubsub->channels, key, len));
+	}
+	if (--ctx->pubsub->subscriptions[ctx->fd] == 0) {
+		return SGE_ERR;
+	}
+	return SGE_OK;
+}
@@ -0,0 +1,18 @@
+#ifndef PUBSUB_H_
+#define PUBSUB_H_
+
+#include <stdint.h>
+
+typedef struct sge_pubsub sge_pubsub;
+
+typedef void (*cb_subscriber)(int fd, void* ud);
+
+sge_pubsub* create_pubsub();
+void destroy_pubsub(sge_pubsub* pubsub);
+int pubsub_subscribe(sge_pubsub* pubsub, const char* channel, size_t len, int fd);
+int pubsub_unsubscribe(sge_pubsub* pubsub, const char* channel, size_t len, int fd);
+void pubsub_drop(sge_pubsub* pubsub, int fd);
+size_t pubsub_foreach(sge_pubsub* pubsub, const char* channel, size_t len, cb_subscriber cb, void* ud);
+size_t pubsub_channels(sge_pubsub* pubsub);
+
+#endif
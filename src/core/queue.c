@@ -112,3 +112,28 @@ dequeue(sge_queue* q, void** ud) {
 	SPIN_UNLOCK(q);
 	return q->used;
 }
+
+int
+queue_size(sge_queue* q) {
+	assert(q);
+	SPIN_LOCK(q);
+	int size = q->used;
+	SPIN_UNLOCK(q);
+	return size;
+}
+
+/*
+ * calls fn with the oldest item under the lock, so the consumer can't
+ * take and free it meanwhile. fn is not called on an empty queue.
+ */
+int
+queue_peek(sge_queue* q, void (*fn)(void* data, void* ud), void* ud) {
+	assert(q);
+	SPIN_LOCK(q);
+	int size = q->used;
+	if (size > 0) {
+		fn(q->data[q->r], ud);
+	}
+	SPIN_UNLOCK(q);
+	return size;
+}
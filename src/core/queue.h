@@ -10,5 +10,7 @@ sge_queue* create_queue(size_t size);
 void destroy_queue(sge_queue* queue);
 int enqueue(sge_queue* q, void* data);
 int dequeue(sge_queue* q, void** ud);
+int queue_size(sge_queue* q);
+int queue_peek(sge_queue* q, void (*fn)(void* data, void* ud), void* ud);
 
 #endif
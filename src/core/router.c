@@ -0,0 +1,304 @@
+#include "core/sge.h"
+#include "core/router.h"
+
+/*
+ * routes are kept in a tree keyed on path segments. every node has
+ * its static children, at most one parameter child ({name} or :name)
+ * and at most one wildcard child (*name, which must be the last
+ * segment). lookups prefer static > parameter > wildcard and backtrack
+ * when a branch does not lead to a handler.
+ */
+
+enum {
+	METHOD_GET,
+	METHOD_HEAD,
+	METHOD_POST,
+	METHOD_PUT,
+	METHOD_DELETE,
+	METHOD_PATCH,
+	METHOD_OPTIONS,
+	METHOD_ANY,
+	METHOD_NUM
+};
+
+typedef enum {
+	NODE_STATIC,
+	NODE_PARAM,
+	NODE_WILDCARD
+} NODE_TYPE;
+
+typedef struct sge_route_node {
+	NODE_TYPE type;
+	char* segment;
+	size_t len;
+	struct sge_route_node** children;
+	size_t nchildren;
+	struct sge_route_node* param;
+	struct sge_route_node* wildcard;
+	void* handlers[METHOD_NUM];
+	int nhandlers;
+	char* route;
+} sge_route_node;
+
+struct sge_router {
+	sge_route_node* root;
+	size_t size;
+};
+
+static const char* METHOD_NAMES[] = {"GET", "HEAD", "POST", "PUT", "DELETE", "PATCH", "OPTIONS", "*"};
+
+
+static int
+method_index(const char* method, size_t len) {
+	int i;
+	for (i = 0; i < METHOD_NUM; ++i) {
+		if (strlen(METHOD_NAMES[i]) == len && memcmp(METHOD_NAMES[i], method, len) == 0) {
+			return i;
+		}
+	}
+	if (len == 3 && memcmp(method, "ANY", 3) == 0) {
+		return METHOD_ANY;
+	}
+	return SGE_ERR;
+}
+
+static sge_route_node*
+create_node(NODE_TYPE type, const char* segment, size_t len) {
+	sge_route_node* node = sge_malloc(sizeof(*node));
+	memset(node, 0, sizeof(*node));
+	node->type = type;
+	node->segment = sge_malloc(len + 1);
+	memcpy(node->segment, segment, len);
+	node->segment[len] = '\0';
+	node->len = len;
+	return node;
+}
+
+static void
+destroy_node(sge_route_node* node, void (*cb_free)(void*)) {
+	size_t i;
+
+	if (NULL == node) {
+		return;
+	}
+	for (i = 0; i < node->nchildren; ++i) {
+		destroy_node(node->children[i], cb_free);
+	}
+	destroy_node(node->param, cb_free);
+	destroy_node(node->wildcard, cb_free);
+	for (i = 0; i < METHOD_NUM; ++i) {
+		if (node->handlers[i] && cb_free) {
+			cb_free(node->handlers[i]);
+		}
+	}
+	sge_free(node->children);
+	sge_free(node->segment);
+	sge_free(node->route);
+	sge_free(node);
+}
+
+static sge_route_node*
+add_static_child(sge_route_node* node, const char* segment, size_t len) {
+	size_t i;
+	sge_route_node* child;
+
+	for (i = 0; i < node->nchildren; ++i) {
+		child = node->children[i];
+		if (child->len == len && memcmp(child->segment, segment, len) == 0) {
+			return child;
+		}
+	}
+
+	child = create_node(NODE_STATIC, segment, len);
+	node->children = realloc(node->children, sizeof(child) * (node->nchildren + 1));
+	node->children[node->nchildren++] = child;
+	return child;
+}
+
+static sge_route_node*
+add_param_child(sge_route_node** slot, NODE_TYPE type, const char* name, size_t len) {
+	sge_route_node* child = *slot;
+
+	if (NULL == child) {
+		child = create_node(type, name, len);
+		*slot = child;
+		return child;
+	}
+	if (child->len != len || memcmp(child->segment, name, len) != 0) {
+		return NULL;
+	}
+	return child;
+}
+
+static const char*
+next_segment(const char* p, const char* end, const char** seg_end) {
+	while (p < end && *p == '/') {
+		p++;
+	}
+	const char* q = p;
+	while (q < end && *q != '/') {
+		q++;
+	}
+	*seg_end = q;
+	return p;
+}
+
+static void*
+node_handler(sge_route_node* node, int method, sge_route_match* match, int* found_path) {
+	void* handler;
+
+	if (node->nhandlers == 0) {
+		return NULL;
+	}
+	handler = node->handlers[method];
+	if (NULL == handler) {
+		handler = node->handlers[METHOD_ANY];
+	}
+	if (NULL == handler) {
+		*found_path = 1;
+	} else {
+		match->route = node->route;
+	}
+	return handler;
+}
+
+static void*
+match_node(sge_route_node* node, const char* p, const char* end, int method, sge_route_match* match, int* found_path) {
+	size_t i;
+	void* handler;
+	const char* seg_end;
+	sge_route_node* child;
+	sge_route_param* param;
+
+	p = next_segment(p, end, &seg_end);
+	if (p == end) {
+		handler = node_handler(node, method, match, found_path);
+		if (handler) {
+			return handler;
+		}
+		goto WILDCARD;
+	}
+
+	for (i = 0; i < node->nchildren; ++i) {
+		child = node->children[i];
+		if (child->len != seg_end - p || memcmp(child->segment, p, child->len) != 0) {
+			continue;
+		}
+		handler = match_node(child, seg_end, end, method, match, found_path);
+		if (handler) {
+			return handler;
+		}
+		break;
+	}
+
+	if (node->param) {
+		param = &(match->params[match->nparams++]);
+		param->name = node->param->segment;
+		param->name_len = node->param->len;
+		param->value = p;
+		param->value_len = seg_end - p;
+		handler = match_node(node->param, seg_end, end, method, match, found_path);
+		if (handler) {
+			return handler;
+		}
+		match->nparams--;
+	}
+
+WILDCARD:
+	if (node->wildcard) {
+		handler = node_handler(node->wildcard, method, match, found_path);
+		if (handler) {
+			param = &(match->params[match->nparams++]);
+			param->name = node->wildcard->segment;
+			param->name_len = node->wildcard->len;
+			param->value = p;
+			param->value_len = end - p;
+			return handler;
+		}
+	}
+	return NULL;
+}
+
+
+sge_router*
+create_router() {
+	sge_router* router = sge_malloc(sizeof(*router));
+	router->root = create_node(NODE_STATIC, "", 0);
+	router->size = 0;
+	return router;
+}
+
+void
+destroy_router(sge_router* router, void (*cb_free)(void*)) {
+	destroy_node(router->root, cb_free);
+	sge_free(router);
+}
+
+int
+router_add(sge_router* router, const char* method, const char* path, void* handler) {
+	int m, nparams = 0;
+	const char* p, *seg_end;
+	const char* end = path + strlen(path);
+	sge_route_node* node = router->root;
+
+	m = method_index(method, strlen(method));
+	if (m == SGE_ERR) {
+		return SGE_ERR;
+	}
+
+	p = next_segment(path, end, &seg_end);
+	while (p < end) {
+		size_t len = seg_end - p;
+		if (*p == '*') {
+			if (seg_end != end) {
+				return SGE_ERR;
+			}
+			node = add_param_child(&(node->wildcard), NODE_WILDCARD, p + 1, len - 1);
+			nparams++;
+		} else if (*p == ':' || (*p == '{' && p[len - 1] == '}')) {
+			size_t skip = (*p == ':') ? 1 : 2;
+			node = add_param_child(&(node->param), NODE_PARAM, p + 1, len - skip);
+			nparams++;
+		} else {
+			node = add_static_child(node, p, len);
+		}
+		if (NULL == node || nparams > MAX_ROUTE_PARAMS) {
+			return SGE_ERR;
+		}
+		p = next_segment(seg_end, end, &seg_end);
+	}
+
+	if (node->handlers[m]) {
+		return SGE_ERR;
+	}
+	node->handlers[m] = handler;
+	node->nhandlers++;
+	if (NULL == node->route) {
+		node->route = strdup(path);
+	}
+	router->size++;
+	return SGE_OK;
+}
+
+int
+router_match(sge_router* router, const char* method, size_t method_len, const char* path, size_t path_len, sge_route_match* match) {
+	int found_path = 0;
+	int m = method_index(method, method_len);
+
+	match->nparams = 0;
+	match->handler = NULL;
+	match->route = NULL;
+	if (m == SGE_ERR) {
+		m = METHOD_ANY;
+	}
+	match->handler = match_node(router->root, path, path + path_len, m, match, &found_path);
+	if (match->handler) {
+		return ROUTE_FOUND;
+	}
+	return found_path ? ROUTE_NOT_ALLOWED : ROUTE_NOT_FOUND;
+}
+
+int
+router_empty(sge_router* router) {
+	return router->size == 0;
+}
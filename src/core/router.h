@@ -0,0 +1,32 @@
+#ifndef ROUTER_H_
+#define ROUTER_H_
+
+#define MAX_ROUTE_PARAMS 16
+
+#define ROUTE_FOUND 0
+#define ROUTE_NOT_FOUND 1
+#define ROUTE_NOT_ALLOWED 2
+
+typedef struct sge_router sge_router;
+
+typedef struct {
+	const char* name;
+	size_t name_len;
+	const char* value;
+	size_t value_len;
+} sge_route_param;
+
+typedef struct {
+	void* handler;
+	const char* route;
+	int nparams;
+	sge_route_param params[MAX_ROUTE_PARAMS];
+} sge_route_match;
+
+sge_router* create_router();
+void destroy_router(sge_router* router, void (*cb_free)(void*));
+int router_add(sge_router* router, const char* method, const char* path, void* handler);
+int router_match(sge_router* router, const char* method, size_t method_len, const char* path, size_t path_len, sge_route_match* match);
+int router_empty(sge_router* router);
+
+#endif
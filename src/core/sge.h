@@ -1,6 +1,7 @@
 #ifndef SGE_H_
 #define SGE_H_
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -11,13 +12,31 @@
 #define sge_free free
 
 #define MAX_SOCK_NUM 1024
+// ids from MAX_SOCK_NUM on name http/2 streams rather than sockets
+#define MAX_STREAM_NUM 4096
+#define MAX_CONN_ID (MAX_SOCK_NUM + MAX_STREAM_NUM)
 
 typedef enum {
     CMD_QUIT,
     CMD_NEW_CONN,
     CMD_MESSAGE,
     CMD_READDONE,
-    CMD_CLOSE
+    CMD_CLOSE,
+    CMD_RELEASE,
+    CMD_CACHE,
+    CMD_WS_OPEN,
+    CMD_WS_TEXT,
+    CMD_WS_BINARY,
+    CMD_SUBSCRIBE,
+    CMD_UNSUBSCRIBE,
+    CMD_PUBLISH,
+    CMD_COMPRESS,
+    CMD_COMPRESSED,
+    CMD_FRAME,
+    CMD_CONNECT,
+    CMD_UPSTREAM_DATA,
+    CMD_UPSTREAM_CLOSE,
+    CMD_RESPONSE_END
 } COMMAND_TYPE;
 
 typedef struct {
@@ -25,8 +44,13 @@ typedef struct {
     int id;
     void (*free)(void*);
     void* ud;
+    uint64_t ts;
 } sge_message;
 
+struct sge_buffer;
+
 typedef int (*cb_worker)(sge_message*);
+typedef int (*cb_runner)(cb_worker);
+typedef int (*cb_admin)(const char* cmd, size_t len, struct sge_buffer** body);
 
 #endif
@@ -0,0 +1,191 @@
+#include <time.h>
+#include <stdio.h>
+
+#include "core/sge.h"
+#include "core/spinlock.h"
+#include "core/histogram.h"
+#include "core/stats.h"
+
+/*
+ * per-stage latency of a request, in nanoseconds.
+ * every thread records into its own histograms, registered on first
+ * use; a snapshot merges all of them. when disabled stats_now() returns
+ * 0 and recording a stage that started at 0 is a no-op, so call sites
+ * need no checks.
+ */
+
+#define MAX_STATS_THREADS 64
+
+typedef struct {
+	sge_histogram* stages[STAGE_MAX];
+} sge_stats_local;
+
+struct sge_stats {
+	int enabled;
+	int nthread;
+	sge_spinlock lock;
+	sge_stats_local* threads[MAX_STATS_THREADS];
+};
+
+static struct sge_stats STATS;
+static __thread sge_stats_local* LOCAL = NULL;
+
+static const char* STAGE_NAMES[STAGE_MAX] = {
+	"reactor",
+	"worker_queue",
+	"parse",
+	"handler",
+	"server_queue",
+	"write",
+	"total"
+};
+
+static sge_stats_local*
+local_stats() {
+	int i;
+	sge_stats_local* local;
+
+	if (LOCAL) {
+		return LOCAL;
+	}
+	SPIN_LOCK(&STATS);
+	if (STATS.nthread == MAX_STATS_THREADS) {
+		SPIN_UNLOCK(&STATS);
+		return NULL;
+	}
+	local = sge_malloc(sizeof(*local));
+	for (i = 0; i < STAGE_MAX; ++i) {
+		local->stages[i] = create_histogram();
+	}
+	STATS.threads[STATS.nthread++] = local;
+	SPIN_UNLOCK(&STATS);
+	LOCAL = local;
+	return local;
+}
+
+int
+init_stats(int enabled) {
+	SPIN_INIT(&STATS);
+	STATS.enabled = enabled;
+	return SGE_OK;
+}
+
+void
+destroy_stats() {
+	int i, j;
+
+	for (i = 0; i < STATS.nthread; ++i) {
+		for (j = 0; j < STAGE_MAX; ++j) {
+			destroy_histogram(STATS.threads[i]->stages[j]);
+		}
+		sge_free(STATS.threads[i]);
+	}
+	STATS.nthread = 0;
+	STATS.enabled = 0;
+	SPIN_DESTROY(&STATS);
+}
+
+uint64_t
+stats_now() {
+	struct timespec ts;
+
+	if (!STATS.enabled) {
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+stats_since(STAGE_TYPE stage, uint64_t start) {
+	sge_stats_local* local;
+	uint64_t now;
+
+	if (start == 0 || (now = stats_now()) < start) {
+		return;
+	}
+	local = local_stats();
+	if (local) {
+		histogram_record(local->stages[stage], now - start);
+	}
+}
+
+static void
+merge_stage(sge_histogram* merged, STAGE_TYPE stage) {
+	int i;
+
+	histogram_reset(merged);
+	SPIN_LOCK(&STATS);
+	for (i = 0; i < STATS.nthread; ++i) {
+		histogram_merge(merged, STATS.threads[i]->stages[stage]);
+	}
+	SPIN_UNLOCK(&STATS);
+}
+
+/*
+ * a text table of all stages, times in microseconds.
+ */
+sge_buffer*
+format_stages(sge_buffer* buf) {
+	int i, n;
+	char line[256];
+	sge_histogram* merged;
+
+	n = snprintf(line, sizeof(line), "%-14s %10s %10s %10s %10s %10s %10s %10s\n",
+		"stage(us)", "count", "p50", "p90", "p99", "p99.9", "max", "mean");
+	buf = append_buffer(buf, line, n);
+	if (!STATS.enabled) {
+		return buf;
+	}
+
+	merged = create_histogram();
+	for (i = 0; i < STAGE_MAX; ++i) {
+		merge_stage(merged, i);
+		n = snprintf(line, sizeof(line), "%-14s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			STAGE_NAMES[i], histogram_count(merged),
+			histogram_percentile(merged, 50) / 1e3,
+			histogram_percentile(merged, 90) / 1e3,
+			histogram_percentile(merged, 99) / 1e3,
+			histogram_percentile(merged, 99.9) / 1e3,
+			histogram_max(merged) / 1e3,
+			histogram_mean(merged) / 1e3);
+		buf = append_buffer(buf, line, n);
+	}
+	destroy_histogram(merged);
+	return buf;
+}
+
+/*
+ * the same histograms as a prometheus summary, in seconds.
+ */
+sge_buffer*
+format_stages_summary(sge_buffer* buf) {
+	static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+	int i, j, n;
+	char line[256];
+	sge_histogram* merged;
+
+	if (!STATS.enabled) {
+		return buf;
+	}
+	n = snprintf(line, sizeof(line), "# HELP sge_stage_seconds Time spent per request stage.\n"
+		"# TYPE sge_stage_seconds summary\n");
+	buf = append_buffer(buf, line, n);
+
+	merged = create_histogram();
+	for (i = 0; i < STAGE_MAX; ++i) {
+		merge_stage(merged, i);
+		for (j = 0; j < sizeof(quantiles) / sizeof(quantiles[0]); ++j) {
+			n = snprintf(line, sizeof(line), "sge_stage_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n",
+				STAGE_NAMES[i], quantiles[j], histogram_percentile(merged, quantiles[j] * 100) / 1e9);
+			buf = append_buffer(buf, line, n);
+		}
+		n = snprintf(line, sizeof(line), "sge_stage_seconds_sum{stage=\"%s\"} %.9f\n"
+			"sge_stage_seconds_count{stage=\"%s\"} %lu\n",
+			STAGE_NAMES[i], histogram_mean(merged) * histogram_count(merged) / 1e9,
+			STAGE_NAMES[i], histogram_count(merged));
+		buf = append_buffer(buf, line, n);
+	}
+	destroy_histogram(merged);
+	return buf;
+}
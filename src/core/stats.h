@@ -0,0 +1,25 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include "core/buffer.h"
+
+typedef enum {
+	STAGE_REACTOR,
+	STAGE_WORKER_QUEUE,
+	STAGE_PARSE,
+	STAGE_HANDLER,
+	STAGE_SERVER_QUEUE,
+	STAGE_WRITE,
+	STAGE_TOTAL,
+	STAGE_MAX
+} STAGE_TYPE;
+
+int init_stats(int enabled);
+void destroy_stats();
+uint64_t stats_now();
+void stats_since(STAGE_TYPE stage, uint64_t start);
+sge_buffer* format_stages(sge_buffer* buf);
+sge_buffer* format_stages_summary(sge_buffer* buf);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/*
+ * USDT probes of provider "sge" for perf, bpftrace and systemtap. with
+ * <sys/sdt.h> available a probe is a single nop plus an ELF note and
+ * costs nothing until attached; without it, or when built with
+ * -DSGE_NO_USDT, the probes compile to nothing.
+ * probe names use `__`, tools show it as `-` (worker__enqueue is
+ * sge:worker-enqueue in perf).
+ */
+
+#if !defined(SGE_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SGE_HAVE_USDT 1
+#endif
+#endif
+
+#ifdef SGE_HAVE_USDT
+#define TRACE1(name, a) DTRACE_PROBE1(sge, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(sge, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(sge, name, a, b, c)
+#define TRACE4(name, a, b, c, d) DTRACE_PROBE4(sge, name, a, b, c, d)
+#else
+#define TRACE1(name, a) ((void)0)
+#define TRACE2(name, a, b) ((void)0)
+#define TRACE3(name, a, b, c) ((void)0)
+#define TRACE4(name, a, b, c, d) ((void)0)
+#endif
+
+#endif
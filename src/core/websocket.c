@@ -0,0 +1,568 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "core/sge.h"
+#include "core/websocket.h"
+
+/*
+ * the server side of a websocket without the socket: bytes read go in
+ * through ws_feed(), frames to write come out of ws_output(). frames
+ * are parsed as they arrive, the payload unmasked straight into the
+ * message it belongs to, so a large message is never copied twice.
+ * pings are answered and the close handshake is done here, only
+ * complete text and binary messages reach the callback.
+ * no extensions, so no permessage-deflate.
+ */
+
+#define MAX_HEAD_LEN 14
+#define MAX_CONTROL_LEN 125
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// end_frame() after a close frame, the connection is done
+#define WS_DONE -1
+
+struct sge_ws {
+	cb_ws_message cb;
+	void* ud;
+	size_t max_size;
+	sge_buffer* out;
+	sge_buffer* msg;
+	int msg_opcode;
+	uint8_t head[MAX_HEAD_LEN];
+	size_t head_len;
+	int in_frame;
+	int fin;
+	int opcode;
+	uint64_t left;
+	uint8_t mask[4];
+	size_t mask_pos;
+	char* tail;
+	uint8_t control[MAX_CONTROL_LEN];
+	size_t control_len;
+	int closed;
+	int alive;
+};
+
+static size_t head_size(const uint8_t* head, size_t len);
+static int begin_frame(sge_ws* ws);
+static int end_frame(sge_ws* ws);
+static int control_frame(sge_ws* ws);
+static int fail(sge_ws* ws, uint16_t code);
+static void append_frame(sge_ws* ws, int opcode, const uint8_t* payload, size_t len);
+static void unmask(uint8_t* dst, const uint8_t* src, size_t len, const uint8_t* mask, size_t pos);
+static int utf8_valid(const uint8_t* s, size_t len);
+static int close_code_valid(uint16_t code);
+static void sha1_block(uint32_t h[5], const uint8_t* block);
+static void sha1(const uint8_t* data, size_t len, uint8_t digest[20]);
+static void base64_encode(const uint8_t* data, size_t len, char* out);
+
+
+sge_ws*
+create_ws(size_t max_size, cb_ws_message cb, void* ud) {
+	sge_ws* ws = sge_malloc(sizeof(*ws));
+
+	memset(ws, 0, sizeof(*ws));
+	ws->cb = cb;
+	ws->ud = ud;
+	ws->max_size = max_size;
+	ws->out = create_buffer(256);
+	ws->alive = 1;
+	return ws;
+}
+
+void
+destroy_ws(sge_ws* ws) {
+	if (ws->msg) {
+		destroy_buffer(ws->msg);
+	}
+	destroy_buffer(ws->out);
+	sge_free(ws);
+}
+
+// Sec-WebSocket-Accept for a Sec-WebSocket-Key
+void
+ws_accept_key(const char* key, size_t len, char* accept) {
+	uint8_t digest[20];
+	sge_buffer* buf = create_buffer_ex(key, len);
+	const char* data;
+
+	buf = append_buffer(buf, WS_GUID, sizeof(WS_GUID) - 1);
+	data = buffer_data(buf, &len);
+	sha1((const uint8_t*)data, len, digest);
+	base64_encode(digest, sizeof(digest), accept);
+	destroy_buffer(buf);
+}
+
+/*
+ * SGE_ERR when the connection has to be closed, after the close frame
+ * that says why is written.
+ */
+int
+ws_feed(sge_ws* ws, const char* data, size_t len) {
+	int code;
+	size_t n, need;
+	const uint8_t* p = (const uint8_t*)data, *end = p + len;
+
+	if (ws->closed) {
+		// waiting for the peer to hang up, what it still sends is moot
+		return SGE_OK;
+	}
+	ws->alive = 1;
+	while (p < end) {
+		if (!ws->in_frame) {
+			need = head_size(ws->head, ws->head_len);
+			while (ws->head_len < need && p < end) {
+				ws->head[ws->head_len++] = *p++;
+				need = head_size(ws->head, ws->head_len);
+			}
+			if (ws->head_len < need) {
+				return SGE_OK;
+			}
+			code = begin_frame(ws);
+			if (code) {
+				return fail(ws, code);
+			}
+			ws->in_frame = 1;
+		}
+
+		n = (size_t)(end - p) < ws->left ? (size_t)(end - p) : ws->left;
+		if (ws->opcode & 0x8) {
+			unmask(ws->control + ws->control_len, p, n, ws->mask, ws->mask_pos);
+			ws->control_len += n;
+		} else {
+			unmask((uint8_t*)ws->tail, p, n, ws->mask, ws->mask_pos);
+			ws->tail += n;
+		}
+		ws->mask_pos += n;
+		ws->left -= n;
+		p += n;
+		if (ws->left > 0) {
+			return SGE_OK;
+		}
+
+		ws->in_frame = 0;
+		ws->head_len = 0;
+		code = end_frame(ws);
+		if (code == WS_DONE) {
+			return SGE_ERR;
+		}
+		if (code) {
+			return fail(ws, code);
+		}
+	}
+	return SGE_OK;
+}
+
+/*
+ * the head of a frame whose `len` bytes of payload the caller writes
+ * right after it. servers never mask.
+ */
+int
+ws_frame_head(sge_ws* ws, int opcode, size_t len) {
+	uint8_t head[MAX_HEAD_LEN];
+	size_t n = 2;
+	int i;
+
+	if (ws->closed) {
+		return SGE_ERR;
+	}
+	head[0] = 0x80 | opcode;
+	if (len < 126) {
+		head[1] = len;
+	} else if (len <= 0xffff) {
+		head[1] = 126;
+		head[2] = len >> 8;
+		head[3] = len;
+		n = 4;
+	} else {
+		head[1] = 127;
+		for (i = 0; i < 8; ++i) {
+			head[2 + i] = (uint64_t)len >> (56 - i * 8);
+		}
+		n = 10;
+	}
+	ws->out = append_buffer(ws->out, (const char*)head, n);
+	return SGE_OK;
+}
+
+// starts the close handshake, nothing is sent after it
+int
+ws_close(sge_ws* ws, uint16_t code) {
+	uint8_t payload[2] = {code >> 8, code & 0xff};
+
+	if (ws->closed) {
+		return SGE_OK;
+	}
+	append_frame(ws, WS_CLOSE, payload, sizeof(payload));
+	ws->closed = 1;
+	return SGE_OK;
+}
+
+/*
+ * keepalive, called every interval. SGE_ERR when not a byte came in
+ * since the last call, the pong to the last ping included.
+ */
+int
+ws_ping(sge_ws* ws) {
+	if (ws->closed) {
+		return SGE_OK;
+	}
+	if (!ws->alive) {
+		return SGE_ERR;
+	}
+	ws->alive = 0;
+	append_frame(ws, WS_PING, NULL, 0);
+	return SGE_OK;
+}
+
+sge_buffer*
+ws_output(sge_ws* ws) {
+	sge_buffer* out;
+
+	if (buffer_size(ws->out) == 0) {
+		return NULL;
+	}
+	out = ws->out;
+	ws->out = create_buffer(256);
+	return out;
+}
+
+// 2 until the second byte tells about the length and mask
+size_t
+head_size(const uint8_t* head, size_t len) {
+	size_t n = 2;
+
+	if (len < 2) {
+		return n;
+	}
+	if ((head[1] & 0x7f) == 126) {
+		n += 2;
+	} else if ((head[1] & 0x7f) == 127) {
+		n += 8;
+	}
+	return n + ((head[1] & 0x80) ? 4 : 0);
+}
+
+int
+begin_frame(sge_ws* ws) {
+	int i;
+	uint64_t len = ws->head[1] & 0x7f;
+	const uint8_t* p = ws->head + 2;
+	size_t size;
+	sge_buffer* msg;
+
+	ws->fin = ws->head[0] & 0x80;
+	ws->opcode = ws->head[0] & 0x0f;
+	if ((ws->head[0] & 0x70) || !(ws->head[1] & 0x80)) {
+		// no extension sets rsv bits, and clients must mask
+		return WS_PROTOCOL_ERROR;
+	}
+	if (len == 126) {
+		len = (p[0] << 8) | p[1];
+		p += 2;
+	} else if (len == 127) {
+		len = 0;
+		for (i = 0; i < 8; ++i) {
+			len = (len << 8) | p[i];
+		}
+		p += 8;
+		if (len >> 63) {
+			return WS_PROTOCOL_ERROR;
+		}
+	}
+	memcpy(ws->mask, p, 4);
+	ws->mask_pos = 0;
+	ws->left = len;
+
+	switch (ws->opcode) {
+		case WS_CLOSE:
+		case WS_PING:
+		case WS_PONG:
+			if (!ws->fin || len > MAX_CONTROL_LEN) {
+				return WS_PROTOCOL_ERROR;
+			}
+			ws->control_len = 0;
+			return 0;
+		case WS_CONTINUATION:
+			if (NULL == ws->msg) {
+				return WS_PROTOCOL_ERROR;
+			}
+			break;
+		case WS_TEXT:
+		case WS_BINARY:
+			if (ws->msg) {
+				return WS_PROTOCOL_ERROR;
+			}
+			ws->msg_opcode = ws->opcode;
+			break;
+		default:
+			return WS_PROTOCOL_ERROR;
+	}
+
+	size = ws->msg ? buffer_size(ws->msg) : 0;
+	if (len > ws->max_size || size + len > ws->max_size) {
+		return WS_TOO_BIG;
+	}
+	// the whole frame's room at once, it is within max_size
+	msg = ws->msg ? ws->msg : create_buffer(len);
+	ws->msg = extend_buffer(msg, len, &ws->tail);
+	return 0;
+}
+
+int
+end_frame(sge_ws* ws) {
+	size_t len;
+	sge_buffer* msg;
+
+	if (ws->opcode & 0x8) {
+		return control_frame(ws);
+	}
+	if (!ws->fin) {
+		return 0;
+	}
+	msg = ws->msg;
+	ws->msg = NULL;
+	if (ws->msg_opcode == WS_TEXT) {
+		const char* data = buffer_data(msg, &len);
+		if (!utf8_valid((const uint8_t*)data, len)) {
+			destroy_buffer(msg);
+			return WS_INVALID_DATA;
+		}
+	}
+	ws->cb(ws->ud, ws->msg_opcode, msg);
+	return 0;
+}
+
+int
+control_frame(sge_ws* ws) {
+	uint16_t code;
+
+	switch (ws->opcode) {
+		case WS_PING:
+			append_frame(ws, WS_PONG, ws->control, ws->control_len);
+			return 0;
+		case WS_PONG:
+			return 0;
+		default:
+			break;
+	}
+
+	// a close: echo its code and be done
+	if (ws->control_len == 1) {
+		return WS_PROTOCOL_ERROR;
+	}
+	if (ws->control_len >= 2) {
+		code = (ws->control[0] << 8) | ws->control[1];
+		if (!close_code_valid(code)) {
+			return WS_PROTOCOL_ERROR;
+		}
+		if (!utf8_valid(ws->control + 2, ws->control_len - 2)) {
+			return WS_INVALID_DATA;
+		}
+	}
+	append_frame(ws, WS_CLOSE, ws->control, ws->control_len < 2 ? 0 : 2);
+	ws->closed = 1;
+	return WS_DONE;
+}
+
+int
+fail(sge_ws* ws, uint16_t code) {
+	ws_close(ws, code);
+	return SGE_ERR;
+}
+
+void
+append_frame(sge_ws* ws, int opcode, const uint8_t* payload, size_t len) {
+	if (ws_frame_head(ws, opcode, len) == SGE_OK && len > 0) {
+		ws->out = append_buffer(ws->out, (const char*)payload, len);
+	}
+}
+
+/*
+ * xor `len` bytes with the mask, `pos` bytes into the frame. 16 bytes
+ * at a time with SSE2, 8 otherwise; 4 divides both, so the rotated
+ * mask lines up again after every block.
+ */
+void
+unmask(uint8_t* dst, const uint8_t* src, size_t len, const uint8_t* mask, size_t pos) {
+	size_t i = 0;
+	uint8_t m[16];
+	uint64_t m64, v;
+
+	for (i = 0; i < sizeof(m); ++i) {
+		m[i] = mask[(pos + i) & 3];
+	}
+	i = 0;
+#ifdef __SSE2__
+	__m128i m128 = _mm_loadu_si128((const __m128i*)m);
+	for (; i + 16 <= len; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(block, m128));
+	}
+#endif
+	memcpy(&m64, m, sizeof(m64));
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&v, src + i, sizeof(v));
+		v ^= m64;
+		memcpy(dst + i, &v, sizeof(v));
+	}
+	for (; i < len; ++i) {
+		dst[i] = src[i] ^ m[i & 15];
+	}
+}
+
+// shortest forms only, no surrogates, nothing past U+10FFFF
+int
+utf8_valid(const uint8_t* s, size_t len) {
+	size_t i = 0, j, n;
+	uint32_t cp;
+	uint64_t word;
+
+	while (i < len) {
+		if (i + 8 <= len) {
+			memcpy(&word, s + i, sizeof(word));
+			if (!(word & 0x8080808080808080ULL)) {
+				i += 8;
+				continue;
+			}
+		}
+		if (s[i] < 0x80) {
+			i++;
+			continue;
+		}
+		if (s[i] >= 0xc2 && s[i] <= 0xdf) {
+			n = 1;
+			cp = s[i] & 0x1f;
+		} else if (s[i] >= 0xe0 && s[i] <= 0xef) {
+			n = 2;
+			cp = s[i] & 0x0f;
+		} else if (s[i] >= 0xf0 && s[i] <= 0xf4) {
+			n = 3;
+			cp = s[i] & 0x07;
+		} else {
+			return 0;
+		}
+		if (len - i <= n) {
+			return 0;
+		}
+		for (j = 1; j <= n; ++j) {
+			if ((s[i + j] & 0xc0) != 0x80) {
+				return 0;
+			}
+			cp = (cp << 6) | (s[i + j] & 0x3f);
+		}
+		if ((n == 2 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff)))
+			|| (n == 3 && (cp < 0x10000 || cp > 0x10ffff))) {
+			return 0;
+		}
+		i += n + 1;
+	}
+	return 1;
+}
+
+// the codes a peer may send, 1005, 1006 and 1015 are for reporting only
+int
+close_code_valid(uint16_t code) {
+	return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014)
+		|| (code >= 3000 && code <= 4999);
+}
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+void
+sha1_block(uint32_t h[5], const uint8_t* block) {
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		w[i] = ((uint32_t)block[i * 4] << 24) | (block[i * 4 + 1] << 16) | (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+	}
+	for (i = 16; i < 80; ++i) {
+		w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	}
+	a = h[0];
+	b = h[1];
+	c = h[2];
+	d = h[3];
+	e = h[4];
+	for (i = 0; i < 80; ++i) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		t = ROL(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = t;
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+void
+sha1(const uint8_t* data, size_t len, uint8_t digest[20]) {
+	uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+	uint8_t tail[128];
+	size_t i, off, rest = len % 64, n = rest < 56 ? 64 : 128;
+	uint64_t bits = (uint64_t)len * 8;
+
+	for (off = 0; off + 64 <= len; off += 64) {
+		sha1_block(h, data + off);
+	}
+	// 0x80, zeros, then the length in bits in the last 8 bytes
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, data + off, rest);
+	tail[rest] = 0x80;
+	for (i = 0; i < 8; ++i) {
+		tail[n - 8 + i] = bits >> (56 - i * 8);
+	}
+	for (off = 0; off < n; off += 64) {
+		sha1_block(h, tail + off);
+	}
+	for (i = 0; i < 5; ++i) {
+		digest[i * 4] = h[i] >> 24;
+		digest[i * 4 + 1] = h[i] >> 16;
+		digest[i * 4 + 2] = h[i] >> 8;
+		digest[i * 4 + 3] = h[i];
+	}
+}
+
+void
+base64_encode(const uint8_t* data, size_t len, char* out) {
+	static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i;
+	uint32_t v;
+
+	for (i = 0; i + 2 < len; i += 3) {
+		v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+		*out++ = table[v >> 18];
+		*out++ = table[(v >> 12) & 0x3f];
+		*out++ = table[(v >> 6) & 0x3f];
+		*out++ = table[v & 0x3f];
+	}
+	if (i < len) {
+		v = data[i] << 16;
+		if (i + 1 < len) {
+			v |= data[i + 1] << 8;
+		}
+		*out++ = table[v >> 18];
+		*out++ = table[(v >> 12) & 0x3f];
+		*out++ = i + 1 < len ? table[(v >> 6) & 0x3f] : '=';
+		*out++ = '=';
+	}
+}
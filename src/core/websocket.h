@@ -0,0 +1,40 @@
+#ifndef WEBSOCKET_H_
+#define WEBSOCKET_H_
+
+#include <stdint.h>
+
+#include "core/buffer.h"
+
+#define WS_CONTINUATION 0x0
+#define WS_TEXT 0x1
+#define WS_BINARY 0x2
+#define WS_CLOSE 0x8
+#define WS_PING 0x9
+#define WS_PONG 0xA
+
+#define WS_NORMAL_CLOSURE 1000
+#define WS_GOING_AWAY 1001
+#define WS_PROTOCOL_ERROR 1002
+#define WS_INVALID_DATA 1007
+#define WS_POLICY_VIOLATION 1008
+#define WS_TOO_BIG 1009
+#define WS_INTERNAL_ERROR 1011
+
+// base64 of a sha1, without the terminating '\0'
+#define WS_ACCEPT_LEN 28
+
+typedef struct sge_ws sge_ws;
+
+// a complete text or binary message, the callee owns `message`
+typedef void (*cb_ws_message)(void* ud, int opcode, sge_buffer* message);
+
+sge_ws* create_ws(size_t max_size, cb_ws_message cb, void* ud);
+void destroy_ws(sge_ws* ws);
+void ws_accept_key(const char* key, size_t len, char* accept);
+int ws_feed(sge_ws* ws, const char* data, size_t len);
+int ws_frame_head(sge_ws* ws, int opcode, size_t len);
+int ws_close(sge_ws* ws, uint16_t code);
+int ws_ping(sge_ws* ws);
+sge_buffer* ws_output(sge_ws* ws);
+
+#endif
@@ -1,5 +1,10 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+
 #include "core/sge.h"
 #include "core/log.h"
+#include "core/metrics.h"
 #include "os/server.h"
 
 #include "python-src/env.h"
@@ -18,10 +23,59 @@ int main(int argc, char const *argv[]) {
 		.socket = NULL,
 		.user = NULL,
 		.libdir = NULL,
+		.cache_vary = NULL,
+		.admin_socket = NULL,
+		.access_log = NULL,
+		.capture = NULL,
+		.tls_cert = NULL,
+		.tls_key = NULL,
+		.codec = "http",
+		.compress_types = "text/,application/json,application/javascript,application/xml,image/svg+xml",
+		.exe = NULL,
+		.config_file = NULL,
+		.cache_size = 0,
+		.shutdown_timeout = 30,
+		.access_log_size = 64 << 20,
+		.access_log_rotate = 0,
+		.overload_target = 0,
+		.overload_interval = 100,
+		.capture_sample = 1,
+		.capture_size = 1 << 30,
+		.websocket_max_size = 1 << 20,
+		.websocket_ping = 30,
+		.compress_min_size = 1024,
+		.compress_threads = 2,
+		.compress_level = 6,
+		.compress_cache_size = 16 << 20,
+		.codec_max_size = 1 << 20,
+		.upstream_connect_timeout = 1000,
+		.upstream_read_timeout = 30000,
+		.upstream_idle_timeout = 60,
+		.upstream_pool_size = 8,
+		.kv_size = 0,
+		.nlistener = 0,
+		.log_level = LEVEL_DEBUG,
 		.cb = NULL,
-		.daemon = 0
+		.runner = NULL,
+		.admin = NULL,
+		.daemon = 0,
+		.async = 0,
+		.http2 = 0,
+		.websocket = 0,
+		.compress = 0,
+		.coalesce = 0,
+		.ktls = 1
 	};
 
+	// resolved before chdir(workdir), an upgrade execs them again
+	static char exe[PATH_MAX], config_file[PATH_MAX];
+	ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (n > 0) {
+		exe[n] = '\0';
+		config.exe = exe;
+	}
+	config.config_file = realpath(argv[1], config_file) ? config_file : argv[1];
+
 	if (init_env() == SGE_ERR) {
 		return -1;
 	}
@@ -36,6 +90,8 @@ int main(int argc, char const *argv[]) {
 
 	destroy_server();
 	destroy_env();
+	destroy_metrics();
+	stop_log();
 
 	return 0;
 }
@@ -26,7 +26,7 @@ calc_event(EVENT_TYPE types) {
 static int
 init_event(sge_event* evt) {
 	assert(evt->efd == 0);
-	int efd = epoll_create(MAX_EPOLL_SIZE);
+	int efd = epoll_create1(EPOLL_CLOEXEC);
 	if (efd < 0) {
 		SYS_ERROR();
 		return SGE_ERR;
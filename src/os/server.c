@@ -1,3 +1,6 @@
+// accept4()
+#define _GNU_SOURCE
+
 #include <pwd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -5,22 +8,54 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <signal.h>
+#include <time.h>
+#include <stdio.h>
 #include <pthread.h>
+#include <sys/poll.h>
+#include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
 
 #include "core/sge.h"
 #include "core/log.h"
 #include "core/list.h"
 #include "core/queue.h"
+#include "core/http.h"
+#include "core/hash.h"
+#include "core/cache.h"
+#include "core/stats.h"
+#include "core/metrics.h"
+#include "core/accesslog.h"
+#include "core/capture.h"
+#include "core/h2.h"
+#include "core/websocket.h"
+#include "core/pubsub.h"
+#include "core/compress.h"
+#include "core/codec.h"
+#include "core/trace.h"
 #include "os/server.h"
 #include "os/event.h"
+#include "os/tls.h"
 
 #define MAX_WORKER_NUM 128
 #define DEFAULT_READ_SIZE 1024
+#define MAX_IOV_NUM 64
+#define MAX_SNIFF_SIZE 8192
+#define MAX_VARY_NUM 8
+#define ENV_LISTEN_FD "SGE_LISTEN_FD"
+#define ENV_READY_FD "SGE_READY_FD"
+#define MAX_ADMIN_REQUEST 1024
+#define UPSTREAM_READ_SIZE 16384
+// the handle of a pooled upstream, no worker holds it
+#define UPSTREAM_IDLE -1
+#define SHED_RESPONSE "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nRetry-After: 1\r\n\r\n"
+#define SHED_CLOSE_RESPONSE "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n"
 #define CHECK_ARG(msg) \
-if (msg->id < 0 || msg->id > MAX_SOCK_NUM) {		\
+if (msg->id < 0 || msg->id >= MAX_SOCK_NUM) {		\
 	ERROR("invalid fd: %d", msg->id);				\
 	break;										\
 }													\
@@ -31,17 +66,111 @@ if (!s) {											\
 }
 
 
+// a listening socket and what the connections it accepts get
+typedef struct {
+	sge_socket* sock;
+	int codec;
+	int nodelay;
+	int tls;
+	int busy_poll;
+} sge_listener;
+
+// where the worker's id of an http/2 stream leads, see open_stream()
+typedef struct {
+	sge_socket* sock;
+	uint32_t stream;
+} sge_stream_slot;
+
+/*
+ * an outbound connection. `handle` is the worker's name for it while
+ * checked out, UPSTREAM_IDLE while it waits in the pool of `addr`.
+ * `deadline` ends the connect or the idle wait.
+ */
+typedef struct sge_upstream {
+	int handle;
+	int connecting;
+	sge_buffer* addr;
+	uint64_t deadline;
+	sge_socket* next;
+} sge_upstream;
+
+// the idle connections to one address, the last released first
+typedef struct {
+	sge_socket* idle;
+	uint32_t count;
+} sge_upstream_pool;
+
+/*
+ * identical GETs with the worker at once, by cache key. `leader` is the
+ * one the worker runs, `waiters` are parked with their request still
+ * in r_buf until its response comes back.
+ */
+typedef struct sge_flight {
+	sge_buffer* key;
+	sge_socket* leader;
+	sge_socket* waiters;
+} sge_flight;
+
 struct sge_server {
 	sge_event* event;
 	sge_socket* socks[MAX_SOCK_NUM];
 	sge_queue* worker_queue;
 	sge_queue* server_queue;
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
+	sge_socket* notifier;
+	sge_listener listeners[MAX_LISTENERS];
+	int nlistener;
+	sge_socket* upgrade;
+	sge_socket* admin;
+	int worker_fd;
 	pthread_t tids[MAX_WORKER_NUM];
 	uint32_t worker_num;
 	uint32_t sock_num;
 	uint8_t run;
+	volatile sig_atomic_t signal_upgrade;
+	volatile sig_atomic_t signal_quit;
+	uint8_t draining;
+	pid_t upgrade_pid;
+	uint64_t drain_deadline;
+	uint32_t shutdown_timeout;
+	const char* exe;
+	const char* config_file;
+	uint64_t now;
+	uint64_t polled;
+	sge_cache* cache;
+	sge_hash* flights;
+	uint32_t parked;
+	sge_access_log* access;
+	sge_capture* capture;
+	cb_admin admin_cb;
+	uint64_t overload_target;
+	uint64_t overload_interval;
+	uint64_t overload_since;
+	uint64_t shed_end;
+	uint8_t shedding;
+	uint8_t http2;
+	sge_stream_slot streams[MAX_STREAM_NUM];
+	uint32_t stream_next;
+	uint32_t stream_num;
+	sge_socket* h2_pending;
+	uint8_t websocket;
+	size_t ws_max_size;
+	uint64_t ws_ping;
+	uint64_t ws_ping_next;
+	uint32_t ws_num;
+	sge_pubsub* pubsub;
+	sge_compressor* compressor;
+	sge_tls_ctx* tls;
+	size_t codec_max_size;
+	sge_socket* upstreams[MAX_SOCK_NUM];
+	sge_hash* pools;
+	uint32_t upstream_num;
+	uint32_t upstream_idle;
+	uint32_t pool_size;
+	uint64_t connect_timeout;
+	uint64_t idle_timeout;
+	uint64_t upstream_check_next;
+	char* vary[MAX_VARY_NUM];
+	int nvary;
 };
 
 static struct sge_server SERVER;
@@ -51,22 +180,101 @@ static sge_socket* create_conn(int fd);
 static int init_server(sge_config* config);
 static int on_accept(sge_socket* sock);
 static int on_conn_readable(sge_socket* sock);
+static int on_tls_handshake(sge_socket* sock);
+static int on_tls_readable(sge_socket* sock);
 static int on_conn_writeable(sge_socket* sock);
 static int on_read_done(sge_socket* sock);
+static int receive_http(sge_socket* sock, const char* data, size_t len, int first);
+static int forward_data(sge_socket* sock, const char* data, size_t len);
+static int sniff_request(sge_socket* sock, const char* data, size_t len);
+static int serve_cached(sge_socket* sock, sge_http_request* req);
+static int store_cache(sge_socket* sock, sge_cache_item* item);
+static int join_flight(sge_socket* sock, int lead);
+static void land_flight(sge_socket* leader, sge_shared* response);
+static void leave_flight(sge_socket* sock);
+static void forward_sniffed(sge_socket* sock);
+static void resume_sniffing(sge_socket* sock);
+static int private_request(const sge_http_request* req);
+static int end_sniffed(sge_socket* sock, sge_http_request* req);
+static void check_overload(uint64_t now);
+static int shed_request(sge_socket* sock, const char* data, size_t len);
+static void access_begin(sge_socket* sock, const char* data, size_t len);
+static void access_status(sge_socket* sock, sge_chunk* chunk);
+static void access_end(sge_socket* sock);
+static int sniff_upgrade(sge_socket* sock, const char* data, size_t len);
+static void hang_up(sge_socket* sock);
+static int upgrade_h2(sge_socket* sock, sge_http_request* req);
+static void start_h2(sge_socket* sock);
+static int receive_h2(sge_socket* sock, const char* data, size_t len);
+static void flush_h2(sge_socket* sock);
+static void defer_h2(sge_socket* sock);
+static int on_h2_request(void* ud, uint32_t stream, sge_buffer* request);
+static void on_h2_reset(void* ud, int id);
+static int open_stream(sge_socket* sock, uint32_t stream);
+static void close_stream(int id);
+static sge_socket* stream_socket(int id, uint32_t* stream);
+static int write_stream_data(int id, const char* data, size_t len);
+static int finish_stream(int id);
+static int upgrade_ws(sge_socket* sock, sge_http_request* req);
+static int receive_ws(sge_socket* sock, const char* data, size_t len);
+static void flush_ws(sge_socket* sock);
+static void on_ws_message(void* ud, int opcode, sge_buffer* message);
+static int write_ws_frame(sge_socket* sock, int opcode, sge_chunk* chunk);
+static void check_ws_ping();
+static void close_websockets(uint16_t code);
+static void subscribe(int fd, sge_buffer* channel, int on);
+static void publish(sge_publish_item* item);
+static void deliver(int fd, void* ud);
+static int start_compress(sge_socket* sock, sge_compress_job* job);
+static void cancel_compress(void* ud);
+static void on_compressed(sge_compress_job* job, void* ud);
+static void finish_compress(sge_compress_job* job);
+static int receive_frames(sge_socket* sock, const char* data, size_t len);
+static void on_frame(void* ud, sge_buffer* frame);
+static int write_frame(sge_socket* sock, sge_chunk* chunk);
+static void open_upstream(int handle, sge_buffer* addr);
+static int connect_upstream(const char* addr, size_t len);
+static int on_upstream_connected(sge_socket* sock);
+static int on_upstream_readable(sge_socket* sock);
+static void fail_upstream(sge_socket* sock, int err);
+static sge_socket* upstream_socket(int handle);
+static void send_upstream(int handle, sge_chunk* chunk);
+static void release_upstream(int handle, int keep);
+static sge_socket* checkout_upstream(const char* addr, size_t len);
+static void forget_upstream(sge_socket* sock);
+static void check_upstreams();
+static void close_idle_upstreams();
+static int init_cache(sge_config* config);
+static void update_time();
+static int upgrade_server();
+static int on_upgrade_ready(sge_socket* sock);
+static int notify_ready();
+static int stop_accept();
+static int check_drain();
+static int init_admin(const char* path);
+static int on_admin_accept(sge_socket* sock);
+static int on_admin_read(sge_socket* sock);
+static int admin_command(sge_socket* sock, const char* cmd, size_t len);
+static sge_buffer* format_server_metrics(sge_buffer* buf);
 static int set_non_block(sge_socket* sock);
 static int add_socket(struct sge_server* server, sge_socket* sock);
-static int write_socket_data(sge_socket* sock, sge_buffer* buf);
+static int write_socket_data(sge_socket* sock, sge_chunk* chunk);
+static int flush_socket(sge_socket* sock);
 static int try_close_socket(sge_socket* sock);
 static int close_socket(sge_socket* sock);
 static void _destroy_socket(sge_socket* sock);
 static void* worker(void* arg);
 static int start_worker(sge_config* config);
-static int sendto_worker(COMMAND_TYPE type, int id, void (*cb_free)(void*), void* data);
 static int awake_worker();
+static int awake_server();
 static int wait_worker();
+static int on_notify(sge_socket* sock);
+static int init_notifier();
 static int deal_request();
 static int check_socket();
 
+static const sge_h2_callbacks H2_CALLBACKS = {on_h2_request, on_h2_reset};
+
 
 static int
 change_user(const char* user) {
@@ -149,6 +357,12 @@ handle_signal(int signo) {
 		case SIGINT:
 			SERVER.run = 0;
 		break;
+		case SIGUSR2:
+			SERVER.signal_upgrade = 1;
+		break;
+		case SIGQUIT:
+			SERVER.signal_quit = 1;
+		break;
 		default:
 			WARNING("unknown signal %d", signo);
 		break;
@@ -167,29 +381,78 @@ enable_signal(int signo) {
 static int
 init_signal() {
     enable_signal(SIGINT);
+    enable_signal(SIGUSR2);
+    enable_signal(SIGQUIT);
     return SGE_OK;
 }
 
 static int
-write_socket(sge_socket* sock, const char* str, size_t len) {
-	int ret;
+write_socket(sge_socket* sock, const struct iovec* iov, int iovcnt) {
+	ssize_t ret;
 
-	ret = write(sock->fd, str, len);
+	if (sock->tls && !tls_offloaded(sock->tls)) {
+		ret = tls_writev(sock->tls, iov, iovcnt);
+	} else {
+		ret = writev(sock->fd, iov, iovcnt);
+	}
 	if (ret < 0) {
+		if (errno == EINTR || errno == EAGAIN) {
+			return 0;
+		}
 		SYS_ERROR();
-		if (errno != EINTR || errno != EAGAIN) {
-			sendto_worker(CMD_CLOSE, sock->fd, NULL, NULL);
-			clear_buffer(sock->w_buf);
-			close_socket(sock);
+		if (sock->upstream) {
+			fail_upstream(sock, errno);
 			return SGE_ERR;
 		}
-		ret = 0;
+		sendto_worker(CMD_CLOSE, sock->fd, NULL, NULL);
+		clear_socket_output(sock);
+		close_socket(sock);
+		return SGE_ERR;
 	}
+	metrics_add(METRIC_BYTES_OUT, ret);
 	return ret;
 }
 
+/*
+ * the buffer sizes go before listen() so the window scale fits them,
+ * accepted sockets inherit all of these.
+ */
+static void
+set_listen_options(int fd, const sge_listen_config* l, int tcp) {
+	int value;
+
+	if (l->rcvbuf) {
+		value = l->rcvbuf;
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value)) < 0) {
+			SYS_ERROR();
+		}
+	}
+	if (l->sndbuf) {
+		value = l->sndbuf;
+		if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value)) < 0) {
+			SYS_ERROR();
+		}
+	}
+	if (!tcp) {
+		return;
+	}
+	// no wakeup until the first data arrives
+	if (l->defer_accept) {
+		value = l->defer_accept;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &value, sizeof(value)) < 0) {
+			SYS_ERROR();
+		}
+	}
+	if (l->fastopen) {
+		value = l->fastopen;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &value, sizeof(value)) < 0) {
+			SYS_ERROR();
+		}
+	}
+}
+
 static int
-init_unix_socket(const char* sock) {
+init_unix_socket(const char* sock, const sge_listen_config* l) {
 	int fd, retcode;
 	struct sockaddr_un addr;
 
@@ -210,7 +473,8 @@ init_unix_socket(const char* sock) {
 		goto RET;
 	}
 
-	retcode = listen(fd, 512);
+	set_listen_options(fd, l, 0);
+	retcode = listen(fd, l->backlog);
 	if (retcode < 0) {
 		SYS_ERROR();
 		retcode = SGE_ERR;
@@ -224,10 +488,10 @@ RET:
 }
 
 static int
-init_port(const char* host, const char* port) {
+init_port(const char* host, const char* port, const sge_listen_config* l) {
 	struct addrinfo hints;
 	struct addrinfo *result, *rp;
-	int sfd, s;
+	int sfd, s, on = 1;
 	int retcode = SGE_OK;
 
 	memset(&hints, 0, sizeof(struct addrinfo));
@@ -246,6 +510,7 @@ init_port(const char* host, const char* port) {
 		if (sfd == -1)
 			continue;
 
+		setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 		if (bind(sfd, rp->ai_addr, rp->ai_addrlen) == 0) {
 			break;
 		}
@@ -258,7 +523,8 @@ init_port(const char* host, const char* port) {
 		goto RET;
 	}
 
-	retcode = listen(sfd, 512);
+	set_listen_options(sfd, l, 1);
+	retcode = listen(sfd, l->backlog);
 	if (retcode < 0) {
 		close(sfd);
 		SYS_ERROR();
@@ -272,26 +538,127 @@ RET:
 	return retcode;
 }
 
+/*
+ * the listeners inherited from the process that exec'd us during an
+ * upgrade, see upgrade_server(). -1 for any that is not a listening
+ * socket.
+ */
+static int
+inherited_listeners(int* fds, int max) {
+	int n = 0, accepting;
+	socklen_t len;
+	const char* env = getenv(ENV_LISTEN_FD);
+
+	if (NULL == env) {
+		return 0;
+	}
+	while (n < max && *env) {
+		fds[n] = atoi(env);
+		accepting = 0;
+		len = sizeof(accepting);
+		if (getsockopt(fds[n], SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) < 0 || !accepting) {
+			ERROR("inherited fd %d is not a listening socket", fds[n]);
+			fds[n] = -1;
+		} else {
+			INFO("inherited listener fd %d", fds[n]);
+		}
+		n++;
+		env = strchr(env, ',');
+		if (NULL == env) {
+			break;
+		}
+		env++;
+	}
+	unsetenv(ENV_LISTEN_FD);
+	return n;
+}
+
+// "host:port" into its parts, SGE_ERR for a unix socket path
+static int
+split_address(const char* sock, char* host, size_t host_size, char* port, size_t port_size) {
+	const char* p = strchr(sock, ':');
+	size_t host_len, port_len;
+
+	if (NULL == p) {
+		return SGE_ERR;
+	}
+	host_len = p - sock;
+	port_len = strlen(p + 1);
+	if (host_len >= host_size || port_len >= port_size) {
+		return SGE_ERR;
+	}
+	memcpy(host, sock, host_len);
+	memcpy(port, p + 1, port_len);
+	host[host_len] = '\0';
+	port[port_len] = '\0';
+	return SGE_OK;
+}
+
+static int
+same_address(const struct sockaddr* a, const struct sockaddr_storage* b) {
+	const struct sockaddr_in* in = (const struct sockaddr_in*)b;
+	const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)b;
+
+	if (a->sa_family != b->ss_family) {
+		return 0;
+	}
+	if (a->sa_family == AF_INET) {
+		return in->sin_port == ((const struct sockaddr_in*)a)->sin_port
+			&& in->sin_addr.s_addr == ((const struct sockaddr_in*)a)->sin_addr.s_addr;
+	}
+	if (a->sa_family == AF_INET6) {
+		return in6->sin6_port == ((const struct sockaddr_in6*)a)->sin6_port
+			&& memcmp(&in6->sin6_addr, &((const struct sockaddr_in6*)a)->sin6_addr, sizeof(in6->sin6_addr)) == 0;
+	}
+	return 0;
+}
+
+// whether inherited listener `fd` is bound to the configured address `sock`
+static int
+bound_to(int fd, const char* sock) {
+	char host[128], port[6];
+	struct sockaddr_storage addr;
+	struct addrinfo hints, *result, *rp;
+	socklen_t len = sizeof(addr);
+	int found = 0;
+
+	memset(&addr, 0, sizeof(addr));
+	if (getsockname(fd, (struct sockaddr*)&addr, &len) < 0) {
+		SYS_ERROR();
+		return 0;
+	}
+	if (split_address(sock, host, sizeof(host), port, sizeof(port)) == SGE_ERR) {
+		return addr.ss_family == AF_UNIX && strcmp(((struct sockaddr_un*)&addr)->sun_path, sock) == 0;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	if (getaddrinfo(host, port, &hints, &result) != 0) {
+		return 0;
+	}
+	for (rp = result; rp && !found; rp = rp->ai_next) {
+		found = same_address(rp->ai_addr, &addr);
+	}
+	freeaddrinfo(result);
+	return found;
+}
+
+// `fd` is an inherited listener, or -1 to open l->socket
 static sge_socket*
-init_listener(const char* sock) {
-	int fd, ret;
-	char *p = strstr((char*)sock, ":");
-	if (p) {
-		char host[128];
-		char port[6];
-		int host_len = p - sock;
-		int port_len = strlen(sock) - host_len - 1;
-		strncpy(host, sock, host_len);
-		strncpy(port, p+1, port_len);
-		host[host_len] = '\0';
-		port[port_len] = '\0';
-		fd = init_port(host, port);
-	} else {
-		fd = init_unix_socket(sock);
+init_listener(const sge_listen_config* l, int fd) {
+	char host[128], port[6];
+
+	if (fd < 0 && split_address(l->socket, host, sizeof(host), port, sizeof(port)) == SGE_OK) {
+		fd = init_port(host, port, l);
+	} else if (fd < 0) {
+		fd = init_unix_socket(l->socket, l);
 	}
 	if (fd < 0) {
 		return NULL;
 	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
 
 	sge_socket* listener = create_socket(fd);
 	listener->on_read = on_accept;
@@ -300,6 +667,56 @@ init_listener(const char* sock) {
 	return listener;
 }
 
+/*
+ * an inherited listener is kept by the configured one bound to the same
+ * address, whatever its place in the list. the others are closed before
+ * anything is opened, so a new listener may take over their port.
+ */
+static int
+init_listeners(sge_config* config) {
+	int i, j, n, fds[MAX_LISTENERS], kept[MAX_LISTENERS];
+	sge_listener* l;
+	const sge_listen_config* c;
+
+	n = inherited_listeners(fds, MAX_LISTENERS);
+	for (i = 0; i < config->nlistener; ++i) {
+		kept[i] = -1;
+		for (j = 0; j < n; ++j) {
+			if (fds[j] >= 0 && bound_to(fds[j], config->listeners[i].socket)) {
+				kept[i] = fds[j];
+				fds[j] = -1;
+				break;
+			}
+		}
+	}
+	for (j = 0; j < n; ++j) {
+		if (fds[j] >= 0) {
+			INFO("inherited listener fd %d is no longer configured", fds[j]);
+			close(fds[j]);
+		}
+	}
+	for (i = 0; i < config->nlistener; ++i) {
+		c = &config->listeners[i];
+		l = &SERVER.listeners[i];
+		l->sock = init_listener(c, kept[i]);
+		if (NULL == l->sock) {
+			return SGE_ERR;
+		}
+		l->codec = codec_type(c->codec);
+		l->nodelay = c->nodelay;
+		l->tls = c->tls;
+		l->busy_poll = (int)c->busy_poll;
+		set_non_block(l->sock);
+		if (SERVER.event->add(SERVER.event, l->sock, EVT_READ) == SGE_ERR) {
+			return SGE_ERR;
+		}
+		add_socket(&SERVER, l->sock);
+		SERVER.nlistener++;
+		INFO("listening on %s (%s)", c->socket, c->codec);
+	}
+	return SGE_OK;
+}
+
 sge_socket*
 create_conn(int fd) {
 	sge_socket* conn;
@@ -315,31 +732,83 @@ create_conn(int fd) {
 
 int
 on_accept(sge_socket* sock) {
-	int clt;
-	struct sockaddr_in sockaddr;
-	socklen_t size;
+	int clt, on = 1;
+	struct sockaddr_storage sockaddr;
+	socklen_t size = sizeof(sockaddr);
+	sge_listener* l = SERVER.listeners;
+
+	while (l->sock != sock) {
+		l++;
+	}
 
-	clt = accept(sock->fd, (struct sockaddr*)&sockaddr, &size);
+	// only the listeners may outlive an upgrade's execve
+	clt = accept4(sock->fd, (struct sockaddr*)&sockaddr, &size, SOCK_CLOEXEC);
 	if (clt < 0) {
 		SYS_ERROR();
 		return SGE_OK;
 	}
-	if (SERVER.sock_num >= MAX_SOCK_NUM) {
+	// SERVER.socks is indexed by fd
+	if (clt >= MAX_SOCK_NUM || SERVER.sock_num >= MAX_SOCK_NUM) {
 		WARNING("Too many connections. current connection num: %d", SERVER.sock_num);
+		metrics_add(METRIC_REJECTS, 1);
 		close(clt);
 		return SGE_OK;
 	}
+	TRACE2(accept, clt, sockaddr.ss_family);
+	if (l->nodelay && sockaddr.ss_family != AF_UNIX) {
+		setsockopt(clt, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+	if (l->busy_poll && setsockopt(clt, SOL_SOCKET, SO_BUSY_POLL, &l->busy_poll, sizeof(l->busy_poll)) < 0) {
+		// wants CAP_NET_ADMIN above net.core.busy_read, say so once
+		SYS_ERROR();
+		l->busy_poll = 0;
+	}
 
+	sge_tls* tls = NULL;
+	if (SERVER.tls && l->tls && NULL == (tls = create_tls(SERVER.tls, clt))) {
+		close(clt);
+		return SGE_OK;
+	}
 	sge_socket* conn = create_conn(clt);
 	set_non_block(conn);
 	conn->on_read = on_conn_readable;
 	conn->on_write = on_conn_writeable;
+	conn->on_data = SERVER.cache || SERVER.flights ? sniff_request : forward_data;
+	if (SERVER.http2 || SERVER.websocket) {
+		conn->on_data = sniff_upgrade;
+	}
+	if (l->codec != CODEC_HTTP) {
+		conn->codec = create_codec(l->codec, SERVER.codec_max_size, on_frame, conn);
+		conn->on_data = receive_frames;
+	}
+	conn->tls = tls;
+	if (tls) {
+		conn->on_read = conn->on_write = on_tls_handshake;
+	}
+	if (SERVER.access) {
+		if (NULL == conn->access) {
+			conn->access = sge_malloc(sizeof(sge_access_record));
+		}
+		memset(conn->access, 0, sizeof(sge_access_record));
+		conn->access->family = sockaddr.ss_family;
+		if (sockaddr.ss_family == AF_INET) {
+			struct sockaddr_in* in = (struct sockaddr_in*)&sockaddr;
+			conn->access->port = ntohs(in->sin_port);
+			memcpy(conn->access->peer, &in->sin_addr, 4);
+		} else if (sockaddr.ss_family == AF_INET6) {
+			struct sockaddr_in6* in6 = (struct sockaddr_in6*)&sockaddr;
+			conn->access->port = ntohs(in6->sin6_port);
+			memcpy(conn->access->peer, &in6->sin6_addr, 16);
+		}
+	}
+	conn->capture = SERVER.capture ? capture_open(SERVER.capture) : 0;
 	add_socket(&SERVER, conn);
 	if (SERVER.event->add(SERVER.event, conn, EVT_READ) == SGE_ERR) {
 		_destroy_socket(conn);
 		return SGE_ERR;
 	}
-	sendto_worker(CMD_NEW_CONN, clt, NULL, (void*)&(conn->fd));
+	sendto_worker(CMD_NEW_CONN, clt, NULL, (void*)(intptr_t)l->codec);
+	metrics_add(METRIC_ACCEPTS, 1);
 	return SGE_OK;
 }
 
@@ -347,200 +816,1815 @@ int
 on_conn_readable(sge_socket* sock) {
 	int nread;
 	char buf[DEFAULT_READ_SIZE];
+	int first = sock->read_ns == 0;
 
-	nread = read(sock->fd, buf, DEFAULT_READ_SIZE);
+	stats_since(STAGE_REACTOR, SERVER.polled);
+	if (first) {
+		sock->read_ns = stats_now();
+	}
+	if (sock->tls) {
+		nread = tls_read(sock->tls, buf, DEFAULT_READ_SIZE);
+	} else {
+		nread = read(sock->fd, buf, DEFAULT_READ_SIZE);
+	}
+	TRACE2(read, sock->fd, nread);
 	if (nread < 0) {
+		if (errno == EINTR || errno == EAGAIN) {
+			return SGE_OK;
+		}
 		SYS_ERROR();
+		sendto_worker(CMD_CLOSE, sock->fd, NULL, NULL);
+		clear_socket_output(sock);
+		close_socket(sock);
 		return SGE_ERR;
 	}
 	if (nread == 0 && sock->status == SOCKET_AVAILABLE) {
+		if (sock->capture) {
+			capture_record(SERVER.capture, sock->capture, CAPTURE_CLOSE, NULL, 0);
+			sock->capture = 0;
+		}
 		on_read_done(sock);
 		return SGE_OK;
 	}
-	sge_buffer* b = create_buffer_ex(buf, nread);
-	sendto_worker(CMD_MESSAGE, sock->fd, destroy_buffer, (void*)b);
-	return SGE_OK;
+	metrics_add(METRIC_BYTES_IN, nread);
+	if (sock->capture) {
+		capture_record(SERVER.capture, sock->capture, CAPTURE_DATA, buf, nread);
+	}
+	if (sock->h2 || sock->ws || sock->codec || sock->on_data == sniff_upgrade) {
+		return sock->on_data(sock, buf, nread);
+	}
+	return receive_http(sock, buf, nread, first);
 }
 
+/*
+ * the handshake runs on whichever of read and write the socket waits
+ * for. once done the connection reads through the session and, unless
+ * the kernel took over the records, writes through it as well.
+ */
 int
-on_conn_writeable(sge_socket* sock) {
-	int nwrite;
-	size_t len;
+on_tls_handshake(sge_socket* sock) {
+	int ret = tls_handshake(sock->tls);
 
-	const char* str = buffer_data(sock->w_buf, &len);
-	nwrite = write_socket(sock, str, len);
-	if (nwrite == SGE_ERR) {
+	if (ret == TLS_WANT_WRITE && !(sock->events & EVT_WRITE)) {
+		SERVER.event->add(SERVER.event, sock, EVT_WRITE);
+	} else if (ret == TLS_WANT_READ && (sock->events & EVT_WRITE)) {
+		SERVER.event->remove(SERVER.event, sock, EVT_WRITE);
+	}
+	if (ret == TLS_WANT_READ || ret == TLS_WANT_WRITE) {
+		return SGE_OK;
+	}
+	if (ret == SGE_ERR) {
+		metrics_add(METRIC_TLS_FAILED, 1);
+		sendto_worker(CMD_CLOSE, sock->fd, NULL, NULL);
+		clear_socket_output(sock);
+		close_socket(sock);
 		return SGE_ERR;
 	}
-	erase_buffer(sock->w_buf, 0, nwrite);
-	if (len == nwrite) {
-		SERVER.event->remove(SERVER.event, sock, EVT_WRITE);
+
+	metrics_add(METRIC_TLS_HANDSHAKES, 1);
+	if (tls_offloaded(sock->tls)) {
+		metrics_add(METRIC_TLS_OFFLOADED, 1);
 	}
-	return SGE_OK;
+	if (!empty_socket_output(sock) && !(sock->events & EVT_WRITE)) {
+		SERVER.event->add(SERVER.event, sock, EVT_WRITE);
+	}
+	sock->on_read = on_tls_readable;
+	sock->on_write = on_conn_writeable;
+	if (tls_h2(sock->tls)) {
+		start_h2(sock);
+	}
+	// the first request may have come along with the client's Finished
+	return on_tls_readable(sock);
 }
 
+// a record holds more than one read, what is left does not wake epoll
 int
-on_read_done(sge_socket* sock) {
-	SERVER.event->remove(SERVER.event, sock, EVT_READ);
-	shutdown(sock->fd, SHUT_RD);
-	sock->status = SOCKET_HALFCLOSE;
-	return sendto_worker(CMD_READDONE, sock->fd, NULL, NULL);
+on_tls_readable(sge_socket* sock) {
+	int ret;
+
+	do {
+		ret = on_conn_readable(sock);
+	} while (ret == SGE_OK && sock->status == SOCKET_AVAILABLE && tls_pending(sock->tls));
+	return ret;
 }
 
+/*
+ * HTTP/1.x bytes from the client, `first` when nothing of the current
+ * request has been read before.
+ */
 int
-set_non_block(sge_socket* sock) {
-	int flags = 0;
-	flags = fcntl(sock->fd, F_GETFL);
-	flags |= O_NONBLOCK;
-	fcntl(sock->fd, F_SETFL, flags);
-	return SGE_OK;
+receive_http(sge_socket* sock, const char* data, size_t len, int first) {
+	if (sock->access) {
+		access_begin(sock, data, len);
+	}
+	// a sniffing connection sheds on a cache miss, see sniff_request()
+	if (SERVER.shedding && first && sock->on_data == forward_data) {
+		return shed_request(sock, data, len);
+	}
+	return sock->on_data(sock, data, len);
 }
 
 int
-add_socket(struct sge_server* server, sge_socket* sock) {
-	server->sock_num++;
-	server->socks[sock->fd] = sock;
+forward_data(sge_socket* sock, const char* data, size_t len) {
+	sge_buffer* b = create_buffer_ex(data, len);
+	sendto_worker(CMD_MESSAGE, sock->fd, destroy_buffer, (void*)b);
 	return SGE_OK;
 }
 
+/*
+ * buffer each request of a connection until its head is complete and
+ * answer it from the response cache if possible. a miss goes to the
+ * worker, see forward_sniffed(), and the requests after it are sniffed
+ * once its response is out.
+ */
 int
-write_socket_data(sge_socket* sock, sge_buffer* buf) {
-	int nwrite;
-	size_t len;
-	const char* str = buffer_data(buf, &len);
+sniff_request(sge_socket* sock, const char* data, size_t len) {
+	int ret;
+	size_t size;
+	const char* str;
+	sge_http_request req;
+
+	// the rest of the body of the request with the worker
+	if (sock->body_left > 0 && len > 0) {
+		size = len < sock->body_left ? len : sock->body_left;
+		forward_data(sock, data, size);
+		sock->body_left -= size;
+		data += size;
+		len -= size;
+	}
+	if (NULL == sock->r_buf) {
+		sock->r_buf = create_buffer(len);
+	}
+	sock->r_buf = append_buffer(sock->r_buf, data, len);
+	// parked or forwarded, what follows is looked at once its request is answered
+	if (sock->flight || sock->forwarded) {
+		return SGE_OK;
+	}
 
-	nwrite = write_socket(sock, str, len);
-	if (nwrite == SGE_ERR) {
-		return SGE_ERR;
+	while (1) {
+		str = buffer_data(sock->r_buf, &size);
+		if (size == 0) {
+			return SGE_OK;
+		}
+		ret = parse_http_request(str, size, &req);
+		if (ret == HTTP_AGAIN && size <= MAX_SNIFF_SIZE) {
+			return SGE_OK;
+		}
+		if (ret != SGE_OK || serve_cached(sock, &req) == SGE_ERR) {
+			break;
+		}
+		if (sock->status == SOCKET_CLOSED || end_sniffed(sock, &req) == SGE_ERR) {
+			return SGE_OK;
+		}
 	}
 
-	sock->w_buf = append_buffer(sock->w_buf, str + nwrite, len - nwrite);
-	SERVER.event->add(SERVER.event, sock, EVT_WRITE);
+	// parking costs the worker nothing, only a new leader is shed
+	if (ret == SGE_OK && SERVER.flights && sock->cache_key && !private_request(&req) && join_flight(sock, !SERVER.shedding)) {
+		return SGE_OK;
+	}
+	if (SERVER.shedding) {
+		return shed_request(sock, str, size);
+	}
+	forward_sniffed(sock);
 	return SGE_OK;
 }
 
+// the request at the start of r_buf was answered, SGE_ERR if that closed the connection
 int
-try_close_socket(sge_socket* sock) {
-	if (empty_buffer(sock->w_buf)) {
-		_destroy_socket(sock);
-		return SGE_OK;
+end_sniffed(sge_socket* sock, sge_http_request* req) {
+	erase_buffer(sock->r_buf, 0, req->head_len);
+	if (!http_keep_alive(req)) {
+		SERVER.event->remove(SERVER.event, sock, EVT_READ);
+		sock->status = SOCKET_HALFCLOSE;
+		sendto_worker(CMD_CLOSE, sock->fd, NULL, NULL);
+		reset_socket_input(sock);
+		close_socket(sock);
+		return SGE_ERR;
 	}
-	return SGE_ERR;
+	return SGE_OK;
 }
 
-int
-close_socket(sge_socket* sock) {
-	if (try_close_socket(sock) == SGE_OK) {
-		return SGE_OK;
+/*
+ * the request at the start of r_buf goes to the worker, with as much of
+ * its body as has been read. when the head does not parse or does not
+ * tell where the body ends, as for a chunked one, everything buffered
+ * goes instead and the connection is forwarded as is from then on.
+ */
+void
+forward_sniffed(sge_socket* sock) {
+	size_t size, body;
+	const char* str = buffer_data(sock->r_buf, &size);
+	sge_http_request req;
+
+	if (parse_http_request(str, size, &req) != SGE_OK || http_body_length(&req, &body) == SGE_ERR) {
+		sock->on_data = forward_data;
+		sendto_worker(CMD_MESSAGE, sock->fd, destroy_buffer, (void*)sock->r_buf);
+		sock->r_buf = NULL;
+		return;
 	}
-	list_add(DELAY_CLOSE_SOCKS, (void*)sock);
-	return SGE_OK;
+	sock->body_left = body > size - req.head_len ? body - (size - req.head_len) : 0;
+	size = req.head_len + body - sock->body_left;
+	sendto_worker(CMD_MESSAGE, sock->fd, destroy_buffer, create_buffer_ex(str, size));
+	erase_buffer(sock->r_buf, 0, size);
+	sock->forwarded = 1;
 }
 
+// CMD_RESPONSE_END, the worker answered the request forwarded last
 void
-_destroy_socket(sge_socket* sock) {
-	if (sock->status == SOCKET_CLOSED) {
+resume_sniffing(sge_socket* sock) {
+	if (!sock->forwarded) {
 		return;
 	}
-	SERVER.sock_num--;
-	if (sock->events) {
-		SERVER.event->remove(SERVER.event, sock, sock->events);
+	sock->forwarded = 0;
+	if (sock->status == SOCKET_AVAILABLE) {
+		sniff_request(sock, "", 0);
 	}
-	sock->status = SOCKET_CLOSED;
-	sock->on_write = sock->on_read = NULL;
-	close(sock->fd);
 }
 
-void*
-worker(void* arg) {
-	sge_message* msg;
-	cb_worker cb = arg;
-	while(SERVER.run) {
-		dequeue(SERVER.worker_queue, (void**)&msg);
-		if (msg == NULL) {
-			pthread_mutex_lock(&(SERVER.mutex));
-			pthread_cond_wait(&(SERVER.cond), &(SERVER.mutex));
-			pthread_mutex_unlock(&(SERVER.mutex));
+/*
+ * a request with credentials that are not part of the cache key may get
+ * a response meant for its user alone, it neither leads nor joins a flight.
+ */
+int
+private_request(const sge_http_request* req) {
+	static const char* credentials[] = {"Cookie", "Authorization"};
+	size_t i;
+	int j;
+
+	for (i = 0; i < sizeof(credentials) / sizeof(credentials[0]); ++i) {
+		if (NULL == http_header(req, credentials[i])) {
 			continue;
 		}
-		cb(msg);
-		if (msg->free) {
-			msg->free(msg->ud);
+		for (j = 0; j < SERVER.nvary; ++j) {
+			if (strcasecmp(SERVER.vary[j], credentials[i]) == 0) {
+				break;
+			}
+		}
+		if (j == SERVER.nvary) {
+			return 1;
 		}
-		sge_free(msg);
 	}
-	return NULL;
+	return 0;
 }
 
+/*
+ * cache key: method, path, query, Host and the configured vary headers.
+ * the key of a miss is kept on the socket until the worker answers.
+ */
 int
-start_worker(sge_config* config) {
-	pthread_t tid;
-	int ret = pthread_create(&tid, NULL, worker, config->cb);
-	if (ret < 0) {
-		SYS_ERROR();
+serve_cached(sge_socket* sock, sge_http_request* req) {
+	int i;
+	size_t len;
+	const char* key;
+	const sge_http_header* host;
+	sge_shared* hit;
+	sge_buffer* buf;
+
+	if (sock->cache_key) {
+		destroy_buffer(sock->cache_key);
+		sock->cache_key = NULL;
+	}
+	if (!http_token_equal(req->method, req->method_len, "GET") || http_has_body(req)) {
 		return SGE_ERR;
 	}
-	SERVER.tids[SERVER.worker_num++] = tid;
+
+	buf = create_buffer(req->path_len + req->query_len + 64);
+	buf = append_buffer(buf, req->path, req->path_len);
+	buf = append_buffer(buf, "?", 1);
+	buf = append_buffer(buf, req->query, req->query_len);
+	host = http_header(req, "Host");
+	buf = append_buffer(buf, "\n", 1);
+	if (host) {
+		buf = append_buffer(buf, host->value, host->value_len);
+	}
+	for (i = 0; i < SERVER.nvary; ++i) {
+		const sge_http_header* header = http_header(req, SERVER.vary[i]);
+		buf = append_buffer(buf, "\n", 1);
+		if (header) {
+			buf = append_buffer(buf, header->value, header->value_len);
+		}
+	}
+
+	// without a cache the key is only needed for single flight
+	if (NULL == SERVER.cache) {
+		sock->cache_key = buf;
+		return SGE_ERR;
+	}
+	key = buffer_data(buf, &len);
+	hit = cache_get(SERVER.cache, key, len, SERVER.now);
+	if (NULL == hit) {
+		metrics_add(METRIC_CACHE_MISSES, 1);
+		sock->cache_key = buf;
+		return SGE_ERR;
+	}
+	metrics_add(METRIC_CACHE_HITS, 1);
+	destroy_buffer(buf);
+	write_socket_data(sock, create_chunk_shared(hit));
 	return SGE_OK;
 }
 
 int
-sendto_worker(COMMAND_TYPE type, int id, void (*cb_free)(void*), void* data) {
-	sge_message* msg = sge_malloc(sizeof(*msg));
-	msg->id = id;
-	msg->free = cb_free;
-	msg->type = type;
-	msg->ud = data;
-	int size = enqueue(SERVER.worker_queue, (void*)msg);
-	if (size == 1) {
-		awake_worker();
+store_cache(sge_socket* sock, sge_cache_item* item) {
+	size_t len;
+	const char* key;
+
+	if (SERVER.cache && sock->cache_key && item->ttl > 0) {
+		key = buffer_data(sock->cache_key, &len);
+		cache_set(SERVER.cache, key, len, item->data, SERVER.now + item->ttl * 1000);
+	}
+	if (sock->cache_key) {
+		destroy_buffer(sock->cache_key);
+		sock->cache_key = NULL;
+	}
+	write_socket_data(sock, create_chunk_shared(item->data));
+	if (sock->flight) {
+		land_flight(sock, item->data);
 	}
 	return SGE_OK;
 }
 
-int
-awake_worker() {
-	pthread_mutex_lock(&(SERVER.mutex));
-	pthread_cond_broadcast(&(SERVER.cond));
-	pthread_mutex_unlock(&(SERVER.mutex));
-	return SGE_OK;
+static void
+destroy_flight(void* ud) {
+	sge_flight* flight = ud;
+	destroy_buffer(flight->key);
+	sge_free(flight);
 }
 
+/*
+ * 1 when parked behind an identical request, 0 when the worker is to
+ * run this one, as the leader of a new flight if `lead`.
+ */
 int
-wait_worker() {
-	void *result;
-	int i = 0;
-
-	awake_worker();
+join_flight(sge_socket* sock, int lead) {
+	size_t len;
+	const char* key = buffer_data(sock->cache_key, &len);
+	sge_flight* flight = hash_get(SERVER.flights, key, len);
 
-	for (; i < SERVER.worker_num; ++i) {
-		pthread_join(SERVER.tids[i], &result);
-		INFO("worker[%d] exit.", SERVER.tids[i]);
+	if (NULL == flight && !lead) {
+		return 0;
 	}
-	INFO("all worker exit.");
-	return SGE_OK;
+	if (NULL == flight) {
+		flight = sge_malloc(sizeof(*flight));
+		flight->key = create_buffer_ex(key, len);
+		flight->leader = sock;
+		flight->waiters = NULL;
+		hash_set(SERVER.flights, key, len, flight);
+		sock->flight = flight;
+		return 0;
+	}
+	sock->flight = flight;
+	sock->flight_next = flight->waiters;
+	flight->waiters = sock;
+	SERVER.parked++;
+	return 1;
 }
 
-int
-deal_request() {
-	sge_socket* s;
-	sge_message* msg;
-
-	dequeue(SERVER.server_queue, (void**)&msg);
-	if (msg == NULL) {
-		return SGE_OK;
+/*
+ * the leader's response is out. the waiters get the same shared buffer,
+ * or go to the worker themselves when there is none to share, that is
+ * when it was streamed or compressed for the leader's Accept-Encoding.
+ */
+void
+land_flight(sge_socket* leader, sge_shared* response) {
+	size_t len;
+	const char* str;
+	sge_http_request req;
+	sge_socket* sock, *next;
+	sge_flight* flight = leader->flight;
+
+	str = buffer_data(flight->key, &len);
+	hash_del(SERVER.flights, str, len);
+	leader->flight = NULL;
+	for (sock = flight->waiters; sock; sock = next) {
+		next = sock->flight_next;
+		sock->flight = NULL;
+		sock->flight_next = NULL;
+		SERVER.parked--;
+		if (NULL == response) {
+			forward_sniffed(sock);
+			continue;
+		}
+		metrics_add(METRIC_COALESCED, 1);
+		write_socket_data(sock, create_chunk_shared(response));
+		if (sock->status == SOCKET_CLOSED) {
+			continue;
+		}
+		// parsed once already, before it was parked
+		str = buffer_data(sock->r_buf, &len);
+		parse_http_request(str, len, &req);
+		if (end_sniffed(sock, &req) == SGE_OK) {
+			// the requests it pipelined behind
+			sniff_request(sock, "", 0);
+		}
 	}
+	destroy_flight(flight);
+}
 
-	while(msg) {
-		switch (msg->type) {
-			case CMD_MESSAGE:
-				CHECK_ARG(msg);
-				write_socket_data(s, (sge_buffer*)msg->ud);
+// out of its flight as the socket is destroyed, a gone leader is replaced by a waiter
+void
+leave_flight(sge_socket* sock) {
+	size_t len;
+	const char* key;
+	sge_socket** p;
+	sge_flight* flight = sock->flight;
+
+	sock->flight = NULL;
+	if (flight->leader != sock) {
+		for (p = &flight->waiters; *p; p = &(*p)->flight_next) {
+			if (*p == sock) {
+				*p = sock->flight_next;
+				SERVER.parked--;
+				break;
+			}
+		}
+		sock->flight_next = NULL;
+		return;
+	}
+	if (NULL == flight->waiters) {
+		key = buffer_data(flight->key, &len);
+		hash_del(SERVER.flights, key, len);
+		destroy_flight(flight);
+		return;
+	}
+	flight->leader = flight->waiters;
+	flight->waiters = flight->leader->flight_next;
+	flight->leader->flight_next = NULL;
+	SERVER.parked--;
+	forward_sniffed(flight->leader);
+}
+
+static void
+oldest_message(void* data, void* ud) {
+	*(uint64_t*)ud = ((sge_message*)data)->ts;
+}
+
+/*
+ * CoDel on the worker queue, checked once per loop: the age of the
+ * oldest message is the least delay a new request would see. once it
+ * has stayed above the target for a whole interval, new requests are
+ * shed until it is below the target again, which shedding brings about
+ * by letting the queue drain. like CoDel's drop state, shedding that
+ * ended less than an interval ago resumes as soon as the target is
+ * crossed, or the connections let in at once would refill the queue.
+ */
+void
+check_overload(uint64_t now) {
+	uint64_t oldest = 0;
+	int recent;
+
+	queue_peek(SERVER.worker_queue, oldest_message, &oldest);
+	if (oldest == 0 || now < oldest + SERVER.overload_target) {
+		if (SERVER.shedding) {
+			SERVER.shed_end = now;
+		}
+		SERVER.overload_since = 0;
+		SERVER.shedding = 0;
+		return;
+	}
+	if (SERVER.overload_since == 0) {
+		SERVER.overload_since = now;
+	}
+	if (SERVER.shedding) {
+		return;
+	}
+	recent = SERVER.shed_end && now < SERVER.shed_end + SERVER.overload_interval;
+	if (!recent && now >= SERVER.overload_since + SERVER.overload_interval) {
+		WARNING("worker queue delay over %lums for %lums, shedding new requests.",
+			(unsigned long)(SERVER.overload_target / 1000000),
+			(unsigned long)(SERVER.overload_interval / 1000000));
+	} else if (!recent) {
+		return;
+	}
+	SERVER.shedding = 1;
+}
+
+/*
+ * answer a new request with a static 503 and never queue it. when the
+ * read holds exactly one request without a body the connection is kept,
+ * otherwise it is closed: the rest of the request is never read, and
+ * dropping the connection costs the worker one message.
+ */
+int
+shed_request(sge_socket* sock, const char* data, size_t len) {
+	sge_http_request req;
+	int keep = parse_http_request(data, len, &req) == SGE_OK && req.head_len == len
+		&& !http_has_body(&req) && http_keep_alive(&req);
+
+	metrics_add(METRIC_SHED, 1);
+	reset_socket_input(sock);
+	if (keep) {
+		return write_socket_data(sock, create_chunk(SHED_RESPONSE, sizeof(SHED_RESPONSE) - 1, NULL, NULL));
+	}
+	SERVER.event->remove(SERVER.event, sock, EVT_READ);
+	sock->status = SOCKET_HALFCLOSE;
+	sendto_worker(CMD_CLOSE, sock->fd, NULL, NULL);
+	write_socket_data(sock, create_chunk(SHED_CLOSE_RESPONSE, sizeof(SHED_CLOSE_RESPONSE) - 1, NULL, NULL));
+	return close_socket(sock);
+}
+
+/*
+ * an access record covers the same span as the total stage: from the
+ * first read after the output was drained to the output drained again.
+ * method and path come from the first read, the status from the first
+ * output chunk.
+ */
+void
+access_begin(sge_socket* sock, const char* data, size_t len) {
+	struct timespec ts;
+	sge_access_record* r = sock->access;
+	const char* sp, *end = data + len;
+
+	r->bytes_in += len;
+	if (r->time) {
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->time = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	r->bytes_in = len;
+	r->bytes_out = 0;
+	r->status = 0;
+	r->path_len = 0;
+	memset(r->method, 0, ACCESS_METHOD_SIZE);
+	sp = memchr(data, ' ', len < ACCESS_METHOD_SIZE ? len : ACCESS_METHOD_SIZE);
+	if (NULL == sp) {
+		return;
+	}
+	memcpy(r->method, data, sp - data);
+	data = sp + 1;
+	sp = memchr(data, ' ', end - data);
+	len = (sp ? sp : end) - data;
+	r->path_len = len < ACCESS_PATH_SIZE ? len : ACCESS_PATH_SIZE;
+	memcpy(r->path, data, r->path_len);
+}
+
+void
+access_status(sge_socket* sock, sge_chunk* chunk) {
+	const char* p = chunk->data + chunk->offset;
+	size_t len = chunk->len - chunk->offset;
+
+	if (len >= 12 && memcmp(p, "HTTP/", 5) == 0 && p[8] == ' ') {
+		sock->access->status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+	}
+}
+
+void
+access_end(sge_socket* sock) {
+	sge_access_record* r = sock->access;
+	uint64_t now = stats_now();
+	// cache hits are written straight from the read, without a write_ns
+	uint64_t write_ns = sock->write_ns ? sock->write_ns : now;
+
+	if (sock->read_ns && now) {
+		r->wait_ns = write_ns - sock->read_ns;
+		r->write_ns = now - write_ns;
+		r->total_ns = now - sock->read_ns;
+		access_log_write(SERVER.access, r);
+	}
+	r->time = 0;
+}
+
+/*
+ * with http2 or websocket on, the first bytes of a connection decide
+ * its protocol: the h2c preface starts a session at once, an HTTP/1.1
+ * request with "Upgrade: websocket" or "Upgrade: h2c" switches after
+ * its head, anything else is HTTP/1.x.
+ */
+int
+sniff_upgrade(sge_socket* sock, const char* data, size_t len) {
+	int ret;
+	size_t size;
+	const char* str;
+	sge_buffer* buf;
+	sge_http_request req;
+
+	if (NULL == sock->r_buf) {
+		sock->r_buf = create_buffer(len);
+	}
+	sock->r_buf = append_buffer(sock->r_buf, data, len);
+	str = buffer_data(sock->r_buf, &size);
+	if (SERVER.http2 && memcmp(str, H2_PREFACE, size < H2_PREFACE_LEN ? size : H2_PREFACE_LEN) == 0) {
+		if (size < H2_PREFACE_LEN) {
+			return SGE_OK;
+		}
+		start_h2(sock);
+	} else {
+		ret = parse_http_request(str, size, &req);
+		if (ret == HTTP_AGAIN && size <= MAX_SNIFF_SIZE) {
+			return SGE_OK;
+		}
+		if (ret == SGE_OK && (upgrade_ws(sock, &req) == SGE_OK || upgrade_h2(sock, &req) == SGE_OK)) {
+			str += req.head_len;
+			size -= req.head_len;
+		} else {
+			sock->on_data = SERVER.cache || SERVER.flights ? sniff_request : forward_data;
+		}
+	}
+
+	buf = sock->r_buf;
+	sock->r_buf = NULL;
+	if (sock->h2) {
+		ret = receive_h2(sock, str, size);
+	} else if (sock->ws) {
+		ret = receive_ws(sock, str, size);
+	} else {
+		ret = receive_http(sock, str, size, 1);
+	}
+	destroy_buffer(buf);
+	return ret;
+}
+
+/*
+ * the request that asked for the upgrade becomes stream 1. one with a
+ * body would have to be read as HTTP/1.1 first, so it stays HTTP/1.1.
+ */
+int
+upgrade_h2(sge_socket* sock, sge_http_request* req) {
+	static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+	const sge_http_header* upgrade = http_header(req, "Upgrade");
+	const sge_http_header* settings = http_header(req, "HTTP2-Settings");
+	sge_buffer* request;
+	size_t size;
+
+	if (!SERVER.http2 || NULL == upgrade || NULL == settings || http_has_body(req)
+		|| !http_token_equal(upgrade->value, upgrade->value_len, "h2c")) {
+		return SGE_ERR;
+	}
+	request = create_buffer_ex(buffer_data(sock->r_buf, &size), req->head_len);
+	start_h2(sock);
+	if (h2_upgrade(sock->h2, settings->value, settings->value_len, request) == SGE_ERR) {
+		destroy_buffer(request);
+		destroy_h2(sock->h2);
+		sock->h2 = NULL;
+		return SGE_ERR;
+	}
+	return write_socket_data(sock, create_chunk(switching, sizeof(switching) - 1, NULL, NULL));
+}
+
+/*
+ * frames of many streams interleave on the connection, so one small
+ * frame must not sit behind Nagle waiting for the ack of another.
+ * fails quietly on a unix socket.
+ */
+void
+start_h2(sge_socket* sock) {
+	int on = 1;
+
+	setsockopt(sock->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	sock->h2 = create_h2(&H2_CALLBACKS, sock);
+	sock->on_data = receive_h2;
+}
+
+int
+receive_h2(sge_socket* sock, const char* data, size_t len) {
+	int ret = h2_feed(sock->h2, data, len);
+
+	flush_h2(sock);
+	if (ret == SGE_ERR) {
+		// the GOAWAY saying why is on its way
+		hang_up(sock);
+	}
+	return SGE_OK;
+}
+
+/*
+ * the protocol ended the connection: the worker lets go of it and the
+ * socket closes once its last frames are out.
+ */
+void
+hang_up(sge_socket* sock) {
+	if (sock->status != SOCKET_AVAILABLE) {
+		return;
+	}
+	SERVER.event->remove(SERVER.event, sock, EVT_READ);
+	sock->status = SOCKET_HALFCLOSE;
+	sendto_worker(CMD_CLOSE, sock->fd, NULL, NULL);
+	close_socket(sock);
+}
+
+void
+flush_h2(sge_socket* sock) {
+	sge_buffer* out;
+
+	if (NULL == sock->h2) {
+		return;
+	}
+	out = h2_output(sock->h2);
+	if (out) {
+		write_socket_data(sock, create_chunk_buffer(out));
+	}
+}
+
+/*
+ * frames for one connection are written once deal_request() moves on
+ * to another connection or runs out of messages, so a response's
+ * HEADERS and DATA leave in one write instead of waiting on Nagle.
+ */
+void
+defer_h2(sge_socket* sock) {
+	if (SERVER.h2_pending && SERVER.h2_pending != sock) {
+		flush_h2(SERVER.h2_pending);
+	}
+	SERVER.h2_pending = sock;
+}
+
+/*
+ * a stream reaches the worker like a connection of its own that
+ * carries a single request, under an id past the fds.
+ */
+int
+on_h2_request(void* ud, uint32_t stream, sge_buffer* request) {
+	int id;
+
+	if (SERVER.shedding) {
+		metrics_add(METRIC_SHED, 1);
+		destroy_buffer(request);
+		return H2_UNAVAILABLE;
+	}
+	id = open_stream(ud, stream);
+	if (id == SGE_ERR) {
+		destroy_buffer(request);
+		return H2_REFUSED;
+	}
+	sendto_worker(CMD_NEW_CONN, id, NULL, NULL);
+	sendto_worker(CMD_MESSAGE, id, destroy_buffer, request);
+	return id;
+}
+
+void
+on_h2_reset(void* ud, int id) {
+	close_stream(id);
+	sendto_worker(CMD_CLOSE, id, NULL, NULL);
+}
+
+/*
+ * ids are handed out round robin, so one is reused as late as possible
+ * and a message still on its way for a reset stream is unlikely to
+ * find a new stream under the same id.
+ */
+int
+open_stream(sge_socket* sock, uint32_t stream) {
+	uint32_t i, slot;
+
+	for (i = 0; i < MAX_STREAM_NUM; ++i) {
+		slot = (SERVER.stream_next + i) % MAX_STREAM_NUM;
+		if (NULL == SERVER.streams[slot].sock) {
+			SERVER.streams[slot].sock = sock;
+			SERVER.streams[slot].stream = stream;
+			SERVER.stream_next = slot + 1;
+			SERVER.stream_num++;
+			return MAX_SOCK_NUM + slot;
+		}
+	}
+	return SGE_ERR;
+}
+
+void
+close_stream(int id) {
+	sge_stream_slot* slot = &(SERVER.streams[id - MAX_SOCK_NUM]);
+
+	if (slot->sock) {
+		slot->sock = NULL;
+		SERVER.stream_num--;
+	}
+}
+
+sge_socket*
+stream_socket(int id, uint32_t* stream) {
+	sge_stream_slot* slot;
+
+	if (id >= MAX_CONN_ID) {
+		ERROR("invalid stream id: %d", id);
+		return NULL;
+	}
+	slot = &(SERVER.streams[id - MAX_SOCK_NUM]);
+	*stream = slot->stream;
+	return slot->sock;
+}
+
+int
+write_stream_data(int id, const char* data, size_t len) {
+	uint32_t stream;
+	sge_socket* sock = stream_socket(id, &stream);
+
+	if (NULL == sock) {
+		return SGE_ERR;
+	}
+	h2_respond(sock->h2, stream, data, len);
+	defer_h2(sock);
+	return SGE_OK;
+}
+
+int
+finish_stream(int id) {
+	uint32_t stream;
+	sge_socket* sock = stream_socket(id, &stream);
+
+	if (NULL == sock) {
+		return SGE_ERR;
+	}
+	close_stream(id);
+	h2_finish(sock->h2, stream);
+	defer_h2(sock);
+	return SGE_OK;
+}
+
+/*
+ * the handshake is answered here, the worker gets the request head to
+ * pick a handler by path. asking it first would cost a round trip per
+ * upgrade, so a websocket nobody handles is accepted and then closed.
+ */
+int
+upgrade_ws(sge_socket* sock, sge_http_request* req) {
+	static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
+	const sge_http_header* upgrade = http_header(req, "Upgrade");
+	const sge_http_header* connection = http_header(req, "Connection");
+	const sge_http_header* key = http_header(req, "Sec-WebSocket-Key");
+	const sge_http_header* version = http_header(req, "Sec-WebSocket-Version");
+	char accept[WS_ACCEPT_LEN];
+	sge_buffer* buf;
+	size_t size;
+
+	// a handshake the server won't take is the worker's to answer, or shed
+	if (!SERVER.websocket || SERVER.shedding
+		|| NULL == upgrade || NULL == connection || NULL == key || NULL == version
+		|| !http_token_equal(req->method, req->method_len, "GET") || http_has_body(req)
+		|| !http_has_token(upgrade->value, upgrade->value_len, "websocket")
+		|| !http_has_token(connection->value, connection->value_len, "upgrade")
+		|| !http_token_equal(version->value, version->value_len, "13")
+		|| key->value_len != 24) {
+		return SGE_ERR;
+	}
+	ws_accept_key(key->value, key->value_len, accept);
+	buf = create_buffer_ex(switching, sizeof(switching) - 1);
+	buf = append_buffer(buf, accept, WS_ACCEPT_LEN);
+	buf = append_buffer(buf, "\r\n\r\n", 4);
+
+	sock->ws = create_ws(SERVER.ws_max_size, on_ws_message, sock);
+	sock->on_data = receive_ws;
+	SERVER.ws_num++;
+	sendto_worker(CMD_WS_OPEN, sock->fd, destroy_buffer, create_buffer_ex(buffer_data(sock->r_buf, &size), req->head_len));
+	return write_socket_data(sock, create_chunk_buffer(buf));
+}
+
+int
+receive_ws(sge_socket* sock, const char* data, size_t len) {
+	int ret = ws_feed(sock->ws, data, len);
+
+	flush_ws(sock);
+	if (ret == SGE_ERR) {
+		// answered a close, or sent one saying what was wrong
+		hang_up(sock);
+	}
+	return SGE_OK;
+}
+
+void
+flush_ws(sge_socket* sock) {
+	sge_buffer* out;
+
+	if (NULL == sock->ws) {
+		return;
+	}
+	out = ws_output(sock->ws);
+	if (out) {
+		write_socket_data(sock, create_chunk_buffer(out));
+	}
+}
+
+void
+on_ws_message(void* ud, int opcode, sge_buffer* message) {
+	sge_socket* sock = ud;
+	sendto_worker(opcode == WS_TEXT ? CMD_WS_TEXT : CMD_WS_BINARY, sock->fd, destroy_buffer, message);
+}
+
+// the worker's payload goes out as is, behind a frame head
+int
+write_ws_frame(sge_socket* sock, int opcode, sge_chunk* chunk) {
+	size_t len = chunk->len - chunk->offset;
+
+	if (NULL == sock->ws || ws_frame_head(sock->ws, opcode, len) == SGE_ERR) {
+		destroy_chunk(chunk);
+		return SGE_ERR;
+	}
+	flush_ws(sock);
+	if (len == 0) {
+		destroy_chunk(chunk);
+		return SGE_OK;
+	}
+	return write_socket_data(sock, chunk);
+}
+
+/*
+ * every websocket_ping seconds each websocket gets a ping; one that
+ * sent nothing since the last, not even the pong, is dropped.
+ */
+void
+check_ws_ping() {
+	int i;
+	sge_socket* sock;
+
+	if (SERVER.now < SERVER.ws_ping_next) {
+		return;
+	}
+	SERVER.ws_ping_next = SERVER.now + SERVER.ws_ping;
+	for (i = 0; i < MAX_SOCK_NUM; ++i) {
+		sock = SERVER.socks[i];
+		if (NULL == sock || NULL == sock->ws || sock->status != SOCKET_AVAILABLE) {
+			continue;
+		}
+		if (ws_ping(sock->ws) == SGE_ERR) {
+			clear_socket_output(sock);
+			hang_up(sock);
+		} else {
+			flush_ws(sock);
+		}
+	}
+}
+
+// websockets never finish on their own, a drain would wait them out
+void
+close_websockets(uint16_t code) {
+	int i;
+	sge_socket* sock;
+
+	for (i = 0; i < MAX_SOCK_NUM; ++i) {
+		sock = SERVER.socks[i];
+		if (sock && sock->ws && sock->status == SOCKET_AVAILABLE) {
+			ws_close(sock->ws, code);
+			flush_ws(sock);
+			hang_up(sock);
+		}
+	}
+}
+
+void
+subscribe(int fd, sge_buffer* channel, int on) {
+	size_t len;
+	const char* name = buffer_data(channel, &len);
+
+	if (on) {
+		pubsub_subscribe(SERVER.pubsub, name, len, fd);
+	} else {
+		pubsub_unsubscribe(SERVER.pubsub, name, len, fd);
+	}
+}
+
+/*
+ * the message was copied once by the worker, each subscriber gets a
+ * reference to it queued; websockets get a frame head in front.
+ */
+void
+publish(sge_publish_item* item) {
+	size_t len, n;
+	const char* name = buffer_data(item->channel, &len);
+
+	n = pubsub_foreach(SERVER.pubsub, name, len, deliver, item);
+	metrics_add(METRIC_PUBLISHED, 1);
+	metrics_add(METRIC_DELIVERED, n);
+}
+
+void
+deliver(int fd, void* ud) {
+	size_t len;
+	sge_publish_item* item = ud;
+	sge_socket* sock = SERVER.socks[fd];
+
+	if (NULL == sock || sock->status != SOCKET_AVAILABLE) {
+		return;
+	}
+	if (sock->ws) {
+		write_ws_frame(sock, item->text ? WS_TEXT : WS_BINARY, create_chunk_shared(item->data));
+		return;
+	}
+	shared_data(item->data, &len);
+	if (len > 0) {
+		write_socket_data(sock, create_chunk_shared(item->data));
+	}
+}
+
+/*
+ * an empty placeholder keeps the response's place in the output while a
+ * compression thread encodes it, whatever the worker sends after it
+ * queues up behind.
+ */
+int
+start_compress(sge_socket* sock, sge_compress_job* job) {
+	sge_chunk* chunk;
+
+	if (sock->status == SOCKET_CLOSED) {
+		destroy_compress_job(job);
+		return SGE_ERR;
+	}
+	chunk = create_chunk(NULL, 0, cancel_compress, job);
+	job->ud = chunk;
+	write_socket_data(sock, chunk);
+	return compress_submit(SERVER.compressor, job);
+}
+
+// the socket dropped the placeholder, the job is freed when it is done
+void
+cancel_compress(void* ud) {
+	sge_compress_job* job = ud;
+	job->ud = NULL;
+}
+
+// on a compression thread
+void
+on_compressed(sge_compress_job* job, void* ud) {
+	sendto_server(CMD_COMPRESSED, job->id, destroy_compress_job, job);
+}
+
+void
+finish_compress(sge_compress_job* job) {
+	size_t len;
+	sge_chunk* chunk = job->ud, *body;
+	sge_socket* sock = SERVER.socks[job->id];
+
+	if (NULL == chunk) {
+		return;
+	}
+	// the placeholder becomes the head, the body goes right behind it
+	chunk->data = buffer_data(job->head, &len);
+	chunk->len = len;
+	chunk->release = destroy_buffer;
+	chunk->ud = job->head;
+	job->head = NULL;
+	body = create_chunk_shared(job->body);
+	body->next = chunk->next;
+	chunk->next = body;
+	if (sock->w_tail == chunk) {
+		sock->w_tail = body;
+	}
+	if (sock->access && sock->access->time && !sock->access->status) {
+		access_status(sock, chunk);
+	}
+	if (!(sock->events & EVT_WRITE)) {
+		flush_socket(sock);
+	}
+}
+
+// frames too big for codec_max_size drop the connection
+int
+receive_frames(sge_socket* sock, const char* data, size_t len) {
+	if (codec_feed(sock->codec, data, len) == SGE_ERR) {
+		WARNING("frame over %zu bytes from connection %d", SERVER.codec_max_size, sock->fd);
+		hang_up(sock);
+	}
+	return SGE_OK;
+}
+
+void
+on_frame(void* ud, sge_buffer* frame) {
+	sge_socket* sock = ud;
+
+	metrics_add(METRIC_FRAMES_IN, 1);
+	sendto_worker(CMD_FRAME, sock->fd, destroy_buffer, frame);
+}
+
+// the worker's payload goes out as is, between the codec's prefix and line ending
+int
+write_frame(sge_socket* sock, sge_chunk* chunk) {
+	int n;
+	const char* tail;
+	char head[CODEC_MAX_HEAD];
+	size_t tail_len, len = chunk->len - chunk->offset;
+
+	if (sock->status == SOCKET_CLOSED || NULL == sock->codec
+		|| (n = codec_frame_head(sock->codec, len, head)) == SGE_ERR) {
+		destroy_chunk(chunk);
+		return SGE_ERR;
+	}
+	metrics_add(METRIC_FRAMES_OUT, 1);
+	if (n > 0) {
+		append_socket_output(sock, create_chunk_buffer(create_buffer_ex(head, n)));
+	}
+	if (len > 0) {
+		append_socket_output(sock, chunk);
+	} else {
+		destroy_chunk(chunk);
+	}
+	tail = codec_frame_tail(sock->codec, &tail_len);
+	if (tail_len > 0) {
+		append_socket_output(sock, create_chunk(tail, tail_len, NULL, NULL));
+	}
+	if (sock->events & EVT_WRITE) {
+		return SGE_OK;
+	}
+	return flush_socket(sock);
+}
+
+/*
+ * CMD_CONNECT: a pooled connection to `addr` if there is one, else a
+ * new one. the worker hears back with CMD_CONNECT, carrying an errno
+ * when it failed. addresses are "host:port" with a numeric host, or a
+ * unix socket path, so nothing blocks the reactor on a resolver.
+ */
+void
+open_upstream(int handle, sge_buffer* addr) {
+	int fd;
+	size_t len;
+	sge_socket* sock;
+	const char* s = buffer_data(addr, &len);
+
+	sock = checkout_upstream(s, len);
+	if (sock) {
+		destroy_buffer(addr);
+		metrics_add(METRIC_UPSTREAM_REUSED, 1);
+		sock->upstream->handle = handle;
+		SERVER.upstreams[UPSTREAM_SLOT(handle)] = sock;
+		sendto_worker(CMD_CONNECT, handle, NULL, NULL);
+		return;
+	}
+	fd = connect_upstream(s, len);
+	if (fd >= 0 && (fd >= MAX_SOCK_NUM || SERVER.sock_num >= MAX_SOCK_NUM)) {
+		close(fd);
+		fd = -1;
+		errno = EMFILE;
+	}
+	if (fd < 0) {
+		destroy_buffer(addr);
+		metrics_add(METRIC_UPSTREAM_FAILED, 1);
+		sendto_worker(CMD_CONNECT, handle, NULL, (void*)(intptr_t)errno);
+		return;
+	}
+	metrics_add(METRIC_UPSTREAM_CONNECTS, 1);
+	sock = create_conn(fd);
+	sock->upstream = sge_malloc(sizeof(sge_upstream));
+	sock->upstream->handle = handle;
+	sock->upstream->connecting = 1;
+	sock->upstream->addr = addr;
+	// 0 waits as long as the kernel does
+	sock->upstream->deadline = SERVER.connect_timeout ? SERVER.now + SERVER.connect_timeout : 0;
+	sock->upstream->next = NULL;
+	sock->on_read = sock->on_write = on_upstream_connected;
+	add_socket(&SERVER, sock);
+	SERVER.upstreams[UPSTREAM_SLOT(handle)] = sock;
+	SERVER.upstream_num++;
+	if (SERVER.event->add(SERVER.event, sock, EVT_WRITE) == SGE_ERR) {
+		fail_upstream(sock, errno);
+	}
+}
+
+// a non-blocking connect in flight, or done already for most unix sockets
+int
+connect_upstream(const char* addr, size_t len) {
+	int fd, ret;
+	char host[128], *port;
+	struct sockaddr_un un;
+	struct addrinfo hints, *result;
+
+	if (memchr(addr, ':', len)) {
+		if (len >= sizeof(host)) {
+			errno = ENAMETOOLONG;
+			return SGE_ERR;
+		}
+		memcpy(host, addr, len);
+		host[len] = '\0';
+		port = strrchr(host, ':');
+		*port++ = '\0';
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+		if (getaddrinfo(host, port, &hints, &result) != 0) {
+			errno = EINVAL;
+			return SGE_ERR;
+		}
+		fd = socket(result->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		ret = fd < 0 ? -1 : connect(fd, result->ai_addr, result->ai_addrlen);
+		freeaddrinfo(result);
+		if (fd >= 0) {
+			int on = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		}
+	} else {
+		if (len >= sizeof(un.sun_path)) {
+			errno = ENAMETOOLONG;
+			return SGE_ERR;
+		}
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		memcpy(un.sun_path, addr, len);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		ret = fd < 0 ? -1 : connect(fd, (struct sockaddr*)&un, sizeof(un));
+	}
+	if (fd < 0) {
+		return SGE_ERR;
+	}
+	if (ret < 0 && errno != EINPROGRESS) {
+		ret = errno;
+		close(fd);
+		errno = ret;
+		return SGE_ERR;
+	}
+	return fd;
+}
+
+int
+on_upstream_connected(sge_socket* sock) {
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(sock->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+		err = errno;
+	}
+	if (err) {
+		metrics_add(METRIC_UPSTREAM_FAILED, 1);
+		fail_upstream(sock, err);
+		return SGE_OK;
+	}
+	sock->upstream->connecting = 0;
+	sock->upstream->deadline = 0;
+	sock->on_read = on_upstream_readable;
+	sock->on_write = on_conn_writeable;
+	SERVER.event->remove(SERVER.event, sock, EVT_WRITE);
+	SERVER.event->add(SERVER.event, sock, EVT_READ);
+	sendto_worker(CMD_CONNECT, sock->upstream->handle, NULL, NULL);
+	if (!empty_socket_output(sock)) {
+		flush_socket(sock);
+	}
+	return SGE_OK;
+}
+
+// an idle connection that reads anything, even its end, is done with
+int
+on_upstream_readable(sge_socket* sock) {
+	int nread;
+	char buf[UPSTREAM_READ_SIZE];
+
+	nread = read(sock->fd, buf, sizeof(buf));
+	if (nread < 0) {
+		if (errno == EINTR || errno == EAGAIN) {
+			return SGE_OK;
+		}
+		fail_upstream(sock, errno);
+		return SGE_ERR;
+	}
+	if (nread == 0 || sock->upstream->handle == UPSTREAM_IDLE) {
+		fail_upstream(sock, 0);
+		return SGE_OK;
+	}
+	sendto_worker(CMD_UPSTREAM_DATA, sock->upstream->handle, destroy_buffer, create_buffer_ex(buf, nread));
+	return SGE_OK;
+}
+
+// CMD_CONNECT or CMD_UPSTREAM_CLOSE tell the worker, err 0 is the peer's close
+void
+fail_upstream(sge_socket* sock, int err) {
+	int handle = sock->upstream->handle;
+
+	if (handle != UPSTREAM_IDLE) {
+		sendto_worker(sock->upstream->connecting ? CMD_CONNECT : CMD_UPSTREAM_CLOSE, handle, NULL, (void*)(intptr_t)err);
+	}
+	clear_socket_output(sock);
+	_destroy_socket(sock);
+}
+
+// NULL once the connection closed or its handle was released
+sge_socket*
+upstream_socket(int handle) {
+	sge_socket* sock = SERVER.upstreams[UPSTREAM_SLOT(handle)];
+
+	if (NULL == sock || NULL == sock->upstream || sock->upstream->handle != handle) {
+		return NULL;
+	}
+	return sock;
+}
+
+// data for a connection the peer closed meanwhile is dropped, the worker hears of the close
+void
+send_upstream(int handle, sge_chunk* chunk) {
+	sge_socket* sock = upstream_socket(handle);
+
+	if (NULL == sock || chunk->len == chunk->offset) {
+		destroy_chunk(chunk);
+		return;
+	}
+	if (sock->upstream->connecting) {
+		append_socket_output(sock, chunk);
+		return;
+	}
+	write_socket_data(sock, chunk);
+}
+
+/*
+ * CMD_UPSTREAM_CLOSE from the worker. `keep` puts the connection back
+ * in its pool, unless it still has output, the pool is full or the
+ * server is draining.
+ */
+void
+release_upstream(int handle, int keep) {
+	size_t len;
+	const char* addr;
+	sge_upstream_pool* pool;
+	sge_socket* sock = upstream_socket(handle);
+
+	if (NULL == sock) {
+		return;
+	}
+	SERVER.upstreams[UPSTREAM_SLOT(handle)] = NULL;
+	sock->upstream->handle = UPSTREAM_IDLE;
+	if (keep && !sock->upstream->connecting && sock->status == SOCKET_AVAILABLE
+		&& empty_socket_output(sock) && !SERVER.draining && SERVER.pool_size > 0) {
+		addr = buffer_data(sock->upstream->addr, &len);
+		pool = hash_get(SERVER.pools, addr, len);
+		if (NULL == pool) {
+			pool = sge_malloc(sizeof(*pool));
+			pool->idle = NULL;
+			pool->count = 0;
+			hash_set(SERVER.pools, addr, len, pool);
+		}
+		if (pool->count < SERVER.pool_size) {
+			sock->upstream->next = pool->idle;
+			sock->upstream->deadline = SERVER.now + SERVER.idle_timeout;
+			pool->idle = sock;
+			pool->count++;
+			SERVER.upstream_idle++;
+			return;
+		}
+	}
+	if (!empty_socket_output(sock)) {
+		flush_socket(sock);
+	}
+	clear_socket_output(sock);
+	_destroy_socket(sock);
+}
+
+sge_socket*
+checkout_upstream(const char* addr, size_t len) {
+	sge_socket* sock;
+	sge_upstream_pool* pool = hash_get(SERVER.pools, addr, len);
+
+	if (NULL == pool || NULL == pool->idle) {
+		return NULL;
+	}
+	sock = pool->idle;
+	pool->idle = sock->upstream->next;
+	pool->count--;
+	SERVER.upstream_idle--;
+	sock->upstream->next = NULL;
+	sock->upstream->deadline = 0;
+	return sock;
+}
+
+// out of the pool or the handle table, called as the socket is destroyed
+void
+forget_upstream(sge_socket* sock) {
+	size_t len;
+	const char* addr;
+	sge_socket** p;
+	sge_upstream_pool* pool;
+	sge_upstream* up = sock->upstream;
+
+	if (up->handle != UPSTREAM_IDLE) {
+		if (SERVER.upstreams[UPSTREAM_SLOT(up->handle)] == sock) {
+			SERVER.upstreams[UPSTREAM_SLOT(up->handle)] = NULL;
+		}
+	} else if (SERVER.pools) {
+		addr = buffer_data(up->addr, &len);
+		pool = hash_get(SERVER.pools, addr, len);
+		for (p = pool ? &pool->idle : NULL; p && *p; p = &(*p)->upstream->next) {
+			if (*p == sock) {
+				*p = up->next;
+				pool->count--;
+				SERVER.upstream_idle--;
+				break;
+			}
+		}
+	}
+	SERVER.upstream_num--;
+	destroy_buffer(up->addr);
+	sge_free(up);
+	sock->upstream = NULL;
+}
+
+// connects past upstream_connect_timeout fail, idle ones past upstream_idle_timeout close
+void
+check_upstreams() {
+	int i;
+	sge_socket* sock;
+
+	if (SERVER.upstream_num == 0 || SERVER.now < SERVER.upstream_check_next) {
+		return;
+	}
+	SERVER.upstream_check_next = SERVER.now + 100;
+	for (i = 0; i < MAX_SOCK_NUM; ++i) {
+		sock = SERVER.socks[i];
+		if (NULL == sock || NULL == sock->upstream || sock->status == SOCKET_CLOSED
+			|| 0 == sock->upstream->deadline || SERVER.now < sock->upstream->deadline) {
+			continue;
+		}
+		if (sock->upstream->connecting) {
+			metrics_add(METRIC_UPSTREAM_FAILED, 1);
+		}
+		fail_upstream(sock, ETIMEDOUT);
+	}
+}
+
+void
+close_idle_upstreams() {
+	int i;
+	sge_socket* sock;
+
+	for (i = 0; i < MAX_SOCK_NUM && SERVER.upstream_idle > 0; ++i) {
+		sock = SERVER.socks[i];
+		if (sock && sock->upstream && sock->upstream->handle == UPSTREAM_IDLE && sock->status != SOCKET_CLOSED) {
+			_destroy_socket(sock);
+		}
+	}
+}
+
+int
+on_conn_writeable(sge_socket* sock) {
+	return flush_socket(sock);
+}
+
+int
+on_read_done(sge_socket* sock) {
+	SERVER.event->remove(SERVER.event, sock, EVT_READ);
+	shutdown(sock->fd, SHUT_RD);
+	sock->status = SOCKET_HALFCLOSE;
+	return sendto_worker(CMD_READDONE, sock->fd, NULL, NULL);
+}
+
+int
+set_non_block(sge_socket* sock) {
+	int flags = 0;
+	flags = fcntl(sock->fd, F_GETFL);
+	flags |= O_NONBLOCK;
+	fcntl(sock->fd, F_SETFL, flags);
+	return SGE_OK;
+}
+
+int
+add_socket(struct sge_server* server, sge_socket* sock) {
+	server->sock_num++;
+	server->socks[sock->fd] = sock;
+	return SGE_OK;
+}
+
+int
+write_socket_data(sge_socket* sock, sge_chunk* chunk) {
+	if (sock->status == SOCKET_CLOSED) {
+		destroy_chunk(chunk);
+		return SGE_ERR;
+	}
+	if (sock->access && sock->access->time && !sock->access->status) {
+		access_status(sock, chunk);
+	}
+	append_socket_output(sock, chunk);
+	if (sock->events & EVT_WRITE) {
+		return SGE_OK;
+	}
+	return flush_socket(sock);
+}
+
+int
+flush_socket(sge_socket* sock) {
+	int iovcnt, nwrite;
+	size_t total;
+	sge_chunk* chunk;
+	struct iovec iov[MAX_IOV_NUM];
+
+	while (!empty_socket_output(sock)) {
+		iovcnt = 0;
+		total = 0;
+		// a chunk without data is a response still being compressed
+		for (chunk = sock->w_head; chunk && chunk->data && iovcnt < MAX_IOV_NUM; chunk = chunk->next) {
+			iov[iovcnt].iov_base = (void*)(chunk->data + chunk->offset);
+			iov[iovcnt].iov_len = chunk->len - chunk->offset;
+			total += iov[iovcnt].iov_len;
+			iovcnt++;
+		}
+
+		if (iovcnt == 0) {
+			break;
+		}
+		nwrite = write_socket(sock, iov, iovcnt);
+		TRACE3(write, sock->fd, total, nwrite);
+		if (nwrite == SGE_ERR) {
+			return SGE_ERR;
+		}
+		consume_socket_output(sock, nwrite);
+		if (sock->access) {
+			sock->access->bytes_out += nwrite;
+		}
+		if (sock->capture && nwrite > 0) {
+			capture_record(SERVER.capture, sock->capture, CAPTURE_WRITE, NULL, nwrite);
+		}
+		if (nwrite < total) {
+			break;
+		}
+	}
+
+	if (empty_socket_output(sock)) {
+		if (sock->events & EVT_WRITE) {
+			SERVER.event->remove(SERVER.event, sock, EVT_WRITE);
+		}
+		TRACE1(drain, sock->fd);
+		stats_since(STAGE_WRITE, sock->write_ns);
+		stats_since(STAGE_TOTAL, sock->read_ns);
+		if (sock->access && sock->access->time) {
+			access_end(sock);
+		}
+		sock->write_ns = sock->read_ns = 0;
+	} else if (NULL == sock->w_head->data) {
+		// finish_compress() flushes again
+		if (sock->events & EVT_WRITE) {
+			SERVER.event->remove(SERVER.event, sock, EVT_WRITE);
+		}
+	} else if (!(sock->events & EVT_WRITE)) {
+		SERVER.event->add(SERVER.event, sock, EVT_WRITE);
+	}
+	return SGE_OK;
+}
+
+int
+try_close_socket(sge_socket* sock) {
+	if (empty_socket_output(sock)) {
+		_destroy_socket(sock);
+		return SGE_OK;
+	}
+	return SGE_ERR;
+}
+
+int
+close_socket(sge_socket* sock) {
+	if (try_close_socket(sock) == SGE_OK) {
+		return SGE_OK;
+	}
+	list_add(DELAY_CLOSE_SOCKS, (void*)sock);
+	return SGE_OK;
+}
+
+void
+_destroy_socket(sge_socket* sock) {
+	if (sock->status == SOCKET_CLOSED) {
+		return;
+	}
+	TRACE1(close, sock->fd);
+	SERVER.sock_num--;
+	if (sock->events) {
+		SERVER.event->remove(SERVER.event, sock, sock->events);
+	}
+	sock->status = SOCKET_CLOSED;
+	sock->on_write = sock->on_read = NULL;
+	sock->read_ns = sock->write_ns = 0;
+	sock->forwarded = 0;
+	sock->body_left = 0;
+	if (sock->access) {
+		sock->access->time = 0;
+	}
+	if (sock->capture) {
+		capture_record(SERVER.capture, sock->capture, CAPTURE_CLOSE, NULL, 0);
+		sock->capture = 0;
+	}
+	if (sock->h2) {
+		destroy_h2(sock->h2);
+		sock->h2 = NULL;
+	}
+	if (sock->ws) {
+		destroy_ws(sock->ws);
+		sock->ws = NULL;
+		SERVER.ws_num--;
+	}
+	if (sock->codec) {
+		destroy_codec(sock->codec);
+		sock->codec = NULL;
+	}
+	if (sock->upstream) {
+		forget_upstream(sock);
+	}
+	if (sock->flight) {
+		leave_flight(sock);
+	}
+	pubsub_drop(SERVER.pubsub, sock->fd);
+	clear_socket_output(sock);
+	if (sock->tls) {
+		destroy_tls(sock->tls);
+		sock->tls = NULL;
+	}
+	reset_socket_input(sock);
+	close(sock->fd);
+}
+
+void*
+worker(void* arg) {
+	sge_config* config = arg;
+
+	if (config->runner) {
+		config->runner(config->cb);
+		return NULL;
+	}
+
+	while (poll_worker(config->cb) == SGE_OK) {
+		wait_worker_message();
+	}
+	return NULL;
+}
+
+int
+start_worker(sge_config* config) {
+	pthread_t tid;
+	int ret = pthread_create(&tid, NULL, worker, config);
+	if (ret < 0) {
+		SYS_ERROR();
+		return SGE_ERR;
+	}
+	SERVER.tids[SERVER.worker_num++] = tid;
+	return SGE_OK;
+}
+
+int
+sendto_worker(COMMAND_TYPE type, int id, void (*cb_free)(void*), void* data) {
+	sge_message* msg = sge_malloc(sizeof(*msg));
+	msg->id = id;
+	msg->free = cb_free;
+	msg->type = type;
+	msg->ud = data;
+	msg->ts = stats_now();
+	if (type == CMD_MESSAGE) {
+		metrics_add(METRIC_REQUESTS, 1);
+	}
+	TRACE4(worker__enqueue, msg, id, type, type == CMD_MESSAGE ? buffer_size(data) : 0);
+	int size = enqueue(SERVER.worker_queue, (void*)msg);
+	if (size == 1) {
+		awake_worker();
+	}
+	return SGE_OK;
+}
+
+int
+awake_worker() {
+	uint64_t n = 1;
+	if (write(SERVER.worker_fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+		SYS_ERROR();
+		return SGE_ERR;
+	}
+	return SGE_OK;
+}
+
+int
+awake_server() {
+	uint64_t n = 1;
+	if (write(SERVER.notifier->fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+		SYS_ERROR();
+		return SGE_ERR;
+	}
+	return SGE_OK;
+}
+
+int
+wait_worker() {
+	void *result;
+	int i = 0;
+
+	for (; i < SERVER.worker_num; ++i) {
+		awake_worker();
+		pthread_join(SERVER.tids[i], &result);
+		INFO("worker[%d] exit.", SERVER.tids[i]);
+	}
+	INFO("all worker exit.");
+	return SGE_OK;
+}
+
+int
+on_notify(sge_socket* sock) {
+	uint64_t n;
+	read(sock->fd, &n, sizeof(n));
+	return SGE_OK;
+}
+
+int
+init_notifier() {
+	int fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (fd < 0) {
+		SYS_ERROR();
+		return SGE_ERR;
+	}
+	SERVER.notifier = create_socket(fd);
+	SERVER.notifier->on_read = on_notify;
+	SERVER.notifier->on_write = NULL;
+	if (SERVER.event->add(SERVER.event, SERVER.notifier, EVT_READ) == SGE_ERR) {
+		return SGE_ERR;
+	}
+
+	SERVER.worker_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (SERVER.worker_fd < 0) {
+		SYS_ERROR();
+		return SGE_ERR;
+	}
+	return SGE_OK;
+}
+
+int
+deal_request() {
+	sge_socket* s;
+	sge_message* msg;
+
+	dequeue(SERVER.server_queue, (void**)&msg);
+	if (msg == NULL) {
+		return SGE_OK;
+	}
+
+	while(msg) {
+		TRACE3(server__dequeue, msg, msg->id, msg->type);
+		switch (msg->type) {
+			case CMD_MESSAGE:
+				if (msg->id >= MAX_SOCK_NUM) {
+					sge_chunk* chunk = msg->ud;
+					stats_since(STAGE_SERVER_QUEUE, msg->ts);
+					write_stream_data(msg->id, chunk->data + chunk->offset, chunk->len - chunk->offset);
+					break;
+				}
+				CHECK_ARG(msg);
+				stats_since(STAGE_SERVER_QUEUE, msg->ts);
+				if (s->write_ns == 0) {
+					s->write_ns = stats_now();
+				}
+				// nothing to share with the requests parked behind it
+				if (s->flight) {
+					land_flight(s, NULL);
+				}
+				write_socket_data(s, (sge_chunk*)msg->ud);
+				msg->ud = NULL;
 			break;
 			case CMD_CLOSE:
+				if (msg->id >= MAX_SOCK_NUM) {
+					finish_stream(msg->id);
+					break;
+				}
 				CHECK_ARG(msg);
+				if (s->ws) {
+					ws_close(s->ws, msg->ud ? (intptr_t)msg->ud : WS_NORMAL_CLOSURE);
+					flush_ws(s);
+				}
 				close_socket(s);
 			break;
+			case CMD_WS_TEXT:
+			case CMD_WS_BINARY:
+				CHECK_ARG(msg);
+				write_ws_frame(s, msg->type == CMD_WS_TEXT ? WS_TEXT : WS_BINARY, (sge_chunk*)msg->ud);
+				msg->ud = NULL;
+			break;
+			case CMD_SUBSCRIBE:
+			case CMD_UNSUBSCRIBE:
+				CHECK_ARG(msg);
+				subscribe(msg->id, (sge_buffer*)msg->ud, msg->type == CMD_SUBSCRIBE);
+			break;
+			case CMD_PUBLISH:
+				publish((sge_publish_item*)msg->ud);
+			break;
+			case CMD_COMPRESS:
+				CHECK_ARG(msg);
+				stats_since(STAGE_SERVER_QUEUE, msg->ts);
+				if (s->write_ns == 0) {
+					s->write_ns = stats_now();
+				}
+				if (s->flight) {
+					land_flight(s, NULL);
+				}
+				start_compress(s, (sge_compress_job*)msg->ud);
+				msg->ud = NULL;
+			break;
+			case CMD_COMPRESSED:
+				finish_compress((sge_compress_job*)msg->ud);
+			break;
+			case CMD_FRAME:
+				CHECK_ARG(msg);
+				write_frame(s, (sge_chunk*)msg->ud);
+				msg->ud = NULL;
+			break;
+			case CMD_CONNECT:
+				open_upstream(msg->id, (sge_buffer*)msg->ud);
+				msg->ud = NULL;
+			break;
+			case CMD_UPSTREAM_DATA:
+				send_upstream(msg->id, (sge_chunk*)msg->ud);
+				msg->ud = NULL;
+			break;
+			case CMD_UPSTREAM_CLOSE:
+				release_upstream(msg->id, (intptr_t)msg->ud);
+			break;
+			case CMD_RESPONSE_END:
+				CHECK_ARG(msg);
+				resume_sniffing(s);
+			break;
+			case CMD_CACHE:
+				if (msg->id >= MAX_SOCK_NUM) {
+					// no response cache for streams, the response is just written
+					size_t len;
+					const char* data = shared_data(((sge_cache_item*)msg->ud)->data, &len);
+					write_stream_data(msg->id, data, len);
+					break;
+				}
+				CHECK_ARG(msg);
+				stats_since(STAGE_SERVER_QUEUE, msg->ts);
+				if (s->write_ns == 0) {
+					s->write_ns = stats_now();
+				}
+				store_cache(s, (sge_cache_item*)msg->ud);
+			break;
 			default:
 				WARNING("unknown message type: %d", msg->type);
 			break;
@@ -551,6 +2635,10 @@ deal_request() {
 		sge_free(msg);
 		dequeue(SERVER.server_queue, (void**)&msg);
 	}
+	if (SERVER.h2_pending) {
+		flush_h2(SERVER.h2_pending);
+		SERVER.h2_pending = NULL;
+	}
 	return SGE_OK;
 }
 
@@ -585,6 +2673,12 @@ init_server(sge_config* config) {
 		return SGE_ERR;
 	}
 
+	// the flusher thread would not survive daemon()'s fork
+	set_log_level(config->log_level);
+	if (start_log() == SGE_ERR) {
+		return SGE_ERR;
+	}
+
 	if (init_signal() == SGE_ERR) {
 		return SGE_ERR;
 	}
@@ -599,22 +2693,391 @@ init_server(sge_config* config) {
 		return SGE_ERR;
 	}
 
-	sge_socket* listener = init_listener(config->socket);
-	if (NULL == listener) {
+	if (init_listeners(config) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	SERVER.exe = config->exe;
+	SERVER.config_file = config->config_file;
+	SERVER.shutdown_timeout = config->shutdown_timeout;
+	SERVER.admin_cb = config->admin;
+	if (init_notifier() == SGE_ERR) {
 		return SGE_ERR;
 	}
-	set_non_block(listener);
-	if (SERVER.event->add(SERVER.event, listener, EVT_READ) == SGE_ERR) {
+	if (init_cache(config) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	// the access log and overload control need the timestamps as well
+	init_stats(config->admin_socket != NULL || config->access_log != NULL || config->overload_target > 0);
+	SERVER.overload_target = (uint64_t)config->overload_target * 1000000;
+	SERVER.overload_interval = (uint64_t)config->overload_interval * 1000000;
+	SERVER.http2 = config->http2;
+	SERVER.websocket = config->websocket;
+	SERVER.ws_max_size = config->websocket_max_size;
+	SERVER.ws_ping = (uint64_t)config->websocket_ping * 1000;
+	SERVER.pubsub = create_pubsub();
+	SERVER.codec_max_size = config->codec_max_size;
+	SERVER.pools = create_hash(64);
+	SERVER.pool_size = config->upstream_pool_size;
+	SERVER.connect_timeout = config->upstream_connect_timeout;
+	SERVER.idle_timeout = (uint64_t)config->upstream_idle_timeout * 1000;
+	if (config->tls_cert) {
+		SERVER.tls = create_tls_ctx(config->tls_cert, config->tls_key ? config->tls_key : config->tls_cert, config->ktls, config->http2);
+		if (NULL == SERVER.tls) {
+			return SGE_ERR;
+		}
+	}
+	if (config->compress) {
+		SERVER.compressor = create_compressor(config->compress_threads > 0 ? config->compress_threads : 1,
+			config->compress_level, config->compress_cache_size, on_compressed, NULL);
+		if (NULL == SERVER.compressor) {
+			return SGE_ERR;
+		}
+	}
+	if (config->access_log) {
+		SERVER.access = create_access_log(config->access_log, config->access_log_size, config->access_log_rotate);
+		if (NULL == SERVER.access) {
+			return SGE_ERR;
+		}
+	}
+	if (config->capture) {
+		SERVER.capture = create_capture(config->capture, config->capture_sample, config->capture_size);
+		if (NULL == SERVER.capture) {
+			return SGE_ERR;
+		}
+	}
+	if (config->admin_socket && init_admin(config->admin_socket) == SGE_ERR) {
 		return SGE_ERR;
 	}
-	add_socket(&SERVER, listener);
 	SERVER.worker_queue = create_queue(8);
 	SERVER.server_queue = create_queue(8);
-	pthread_mutex_init(&(SERVER.mutex), NULL);
-	pthread_cond_init(&(SERVER.cond), NULL);
+	update_time();
+	return SGE_OK;
+}
+
+int
+init_cache(sge_config* config) {
+	const char* p, *q;
+
+	if (config->cache_size == 0 && !config->coalesce) {
+		return SGE_OK;
+	}
+	if (config->cache_size > 0) {
+		SERVER.cache = create_cache(config->cache_size);
+	}
+	if (config->coalesce) {
+		SERVER.flights = create_hash(64);
+	}
+	SERVER.nvary = 0;
+	for (p = config->cache_vary; p && *p && SERVER.nvary < MAX_VARY_NUM; p = q) {
+		while (*p == ',' || *p == ' ') {
+			p++;
+		}
+		q = p;
+		while (*q && *q != ',' && *q != ' ') {
+			q++;
+		}
+		if (q > p) {
+			SERVER.vary[SERVER.nvary++] = strndup(p, q - p);
+		}
+	}
+	return SGE_OK;
+}
+
+void
+update_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	SERVER.now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * nginx style binary upgrade: exec the binary again with the listener
+ * fd inherited, and keep serving until the new process reports that it
+ * is accepting. only then stop accepting here and drain.
+ */
+int
+upgrade_server() {
+	int fds[2];
+	pid_t pid;
+	int i, len;
+	char listen_env[32 + MAX_LISTENERS * 12], ready_env[64];
+	char* const argv[] = {(char*)SERVER.exe, (char*)SERVER.config_file, NULL};
+	extern char** environ;
+	char** envp;
+	size_t n = 0;
+
+	if (SERVER.upgrade || SERVER.draining || NULL == SERVER.exe) {
+		WARNING("upgrade ignored: already upgrading or draining");
+		return SGE_ERR;
+	}
+	if (pipe(fds) < 0) {
+		SYS_ERROR();
+		return SGE_ERR;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	len = snprintf(listen_env, sizeof(listen_env), "%s=", ENV_LISTEN_FD);
+	for (i = 0; i < SERVER.nlistener; ++i) {
+		len += snprintf(listen_env + len, sizeof(listen_env) - len, i ? ",%d" : "%d", SERVER.listeners[i].sock->fd);
+	}
+	snprintf(ready_env, sizeof(ready_env), "%s=%d", ENV_READY_FD, fds[1]);
+	while (environ[n]) {
+		n++;
+	}
+	envp = sge_malloc(sizeof(char*) * (n + 3));
+	memcpy(envp, environ, sizeof(char*) * n);
+	envp[n] = listen_env;
+	envp[n + 1] = ready_env;
+	envp[n + 2] = NULL;
+
+	pid = fork();
+	if (pid == 0) {
+		for (i = 0; i < SERVER.nlistener; ++i) {
+			fcntl(SERVER.listeners[i].sock->fd, F_SETFD, 0);
+		}
+		fcntl(fds[1], F_SETFD, 0);
+		execve(SERVER.exe, argv, envp);
+		_exit(127);
+	}
+	sge_free(envp);
+	close(fds[1]);
+	if (pid < 0) {
+		SYS_ERROR();
+		close(fds[0]);
+		return SGE_ERR;
+	}
+
+	INFO("upgrading: started %s as pid %d", SERVER.exe, pid);
+	SERVER.upgrade_pid = pid;
+	SERVER.upgrade = create_socket(fds[0]);
+	SERVER.upgrade->on_read = on_upgrade_ready;
+	SERVER.upgrade->on_write = NULL;
+	return SERVER.event->add(SERVER.event, SERVER.upgrade, EVT_READ);
+}
+
+int
+on_upgrade_ready(sge_socket* sock) {
+	char c;
+	int status;
+	ssize_t n = read(sock->fd, &c, 1);
+
+	if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+		return SGE_OK;
+	}
+	SERVER.event->remove(SERVER.event, sock, sock->events);
+	close(sock->fd);
+	destroy_socket(sock);
+	SERVER.upgrade = NULL;
+
+	if (n != 1) {
+		waitpid(SERVER.upgrade_pid, &status, 0);
+		ERROR("upgrade failed: new server %d exited before it was ready", SERVER.upgrade_pid);
+		return SGE_ERR;
+	}
+	INFO("new server %d is ready, draining.", SERVER.upgrade_pid);
+	return stop_accept();
+}
+
+int
+notify_ready() {
+	int fd;
+	const char* env = getenv(ENV_READY_FD);
+
+	if (NULL == env) {
+		return SGE_OK;
+	}
+	fd = atoi(env);
+	unsetenv(ENV_READY_FD);
+	if (write(fd, "1", 1) < 0) {
+		SYS_ERROR();
+	}
+	close(fd);
+	return SGE_OK;
+}
+
+/*
+ * stop accepting and let the open connections finish. the listening
+ * socket itself stays open in any process that inherited it.
+ */
+int
+stop_accept() {
+	int i;
+
+	if (SERVER.draining) {
+		return SGE_OK;
+	}
+	SERVER.draining = 1;
+	SERVER.drain_deadline = SERVER.now + (uint64_t)SERVER.shutdown_timeout * 1000;
+	for (i = 0; i < SERVER.nlistener; ++i) {
+		_destroy_socket(SERVER.listeners[i].sock);
+	}
+	close_websockets(WS_GOING_AWAY);
+	close_idle_upstreams();
+	INFO("stop accepting, %d connections left.", SERVER.sock_num);
+	return SGE_OK;
+}
+
+int
+check_drain() {
+	if (!SERVER.draining) {
+		return SGE_OK;
+	}
+	if (SERVER.sock_num == 0) {
+		INFO("all connections drained.");
+		SERVER.run = 0;
+	} else if (SERVER.now >= SERVER.drain_deadline) {
+		WARNING("drain timeout, %d connections dropped.", SERVER.sock_num);
+		SERVER.run = 0;
+	}
+	return SGE_OK;
+}
+
+/*
+ * the admin socket answers one request per connection from the reactor
+ * and never involves the worker. a request is either a bare command
+ * line ("stages", "metrics") or an http GET for the same path, so curl
+ * and prometheus work too.
+ */
+int
+init_admin(const char* path) {
+	static const sge_listen_config options = {.backlog = DEFAULT_BACKLOG};
+	int fd = init_unix_socket(path, &options);
+	if (fd < 0) {
+		return SGE_ERR;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	SERVER.admin = create_socket(fd);
+	SERVER.admin->on_read = on_admin_accept;
+	SERVER.admin->on_write = NULL;
+	set_non_block(SERVER.admin);
+	INFO("admin socket listening on %s", path);
+	return SERVER.event->add(SERVER.event, SERVER.admin, EVT_READ);
+}
+
+int
+on_admin_accept(sge_socket* sock) {
+	int fd = accept4(sock->fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		SYS_ERROR();
+		return SGE_OK;
+	}
+	if (fd >= MAX_SOCK_NUM || SERVER.sock_num >= MAX_SOCK_NUM) {
+		close(fd);
+		return SGE_OK;
+	}
+
+	sge_socket* conn = create_conn(fd);
+	set_non_block(conn);
+	conn->on_read = on_admin_read;
+	conn->on_write = on_conn_writeable;
+	conn->on_data = NULL;
+	add_socket(&SERVER, conn);
+	if (SERVER.event->add(SERVER.event, conn, EVT_READ) == SGE_ERR) {
+		_destroy_socket(conn);
+		return SGE_ERR;
+	}
 	return SGE_OK;
 }
 
+int
+on_admin_read(sge_socket* sock) {
+	char buf[MAX_ADMIN_REQUEST];
+	const char* data, *eol;
+	size_t len;
+	int nread;
+
+	nread = read(sock->fd, buf, sizeof(buf));
+	if (nread < 0 && (errno == EINTR || errno == EAGAIN)) {
+		return SGE_OK;
+	}
+	if (nread <= 0) {
+		_destroy_socket(sock);
+		return SGE_OK;
+	}
+	if (NULL == sock->r_buf) {
+		sock->r_buf = create_buffer(nread);
+	}
+	sock->r_buf = append_buffer(sock->r_buf, buf, nread);
+	data = buffer_data(sock->r_buf, &len);
+	eol = memchr(data, '\n', len);
+	if (NULL == eol) {
+		if (len >= MAX_ADMIN_REQUEST) {
+			_destroy_socket(sock);
+		}
+		return SGE_OK;
+	}
+
+	len = eol - data;
+	if (len > 0 && data[len - 1] == '\r') {
+		len--;
+	}
+	SERVER.event->remove(SERVER.event, sock, EVT_READ);
+	admin_command(sock, data, len);
+	return close_socket(sock);
+}
+
+sge_buffer*
+format_server_metrics(sge_buffer* buf) {
+	sge_gauge gauges[] = {
+		{"sge_connections", "Open sockets, listeners and admin connections included.", SERVER.sock_num},
+		{"sge_worker_queue_depth", "Messages waiting for the worker.", queue_size(SERVER.worker_queue)},
+		{"sge_server_queue_depth", "Messages waiting for the reactor.", queue_size(SERVER.server_queue)},
+		{"sge_delay_close_sockets", "Closed sockets still flushing output.", list_size(DELAY_CLOSE_SOCKS)},
+		{"sge_cache_bytes", "Bytes held by the response cache.", SERVER.cache ? cache_bytes(SERVER.cache) : 0},
+		{"sge_cache_entries", "Entries in the response cache.", SERVER.cache ? cache_count(SERVER.cache) : 0},
+		{"sge_coalesce_parked", "GETs waiting for the response of an identical one.", SERVER.parked},
+		{"sge_access_log_dropped", "Access log records dropped for want of a segment.", SERVER.access ? access_log_dropped(SERVER.access) : 0},
+		{"sge_overloaded", "1 while new requests are shed for worker queue delay.", SERVER.shedding},
+		{"sge_capture_bytes", "Bytes recorded by the traffic capture.", SERVER.capture ? capture_bytes(SERVER.capture) : 0},
+		{"sge_h2_streams", "HTTP/2 streams the worker has yet to finish.", SERVER.stream_num},
+		{"sge_websockets", "Open websocket connections.", SERVER.ws_num},
+		{"sge_pubsub_channels", "Channels with at least one subscriber.", pubsub_channels(SERVER.pubsub)},
+		{"sge_upstream_connections", "Open outbound connections, pooled ones included.", SERVER.upstream_num},
+		{"sge_upstream_idle", "Outbound connections waiting in a pool.", SERVER.upstream_idle},
+		{"sge_compress_cache_bytes", "Bytes held by the compression cache.", SERVER.compressor ? compress_cache_bytes(SERVER.compressor) : 0}
+	};
+
+	buf = format_metrics(buf, gauges, sizeof(gauges) / sizeof(gauges[0]));
+	return format_stages_summary(buf);
+}
+
+int
+admin_command(sge_socket* sock, const char* cmd, size_t len) {
+	int http = 0, n;
+	char head[128];
+	const char* status = "200 OK";
+	const char* type = "text/plain";
+	sge_buffer* body = create_buffer(1024);
+	size_t size;
+
+	if (len > 4 && strncmp(cmd, "GET ", 4) == 0) {
+		const char* end = memchr(cmd + 4, ' ', len - 4);
+		http = 1;
+		len = (end ? end : cmd + len) - (cmd + 5);
+		cmd += 5;
+	}
+	if (len == 6 && strncmp(cmd, "stages", len) == 0) {
+		body = format_stages(body);
+	} else if (len == 7 && strncmp(cmd, "metrics", len) == 0) {
+		body = format_server_metrics(body);
+		type = "text/plain; version=0.0.4";
+	} else if (SERVER.admin_cb && SERVER.admin_cb(cmd, len, &body) == SGE_OK) {
+		// commands of the embedding, e.g. the profiler
+	} else {
+		status = "404 Not Found";
+		body = append_buffer(body, "unknown command\n", 16);
+	}
+
+	buffer_data(body, &size);
+	if (http) {
+		n = snprintf(head, sizeof(head),
+			"HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n", status, type, size);
+		write_socket_data(sock, create_chunk_buffer(create_buffer_ex(head, n)));
+	}
+	return write_socket_data(sock, create_chunk_buffer(body));
+}
+
 // export
 int
 start_server(sge_config* config) {
@@ -627,24 +3090,46 @@ start_server(sge_config* config) {
 		return SGE_ERR;
 	}
 
+	SERVER.run = 1;
 	if (start_worker(config) == SGE_ERR) {
 		return SGE_ERR;
 	}
+	notify_ready();
 
-	SERVER.run = 1;
 	while(SERVER.run) {
+		if (SERVER.signal_upgrade) {
+			SERVER.signal_upgrade = 0;
+			upgrade_server();
+		}
+		if (SERVER.signal_quit) {
+			SERVER.signal_quit = 0;
+			stop_accept();
+		}
 		deal_request();
 		active_num = SERVER.event->poll(SERVER.event, socks);
+		update_time();
+		SERVER.polled = stats_now();
+		if (SERVER.overload_target) {
+			check_overload(SERVER.polled);
+		}
+		if (SERVER.websocket && SERVER.ws_ping) {
+			check_ws_ping();
+		}
+		check_upstreams();
 		for (i = 0; i < active_num; ++i) {
 			s = socks[i];
 			if (s->options & EVT_READ) {
 				s->on_read(s);
 			}
-			if (s->options & EVT_WRITE) {
+			if ((s->options & EVT_WRITE) && s->on_write) {
 				s->on_write(s);
 			}
 		}
 		check_socket();
+		check_drain();
+		if (SERVER.capture) {
+			capture_flush(SERVER.capture);
+		}
 	}
 
 	wait_worker();
@@ -657,8 +3142,6 @@ destroy_server() {
 	int i = 0;
 	sge_socket* s;
 
-	destroy_queue(SERVER.worker_queue);
-	destroy_queue(SERVER.server_queue);
 	list_destroy(DELAY_CLOSE_SOCKS);
 	for (i = 0; i < MAX_SOCK_NUM; ++i) {
 		s = SERVER.socks[i];
@@ -667,9 +3150,46 @@ destroy_server() {
 		}
 		_destroy_socket(s);
 	}
+	// compression threads post to the server queue until they are joined
+	if (SERVER.compressor) {
+		destroy_compressor(SERVER.compressor);
+	}
+	if (SERVER.tls) {
+		destroy_tls_ctx(SERVER.tls);
+	}
+	// after the sockets, closing http/2 streams still messages the worker
+	destroy_queue(SERVER.worker_queue);
+	destroy_queue(SERVER.server_queue);
+	close(SERVER.notifier->fd);
+	destroy_socket(SERVER.notifier);
+	if (SERVER.cache) {
+		destroy_cache(SERVER.cache);
+	}
+	if (SERVER.flights) {
+		destroy_hash(SERVER.flights, destroy_flight);
+	}
+	if (SERVER.pubsub) {
+		destroy_pubsub(SERVER.pubsub);
+	}
+	if (SERVER.pools) {
+		destroy_hash(SERVER.pools, sge_free);
+	}
+	for (i = 0; i < SERVER.nvary; ++i) {
+		sge_free(SERVER.vary[i]);
+	}
+	if (SERVER.admin) {
+		close(SERVER.admin->fd);
+		destroy_socket(SERVER.admin);
+	}
+	if (SERVER.access) {
+		destroy_access_log(SERVER.access);
+	}
+	if (SERVER.capture) {
+		destroy_capture(SERVER.capture);
+	}
+	destroy_stats();
+	close(SERVER.worker_fd);
 	SERVER.event->destroy(SERVER.event);
-	pthread_mutex_destroy(&(SERVER.mutex));
-	pthread_cond_destroy(&(SERVER.cond));
 	return SGE_OK;
 }
 
@@ -680,6 +3200,68 @@ sendto_server(COMMAND_TYPE type, int id, void (*cb_free)(void*), void* data) {
 	msg->free = cb_free;
 	msg->type = type;
 	msg->ud = data;
-	enqueue(SERVER.server_queue, (void*)msg);
+	msg->ts = stats_now();
+	TRACE4(server__enqueue, msg, id, type, type == CMD_MESSAGE ? ((sge_chunk*)data)->len : 0);
+	int size = enqueue(SERVER.server_queue, (void*)msg);
+	if (size == 1) {
+		awake_server();
+	}
+	return SGE_OK;
+}
+
+int
+worker_fd() {
+	return SERVER.worker_fd;
+}
+
+int
+wait_worker_message() {
+	struct pollfd pfd;
+
+	pfd.fd = SERVER.worker_fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+		SYS_ERROR();
+		return SGE_ERR;
+	}
 	return SGE_OK;
 }
+
+int
+poll_worker(cb_worker cb) {
+	uint64_t n;
+	sge_message* msg;
+
+	read(SERVER.worker_fd, &n, sizeof(n));
+	while (SERVER.run) {
+		dequeue(SERVER.worker_queue, (void**)&msg);
+		if (msg == NULL) {
+			return SGE_OK;
+		}
+		TRACE3(worker__dequeue, msg, msg->id, msg->type);
+		if (msg->type == CMD_MESSAGE) {
+			stats_since(STAGE_WORKER_QUEUE, msg->ts);
+		}
+		cb(msg);
+		if (msg->free) {
+			msg->free(msg->ud);
+		}
+		sge_free(msg);
+	}
+	return SGE_ERR;
+}
+
+void
+destroy_cache_item(void* ud) {
+	sge_cache_item* item = ud;
+	release_shared(item->data);
+	sge_free(item);
+}
+
+void
+destroy_publish_item(void* ud) {
+	sge_publish_item* item = ud;
+	destroy_buffer(item->channel);
+	release_shared(item->data);
+	sge_free(item);
+}
@@ -1,11 +1,38 @@
 #ifndef SERVER_H_
 #define SERVER_H_
 
+#include <stdint.h>
+
 #include "core/config.h"
+#include "core/chunk.h"
+
+// payload of CMD_CACHE: a serialized response the reactor may keep for `ttl` seconds
+typedef struct {
+	sge_shared* data;
+	uint32_t ttl;
+} sge_cache_item;
+
+// payload of CMD_PUBLISH: one copy of the message, shared by every subscriber
+typedef struct {
+	sge_buffer* channel;
+	sge_shared* data;
+	int text;
+} sge_publish_item;
 
 int start_server(sge_config* config);
 int destroy_server();
 
+int sendto_worker(COMMAND_TYPE type, int id, void (*cb_free)(void*), void* data);
 int sendto_server(COMMAND_TYPE type, int id, void (*cb_free)(void*), void* data);
+void destroy_cache_item(void* item);
+void destroy_publish_item(void* item);
+
+// the slot of an outbound connection's handle, the rest of it is a generation
+#define UPSTREAM_SLOT(handle) ((handle) & (MAX_SOCK_NUM - 1))
+
+// worker side of the mailbox, for runners that drive their own loop
+int worker_fd();
+int wait_worker_message();
+int poll_worker(cb_worker cb);
 
 #endif
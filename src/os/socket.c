@@ -5,15 +5,81 @@
 sge_socket*
 create_socket(int fd) {
 	sge_socket* sock = sge_malloc(sizeof(*sock));
-	memset(sock, 0, sizeof(sock));
+	memset(sock, 0, sizeof(*sock));
 	sock->fd = fd;
 	sock->status = SOCKET_AVAILABLE;
-	sock->w_buf = create_buffer(512);
+	sock->w_head = sock->w_tail = NULL;
 	return sock;
 }
 
 void
 destroy_socket(sge_socket* sock) {
-	destroy_buffer(sock->w_buf);
+	clear_socket_output(sock);
+	reset_socket_input(sock);
+	if (sock->access) {
+		sge_free(sock->access);
+	}
 	sge_free(sock);
 }
+
+int
+append_socket_output(sge_socket* sock, sge_chunk* chunk) {
+	chunk->next = NULL;
+	if (sock->w_tail) {
+		sock->w_tail->next = chunk;
+	} else {
+		sock->w_head = chunk;
+	}
+	sock->w_tail = chunk;
+	return SGE_OK;
+}
+
+size_t
+consume_socket_output(sge_socket* sock, size_t len) {
+	size_t remain;
+	sge_chunk* chunk;
+
+	while (len > 0 && sock->w_head) {
+		chunk = sock->w_head;
+		remain = chunk->len - chunk->offset;
+		if (len < remain) {
+			chunk->offset += len;
+			return 0;
+		}
+		len -= remain;
+		sock->w_head = chunk->next;
+		destroy_chunk(chunk);
+	}
+	if (NULL == sock->w_head) {
+		sock->w_tail = NULL;
+	}
+	return len;
+}
+
+int
+empty_socket_output(sge_socket* sock) {
+	return sock->w_head == NULL;
+}
+
+void
+clear_socket_output(sge_socket* sock) {
+	sge_chunk* chunk, *next;
+
+	for (chunk = sock->w_head; chunk; chunk = next) {
+		next = chunk->next;
+		destroy_chunk(chunk);
+	}
+	sock->w_head = sock->w_tail = NULL;
+}
+
+void
+reset_socket_input(sge_socket* sock) {
+	if (sock->r_buf) {
+		destroy_buffer(sock->r_buf);
+		sock->r_buf = NULL;
+	}
+	if (sock->cache_key) {
+		destroy_buffer(sock->cache_key);
+		sock->cache_key = NULL;
+	}
+}
@@ -2,7 +2,7 @@
 #define SOCKET_H_
 
 #include <stdint.h>
-#include "core/buffer.h"
+#include "core/chunk.h"
 
 typedef enum EVENT_TYPE {
 	EVT_READ = 0X01,
@@ -17,9 +17,17 @@ typedef enum {
 } SOCKET_STATUS;
 
 typedef struct sge_socket sge_socket;
+struct sge_access_record;
+struct sge_h2;
+struct sge_ws;
+struct sge_tls;
+struct sge_codec;
+struct sge_upstream;
+struct sge_flight;
 
 typedef int (*cb_on_read)(sge_socket* sock);
 typedef int (*cb_on_write)(sge_socket* sock);
+typedef int (*cb_on_data)(sge_socket* sock, const char* data, size_t len);
 
 struct sge_socket {
 	int fd;
@@ -27,11 +35,34 @@ struct sge_socket {
 	uint32_t options;
 	cb_on_read on_read;
 	cb_on_write on_write;
+	cb_on_data on_data;
 	int status;
-	sge_buffer* w_buf;
+	sge_chunk* w_head;
+	sge_chunk* w_tail;
+	sge_buffer* r_buf;
+	sge_buffer* cache_key;
+	uint64_t read_ns;
+	uint64_t write_ns;
+	struct sge_access_record* access;
+	uint32_t capture;
+	struct sge_h2* h2;
+	struct sge_ws* ws;
+	struct sge_tls* tls;
+	struct sge_codec* codec;
+	struct sge_upstream* upstream;
+	struct sge_flight* flight;
+	sge_socket* flight_next;
+	// a sniffed request is with the worker, and how much of its body is still to come
+	int forwarded;
+	size_t body_left;
 };
 
 sge_socket* create_socket(int fd);
 void destroy_socket(sge_socket* sock);
+int append_socket_output(sge_socket* sock, sge_chunk* chunk);
+size_t consume_socket_output(sge_socket* sock, size_t len);
+int empty_socket_output(sge_socket* sock);
+void clear_socket_output(sge_socket* sock);
+void reset_socket_input(sge_socket* sock);
 
 #endif
@@ -0,0 +1,238 @@
+#include <errno.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "core/sge.h"
+#include "core/log.h"
+#include "os/tls.h"
+
+/*
+ * TLS for client connections. OpenSSL does the handshake on the
+ * nonblocking socket; with SSL_OP_ENABLE_KTLS it then hands the session
+ * keys to the kernel (setsockopt TCP_ULP "tls" and TLS_TX/TLS_RX), and
+ * plain write()/writev() on the fd send records from then on. without
+ * the kernel module writes go through SSL_write() instead. reads always
+ * go through SSL_read(), which reads the plain data from the kernel when
+ * it decrypts as well.
+ */
+
+struct sge_tls_ctx {
+	SSL_CTX* ssl_ctx;
+	int ktls;
+	int warned;
+	int h2;
+};
+
+struct sge_tls {
+	sge_tls_ctx* ctx;
+	SSL* ssl;
+	int offloaded;
+};
+
+static int select_alpn(SSL* ssl, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void* arg);
+static ssize_t ssl_result(sge_tls* tls, int ret);
+static void log_ssl_error(const char* what);
+
+
+sge_tls_ctx*
+create_tls_ctx(const char* cert, const char* key, int ktls, int h2) {
+	sge_tls_ctx* ctx;
+	SSL_CTX* ssl_ctx = SSL_CTX_new(TLS_server_method());
+
+	if (NULL == ssl_ctx) {
+		log_ssl_error("SSL_CTX_new");
+		return NULL;
+	}
+	SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_2_VERSION);
+	SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	// most clients just close, that is the end of the stream and not an error
+	SSL_CTX_set_options(ssl_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+	// session tickets would be written by SSL_write() behind the kernel's back
+	SSL_CTX_set_num_tickets(ssl_ctx, 0);
+	if (ktls) {
+		SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+	}
+	if (SSL_CTX_use_certificate_chain_file(ssl_ctx, cert) != 1) {
+		ERROR("can not load tls certificate %s", cert);
+		log_ssl_error("SSL_CTX_use_certificate_chain_file");
+		SSL_CTX_free(ssl_ctx);
+		return NULL;
+	}
+	if (SSL_CTX_use_PrivateKey_file(ssl_ctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ssl_ctx) != 1) {
+		ERROR("can not load tls key %s", key);
+		log_ssl_error("SSL_CTX_use_PrivateKey_file");
+		SSL_CTX_free(ssl_ctx);
+		return NULL;
+	}
+
+	ctx = sge_malloc(sizeof(*ctx));
+	ctx->ssl_ctx = ssl_ctx;
+	ctx->ktls = ktls;
+	ctx->warned = 0;
+	ctx->h2 = h2;
+	SSL_CTX_set_alpn_select_cb(ssl_ctx, select_alpn, ctx);
+	return ctx;
+}
+
+void
+destroy_tls_ctx(sge_tls_ctx* ctx) {
+	SSL_CTX_free(ctx->ssl_ctx);
+	sge_free(ctx);
+}
+
+sge_tls*
+create_tls(sge_tls_ctx* ctx, int fd) {
+	sge_tls* tls;
+	SSL* ssl = SSL_new(ctx->ssl_ctx);
+
+	if (NULL == ssl) {
+		log_ssl_error("SSL_new");
+		return NULL;
+	}
+	SSL_set_fd(ssl, fd);
+	SSL_set_accept_state(ssl);
+	tls = sge_malloc(sizeof(*tls));
+	tls->ctx = ctx;
+	tls->ssl = ssl;
+	tls->offloaded = 0;
+	return tls;
+}
+
+// a close_notify on the way out, if the socket takes it
+void
+destroy_tls(sge_tls* tls) {
+	if (SSL_is_init_finished(tls->ssl)) {
+		SSL_shutdown(tls->ssl);
+	}
+	SSL_free(tls->ssl);
+	sge_free(tls);
+}
+
+// SGE_OK once done, TLS_WANT_READ/TLS_WANT_WRITE to be called again
+int
+tls_handshake(sge_tls* tls) {
+	int ret = SSL_do_handshake(tls->ssl);
+
+	if (ret == 1) {
+		tls->offloaded = BIO_get_ktls_send(SSL_get_wbio(tls->ssl));
+		if (tls->ctx->ktls && !tls->offloaded && !tls->ctx->warned) {
+			tls->ctx->warned = 1;
+			WARNING("kernel tls not available for %s, records are written by openssl.", SSL_get_cipher_name(tls->ssl));
+		}
+		return SGE_OK;
+	}
+	switch (SSL_get_error(tls->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+			return TLS_WANT_READ;
+		case SSL_ERROR_WANT_WRITE:
+			return TLS_WANT_WRITE;
+		default:
+			log_ssl_error("SSL_do_handshake");
+			return SGE_ERR;
+	}
+}
+
+// read(2) alike: 0 at the end, -1 with errno EAGAIN when nothing is there yet
+ssize_t
+tls_read(sge_tls* tls, char* buf, size_t len) {
+	errno = 0;
+	return ssl_result(tls, SSL_read(tls->ssl, buf, len));
+}
+
+/*
+ * writev(2) alike for a session the kernel does not encrypt for. the
+ * same bytes have to be passed again after EAGAIN, which flush_socket()
+ * does as it retries from the first unwritten byte.
+ */
+ssize_t
+tls_writev(sge_tls* tls, const struct iovec* iov, int iovcnt) {
+	int i;
+	ssize_t n, total = 0;
+
+	for (i = 0; i < iovcnt; ++i) {
+		if (iov[i].iov_len == 0) {
+			continue;
+		}
+		errno = 0;
+		n = ssl_result(tls, SSL_write(tls->ssl, iov[i].iov_base, iov[i].iov_len));
+		if (n < 0) {
+			return total > 0 ? total : n;
+		}
+		total += n;
+		if ((size_t)n < iov[i].iov_len) {
+			break;
+		}
+	}
+	return total;
+}
+
+// decrypted bytes SSL_read() has without the socket being readable
+int
+tls_pending(sge_tls* tls) {
+	return SSL_pending(tls->ssl) > 0;
+}
+
+// records are written by the kernel, write()/writev() may be used as is
+int
+tls_offloaded(sge_tls* tls) {
+	return tls->offloaded;
+}
+
+int
+tls_h2(sge_tls* tls) {
+	unsigned int len;
+	const unsigned char* proto;
+
+	SSL_get0_alpn_selected(tls->ssl, &proto, &len);
+	return len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+int
+select_alpn(SSL* ssl, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void* arg) {
+	static const unsigned char h2[] = "\x02h2\x08http/1.1";
+	sge_tls_ctx* ctx = arg;
+	const unsigned char* ours = ctx->h2 ? h2 : h2 + 3;
+	unsigned int len = ctx->h2 ? sizeof(h2) - 1 : sizeof(h2) - 4;
+
+	if (SSL_select_next_proto((unsigned char**)out, outlen, ours, len, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+	return SSL_TLSEXT_ERR_OK;
+}
+
+ssize_t
+ssl_result(sge_tls* tls, int ret) {
+	if (ret > 0) {
+		return ret;
+	}
+	switch (SSL_get_error(tls->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_SYSCALL:
+			ERR_clear_error();
+			if (errno == 0) {
+				// the peer closed without close_notify
+				return 0;
+			}
+			return -1;
+		default:
+			log_ssl_error("SSL_read/SSL_write");
+			errno = EPROTO;
+			return -1;
+	}
+}
+
+void
+log_ssl_error(const char* what) {
+	unsigned long e;
+	char buf[256];
+
+	while ((e = ERR_get_error()) != 0) {
+		ERR_error_string_n(e, buf, sizeof(buf));
+		WARNING("%s: %s", what, buf);
+	}
+}
@@ -0,0 +1,24 @@
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define TLS_WANT_READ 1
+#define TLS_WANT_WRITE 2
+
+typedef struct sge_tls_ctx sge_tls_ctx;
+typedef struct sge_tls sge_tls;
+
+sge_tls_ctx* create_tls_ctx(const char* cert, const char* key, int ktls, int h2);
+void destroy_tls_ctx(sge_tls_ctx* ctx);
+sge_tls* create_tls(sge_tls_ctx* ctx, int fd);
+void destroy_tls(sge_tls* tls);
+int tls_handshake(sge_tls* tls);
+ssize_t tls_read(sge_tls* tls, char* buf, size_t len);
+ssize_t tls_writev(sge_tls* tls, const struct iovec* iov, int iovcnt);
+int tls_pending(sge_tls* tls);
+int tls_offloaded(sge_tls* tls);
+int tls_h2(sge_tls* tls);
+
+#endif
@@ -2,6 +2,8 @@
 #-*- coding:utf-8 -*-
 
 import json
+import asyncio
+import traceback
 
 import sgeWeb.Request as Request
 import sgeWeb.Response as Response
@@ -74,12 +76,18 @@ class Connection(dict):
 	def __init__(self):
 		self.__parse_done__ = False
 		self.__read_done__ = False
+		self.__stream__ = False
 		self.__raw_message__ = b''
+		self.__request__ = b''
 		self.headers = {}
 		self.path = ''
 		self.method = ''
 		self.version = ''
 		self.body = {}
+		self.params = {}
+		self.__tasks__ = set()
+		self.__ws_handler__ = None
+		self.__drain_waiters__ = []
 	
 	def close(self):
 		''' 不用处理，底层替换 '''
@@ -89,10 +97,57 @@ class Connection(dict):
 		''' 不用处理，底层替换 '''
 		pass
 
-	def output(self, msg):
-		self.send(msg)
-		if self.__read_done__:
+	def send_cached(self, ttl, head, body):
+		''' 不用处理，底层替换 '''
+		pass
+
+	def send_response(self, head, body):
+		''' 不用处理，底层替换 '''
+		pass
+
+	def ws_send(self, msg):
+		''' 不用处理，底层替换 '''
+		pass
+
+	def send_frame(self, msg):
+		''' 不用处理，底层替换 '''
+		pass
+
+	def subscribe(self, channel):
+		''' 不用处理，底层替换 '''
+		pass
+
+	def unsubscribe(self, channel):
+		''' 不用处理，底层替换 '''
+		pass
+
+	def error(self):
+		''' 不用处理，底层替换 '''
+		pass
+
+	def __end__(self):
+		''' 不用处理，底层替换 '''
+		pass
+
+	def __need_drain__(self):
+		''' 不用处理，底层替换 '''
+		return False
+
+	async def drain(self):
+		if not self.__need_drain__():
+			return
+		waiter = asyncio.get_running_loop().create_future()
+		self.__drain_waiters__.append(waiter)
+		await waiter
+
+	def output(self, *msgs):
+		for msg in msgs:
+			if msg:
+				self.send(msg)
+		if self.__read_done__ or self.__stream__:
 			self.close()
+		else:
+			self.__end__()
 
 	def parse_start_line(self, str_header):
 		[method, path, version] = str_header.split(b" ")
@@ -194,46 +249,83 @@ class Connection(dict):
 		return disposition, params
 
 	def parse_http_request(self):
-		if not self.__raw_message__.find(b"\r\n\r\n"):
+		eoh = self.__raw_message__.find(b"\r\n\r\n")
+		if eoh == -1:
 			return False
-		[header, body] = self.__raw_message__.split(b"\r\n\r\n", 1)
-		self.parse_request_header(header)
-		if not self.parse_request_body(self.headers, body):
+		self.parse_request_header(self.__raw_message__[:eoh])
+		length = int(self.headers.get("Content-Length", 0))
+		end = eoh + 4 + length
+		if len(self.__raw_message__) < end:
 			return False
+		# keep-alive: the next request starts after this one's body
+		self.__request__ = self.__raw_message__[:end]
+		self.__raw_message__ = self.__raw_message__[end:]
+		self.body = {}
+		self.parse_request_body(self.headers, self.__request__[eoh + 4:])
 		self.__parse_done__ = True
 		return True
 
 	def format_status(self, res):
 		return "HTTP/1.1 {status} {message}".format(status=res.status, message=HTTP_STATUS_MAP.get(res.status, "<unknown>"))
 
-	def format_header(self, res):
+	def format_header(self, res, length):
 		s_headers = []
 		for k, v in res.headers.items():
 			s_headers.append("{0}: {1}".format(k, v))
-		if (res.body):
-			s_headers.append("Content-Length: {0}".format(len(res.body)))
+		if length:
+			s_headers.append("Content-Length: {0}".format(length))
 		return "\r\n".join(s_headers)
 
 	def parse_http_response(self, res):
-		return "{status}\r\n{header}\r\n\r\n{body}".format(
+		body = res.body
+		if isinstance(body, str):
+			body = body.encode()
+		head = "{status}\r\n{header}\r\n\r\n".format(
 			status=self.format_status(res),
-			header=self.format_header(res),
-			body=res.body
+			header=self.format_header(res, len(body))
 		)
+		return head, body
 
 	def __on_message__(self, msg):
 		self.__raw_message__ += msg
 		return self.parse_http_request()
 
+	def __on_ws_open__(self, head):
+		self.parse_request_header(head[:head.find(b"\r\n\r\n")])
+		return True
+
 	def __on_read_done__(self):
 		self.__read_done__ = True
 		self.close()
 		return True
 
+	def __on_drain__(self):
+		waiters, self.__drain_waiters__ = self.__drain_waiters__, []
+		for waiter in waiters:
+			if not waiter.done():
+				waiter.set_result(None)
+		return True
+
+	async def __run__(self, coro):
+		try:
+			await coro
+		except Exception:
+			traceback.print_exc()
+			self.error()
+		finally:
+			self.__end__()
+		return True
+
+	def __track__(self, task):
+		self.__tasks__.add(task)
+		task.add_done_callback(self.__tasks__.discard)
+		return True
+
 	def __gen_object__(self):
 		if not self.__parse_done__:
 			return None
 
-		req = Request.Request(self.method, self.path, self.version, self.headers, self.body, self.__raw_message__)
+		self.__parse_done__ = False
+		req = Request.Request(self.method, self.path, self.version, self.headers, self.body, self.__request__)
 		res = Response.Response(self)
 		return (req, res)
@@ -10,6 +10,7 @@ class Request(dict):
 		self.body = body
 		self.raw = raw
 		self.args = {}
+		self.params = {}
 		self.parsePath()
 
 	def getPath(self):
@@ -24,6 +25,9 @@ class Request(dict):
 	def post(self, field, value=None):
 		return self.body.get(field, value)
 
+	def param(self, field, value=None):
+		return self.params.get(field, value)
+
 	def parsePath(self):
 		self.path = self.path.decode()
 		result = self.path.split("?")
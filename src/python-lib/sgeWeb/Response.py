@@ -8,6 +8,7 @@ class Response(dict):
 		self.headers = {}
 		self.cookie = {}
 		self.body = ''
+		self.cache_ttl = 0
 
 	def set_header(self, headers):
 		self.headers.update(headers)
@@ -18,10 +19,41 @@ class Response(dict):
 	def set_status(self, code):
 		self.status = code
 
+	def cache(self, ttl):
+		''' let the server answer identical GETs from its cache for ttl seconds '''
+		self.cache_ttl = ttl
+
+	def get_cache_ttl(self):
+		if self.status != 200:
+			return 0
+		if self.cache_ttl:
+			return self.cache_ttl
+		value = self.headers.get("Cache-Control")
+		if not value:
+			return 0
+		ttl = 0
+		for directive in value.split(","):
+			k, sep, v = directive.strip().partition("=")
+			k = k.lower()
+			if k in ("no-store", "no-cache", "private"):
+				return 0
+			if k == "s-maxage" and v.isdigit():
+				ttl = int(v)
+		return ttl
+
+	def drain(self):
+		return self.conn.drain()
+
 	def end(self, body):
 		self.body = body
 		self._send()
 
 	def _send(self):
-		msg = self.conn.parse_http_response(self)
-		self.conn.output(msg)
+		head, body = self.conn.parse_http_response(self)
+		ttl = self.get_cache_ttl()
+		if ttl > 0:
+			self.conn.send_cached(ttl, head, body)
+			self.conn.output()
+		else:
+			self.conn.send_response(head, body)
+			self.conn.output()
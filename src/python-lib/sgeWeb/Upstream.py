@@ -0,0 +1,173 @@
+#! /usr/bin/env python
+#-*- coding:utf-8 -*-
+
+import os
+import asyncio
+
+
+class Upstream(object):
+	'''
+	an outbound connection from sge.connect(). the network thread does
+	the I/O; reads resolve in the order they were asked for, so requests
+	can be pipelined: send several, then await the replies one by one.
+	'''
+
+	def __init__(self, read_timeout):
+		self.__loop__ = asyncio.get_running_loop()
+		self.__connected__ = self.__loop__.create_future()
+		self.__handle__ = -1
+		self.__buffer__ = bytearray()
+		self.__readers__ = []
+		self.__eof__ = False
+		self.__error__ = None
+		self.read_timeout = read_timeout
+		# closed when the task that opened it is done and still holds it
+		task = asyncio.current_task(self.__loop__)
+		if task is not None:
+			task.add_done_callback(self.__on_task_done__)
+
+	def send(self, data):
+		''' 不用处理，底层替换 '''
+		pass
+
+	def __release__(self, keep):
+		''' 不用处理，底层替换 '''
+		pass
+
+	def close(self):
+		self.__fail__(ConnectionAbortedError("the upstream connection is closed."))
+		self.__release__(False)
+
+	def release(self):
+		''' back to the pool, once every reply has been read '''
+		keep = not self.__buffer__ and not self.__readers__ and not self.__eof__ and self.__error__ is None
+		self.__release__(keep)
+
+	def read(self, n=-1):
+		''' what is there, up to n bytes, b"" at the end '''
+		def take(eof):
+			if not self.__buffer__ and not eof:
+				return None
+			return self.__take__(len(self.__buffer__) if n < 0 else min(n, len(self.__buffer__)))
+		return self.__wait__(take)
+
+	def readexactly(self, n):
+		def take(eof):
+			if len(self.__buffer__) >= n:
+				return self.__take__(n)
+			if eof:
+				raise asyncio.IncompleteReadError(bytes(self.__buffer__), n)
+			return None
+		return self.__wait__(take)
+
+	def readuntil(self, separator=b"\n"):
+		''' up to and including separator '''
+		def take(eof):
+			pos = self.__buffer__.find(separator)
+			if pos >= 0:
+				return self.__take__(pos + len(separator))
+			if eof:
+				raise asyncio.IncompleteReadError(bytes(self.__buffer__), None)
+			return None
+		return self.__wait__(take)
+
+	def request(self, data, separator=b"\n"):
+		''' send and read the reply, safe to call from concurrent tasks '''
+		self.send(data)
+		return self.readuntil(separator)
+
+	async def __aenter__(self):
+		return self
+
+	async def __aexit__(self, exc_type, exc, tb):
+		if exc_type is None:
+			self.release()
+		else:
+			self.close()
+
+	def __take__(self, n):
+		data = bytes(self.__buffer__[:n])
+		del self.__buffer__[:n]
+		return data
+
+	def __wait__(self, take):
+		future = self.__loop__.create_future()
+		if self.__error__ is not None:
+			future.set_exception(self.__error__)
+			return future
+		timer = None
+		if self.read_timeout:
+			timer = self.__loop__.call_later(self.read_timeout, self.__timeout__, future)
+		self.__readers__.append((take, future, timer))
+		self.__feed__()
+		return future
+
+	def __feed__(self):
+		while self.__readers__:
+			take, future, timer = self.__readers__[0]
+			if future.done():
+				# cancelled, it takes nothing
+				self.__readers__.pop(0)
+				if timer:
+					timer.cancel()
+				continue
+			try:
+				data = take(self.__eof__)
+			except Exception as e:
+				data, error = None, e
+			else:
+				if data is None:
+					return
+				error = None
+			self.__readers__.pop(0)
+			if timer:
+				timer.cancel()
+			if error is None:
+				future.set_result(data)
+			else:
+				future.set_exception(error)
+
+	def __fail__(self, error):
+		if self.__error__ is None:
+			self.__error__ = error
+		readers, self.__readers__ = self.__readers__, []
+		for take, future, timer in readers:
+			if timer:
+				timer.cancel()
+			if not future.done():
+				future.set_exception(error)
+
+	def __timeout__(self, future):
+		# where the stream stands is unknown from here on
+		if not future.done():
+			self.__fail__(TimeoutError("upstream read timed out."))
+			self.__release__(False)
+
+	def __on_task_done__(self, task):
+		if self.__release__(False):
+			self.__fail__(ConnectionAbortedError("the upstream connection is closed."))
+
+	def __on_connect__(self, err):
+		if self.__connected__.done():
+			# whoever awaited it was cancelled, no one is left to release it
+			if not err:
+				self.__release__(False)
+			return True
+		if err:
+			self.__connected__.set_exception(OSError(err, os.strerror(err)))
+		else:
+			self.__connected__.set_result(self)
+		return True
+
+	def __on_data__(self, data):
+		self.__buffer__ += data
+		self.__feed__()
+		return True
+
+	def __on_close__(self, err):
+		self.__eof__ = True
+		if err:
+			self.__fail__(OSError(err, os.strerror(err)))
+		else:
+			self.__feed__()
+		return True
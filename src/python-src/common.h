@@ -1,12 +1,22 @@
 #ifndef COMMON_H_
 #define COMMON_H_
 
+#include "core/metrics.h"
+
 
 #define HAVE_SCRIPT_ERROR() PyErr_Occurred()
 
 #define CHECK_SCRIPT_ERROR()            \
 if (HAVE_SCRIPT_ERROR()) {              \
+    metrics_add(METRIC_PY_EXCEPTIONS, 1);\
     PyErr_Print();                      \
 }
 
+// takes the reference to value
+static inline void
+set_attr(PyObject* obj, const char* name, PyObject* value) {
+	PyObject_SetAttrString(obj, name, value);
+	Py_XDECREF(value);
+}
+
 #endif
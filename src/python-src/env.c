@@ -3,13 +3,25 @@
 #include "core/sge.h"
 #include "core/log.h"
 #include "core/config.h"
+#include "core/http.h"
 #include "core/buffer.h"
+#include "core/chunk.h"
+#include "core/stats.h"
+#include "core/trace.h"
+#include "core/websocket.h"
+#include "core/codec.h"
+#include "core/compress.h"
 #include "os/server.h"
 
 #include "python-src/common.h"
 #include "python-src/env.h"
+#include "python-src/module.h"
+#include "python-src/profiler.h"
+#include "python-src/upstream.h"
+#include "python-src/kvstore.h"
 
 #define MAX_FILE_SIZE 10240
+#define MAX_MODULE_NAME 64
 
 #define PARSE_STRING(DICT, NAME, OBJ, IGNORE)									\
 do {																			\
@@ -27,7 +39,6 @@ do {																			\
 	strncpy(tmp, s, size);														\
 	tmp[size] = '\0';															\
 	(OBJ)->NAME = tmp;															\
-	Py_DECREF(value);															\
 } while(0)
 
 #define PY_FUNCTION_ENTRY()														\
@@ -46,36 +57,144 @@ if (!py_result || py_result == Py_None || py_result == Py_False) {				\
 
 
 
+/*
+ * a python object pinned while the reactor writes it out.
+ * str objects are sent from their cached utf-8 representation,
+ * everything else goes through the buffer protocol.
+ */
+typedef struct {
+	int id;
+	int has_view;
+	uint32_t gen;
+	size_t len;
+	PyObject* obj;
+	Py_buffer view;
+} sge_py_output;
+
+/*
+ * worker side state of a connection. `gen` changes whenever the fd
+ * is reused, so late releases of a closed connection are ignored.
+ */
+typedef struct {
+	PyObject* conn;
+	uint32_t gen;
+	size_t pending;
+	int draining;
+	int websocket;
+	int codec;
+	// a request is with its handler and a sniffing reactor holds the next ones back
+	int answering;
+} sge_py_conn;
+
+
 static int new_conn(sge_message* msg);
 static int on_message(sge_message* msg);
 static int on_read_done(sge_message* msg);
 static int on_close(sge_message* msg);
+static int on_release(sge_message* msg);
+static int on_ws_open(sge_message* msg);
+static int on_ws_message(sge_message* msg);
+static int on_frame(sge_message* msg);
 static int output_error(int id);
+static int output_status(int id, const char* status);
+static int route_request(PyObject* conn, PyObject** handler, PyObject** params, const char** route);
+static int route_websocket(PyObject* conn, PyObject** handler, PyObject** params);
+static PyObject* route_params(const sge_route_match* match);
+static void profile_route(PyObject* conn, const char* route);
 static PyObject* call_cb(PyObject* conn);
 static PyObject* py_close_conn(PyObject* conn, PyObject* args);
 static PyObject* py_send_conn(PyObject* conn, PyObject* msg);
+static PyObject* py_error_conn(PyObject* conn, PyObject* args);
+static PyObject* py_need_drain(PyObject* conn, PyObject* args);
+static PyObject* py_end_conn(PyObject* conn, PyObject* args);
+static void end_response(int id);
+static PyObject* py_send_cached(PyObject* conn, PyObject* args);
+static PyObject* py_send_response(PyObject* conn, PyObject* args);
+static int send_compressed(PyObject* conn, int id, PyObject* head, PyObject* body);
+static int is_get(PyObject* conn);
+static int send_coalesced(int id, PyObject* head, PyObject* body);
+static int private_response(const char* head, size_t len);
+static int accepted_encoding(PyObject* conn);
+static PyObject* py_ws_send(PyObject* conn, PyObject* msg);
+static PyObject* py_send_frame(PyObject* conn, PyObject* msg);
+static PyObject* py_subscribe(PyObject* conn, PyObject* channel);
+static PyObject* py_unsubscribe(PyObject* conn, PyObject* channel);
+static PyObject* send_subscription(PyObject* conn, COMMAND_TYPE type, PyObject* channel);
 static int close_conn(int id);
+static int close_ws(int id, int code);
+static int detach_conn(int id);
+static int call_method(PyObject* obj, const char* name);
+static int schedule_task(PyObject* conn, PyObject* coro);
+static int send_output(int id, COMMAND_TYPE type, PyObject* obj);
+static void release_output(void* ud);
+static void destroy_output(sge_py_output* output);
 static int conn_id(PyObject* conn);
 
 
+#define DRAIN_WATERMARK (64 * 1024)
+
 static PyObject* CALLBACK_FUNC = NULL;
-static PyObject* CONNECTIONS[MAX_SOCK_NUM];
+static PyObject* WS_CALLBACK_FUNC = NULL;
+static PyObject* FRAME_CALLBACK_FUNC = NULL;
+static sge_py_conn CONNECTIONS[MAX_CONN_ID];
 static PyObject* CLS_CONNECTION = NULL;
+static PyObject* LOOP = NULL;
+static PyThreadState* MAIN_THREAD = NULL;
+static cb_worker WORKER_CB = NULL;
+static int CACHE_ENABLED = 0;
+static int COMPRESS_ENABLED = 0;
+static int COALESCE_ENABLED = 0;
+static size_t COMPRESS_MIN_SIZE = 0;
+static const char* COMPRESS_TYPES = NULL;
+// whether any listener speaks http, and any a codec
+static int HTTP_LISTENER = 0;
+static int FRAME_LISTENER = 0;
+static size_t PROFILE_HZ = 0;
 static const cb_worker MESSAGE_CBS[] = {
 	NULL,
 	new_conn,
 	on_message,
 	on_read_done,
-	on_close
+	on_close,
+	on_release,
+	NULL,
+	on_ws_open,
+	on_ws_message,
+	on_ws_message,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	on_frame,
+	on_upstream,
+	on_upstream,
+	on_upstream
 };
 
 
 int
 output_error(int id) {
-	static const char* err_50x = "HTTP/1.1 502 Bad Gateway\r\nContent-Type: text/html; charset=utf-8\r\nContent-Length: 146\r\n\r\n<html><head><title>502 Bad Gateway</title></head><body><center><h1>502 Bad Gateway</h1></center><hr><center>SgeServer 0.0.1</center></body></html>";
-	static const size_t err_50x_len = 240;
-	sge_buffer* buf = create_buffer_ex(err_50x, err_50x_len);
-	sendto_server(CMD_MESSAGE, id, destroy_buffer, buf);
+	if (CONNECTIONS[id].websocket) {
+		// past the handshake there is no response left to fail
+		return close_ws(id, WS_INTERNAL_ERROR);
+	}
+	metrics_add(METRIC_BAD_GATEWAY, 1);
+	return output_status(id, "502 Bad Gateway");
+}
+
+int
+output_status(int id, const char* status) {
+	static const char* page = "<html><head><title>%s</title></head><body><center><h1>%s</h1></center><hr><center>SgeServer 0.0.1</center></body></html>";
+	char body[512], head[256];
+	int body_len, head_len;
+
+	body_len = snprintf(body, sizeof(body), page, status, status);
+	head_len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: text/html; charset=utf-8\r\nContent-Length: %d\r\n\r\n", status, body_len);
+
+	sge_buffer* buf = create_buffer_ex(head, head_len);
+	buf = append_buffer(buf, body, body_len);
+	sendto_server(CMD_MESSAGE, id, destroy_chunk, create_chunk_buffer(buf));
 	close_conn(id);
 	return SGE_OK;
 }
@@ -108,9 +227,27 @@ create_conn(int id) {
 
 	static PyMethodDef def_close = {"close", py_close_conn, METH_NOARGS, "close connection."};
 	static PyMethodDef def_send = {"send", py_send_conn, METH_O, "send content"};
-	PyObject_SetAttrString(conn, "__raw_id__", PyLong_FromLong(id));
-	PyObject_SetAttrString(conn, "close", PyCFunction_New(&def_close, conn));
-	PyObject_SetAttrString(conn, "send", PyCFunction_New(&def_send, conn));
+	static PyMethodDef def_error = {"error", py_error_conn, METH_NOARGS, "reply 502 and close connection."};
+	static PyMethodDef def_need_drain = {"__need_drain__", py_need_drain, METH_NOARGS, "output is above the drain watermark."};
+	static PyMethodDef def_end = {"__end__", py_end_conn, METH_NOARGS, "the response to the current request is out."};
+	static PyMethodDef def_send_cached = {"send_cached", py_send_cached, METH_VARARGS, "send a response the server may cache for ttl seconds"};
+	static PyMethodDef def_send_response = {"send_response", py_send_response, METH_VARARGS, "send a response the server may compress"};
+	static PyMethodDef def_ws_send = {"ws_send", py_ws_send, METH_O, "send a websocket message, text for str, binary otherwise"};
+	static PyMethodDef def_send_frame = {"send_frame", py_send_frame, METH_O, "send one frame of the listener codec"};
+	static PyMethodDef def_subscribe = {"subscribe", py_subscribe, METH_O, "receive what sge.publish() sends to channel"};
+	static PyMethodDef def_unsubscribe = {"unsubscribe", py_unsubscribe, METH_O, "stop receiving channel"};
+	set_attr(conn, "__raw_id__", PyLong_FromLong(id));
+	set_attr(conn, "close", PyCFunction_New(&def_close, conn));
+	set_attr(conn, "send", PyCFunction_New(&def_send, conn));
+	set_attr(conn, "error", PyCFunction_New(&def_error, conn));
+	set_attr(conn, "__need_drain__", PyCFunction_New(&def_need_drain, conn));
+	set_attr(conn, "__end__", PyCFunction_New(&def_end, conn));
+	set_attr(conn, "send_cached", PyCFunction_New(&def_send_cached, conn));
+	set_attr(conn, "send_response", PyCFunction_New(&def_send_response, conn));
+	set_attr(conn, "ws_send", PyCFunction_New(&def_ws_send, conn));
+	set_attr(conn, "send_frame", PyCFunction_New(&def_send_frame, conn));
+	set_attr(conn, "subscribe", PyCFunction_New(&def_subscribe, conn));
+	set_attr(conn, "unsubscribe", PyCFunction_New(&def_unsubscribe, conn));
 RET:
 	return conn;
 }
@@ -121,14 +258,27 @@ new_conn(sge_message* msg) {
 	if (NULL == conn) {
 		return SGE_ERR;
 	}
-	CONNECTIONS[msg->id] = conn;
+	sge_py_conn* c = &CONNECTIONS[msg->id];
+	if (msg->id >= MAX_SOCK_NUM) {
+		// an http/2 stream, closed once its one response is out
+		PyObject_SetAttrString(conn, "__stream__", Py_True);
+	}
+	c->conn = conn;
+	c->gen++;
+	c->pending = 0;
+	c->draining = 0;
+	c->websocket = 0;
+	c->answering = 0;
+	c->codec = (int)(intptr_t)msg->ud;
 	return SGE_OK;
 }
 
 int
 on_message(sge_message* msg) {
-	PyObject* conn = CONNECTIONS[msg->id];
-	assert(conn);
+	PyObject* conn = CONNECTIONS[msg->id].conn;
+	if (NULL == conn) {
+		return SGE_OK;
+	}
 	PyObject* func = PyObject_GetAttrString(conn, "__on_message__");
 	assert(func);
 
@@ -137,6 +287,7 @@ on_message(sge_message* msg) {
 	PyObject* ret = NULL, *arg = NULL;
 	sge_buffer* buf = msg->ud;
 	size_t len = 0;
+	uint64_t start = stats_now();
 	const char* str = buffer_data(buf, &len);
 	if (len == 0) {
 		goto RET;
@@ -144,10 +295,15 @@ on_message(sge_message* msg) {
 	arg = PyBytes_FromStringAndSize(str, len);
 
 	ret = CALL_PY_FUNCTION(func, "O", arg);
+	stats_since(STAGE_PARSE, start);
 	if (py_result_code == SGE_ERR) {
 		goto SUCCESS;
 	}
+	start = stats_now();
+	TRACE1(handler__entry, msg->id);
 	ret = call_cb(conn);
+	TRACE2(handler__return, msg->id, ret == Py_True);
+	stats_since(STAGE_HANDLER, start);
 	if (ret == Py_False && HAVE_SCRIPT_ERROR()) {
 		CHECK_SCRIPT_ERROR();
 		goto RET;
@@ -166,8 +322,10 @@ RET:
 
 int
 on_read_done(sge_message* msg) {
-	PyObject* conn = CONNECTIONS[msg->id];
-	assert(conn);
+	PyObject* conn = CONNECTIONS[msg->id].conn;
+	if (NULL == conn) {
+		return SGE_OK;
+	}
 	PyObject* func = PyObject_GetAttrString(conn, "__on_read_done__");
 	assert(func);
 
@@ -177,40 +335,389 @@ on_read_done(sge_message* msg) {
 		goto RET;
 	}
 RET:
-	Py_DECREF(ret);
+	Py_XDECREF(ret);
 	Py_XDECREF(func);
 	return SGE_OK;
 }
 
 int
 on_close(sge_message* msg) {
-	PyObject* conn = CONNECTIONS[msg->id];
-	if (NULL == conn) {
-		return;
+	return detach_conn(msg->id);
+}
+
+int
+on_release(sge_message* msg) {
+	sge_py_output* output = msg->ud;
+	sge_py_conn* c = &CONNECTIONS[output->id];
+
+	if (c->conn && c->gen == output->gen) {
+		c->pending -= output->len;
+		if (c->draining && c->pending <= DRAIN_WATERMARK) {
+			c->draining = 0;
+			call_method(c->conn, "__on_drain__");
+		}
 	}
-	Py_DECREF(conn);
-	CONNECTIONS[msg->id] = NULL;
+	destroy_output(output);
+	return SGE_OK;
+}
+
+/*
+ * the reactor has switched the connection already, the handshake's
+ * head tells which handler gets its messages.
+ */
+int
+on_ws_open(sge_message* msg) {
+	size_t len;
+	const char* data;
+	sge_py_conn* c = &CONNECTIONS[msg->id];
+	PyObject* head, *ret, *handler, *params;
+
+	if (NULL == c->conn) {
+		return SGE_OK;
+	}
+	c->websocket = 1;
+	data = buffer_data(msg->ud, &len);
+	head = PyBytes_FromStringAndSize(data, len);
+	ret = PyObject_CallMethod(c->conn, "__on_ws_open__", "O", head);
+	Py_DECREF(head);
+	if (NULL == ret) {
+		CHECK_SCRIPT_ERROR();
+		return close_conn(msg->id);
+	}
+	Py_DECREF(ret);
+
+	if (route_websocket(c->conn, &handler, &params) == SGE_ERR) {
+		WARNING("no websocket handler for connection %d", msg->id);
+		return close_ws(msg->id, WS_POLICY_VIOLATION);
+	}
+	PyObject_SetAttrString(c->conn, "__ws_handler__", handler);
+	PyObject_SetAttrString(c->conn, "params", params);
+	Py_DECREF(params);
+	return SGE_OK;
+}
+
+// handler(conn, message), message is str for text and bytes for binary
+int
+on_ws_message(sge_message* msg) {
+	size_t len;
+	const char* data;
+	uint64_t start;
+	sge_py_conn* c = &CONNECTIONS[msg->id];
+	PyObject* handler, *message, *result;
+
+	if (NULL == c->conn || !c->websocket) {
+		return SGE_OK;
+	}
+	handler = PyObject_GetAttrString(c->conn, "__ws_handler__");
+	if (NULL == handler || handler == Py_None) {
+		// closed for want of a handler, this one was on its way
+		Py_XDECREF(handler);
+		PyErr_Clear();
+		return SGE_OK;
+	}
+	data = buffer_data(msg->ud, &len);
+	if (msg->type == CMD_WS_TEXT) {
+		message = PyUnicode_DecodeUTF8(data, len, "strict");
+	} else {
+		message = PyBytes_FromStringAndSize(data, len);
+	}
+	if (NULL == message) {
+		CHECK_SCRIPT_ERROR();
+		Py_DECREF(handler);
+		return close_conn(msg->id);
+	}
+
+	start = stats_now();
+	TRACE1(handler__entry, msg->id);
+	result = PyObject_CallFunctionObjArgs(handler, c->conn, message, NULL);
+	TRACE2(handler__return, msg->id, result != NULL);
+	stats_since(STAGE_HANDLER, start);
+	if (NULL == result) {
+		CHECK_SCRIPT_ERROR();
+		output_error(msg->id);
+	} else {
+		PyAsyncMethods* am = Py_TYPE(result)->tp_as_async;
+		if (am && am->am_await && schedule_task(c->conn, result) == SGE_ERR) {
+			CHECK_SCRIPT_ERROR();
+			output_error(msg->id);
+		}
+		Py_DECREF(result);
+	}
+	Py_DECREF(message);
+	Py_DECREF(handler);
+	return SGE_OK;
+}
+
+/*
+ * a complete frame of the listener codec, as bytes. a handler that
+ * raises closes the connection, there is no error reply to send.
+ */
+int
+on_frame(sge_message* msg) {
+	size_t len;
+	const char* data;
+	uint64_t start;
+	sge_py_conn* c = &CONNECTIONS[msg->id];
+	PyObject* frame, *result;
+
+	if (NULL == c->conn) {
+		return SGE_OK;
+	}
+	data = buffer_data(msg->ud, &len);
+	frame = PyBytes_FromStringAndSize(data, len);
+	if (NULL == frame) {
+		CHECK_SCRIPT_ERROR();
+		return close_conn(msg->id);
+	}
+
+	start = stats_now();
+	TRACE1(handler__entry, msg->id);
+	result = PyObject_CallFunctionObjArgs(FRAME_CALLBACK_FUNC, c->conn, frame, NULL);
+	TRACE2(handler__return, msg->id, result != NULL);
+	stats_since(STAGE_HANDLER, start);
+	if (NULL == result) {
+		CHECK_SCRIPT_ERROR();
+		close_conn(msg->id);
+	} else {
+		PyAsyncMethods* am = Py_TYPE(result)->tp_as_async;
+		if (am && am->am_await && schedule_task(c->conn, result) == SGE_ERR) {
+			CHECK_SCRIPT_ERROR();
+			close_conn(msg->id);
+		}
+		Py_DECREF(result);
+	}
+	Py_DECREF(frame);
+	return SGE_OK;
 }
 
 PyObject*
 call_cb(PyObject* conn) {
+	PyObject* handler = CALLBACK_FUNC, *params = NULL;
+	const char* route = NULL;
 	PyObject* func = PyObject_GetAttrString(conn, "__gen_object__");
 	assert(func);
 	PY_FUNCTION_ENTRY();
 	PyObject* objs = CALL_PY_FUNCTION(func, NULL);
+	Py_DECREF(func);
 	if (py_result_code == SGE_ERR) {
-		Py_DECREF(objs);
+		Py_XDECREF(objs);
 		return Py_False;
 	}
 	PyObject* req = PyTuple_GetItem(objs, 0);
 	PyObject* res = PyTuple_GetItem(objs, 1);
-	PyObject* result = CALL_PY_FUNCTION(CALLBACK_FUNC, "OO", req, res);
+
+	if (!router_empty(module_router())) {
+		int code = route_request(conn, &handler, &params, &route);
+		if (code == SGE_ERR) {
+			Py_DECREF(objs);
+			return Py_False;
+		}
+		if (NULL == handler) {
+			output_status(conn_id(conn), code == ROUTE_NOT_ALLOWED ? "405 Method Not Allowed" : "404 Not Found");
+			Py_DECREF(objs);
+			return Py_True;
+		}
+		PyObject_SetAttrString(req, "params", params);
+		Py_DECREF(params);
+	}
+
+	if (profiler_active()) {
+		profile_route(conn, route);
+	}
+	CONNECTIONS[conn_id(conn)].answering = 1;
+	PyObject* result = CALL_PY_FUNCTION(handler, "OO", req, res);
+	profiler_set_route(NULL);
+	if (NULL == result) {
+		// the handler raised, the traceback is printed already
+		Py_DECREF(objs);
+		output_error(conn_id(conn));
+		return Py_True;
+	}
 	if (py_result_code == SGE_ERR) {
+		Py_XDECREF(result);
 		Py_DECREF(objs);
 		return Py_False;
 	}
 	Py_DECREF(objs);
-	return Py_True;
+
+	// an async handler is done once Connection.__run__ is
+	PyAsyncMethods* am = Py_TYPE(result)->tp_as_async;
+	if (am && am->am_await) {
+		py_result_code = schedule_task(conn, result);
+	} else {
+		end_response(conn_id(conn));
+	}
+	Py_DECREF(result);
+	return py_result_code == SGE_OK ? Py_True : Py_False;
+}
+
+/*
+ * resolve the handler from the raw request line kept on the connection.
+ * falls back to entry_func when no route matches.
+ */
+int
+route_request(PyObject* conn, PyObject** handler, PyObject** params, const char** route) {
+	int code = SGE_ERR;
+	char* method, *path, *query;
+	Py_ssize_t method_len, path_len;
+	sge_route_match match;
+	PyObject* py_method = PyObject_GetAttrString(conn, "method");
+	PyObject* py_path = PyObject_GetAttrString(conn, "path");
+
+	if (NULL == py_method || NULL == py_path) {
+		goto RET;
+	}
+	if (PyBytes_AsStringAndSize(py_method, &method, &method_len) < 0) {
+		goto RET;
+	}
+	if (PyBytes_AsStringAndSize(py_path, &path, &path_len) < 0) {
+		goto RET;
+	}
+	query = memchr(path, '?', path_len);
+	if (query) {
+		path_len = query - path;
+	}
+
+	code = router_match(module_router(), method, method_len, path, path_len, &match);
+	if (code != ROUTE_FOUND) {
+		goto RET;
+	}
+
+	*params = route_params(&match);
+	*handler = match.handler;
+	*route = match.route;
+RET:
+	if (code == SGE_ERR) {
+		CHECK_SCRIPT_ERROR();
+	} else if (code != ROUTE_FOUND && CALLBACK_FUNC) {
+		*params = PyDict_New();
+		code = ROUTE_FOUND;
+	} else if (code != ROUTE_FOUND) {
+		*handler = NULL;
+	}
+	Py_XDECREF(py_method);
+	Py_XDECREF(py_path);
+	return code;
+}
+
+/*
+ * websocket routes by path, falling back to the entry file's
+ * on_ws_message when there is one.
+ */
+int
+route_websocket(PyObject* conn, PyObject** handler, PyObject** params) {
+	char* path, *query;
+	Py_ssize_t path_len;
+	sge_route_match match;
+	PyObject* py_path = PyObject_GetAttrString(conn, "path");
+
+	*handler = WS_CALLBACK_FUNC;
+	*params = NULL;
+	if (py_path && PyBytes_AsStringAndSize(py_path, &path, &path_len) == 0) {
+		query = memchr(path, '?', path_len);
+		if (query) {
+			path_len = query - path;
+		}
+		if (router_match(module_ws_router(), "GET", 3, path, path_len, &match) == ROUTE_FOUND) {
+			*handler = match.handler;
+			*params = route_params(&match);
+		}
+	}
+	PyErr_Clear();
+	Py_XDECREF(py_path);
+	if (NULL == *handler) {
+		return SGE_ERR;
+	}
+	if (NULL == *params) {
+		*params = PyDict_New();
+	}
+	return SGE_OK;
+}
+
+PyObject*
+route_params(const sge_route_match* match) {
+	int i;
+	PyObject* params = PyDict_New();
+
+	for (i = 0; i < match->nparams; ++i) {
+		const sge_route_param* param = &(match->params[i]);
+		PyObject* value = PyUnicode_DecodeUTF8(param->value, param->value_len, "replace");
+		PyObject* name = PyUnicode_FromStringAndSize(param->name, param->name_len);
+		PyDict_SetItem(params, name, value);
+		Py_DECREF(name);
+		Py_DECREF(value);
+	}
+	return params;
+}
+
+/*
+ * label the samples of this request with "METHOD route", or the path
+ * when no route matched. an async handler's task finds it on the
+ * connection as __route__.
+ */
+void
+profile_route(PyObject* conn, const char* route) {
+	char buf[256];
+	int n = 0;
+	char* path;
+	Py_ssize_t path_len;
+	PyObject* label, *py_method = PyObject_GetAttrString(conn, "method");
+	PyObject* py_path = PyObject_GetAttrString(conn, "path");
+
+	if (py_method && PyBytes_Check(py_method) && route) {
+		n = snprintf(buf, sizeof(buf), "%s %s", PyBytes_AS_STRING(py_method), route);
+	} else if (py_method && PyBytes_Check(py_method) && py_path && PyBytes_Check(py_path)) {
+		path = PyBytes_AS_STRING(py_path);
+		path_len = PyBytes_GET_SIZE(py_path);
+		if (memchr(path, '?', path_len)) {
+			path_len = (char*)memchr(path, '?', path_len) - path;
+		}
+		n = snprintf(buf, sizeof(buf), "%s %.*s", PyBytes_AS_STRING(py_method), (int)path_len, path);
+	}
+	Py_XDECREF(py_method);
+	Py_XDECREF(py_path);
+	PyErr_Clear();
+	if (n <= 0) {
+		return;
+	}
+	label = PyUnicode_DecodeUTF8(buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf) - 1, "replace");
+	if (NULL == label) {
+		PyErr_Clear();
+		return;
+	}
+	PyObject_SetAttrString(conn, "__route__", label);
+	profiler_set_route(label);
+}
+
+/*
+ * async handlers run as a task on the worker loop, wrapped by
+ * Connection.__run__ which reports failures through conn.error().
+ */
+int
+schedule_task(PyObject* conn, PyObject* coro) {
+	if (NULL == LOOP) {
+		PyErr_Format(PyExc_TypeError, "handler returned an awaitable but async mode is off, set config.async = True.");
+		return SGE_ERR;
+	}
+
+	PyObject* run = PyObject_CallMethod(conn, "__run__", "O", coro);
+	if (NULL == run) {
+		return SGE_ERR;
+	}
+	PyObject* task = PyObject_CallMethod(LOOP, "create_task", "O", run);
+	Py_DECREF(run);
+	if (NULL == task) {
+		return SGE_ERR;
+	}
+	// the loop only keeps weak references to its tasks, a websocket
+	// may have several running at once
+	PyObject* ret = PyObject_CallMethod(conn, "__track__", "O", task);
+	Py_DECREF(task);
+	if (NULL == ret) {
+		return SGE_ERR;
+	}
+	Py_DECREF(ret);
+	return SGE_OK;
 }
 
 PyObject*
@@ -222,29 +729,439 @@ py_close_conn(PyObject* conn, PyObject* args) {
 
 PyObject*
 py_send_conn(PyObject* conn, PyObject* msg) {
-	if (!PyUnicode_Check(msg)) {
-		PyErr_Format(PyExc_TypeError, "args 1 must be str.");
-		Py_RETURN_NONE;
+	int id = conn_id(conn);
+	if (CONNECTIONS[id].conn != conn) {
+		Py_RETURN_FALSE;
+	}
+	if (send_output(id, CMD_MESSAGE, msg) == SGE_ERR) {
+		return NULL;
+	}
+	Py_RETURN_TRUE;
+}
+
+PyObject*
+py_ws_send(PyObject* conn, PyObject* msg) {
+	int id = conn_id(conn);
+	if (CONNECTIONS[id].conn != conn) {
+		Py_RETURN_FALSE;
+	}
+	if (!CONNECTIONS[id].websocket) {
+		PyErr_Format(PyExc_RuntimeError, "ws_send on a connection that is not a websocket.");
+		return NULL;
+	}
+	if (send_output(id, PyUnicode_Check(msg) ? CMD_WS_TEXT : CMD_WS_BINARY, msg) == SGE_ERR) {
+		return NULL;
+	}
+	Py_RETURN_TRUE;
+}
+
+PyObject*
+py_send_frame(PyObject* conn, PyObject* msg) {
+	int id = conn_id(conn);
+	if (CONNECTIONS[id].conn != conn) {
+		Py_RETURN_FALSE;
+	}
+	if (CONNECTIONS[id].codec == CODEC_HTTP) {
+		PyErr_Format(PyExc_RuntimeError, "send_frame on a listener without a codec.");
+		return NULL;
+	}
+	if (send_output(id, CMD_FRAME, msg) == SGE_ERR) {
+		return NULL;
+	}
+	Py_RETURN_TRUE;
+}
+
+PyObject*
+py_subscribe(PyObject* conn, PyObject* channel) {
+	return send_subscription(conn, CMD_SUBSCRIBE, channel);
+}
+
+PyObject*
+py_unsubscribe(PyObject* conn, PyObject* channel) {
+	return send_subscription(conn, CMD_UNSUBSCRIBE, channel);
+}
+
+// the reactor keeps the subscriptions and drops them when the socket closes
+PyObject*
+send_subscription(PyObject* conn, COMMAND_TYPE type, PyObject* channel) {
+	Py_ssize_t len;
+	const char* name;
+	int id = conn_id(conn);
+
+	if (CONNECTIONS[id].conn != conn) {
+		Py_RETURN_FALSE;
+	}
+	if (id >= MAX_SOCK_NUM) {
+		PyErr_Format(PyExc_RuntimeError, "http/2 streams can not subscribe.");
+		return NULL;
+	}
+	if (!PyUnicode_Check(channel)) {
+		PyErr_Format(PyExc_TypeError, "channel must be str, not %.100s", Py_TYPE(channel)->tp_name);
+		return NULL;
+	}
+	name = PyUnicode_AsUTF8AndSize(channel, &len);
+	if (NULL == name) {
+		return NULL;
+	}
+	sendto_server(type, id, destroy_buffer, create_buffer_ex(name, len));
+	Py_RETURN_TRUE;
+}
+
+PyObject*
+py_error_conn(PyObject* conn, PyObject* args) {
+	int id = conn_id(conn);
+	metrics_add(METRIC_PY_EXCEPTIONS, 1);
+	if (CONNECTIONS[id].conn == conn) {
+		output_error(id);
+	}
+	Py_RETURN_TRUE;
+}
+
+PyObject*
+py_need_drain(PyObject* conn, PyObject* args) {
+	sge_py_conn* c = &CONNECTIONS[conn_id(conn)];
+	if (c->conn != conn || c->pending <= DRAIN_WATERMARK) {
+		Py_RETURN_FALSE;
+	}
+	c->draining = 1;
+	Py_RETURN_TRUE;
+}
+
+PyObject*
+py_end_conn(PyObject* conn, PyObject* args) {
+	int id = conn_id(conn);
+	if (CONNECTIONS[id].conn == conn) {
+		end_response(id);
+	}
+	Py_RETURN_TRUE;
+}
+
+/*
+ * a sniffing reactor holds the client's next request back until the
+ * response to this one is out: at Connection.output(), or when the
+ * handler returns, whichever comes first. only the first counts.
+ */
+void
+end_response(int id) {
+	sge_py_conn* c = &CONNECTIONS[id];
+
+	if (NULL == c->conn || !c->answering) {
+		return;
+	}
+	c->answering = 0;
+	if (id < MAX_SOCK_NUM && (CACHE_ENABLED || COALESCE_ENABLED)) {
+		sendto_server(CMD_RESPONSE_END, id, NULL, NULL);
+	}
+}
+
+/*
+ * the response copied once into a shared buffer, which the reactor
+ * writes out, keeps in its cache for `ttl` seconds and hands to the
+ * identical requests waiting on this one.
+ */
+static void
+send_shared(int id, unsigned int ttl, const Py_buffer* head, const Py_buffer* body) {
+	char* data;
+	sge_cache_item* item = sge_malloc(sizeof(*item));
+
+	item->ttl = ttl;
+	item->data = create_shared_ex(head->len + body->len, &data);
+	memcpy(data, head->buf, head->len);
+	memcpy(data + head->len, body->buf, body->len);
+	sendto_server(CMD_CACHE, id, destroy_cache_item, item);
+}
+
+// send_cached(ttl, head, body)
+PyObject*
+py_send_cached(PyObject* conn, PyObject* args) {
+	unsigned int ttl;
+	Py_buffer head, body;
+	int id = conn_id(conn);
+
+	if (CONNECTIONS[id].conn != conn) {
+		Py_RETURN_FALSE;
+	}
+	if (!PyArg_ParseTuple(args, "Is*s*", &ttl, &head, &body)) {
+		return NULL;
+	}
+
+	if (CACHE_ENABLED || COALESCE_ENABLED) {
+		send_shared(id, ttl, &head, &body);
+	} else {
+		sge_buffer* buf = create_buffer_ex(head.buf, head.len);
+		buf = append_buffer(buf, body.buf, body.len);
+		sendto_server(CMD_MESSAGE, id, destroy_chunk, create_chunk_buffer(buf));
 	}
+	PyBuffer_Release(&head);
+	PyBuffer_Release(&body);
+	Py_RETURN_TRUE;
+}
+
+/*
+ * head and body of a whole response. the body is gzip or deflate
+ * encoded on the compression threads when the request and the response
+ * allow it, otherwise both go out as send() would.
+ */
+PyObject*
+py_send_response(PyObject* conn, PyObject* args) {
+	PyObject* head, *body;
+	int ret = 0, id = conn_id(conn);
 
-	size_t output_len = 0;
-	const char* s_output = PyUnicode_AsUTF8AndSize(msg, &output_len);
-	if (output_len) {
-		int id = conn_id(conn);
-		sge_buffer* output_buf = create_buffer_ex(s_output, output_len);
-		sendto_server(CMD_MESSAGE, id, destroy_buffer, output_buf);
+	if (CONNECTIONS[id].conn != conn) {
+		Py_RETURN_FALSE;
+	}
+	if (!PyArg_ParseTuple(args, "OO", &head, &body)) {
+		return NULL;
+	}
+	// http/2 frames its responses as they are written
+	if (COMPRESS_ENABLED && id < MAX_SOCK_NUM) {
+		ret = send_compressed(conn, id, head, body);
+	}
+	if (ret == 0 && COALESCE_ENABLED && id < MAX_SOCK_NUM && is_get(conn)) {
+		ret = send_coalesced(id, head, body);
+	}
+	if (ret == 0) {
+		ret = send_output(id, CMD_MESSAGE, head);
+		if (ret == SGE_OK) {
+			ret = send_output(id, CMD_MESSAGE, body);
+		}
+	}
+	if (ret == SGE_ERR) {
+		return NULL;
 	}
 	Py_RETURN_TRUE;
 }
 
+// 1 when handed to the compression threads, 0 when not to be compressed
+int
+send_compressed(PyObject* conn, int id, PyObject* head, PyObject* body) {
+	Py_buffer view;
+	Py_ssize_t head_len;
+	const char* s_head;
+	int encoding, ret = 0;
+
+	if (!PyUnicode_Check(head) || !PyObject_CheckBuffer(body)) {
+		return 0;
+	}
+	encoding = accepted_encoding(conn);
+	if (encoding == COMPRESS_IDENTITY) {
+		return 0;
+	}
+	if (PyObject_GetBuffer(body, &view, PyBUF_SIMPLE) < 0) {
+		return SGE_ERR;
+	}
+	s_head = PyUnicode_AsUTF8AndSize(head, &head_len);
+	if (NULL == s_head) {
+		ret = SGE_ERR;
+	} else if (view.len > 0 && (size_t)view.len >= COMPRESS_MIN_SIZE && compress_allowed(COMPRESS_TYPES, s_head, head_len)) {
+		sendto_server(CMD_COMPRESS, id, destroy_compress_job, create_compress_job(id, encoding, s_head, head_len, view.buf, view.len));
+		ret = 1;
+	}
+	PyBuffer_Release(&view);
+	return ret;
+}
+
+static int
+is_get(PyObject* conn) {
+	int ret;
+	PyObject* method = PyObject_GetAttrString(conn, "method");
+
+	if (NULL == method) {
+		PyErr_Clear();
+		return 0;
+	}
+	ret = PyBytes_Check(method) && strcmp(PyBytes_AS_STRING(method), "GET") == 0;
+	Py_DECREF(method);
+	return ret;
+}
+
+/*
+ * a GET may lead identical requests parked in the reactor, so its
+ * response goes out as one shared buffer they can all be answered from.
+ * 1 when sent, 0 when the response is for its own client only, SGE_ERR
+ * with an exception set.
+ */
+static int
+send_coalesced(int id, PyObject* head, PyObject* body) {
+	Py_buffer h, b;
+
+	if (!PyArg_Parse(head, "s*", &h)) {
+		return SGE_ERR;
+	}
+	if (private_response(h.buf, h.len)) {
+		PyBuffer_Release(&h);
+		return 0;
+	}
+	if (!PyArg_Parse(body, "s*", &b)) {
+		PyBuffer_Release(&h);
+		return SGE_ERR;
+	}
+	send_shared(id, 0, &h, &b);
+	PyBuffer_Release(&h);
+	PyBuffer_Release(&b);
+	return 1;
+}
+
+// one that sets a cookie or that Cache-Control keeps out of shared caches
+static int
+private_response(const char* head, size_t len) {
+	size_t n;
+	const char* value;
+
+	if (http_response_header(head, len, "Set-Cookie", &n)) {
+		return 1;
+	}
+	value = http_response_header(head, len, "Cache-Control", &n);
+	return value && (http_has_token(value, n, "private") || http_has_token(value, n, "no-store") || http_has_token(value, n, "no-cache"));
+}
+
+// from the Accept-Encoding of the request, header names as the client sent them
+int
+accepted_encoding(PyObject* conn) {
+	Py_ssize_t pos = 0;
+	PyObject* headers, *key, *value;
+	const char* name;
+	int encoding = COMPRESS_IDENTITY;
+
+	headers = PyObject_GetAttrString(conn, "headers");
+	if (NULL == headers) {
+		PyErr_Clear();
+		return COMPRESS_IDENTITY;
+	}
+	while (PyDict_Check(headers) && PyDict_Next(headers, &pos, &key, &value)) {
+		name = PyUnicode_Check(key) ? PyUnicode_AsUTF8(key) : NULL;
+		if (name && strcasecmp(name, "Accept-Encoding") == 0 && PyBytes_Check(value)) {
+			encoding = compress_negotiate(PyBytes_AS_STRING(value), PyBytes_GET_SIZE(value));
+			break;
+		}
+	}
+	Py_DECREF(headers);
+	return encoding;
+}
+
+/*
+ * CMD_MESSAGE for raw response bytes, CMD_WS_TEXT or CMD_WS_BINARY for
+ * the payload of a websocket message and CMD_FRAME for that of a codec
+ * frame, both of which may be empty.
+ */
+int
+send_output(int id, COMMAND_TYPE type, PyObject* obj) {
+	Py_ssize_t len = 0;
+	const char* data = NULL;
+	sge_py_output* output = sge_malloc(sizeof(*output));
+
+	output->id = id;
+	output->has_view = 0;
+	output->gen = CONNECTIONS[id].gen;
+	output->obj = obj;
+	if (PyUnicode_Check(obj)) {
+		data = PyUnicode_AsUTF8AndSize(obj, &len);
+		if (NULL == data) {
+			goto ERROR;
+		}
+		Py_INCREF(obj);
+	} else if (PyObject_CheckBuffer(obj)) {
+		if (PyObject_GetBuffer(obj, &(output->view), PyBUF_SIMPLE) < 0) {
+			goto ERROR;
+		}
+		output->has_view = 1;
+		data = output->view.buf;
+		len = output->view.len;
+	} else {
+		PyErr_Format(PyExc_TypeError, "args 1 must be str or bytes-like object, not %.100s", Py_TYPE(obj)->tp_name);
+		goto ERROR;
+	}
+
+	if (len == 0 && type == CMD_MESSAGE) {
+		destroy_output(output);
+		return SGE_OK;
+	}
+	if (type == CMD_FRAME && CONNECTIONS[id].codec == CODEC_U16 && len > 0xffff) {
+		PyErr_Format(PyExc_ValueError, "a u16 frame holds up to 65535 bytes, not %zd", len);
+		destroy_output(output);
+		return SGE_ERR;
+	}
+
+	output->len = len;
+	CONNECTIONS[id].pending += len;
+	sge_chunk* chunk = create_chunk(data, len, release_output, output);
+	sendto_server(type, id, destroy_chunk, chunk);
+	return SGE_OK;
+ERROR:
+	sge_free(output);
+	return SGE_ERR;
+}
+
+void
+destroy_output(sge_py_output* output) {
+	if (output->has_view) {
+		PyBuffer_Release(&(output->view));
+	} else {
+		Py_DECREF(output->obj);
+	}
+	sge_free(output);
+}
+
+/*
+ * called by the reactor once the data has been written. dropping the
+ * reference needs the interpreter, so hand it back to the worker.
+ */
+void
+release_output(void* ud) {
+	sge_py_output* output = ud;
+	sendto_worker(CMD_RELEASE, output->id, NULL, output);
+}
+
 int
 close_conn(int id) {
-	Py_DECREF(CONNECTIONS[id]);
-	CONNECTIONS[id] = NULL;
+	if (NULL == CONNECTIONS[id].conn) {
+		return SGE_OK;
+	}
+	detach_conn(id);
 	sendto_server(CMD_CLOSE, id, NULL, NULL);
 	return SGE_OK;
 }
 
+// CMD_CLOSE carries the close code for a websocket
+int
+close_ws(int id, int code) {
+	if (NULL == CONNECTIONS[id].conn) {
+		return SGE_OK;
+	}
+	detach_conn(id);
+	sendto_server(CMD_CLOSE, id, NULL, (void*)(intptr_t)code);
+	return SGE_OK;
+}
+
+int
+detach_conn(int id) {
+	sge_py_conn* c = &CONNECTIONS[id];
+	PyObject* conn = c->conn;
+
+	if (NULL == conn) {
+		return SGE_OK;
+	}
+	c->conn = NULL;
+	c->answering = 0;
+	if (c->draining) {
+		c->draining = 0;
+		call_method(conn, "__on_drain__");
+	}
+	Py_DECREF(conn);
+	return SGE_OK;
+}
+
+int
+call_method(PyObject* obj, const char* name) {
+	PyObject* ret = PyObject_CallMethod(obj, name, NULL);
+	if (NULL == ret) {
+		CHECK_SCRIPT_ERROR();
+		return SGE_ERR;
+	}
+	Py_DECREF(ret);
+	return SGE_OK;
+}
+
 int
 conn_id(PyObject* conn) {
 	PyObject* py_raw_id = PyObject_GetAttrString(conn, "__raw_id__");
@@ -258,11 +1175,97 @@ on_request(sge_message* msg) {
 	cb_worker cb = MESSAGE_CBS[msg->type];
 	if (!cb) {
 		ERROR("unknown message type: %d", msg->type);
-		return;
+		return SGE_ERR;
 	}
 	return cb(msg);
 }
 
+static PyObject*
+py_dispatch(PyObject* self, PyObject* args) {
+	if (poll_worker(WORKER_CB) == SGE_ERR) {
+		PyObject* ret = PyObject_CallMethod(LOOP, "stop", NULL);
+		if (NULL == ret) {
+			return NULL;
+		}
+		Py_DECREF(ret);
+	}
+	Py_RETURN_NONE;
+}
+
+static int
+run_worker(cb_worker cb) {
+	PyGILState_STATE state = PyGILState_Ensure();
+
+	if (PROFILE_HZ > 0) {
+		start_profiler(PROFILE_HZ);
+	}
+
+	while (poll_worker(cb) == SGE_OK) {
+		Py_BEGIN_ALLOW_THREADS
+		wait_worker_message();
+		Py_END_ALLOW_THREADS
+	}
+
+	PyGILState_Release(state);
+	return SGE_OK;
+}
+
+/*
+ * async mode: the worker thread runs an asyncio loop and the mailbox
+ * eventfd is just another reader on it, so suspended handlers and new
+ * messages are served by the same thread.
+ */
+static int
+run_loop(cb_worker cb) {
+	static PyMethodDef def_dispatch = {"dispatch", py_dispatch, METH_NOARGS, "dispatch worker messages."};
+	PyObject* asyncio = NULL, *dispatch = NULL, *ret = NULL;
+	PyGILState_STATE state = PyGILState_Ensure();
+
+	WORKER_CB = cb;
+	if (PROFILE_HZ > 0) {
+		start_profiler(PROFILE_HZ);
+	}
+	asyncio = PyImport_ImportModule("asyncio");
+	if (NULL == asyncio) {
+		goto RET;
+	}
+	LOOP = PyObject_CallMethod(asyncio, "new_event_loop", NULL);
+	if (NULL == LOOP) {
+		goto RET;
+	}
+	ret = PyObject_CallMethod(asyncio, "set_event_loop", "O", LOOP);
+	if (NULL == ret) {
+		goto RET;
+	}
+	Py_DECREF(ret);
+
+	dispatch = PyCFunction_New(&def_dispatch, NULL);
+	ret = PyObject_CallMethod(LOOP, "add_reader", "iO", worker_fd(), dispatch);
+	if (NULL == ret) {
+		goto RET;
+	}
+	Py_DECREF(ret);
+	ret = PyObject_CallMethod(LOOP, "call_soon", "O", dispatch);
+	if (NULL == ret) {
+		goto RET;
+	}
+	Py_DECREF(ret);
+
+	ret = PyObject_CallMethod(LOOP, "run_forever", NULL);
+	Py_XDECREF(ret);
+	CHECK_SCRIPT_ERROR();
+
+	ret = PyObject_CallMethod(LOOP, "close", NULL);
+	Py_XDECREF(ret);
+RET:
+	CHECK_SCRIPT_ERROR();
+	Py_XDECREF(dispatch);
+	Py_XDECREF(asyncio);
+	Py_CLEAR(LOOP);
+	PyGILState_Release(state);
+	return SGE_OK;
+}
+
 
 static int
 get_filename(const char* file, char* name) {
@@ -274,12 +1277,12 @@ get_filename(const char* file, char* name) {
 	} else {
 		len = p - base;
 	}
-	if (len == 0) {
-		ERROR("module name len is zero.\n");
+	if (len == 0 || len >= MAX_MODULE_NAME) {
+		ERROR("bad module name length %d.\n", len);
 		return SGE_ERR;
 	}
 	strncpy(name, base, len);
-	name[len + 1] = '\0';
+	name[len] = '\0';
 	return SGE_OK;
 }
 
@@ -308,19 +1311,257 @@ parser_daemon(PyObject* py_config, sge_config* config) {
 	PARSE_STRING(py_config, logfile, config, 0);
 
 RET:
-	Py_XDECREF(py_daemon);
 	config->daemon = daemon;
 	return code;
 }
 
+static int
+parse_bool(PyObject* py_config, const char* name, int* value) {
+	PyObject* py_value = PyDict_GetItemString(py_config, name);
+	if (NULL == py_value) {
+		return SGE_OK;
+	}
+	if (!PyBool_Check(py_value)) {
+		fprintf(stderr, "config.%s must be boolean\n", name);
+		return SGE_ERR;
+	}
+	*value = (py_value == Py_True);
+	return SGE_OK;
+}
+
+static int
+parse_size(PyObject* py_config, const char* name, size_t* value) {
+	PyObject* py_value = PyDict_GetItemString(py_config, name);
+	if (NULL == py_value) {
+		return SGE_OK;
+	}
+	if (!PyLong_Check(py_value)) {
+		fprintf(stderr, "config.%s must be int\n", name);
+		return SGE_ERR;
+	}
+	*value = PyLong_AsSize_t(py_value);
+	if (PyErr_Occurred()) {
+		return SGE_ERR;
+	}
+	return SGE_OK;
+}
+
+static int
+parse_listener(PyObject* py_listener, sge_config* config, sge_listen_config* l) {
+	l->codec = config->codec;
+	l->backlog = DEFAULT_BACKLOG;
+	l->defer_accept = 0;
+	l->fastopen = 0;
+	l->rcvbuf = 0;
+	l->sndbuf = 0;
+	l->busy_poll = 0;
+	l->nodelay = 1;
+	l->tls = 1;
+	PARSE_STRING(py_listener, socket, l, 0);
+	PARSE_STRING(py_listener, codec, l, 1);
+	if (codec_type(l->codec) == SGE_ERR) {
+		fprintf(stderr, "config.codec must be one of http, raw, line, u16 and u32.\n");
+		return SGE_ERR;
+	}
+	if (parse_size(py_listener, "backlog", &(l->backlog)) == SGE_ERR
+		|| parse_size(py_listener, "defer_accept", &(l->defer_accept)) == SGE_ERR
+		|| parse_size(py_listener, "fastopen", &(l->fastopen)) == SGE_ERR
+		|| parse_size(py_listener, "rcvbuf", &(l->rcvbuf)) == SGE_ERR
+		|| parse_size(py_listener, "sndbuf", &(l->sndbuf)) == SGE_ERR
+		|| parse_size(py_listener, "busy_poll", &(l->busy_poll)) == SGE_ERR
+		|| parse_bool(py_listener, "nodelay", &(l->nodelay)) == SGE_ERR
+		|| parse_bool(py_listener, "tls", &(l->tls)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (codec_type(l->codec) == CODEC_HTTP) {
+		HTTP_LISTENER = 1;
+	} else {
+		FRAME_LISTENER = 1;
+	}
+	return SGE_OK;
+}
+
+/*
+ * config.listeners is a list of dicts, each with a socket and its own
+ * codec and socket options. without it config.socket is the one
+ * listener, using the defaults.
+ */
+static int
+parse_listeners(PyObject* py_config, sge_config* config) {
+	Py_ssize_t i, n;
+	PyObject* py_listener;
+	PyObject* py_listeners = PyDict_GetItemString(py_config, "listeners");
+
+	if (NULL == py_listeners) {
+		if (NULL == config->socket) {
+			fprintf(stderr, "can't found config.socket variable.\n");
+			return SGE_ERR;
+		}
+		py_listener = PyDict_New();
+		PyDict_SetItemString(py_listener, "socket", PyDict_GetItemString(py_config, "socket"));
+		config->nlistener = 1;
+		n = parse_listener(py_listener, config, &config->listeners[0]);
+		Py_DECREF(py_listener);
+		return n;
+	}
+	if (!PyList_Check(py_listeners)) {
+		fprintf(stderr, "config.listeners must be a list\n");
+		return SGE_ERR;
+	}
+	n = PyList_GET_SIZE(py_listeners);
+	if (n == 0 || n > MAX_LISTENERS) {
+		fprintf(stderr, "config.listeners must have 1 to %d entries\n", MAX_LISTENERS);
+		return SGE_ERR;
+	}
+	for (i = 0; i < n; ++i) {
+		py_listener = PyList_GET_ITEM(py_listeners, i);
+		if (!PyDict_Check(py_listener)) {
+			fprintf(stderr, "config.listeners[%zd] must be a dict\n", i);
+			return SGE_ERR;
+		}
+		if (parse_listener(py_listener, config, &config->listeners[i]) == SGE_ERR) {
+			return SGE_ERR;
+		}
+	}
+	config->nlistener = n;
+	return SGE_OK;
+}
+
+static int
+parse_log_level(PyObject* py_config, int* value) {
+	static const char* names[] = {"debug", "info", "warn", "error"};
+	PyObject* py_value = PyDict_GetItemString(py_config, "log_level");
+	const char* name;
+	size_t i;
+
+	if (NULL == py_value) {
+		return SGE_OK;
+	}
+	name = PyUnicode_Check(py_value) ? PyUnicode_AsUTF8(py_value) : NULL;
+	for (i = 0; name && i < sizeof(names) / sizeof(names[0]); ++i) {
+		if (strcmp(name, names[i]) == 0) {
+			*value = LEVEL_DEBUG + i;
+			return SGE_OK;
+		}
+	}
+	fprintf(stderr, "config.log_level must be one of debug, info, warn, error\n");
+	return SGE_ERR;
+}
+
 static int
 parse_config(PyObject* py_config, sge_config* config) {
 	PARSE_STRING(py_config, workdir, config, 0);
 	PARSE_STRING(py_config, entry_file, config, 0);
-	PARSE_STRING(py_config, entry_func, config, 0);
-	PARSE_STRING(py_config, socket, config, 0);
+	PARSE_STRING(py_config, entry_func, config, 1);
+	PARSE_STRING(py_config, socket, config, 1);
 	PARSE_STRING(py_config, user, config, 1);
 	PARSE_STRING(py_config, libdir, config, 1);
+	PARSE_STRING(py_config, cache_vary, config, 1);
+	PARSE_STRING(py_config, admin_socket, config, 1);
+	PARSE_STRING(py_config, access_log, config, 1);
+	PARSE_STRING(py_config, capture, config, 1);
+	PARSE_STRING(py_config, compress_types, config, 1);
+	PARSE_STRING(py_config, tls_cert, config, 1);
+	PARSE_STRING(py_config, tls_key, config, 1);
+	PARSE_STRING(py_config, codec, config, 1);
+	if (codec_type(config->codec) == SGE_ERR) {
+		fprintf(stderr, "config.codec must be one of http, raw, line, u16 and u32.\n");
+		return SGE_ERR;
+	}
+	if (parse_listeners(py_config, config) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_bool(py_config, "async", &(config->async)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_bool(py_config, "http2", &(config->http2)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_bool(py_config, "websocket", &(config->websocket)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_bool(py_config, "compress", &(config->compress)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_bool(py_config, "coalesce", &(config->coalesce)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_bool(py_config, "ktls", &(config->ktls)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "cache_size", &(config->cache_size)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	CACHE_ENABLED = config->cache_size > 0;
+	COMPRESS_ENABLED = config->compress;
+	COALESCE_ENABLED = config->coalesce;
+	if (parse_size(py_config, "shutdown_timeout", &(config->shutdown_timeout)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "access_log_size", &(config->access_log_size)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "access_log_rotate", &(config->access_log_rotate)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "overload_target", &(config->overload_target)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "overload_interval", &(config->overload_interval)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "capture_sample", &(config->capture_sample)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "capture_size", &(config->capture_size)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "websocket_max_size", &(config->websocket_max_size)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "websocket_ping", &(config->websocket_ping)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "compress_min_size", &(config->compress_min_size)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "compress_threads", &(config->compress_threads)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "compress_level", &(config->compress_level)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "compress_cache_size", &(config->compress_cache_size)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "codec_max_size", &(config->codec_max_size)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "upstream_connect_timeout", &(config->upstream_connect_timeout)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "upstream_read_timeout", &(config->upstream_read_timeout)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "upstream_idle_timeout", &(config->upstream_idle_timeout)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_size(py_config, "upstream_pool_size", &(config->upstream_pool_size)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	init_upstreams(config->upstream_read_timeout);
+	if (parse_size(py_config, "kv_size", &(config->kv_size)) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	init_kvstore(config->kv_size);
+	COMPRESS_MIN_SIZE = config->compress_min_size;
+	COMPRESS_TYPES = config->compress_types;
+	if (parse_size(py_config, "profile_hz", &PROFILE_HZ) == SGE_ERR) {
+		return SGE_ERR;
+	}
+	if (parse_log_level(py_config, &(config->log_level)) == SGE_ERR) {
+		return SGE_ERR;
+	}
 	return parser_daemon(py_config, config);
 }
 
@@ -379,7 +1620,6 @@ static int
 init_python_syspath(sge_config* config) {
 	PyObject* syspath = PySys_GetObject("path");
 	add_custom_libs(syspath, config->workdir, config->libdir);
-	Py_DECREF(syspath);
 	return SGE_OK;
 }
 
@@ -393,19 +1633,91 @@ load_entry_file(sge_config* config) {
 		return SGE_ERR;
 	}
 
-	PyObject* func = PyObject_GetAttrString(module, config->entry_func);
-	if (NULL == func) {
-		CHECK_SCRIPT_ERROR();
-		return SGE_ERR;
+	if (config->entry_func) {
+		PyObject* func = PyObject_GetAttrString(module, config->entry_func);
+		if (NULL == func) {
+			CHECK_SCRIPT_ERROR();
+			return SGE_ERR;
+		}
+		CALLBACK_FUNC = func;
+		config->async |= is_coroutine_function(func);
+	}
+	WS_CALLBACK_FUNC = PyObject_GetAttrString(module, "on_ws_message");
+	if (WS_CALLBACK_FUNC) {
+		config->async |= is_coroutine_function(WS_CALLBACK_FUNC);
+	} else {
+		PyErr_Clear();
 	}
+	FRAME_CALLBACK_FUNC = PyObject_GetAttrString(module, "on_frame");
+	if (FRAME_CALLBACK_FUNC) {
+		config->async |= is_coroutine_function(FRAME_CALLBACK_FUNC);
+	} else {
+		PyErr_Clear();
+	}
+	return SGE_OK;
+}
 
-	CALLBACK_FUNC = func;
+/*
+ * config.routes = [("GET", "/users/{id}", "module.func"), ...]
+ */
+static int
+load_routes(PyObject* py_config) {
+	Py_ssize_t i;
+	PyObject* routes = PyDict_GetItemString(py_config, "routes");
+	if (NULL == routes) {
+		return SGE_OK;
+	}
 
+	for (i = 0; i < PySequence_Size(routes); ++i) {
+		int code = SGE_ERR;
+		const char* method, *path, *target, *dot;
+		PyObject* route = PySequence_GetItem(routes, i);
+		PyObject* module = NULL, *handler = NULL, *ret = NULL;
+
+		if (NULL == route || !PyArg_ParseTuple(route, "sss", &method, &path, &target)) {
+			goto NEXT;
+		}
+		dot = strrchr(target, '.');
+		if (NULL == dot) {
+			PyErr_Format(PyExc_ValueError, "route handler must be module.func: %s", target);
+			goto NEXT;
+		}
+		PyObject* name = PyUnicode_FromStringAndSize(target, dot - target);
+		module = PyImport_Import(name);
+		Py_DECREF(name);
+		if (NULL == module) {
+			goto NEXT;
+		}
+		handler = PyObject_GetAttrString(module, dot + 1);
+		if (NULL == handler) {
+			goto NEXT;
+		}
+		PyObject* sge = PyImport_ImportModule("sge");
+		if (NULL == sge) {
+			goto NEXT;
+		}
+		ret = PyObject_CallMethod(sge, "add_route", "ssO", method, path, handler);
+		Py_DECREF(sge);
+		if (ret) {
+			code = SGE_OK;
+		}
+NEXT:
+		Py_XDECREF(ret);
+		Py_XDECREF(handler);
+		Py_XDECREF(module);
+		Py_XDECREF(route);
+		if (code == SGE_ERR) {
+			return SGE_ERR;
+		}
+	}
 	return SGE_OK;
 }
 
 int
 init_env() {
+	if (init_module() == SGE_ERR) {
+		return SGE_ERR;
+	}
 	Py_Initialize();
 	if (!Py_IsInitialized()) {
 		return SGE_ERR;
@@ -439,7 +1751,7 @@ load_config(const char* file, sge_config* config) {
 	buffer[len] = '\0';
 	fclose(fp);
 
-	char filename[64];
+	char filename[MAX_MODULE_NAME];
 	PyObject* code = NULL, *module = NULL, *py_config = NULL;
 	if (get_filename(file, filename) == SGE_ERR) {
 		return SGE_ERR;
@@ -468,7 +1780,25 @@ load_config(const char* file, sge_config* config) {
 		goto ERROR;
 	}
 
+	if (load_routes(py_config) == SGE_ERR) {
+		goto ERROR;
+	}
+
+	if (FRAME_LISTENER && NULL == FRAME_CALLBACK_FUNC) {
+		ERROR("a listener has a codec but the entry file has no on_frame.");
+		goto ERROR;
+	}
+
+	if (HTTP_LISTENER && NULL == CALLBACK_FUNC && router_empty(module_router())) {
+		ERROR("config.entry_func is not set and no route is registered.");
+		goto ERROR;
+	}
+
+	config->async |= module_has_async();
+	config->runner = config->async ? run_loop : run_worker;
+
 	config->cb = on_request;
+	config->admin = profiler_command;
 	goto RET;
 
 ERROR:
@@ -476,11 +1806,22 @@ ERROR:
 	CHECK_SCRIPT_ERROR();
 RET:
 	Py_XDECREF(py_config);
+	if (retcode == SGE_OK) {
+		// the worker thread takes the interpreter from here on
+		MAIN_THREAD = PyEval_SaveThread();
+	}
 	return retcode;
 }
 
 int
 destroy_env() {
+	destroy_profiler();
+	if (MAIN_THREAD) {
+		PyEval_RestoreThread(MAIN_THREAD);
+	}
+	destroy_upstreams();
+	destroy_kvstore();
+	destroy_module();
 	Py_Finalize();
 	return SGE_OK;
 }
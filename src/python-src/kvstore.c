@@ -0,0 +1,163 @@
+#include <Python.h>
+#include <time.h>
+
+#include "core/sge.h"
+#include "core/kv.h"
+
+#include "python-src/common.h"
+#include "python-src/kvstore.h"
+
+/*
+ * sge.cache, the handlers' own key-value store. keys are str or bytes,
+ * a str standing for its utf-8. values are copied in from str or
+ * anything bytes-like and come back as bytes. the store lives in C,
+ * so a get or set is one hash lookup under a shard lock and no Python
+ * object is kept alive by it.
+ */
+
+static PyObject* py_get(PyObject* self, PyObject* args, PyObject* kwargs);
+static PyObject* py_set(PyObject* self, PyObject* args, PyObject* kwargs);
+static PyObject* py_delete(PyObject* self, PyObject* args);
+static PyObject* py_stats(PyObject* self, PyObject* args);
+static void* copy_value(const char* data, size_t len);
+static int check_kv();
+static uint64_t now_ms();
+
+
+static sge_kv* KV = NULL;
+
+static PyMethodDef KV_METHODS[] = {
+	{"get", (PyCFunction)py_get, METH_VARARGS | METH_KEYWORDS, "get(key, default=None), the bytes stored under key"},
+	{"set", (PyCFunction)py_set, METH_VARARGS | METH_KEYWORDS, "set(key, value, ttl=0), ttl in seconds, 0 for none. False if value is too big"},
+	{"delete", py_delete, METH_VARARGS, "delete(key), False if there was none"},
+	{"stats", py_stats, METH_NOARGS, "stats(), entries and bytes held"},
+	{NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef KV_MODULE = {
+	PyModuleDef_HEAD_INIT,
+	"sge.cache",
+	"in-process key-value store with TTLs and CLOCK eviction.",
+	-1,
+	KV_METHODS
+};
+
+
+// 0 leaves sge.cache off
+void
+init_kvstore(size_t max_bytes) {
+	if (KV) {
+		destroy_kv(KV);
+		KV = NULL;
+	}
+	if (max_bytes > 0) {
+		KV = create_kv(max_bytes);
+	}
+}
+
+PyObject*
+create_kvstore_module() {
+	return PyModule_Create(&KV_MODULE);
+}
+
+void
+destroy_kvstore() {
+	init_kvstore(0);
+}
+
+PyObject*
+py_get(PyObject* self, PyObject* args, PyObject* kwargs) {
+	static char* kwlist[] = {"key", "default", NULL};
+	Py_buffer key;
+	PyObject* value, *dft = Py_None;
+
+	if (check_kv() == SGE_ERR || !PyArg_ParseTupleAndKeywords(args, kwargs, "s*|O", kwlist, &key, &dft)) {
+		return NULL;
+	}
+	value = kv_get(KV, key.buf, key.len, now_ms(), copy_value);
+	PyBuffer_Release(&key);
+	if (value) {
+		metrics_add(METRIC_KV_HITS, 1);
+		return value;
+	}
+	if (PyErr_Occurred()) {
+		return NULL;
+	}
+	metrics_add(METRIC_KV_MISSES, 1);
+	Py_INCREF(dft);
+	return dft;
+}
+
+PyObject*
+py_set(PyObject* self, PyObject* args, PyObject* kwargs) {
+	static char* kwlist[] = {"key", "value", "ttl", NULL};
+	int evicted;
+	double ttl = 0;
+	Py_buffer key, value;
+
+	if (check_kv() == SGE_ERR || !PyArg_ParseTupleAndKeywords(args, kwargs, "s*s*|d", kwlist, &key, &value, &ttl)) {
+		return NULL;
+	}
+	if (ttl < 0) {
+		PyBuffer_Release(&key);
+		PyBuffer_Release(&value);
+		PyErr_Format(PyExc_ValueError, "ttl must not be negative");
+		return NULL;
+	}
+	// a ttl under a millisecond still expires
+	evicted = kv_set(KV, key.buf, key.len, value.buf, value.len, now_ms(), ttl > 0 ? (uint64_t)(ttl * 1000) + 1 : 0);
+	PyBuffer_Release(&key);
+	PyBuffer_Release(&value);
+	if (evicted == SGE_ERR) {
+		Py_RETURN_FALSE;
+	}
+	if (evicted > 0) {
+		metrics_add(METRIC_KV_EVICTIONS, evicted);
+	}
+	Py_RETURN_TRUE;
+}
+
+PyObject*
+py_delete(PyObject* self, PyObject* args) {
+	int ret;
+	Py_buffer key;
+
+	if (check_kv() == SGE_ERR || !PyArg_ParseTuple(args, "s*", &key)) {
+		return NULL;
+	}
+	ret = kv_del(KV, key.buf, key.len);
+	PyBuffer_Release(&key);
+	if (ret == SGE_ERR) {
+		Py_RETURN_FALSE;
+	}
+	Py_RETURN_TRUE;
+}
+
+PyObject*
+py_stats(PyObject* self, PyObject* args) {
+	if (check_kv() == SGE_ERR) {
+		return NULL;
+	}
+	return Py_BuildValue("{s:n,s:n}", "entries", (Py_ssize_t)kv_count(KV), "bytes", (Py_ssize_t)kv_bytes(KV));
+}
+
+void*
+copy_value(const char* data, size_t len) {
+	return PyBytes_FromStringAndSize(data, len);
+}
+
+int
+check_kv() {
+	if (NULL == KV) {
+		PyErr_Format(PyExc_RuntimeError, "sge.cache needs config.kv_size.");
+		return SGE_ERR;
+	}
+	return SGE_OK;
+}
+
+uint64_t
+now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,10 @@
+#ifndef KVSTORE_H_
+#define KVSTORE_H_
+
+#include <Python.h>
+
+void init_kvstore(size_t max_bytes);
+PyObject* create_kvstore_module();
+void destroy_kvstore();
+
+#endif
@@ -0,0 +1,287 @@
+#include <Python.h>
+
+#include "core/sge.h"
+#include "core/log.h"
+#include "core/router.h"
+#include "core/buffer.h"
+#include "core/chunk.h"
+#include "os/server.h"
+
+#include "python-src/common.h"
+#include "python-src/module.h"
+#include "python-src/upstream.h"
+#include "python-src/kvstore.h"
+
+
+static PyObject* py_add_route(PyObject* self, PyObject* args);
+static PyObject* py_route(PyObject* self, PyObject* args, PyObject* kwargs);
+static PyObject* py_register_route(PyObject* self, PyObject* handler);
+static PyObject* py_websocket(PyObject* self, PyObject* args);
+static PyObject* py_register_websocket(PyObject* path, PyObject* handler);
+static PyObject* py_publish(PyObject* self, PyObject* args);
+static int add_route(PyObject* method, PyObject* path, PyObject* handler);
+static void free_handler(void* handler);
+
+
+static sge_router* ROUTER = NULL;
+static sge_router* WS_ROUTER = NULL;
+static int HAS_ASYNC = 0;
+
+static PyMethodDef SGE_METHODS[] = {
+	{"add_route", py_add_route, METH_VARARGS, "add_route(method, path, handler)"},
+	{"route", (PyCFunction)py_route, METH_VARARGS | METH_KEYWORDS, "route(path, methods=('GET',)) decorator"},
+	{"websocket", py_websocket, METH_VARARGS, "websocket(path) decorator, handler(conn, message)"},
+	{"publish", py_publish, METH_VARARGS, "publish(channel, data) to every connection subscribed to channel"},
+	{"connect", py_connect, METH_O, "connect(addr), awaits an outbound connection kept by the server"},
+	{NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef SGE_MODULE = {
+	PyModuleDef_HEAD_INIT,
+	"sge",
+	"sge-server native api.",
+	-1,
+	SGE_METHODS
+};
+
+
+PyObject*
+py_add_route(PyObject* self, PyObject* args) {
+	PyObject* method, *path, *handler;
+
+	if (!PyArg_ParseTuple(args, "UUO", &method, &path, &handler)) {
+		return NULL;
+	}
+	if (add_route(method, path, handler) == SGE_ERR) {
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+PyObject*
+py_route(PyObject* self, PyObject* args, PyObject* kwargs) {
+	static char* kwlist[] = {"path", "methods", NULL};
+	static PyMethodDef def_register = {"register", py_register_route, METH_O, "register route handler."};
+	PyObject* path, *methods = NULL, *spec, *decorator;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|O", kwlist, &path, &methods)) {
+		return NULL;
+	}
+	if (methods) {
+		methods = PySequence_Tuple(methods);
+	} else {
+		methods = Py_BuildValue("(s)", "GET");
+	}
+	if (NULL == methods) {
+		return NULL;
+	}
+
+	spec = PyTuple_Pack(2, path, methods);
+	Py_DECREF(methods);
+	if (NULL == spec) {
+		return NULL;
+	}
+	decorator = PyCFunction_New(&def_register, spec);
+	Py_DECREF(spec);
+	return decorator;
+}
+
+PyObject*
+py_register_route(PyObject* spec, PyObject* handler) {
+	Py_ssize_t i;
+	PyObject* path = PyTuple_GET_ITEM(spec, 0);
+	PyObject* methods = PyTuple_GET_ITEM(spec, 1);
+
+	for (i = 0; i < PyTuple_GET_SIZE(methods); ++i) {
+		PyObject* method = PyTuple_GET_ITEM(methods, i);
+		if (!PyUnicode_Check(method)) {
+			PyErr_Format(PyExc_TypeError, "route methods must be str.");
+			return NULL;
+		}
+		if (add_route(method, path, handler) == SGE_ERR) {
+			return NULL;
+		}
+	}
+	Py_INCREF(handler);
+	return handler;
+}
+
+PyObject*
+py_websocket(PyObject* self, PyObject* args) {
+	static PyMethodDef def_register = {"register", py_register_websocket, METH_O, "register websocket handler."};
+	PyObject* path;
+
+	if (!PyArg_ParseTuple(args, "U", &path)) {
+		return NULL;
+	}
+	return PyCFunction_New(&def_register, path);
+}
+
+// websocket handlers take the path syntax of routes, keyed by GET
+PyObject*
+py_register_websocket(PyObject* path, PyObject* handler) {
+	const char* s_path = PyUnicode_AsUTF8(path);
+
+	if (NULL == s_path) {
+		return NULL;
+	}
+	if (!PyCallable_Check(handler)) {
+		PyErr_Format(PyExc_TypeError, "websocket handler must be callable.");
+		return NULL;
+	}
+	if (router_add(WS_ROUTER, "GET", s_path, handler) == SGE_ERR) {
+		PyErr_Format(PyExc_ValueError, "invalid or duplicate websocket route: %s", s_path);
+		return NULL;
+	}
+	Py_INCREF(handler);
+	HAS_ASYNC |= is_coroutine_function(handler);
+	Py_INCREF(handler);
+	return handler;
+}
+
+/*
+ * the data is copied here once, the reactor queues the same copy to
+ * every subscriber. str goes to websockets as text, the rest as binary.
+ */
+PyObject*
+py_publish(PyObject* self, PyObject* args) {
+	Py_buffer view;
+	PyObject* channel, *data;
+	Py_ssize_t channel_len, len;
+	const char* s_channel, *src;
+	char* dst;
+	sge_publish_item* item;
+	int text;
+
+	if (!PyArg_ParseTuple(args, "UO", &channel, &data)) {
+		return NULL;
+	}
+	s_channel = PyUnicode_AsUTF8AndSize(channel, &channel_len);
+	if (NULL == s_channel) {
+		return NULL;
+	}
+	text = PyUnicode_Check(data);
+	if (text) {
+		src = PyUnicode_AsUTF8AndSize(data, &len);
+		if (NULL == src) {
+			return NULL;
+		}
+	} else if (PyObject_CheckBuffer(data)) {
+		if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) < 0) {
+			return NULL;
+		}
+		src = view.buf;
+		len = view.len;
+	} else {
+		PyErr_Format(PyExc_TypeError, "args 2 must be str or bytes-like object, not %.100s", Py_TYPE(data)->tp_name);
+		return NULL;
+	}
+
+	item = sge_malloc(sizeof(*item));
+	item->channel = create_buffer_ex(s_channel, channel_len);
+	item->data = create_shared_ex(len, &dst);
+	item->text = text;
+	memcpy(dst, src, len);
+	if (!text) {
+		PyBuffer_Release(&view);
+	}
+	sendto_server(CMD_PUBLISH, 0, destroy_publish_item, item);
+	Py_RETURN_NONE;
+}
+
+int
+add_route(PyObject* method, PyObject* path, PyObject* handler) {
+	const char* s_method = PyUnicode_AsUTF8(method);
+	const char* s_path = PyUnicode_AsUTF8(path);
+
+	if (NULL == s_method || NULL == s_path) {
+		return SGE_ERR;
+	}
+	if (!PyCallable_Check(handler)) {
+		PyErr_Format(PyExc_TypeError, "route handler must be callable.");
+		return SGE_ERR;
+	}
+	if (router_add(ROUTER, s_method, s_path, handler) == SGE_ERR) {
+		PyErr_Format(PyExc_ValueError, "invalid or duplicate route: %s %s", s_method, s_path);
+		return SGE_ERR;
+	}
+	Py_INCREF(handler);
+	HAS_ASYNC |= is_coroutine_function(handler);
+	return SGE_OK;
+}
+
+void
+free_handler(void* handler) {
+	Py_DECREF((PyObject*)handler);
+}
+
+int
+is_coroutine_function(PyObject* func) {
+	int result = 0;
+	PyObject* inspect = PyImport_ImportModule("inspect");
+	if (NULL == inspect) {
+		CHECK_SCRIPT_ERROR();
+		return 0;
+	}
+	PyObject* ret = PyObject_CallMethod(inspect, "iscoroutinefunction", "O", func);
+	if (ret) {
+		result = PyObject_IsTrue(ret);
+		Py_DECREF(ret);
+	}
+	CHECK_SCRIPT_ERROR();
+	Py_DECREF(inspect);
+	return result;
+}
+
+static PyObject*
+PyInit_sge() {
+	PyObject* module = PyModule_Create(&SGE_MODULE);
+	PyObject* cache;
+
+	if (NULL == module) {
+		return NULL;
+	}
+	cache = create_kvstore_module();
+	if (NULL == cache || PyModule_AddObject(module, "cache", cache) < 0) {
+		Py_XDECREF(cache);
+		Py_DECREF(module);
+		return NULL;
+	}
+	return module;
+}
+
+// must be called before Py_Initialize
+int
+init_module() {
+	ROUTER = create_router();
+	WS_ROUTER = create_router();
+	if (PyImport_AppendInittab("sge", PyInit_sge) < 0) {
+		ERROR("can't register module sge.");
+		return SGE_ERR;
+	}
+	return SGE_OK;
+}
+
+int
+destroy_module() {
+	destroy_router(ROUTER, free_handler);
+	destroy_router(WS_ROUTER, free_handler);
+	ROUTER = NULL;
+	WS_ROUTER = NULL;
+	return SGE_OK;
+}
+
+sge_router*
+module_router() {
+	return ROUTER;
+}
+
+sge_router*
+module_ws_router() {
+	return WS_ROUTER;
+}
+
+int
+module_has_async() {
+	return HAS_ASYNC;
+}
@@ -0,0 +1,13 @@
+#ifndef MODULE_H_
+#define MODULE_H_
+
+#include "core/router.h"
+
+int init_module();
+int destroy_module();
+sge_router* module_router();
+sge_router* module_ws_router();
+int module_has_async();
+int is_coroutine_function(PyObject* func);
+
+#endif
@@ -0,0 +1,365 @@
+#include <Python.h>
+#include <frameobject.h>
+#include <time.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "core/sge.h"
+#include "core/log.h"
+#include "core/hash.h"
+#include "core/buffer.h"
+#include "core/spinlock.h"
+
+#include "python-src/profiler.h"
+
+/*
+ * sampling profiler for the python side. a sampler thread wakes up hz
+ * times a second, takes the GIL and walks the frames of every other
+ * python thread. stacks are counted as folded lines, root first and
+ * prefixed with the route of the request they belong to, ready for
+ * flamegraph.pl. taking the GIL makes the worker switch at its next
+ * bytecode boundary, which is all the sampling costs it.
+ * the route comes from call_cb while a handler runs, or from the
+ * Connection.__run__ frame of an async handler's task.
+ */
+
+#define MAX_PROFILE_HZ 1000
+#define MAX_PROFILE_DEPTH 64
+#define MAX_PROFILE_STACKS 20000
+#define MAX_STACK_SIZE 4096
+#define NO_ROUTE "[no request]"
+#define TRUNCATED "[truncated]"
+
+#if PY_VERSION_HEX < 0x030A0000
+static inline PyObject*
+Py_XNewRef(PyObject* obj) {
+	Py_XINCREF(obj);
+	return obj;
+}
+#define Py_NewRef Py_XNewRef
+#endif
+
+// the accessors of frames and thread states came with 3.9, before that the fields are public
+#if PY_VERSION_HEX < 0x03090000
+#define PyFrame_GetCode(frame) ((PyCodeObject*)Py_XNewRef((PyObject*)(frame)->f_code))
+#define PyFrame_GetBack(frame) ((PyFrameObject*)Py_XNewRef((PyObject*)(frame)->f_back))
+#define PyThreadState_GetFrame(ts) ((PyFrameObject*)Py_XNewRef((PyObject*)(ts)->frame))
+#define PyThreadState_GetInterpreter(ts) ((ts)->interp)
+#endif
+
+// co_qualname is 3.11+, the plain name has to do before
+#if PY_VERSION_HEX >= 0x030B0000
+#define CODE_NAME(code) ((code)->co_qualname)
+#else
+#define CODE_NAME(code) ((code)->co_name)
+#endif
+
+struct sge_profiler {
+	int run;
+	int hz;
+	pthread_t tid;
+	sge_spinlock lock;
+	sge_hash* stacks;
+	uint64_t samples;
+	PyObject* route;
+	PyThreadState* worker;
+};
+
+static struct sge_profiler PROFILER;
+
+static void* sampler(void* arg);
+static void sample_threads(PyThreadState* self);
+static void record_stack(PyFrameObject* frame, PyThreadState* ts);
+static size_t append_frame(char* buf, size_t len, PyCodeObject* code);
+static PyObject* task_route(PyFrameObject* frame);
+
+
+static size_t
+append_str(char* buf, size_t len, const char* s) {
+	size_t n = strlen(s);
+
+	if (len + n >= MAX_STACK_SIZE) {
+		n = MAX_STACK_SIZE - 1 - len;
+	}
+	memcpy(buf + len, s, n);
+	return len + n;
+}
+
+size_t
+append_frame(char* buf, size_t len, PyCodeObject* code) {
+	char line[32];
+	const char* name = PyUnicode_AsUTF8(CODE_NAME(code));
+	const char* file = PyUnicode_AsUTF8(code->co_filename);
+	const char* base;
+
+	if (NULL == name || NULL == file) {
+		PyErr_Clear();
+		return append_str(buf, len, ";?");
+	}
+	base = strrchr(file, '/');
+	snprintf(line, sizeof(line), ":%d)", code->co_firstlineno);
+	len = append_str(buf, len, ";");
+	len = append_str(buf, len, name);
+	len = append_str(buf, len, " (");
+	len = append_str(buf, len, base ? base + 1 : file);
+	return append_str(buf, len, line);
+}
+
+/*
+ * an async handler runs in the task of Connection.__run__, whose
+ * connection carries the route call_cb saw.
+ */
+PyObject*
+task_route(PyFrameObject* frame) {
+	PyObject* locals, *self, *route = NULL;
+
+#if PY_VERSION_HEX >= 0x030B0000
+	locals = PyFrame_GetLocals(frame);
+#else
+	// the attribute syncs the fast locals into the dict first, as PyFrame_GetLocals() does
+	locals = PyObject_GetAttrString((PyObject*)frame, "f_locals");
+#endif
+	// a dict, or from 3.13 a FrameLocalsProxy
+	if (locals) {
+		self = PyMapping_GetItemString(locals, "self");
+		if (self) {
+			route = PyObject_GetAttrString(self, "__route__");
+			Py_DECREF(self);
+		}
+	}
+	Py_XDECREF(locals);
+	if (route && !PyUnicode_Check(route)) {
+		Py_CLEAR(route);
+	}
+	PyErr_Clear();
+	return route;
+}
+
+void
+record_stack(PyFrameObject* frame, PyThreadState* ts) {
+	PyFrameObject* frames[MAX_PROFILE_DEPTH];
+	PyCodeObject* code;
+	PyObject* route = NULL;
+	const char* label = NO_ROUTE;
+	char key[MAX_STACK_SIZE];
+	size_t len = 0;
+	uintptr_t count;
+	int i, n = 0;
+
+	while (frame && n < MAX_PROFILE_DEPTH) {
+		frames[n++] = frame;
+		frame = PyFrame_GetBack(frame);
+	}
+	Py_XDECREF(frame);
+
+	for (i = n - 1; i >= 0 && NULL == route; --i) {
+		code = PyFrame_GetCode(frames[i]);
+		if (PyUnicode_CompareWithASCIIString(code->co_name, "__run__") == 0) {
+			route = task_route(frames[i]);
+		}
+		Py_DECREF(code);
+	}
+	if (NULL == route && ts == PROFILER.worker && PROFILER.route) {
+		route = Py_NewRef(PROFILER.route);
+	}
+	if (route) {
+		label = PyUnicode_AsUTF8(route);
+		if (NULL == label) {
+			PyErr_Clear();
+			label = NO_ROUTE;
+		}
+	}
+
+	len = append_str(key, len, label);
+	Py_XDECREF(route);
+	for (i = n - 1; i >= 0; --i) {
+		code = PyFrame_GetCode(frames[i]);
+		len = append_frame(key, len, code);
+		Py_DECREF(code);
+		Py_DECREF(frames[i]);
+	}
+
+	SPIN_LOCK(&PROFILER);
+	count = (uintptr_t)hash_get(PROFILER.stacks, key, len);
+	if (count == 0 && hash_size(PROFILER.stacks) >= MAX_PROFILE_STACKS) {
+		len = strlen(TRUNCATED);
+		memcpy(key, TRUNCATED, len);
+		count = (uintptr_t)hash_get(PROFILER.stacks, key, len);
+	}
+	hash_set(PROFILER.stacks, key, len, (void*)(count + 1));
+	PROFILER.samples++;
+	SPIN_UNLOCK(&PROFILER);
+}
+
+void
+sample_threads(PyThreadState* self) {
+	PyThreadState* ts;
+	PyFrameObject* frame;
+
+	ts = PyInterpreterState_ThreadHead(PyThreadState_GetInterpreter(self));
+	for (; ts; ts = PyThreadState_Next(ts)) {
+		if (ts == self) {
+			continue;
+		}
+		frame = PyThreadState_GetFrame(ts);
+		if (frame) {
+			record_stack(frame, ts);
+		}
+	}
+}
+
+void*
+sampler(void* arg) {
+	struct timespec next;
+	uint64_t period = 1000000000ULL / PROFILER.hz;
+	PyGILState_STATE state = PyGILState_Ensure();
+	PyThreadState* self = PyEval_SaveThread();
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (__atomic_load_n(&PROFILER.run, __ATOMIC_ACQUIRE)) {
+		next.tv_nsec += period;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		if (!__atomic_load_n(&PROFILER.run, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		PyEval_RestoreThread(self);
+		sample_threads(self);
+		PyEval_SaveThread();
+	}
+
+	PyEval_RestoreThread(self);
+	PyGILState_Release(state);
+	return NULL;
+}
+
+int
+start_profiler(int hz) {
+	if (PROFILER.run || hz <= 0 || hz > MAX_PROFILE_HZ) {
+		return SGE_ERR;
+	}
+	if (NULL == PROFILER.stacks) {
+		SPIN_INIT(&PROFILER);
+		PROFILER.stacks = create_hash(1024);
+	}
+	PROFILER.hz = hz;
+	PROFILER.run = 1;
+	if (pthread_create(&PROFILER.tid, NULL, sampler, NULL) != 0) {
+		PROFILER.run = 0;
+		return SGE_ERR;
+	}
+	INFO("profiler started at %d Hz", hz);
+	return SGE_OK;
+}
+
+/*
+ * waits for the sampler, which may be waiting for the GIL: up to one
+ * switch interval.
+ */
+int
+stop_profiler() {
+	if (!PROFILER.run) {
+		return SGE_ERR;
+	}
+	__atomic_store_n(&PROFILER.run, 0, __ATOMIC_RELEASE);
+	pthread_join(PROFILER.tid, NULL);
+	INFO("profiler stopped, %lu samples", (unsigned long)PROFILER.samples);
+	return SGE_OK;
+}
+
+int
+profiler_active() {
+	return __atomic_load_n(&PROFILER.run, __ATOMIC_RELAXED);
+}
+
+/*
+ * called with the GIL by the worker around a handler call, steals the
+ * reference. NULL clears the route.
+ */
+void
+profiler_set_route(PyObject* route) {
+	Py_XSETREF(PROFILER.route, route);
+	PROFILER.worker = route ? PyThreadState_Get() : NULL;
+}
+
+static int
+format_stack(const char* key, size_t len, void* value, void* ud) {
+	char count[32];
+	sge_buffer** buf = ud;
+	int n = snprintf(count, sizeof(count), " %lu\n", (unsigned long)(uintptr_t)value);
+
+	*buf = append_buffer(*buf, key, len);
+	*buf = append_buffer(*buf, count, n);
+	return SGE_OK;
+}
+
+/*
+ * admin commands:
+ *   profile                 folded stacks collected so far
+ *   profile/start[?hz=N]    start sampling (default 100 Hz)
+ *   profile/stop            stop sampling, keep the stacks
+ *   profile/reset           drop the stacks
+ */
+int
+profiler_command(const char* cmd, size_t len, sge_buffer** body) {
+	char msg[128];
+	int n, hz = DEFAULT_PROFILE_HZ;
+
+	if (len < 7 || strncmp(cmd, "profile", 7) != 0) {
+		return SGE_ERR;
+	}
+	cmd += 7;
+	len -= 7;
+
+	if (len == 0) {
+		if (PROFILER.stacks) {
+			SPIN_LOCK(&PROFILER);
+			hash_foreach(PROFILER.stacks, format_stack, body);
+			SPIN_UNLOCK(&PROFILER);
+		}
+		return SGE_OK;
+	}
+	if (len >= 6 && strncmp(cmd, "/start", 6) == 0) {
+		if (len > 10 && strncmp(cmd + 6, "?hz=", 4) == 0) {
+			hz = atoi(cmd + 10);
+		}
+		if (start_profiler(hz) == SGE_OK) {
+			n = snprintf(msg, sizeof(msg), "profiling at %d Hz\n", hz);
+		} else {
+			n = snprintf(msg, sizeof(msg), "not started: already running or hz not in 1..%d\n", MAX_PROFILE_HZ);
+		}
+	} else if (len == 5 && strncmp(cmd, "/stop", 5) == 0) {
+		stop_profiler();
+		n = snprintf(msg, sizeof(msg), "stopped, %lu samples\n", (unsigned long)PROFILER.samples);
+	} else if (len == 6 && strncmp(cmd, "/reset", 6) == 0) {
+		if (PROFILER.stacks) {
+			SPIN_LOCK(&PROFILER);
+			destroy_hash(PROFILER.stacks, NULL);
+			PROFILER.stacks = create_hash(1024);
+			PROFILER.samples = 0;
+			SPIN_UNLOCK(&PROFILER);
+		}
+		n = snprintf(msg, sizeof(msg), "reset\n");
+	} else {
+		return SGE_ERR;
+	}
+	*body = append_buffer(*body, msg, n);
+	return SGE_OK;
+}
+
+/*
+ * before the interpreter is finalized, and before the main thread
+ * takes the GIL back: the sampler may be waiting for it.
+ */
+void
+destroy_profiler() {
+	stop_profiler();
+	if (PROFILER.stacks) {
+		destroy_hash(PROFILER.stacks, NULL);
+		PROFILER.stacks = NULL;
+		SPIN_DESTROY(&PROFILER);
+	}
+}
@@ -0,0 +1,17 @@
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <Python.h>
+
+#include "core/buffer.h"
+
+#define DEFAULT_PROFILE_HZ 100
+
+int start_profiler(int hz);
+int stop_profiler();
+int profiler_active();
+void profiler_set_route(PyObject* route);
+int profiler_command(const char* cmd, size_t len, struct sge_buffer** body);
+void destroy_profiler();
+
+#endif
@@ -0,0 +1,231 @@
+#include <Python.h>
+#include <errno.h>
+
+#include "core/sge.h"
+#include "core/log.h"
+#include "core/buffer.h"
+#include "core/chunk.h"
+#include "os/server.h"
+
+#include "python-src/common.h"
+#include "python-src/upstream.h"
+
+/*
+ * the worker side of sge.connect(). the reactor owns the sockets and
+ * the keep-alive pools, the worker only names its connections by a
+ * handle: a slot of UPSTREAMS plus a generation, so whatever the
+ * reactor still sends for a released handle finds no one.
+ * sgeWeb.Upstream buffers what is read and resolves the awaiting
+ * readers in the order they asked.
+ */
+
+#define GENERATION_SHIFT 10
+#define MAX_GENERATION (1 << 20)
+
+static PyObject* py_send(PyObject* upstream, PyObject* data);
+static PyObject* py_release(PyObject* upstream, PyObject* keep);
+static int upstream_handle(PyObject* upstream);
+static PyObject* take_upstream(int handle);
+
+
+static PyObject* UPSTREAMS[MAX_SOCK_NUM];
+static int HANDLES[MAX_SOCK_NUM];
+static PyObject* CLS_UPSTREAM = NULL;
+static PyObject* READ_TIMEOUT = NULL;
+static uint32_t NEXT_SLOT = 0;
+static uint32_t GENERATION = 0;
+
+
+// read_timeout in milliseconds, 0 for none
+void
+init_upstreams(size_t read_timeout) {
+	Py_XDECREF(READ_TIMEOUT);
+	READ_TIMEOUT = PyFloat_FromDouble(read_timeout / 1000.0);
+}
+
+/*
+ * sge.connect(addr) -> a future of the Upstream. needs the asyncio loop
+ * of the async worker, the Upstream takes it from the running task.
+ */
+PyObject*
+py_connect(PyObject* self, PyObject* addr) {
+	int i, slot, handle;
+	Py_ssize_t len;
+	const char* s;
+	PyObject* module, *upstream, *connected;
+	static PyMethodDef def_send = {"send", py_send, METH_O, "send data upstream"};
+	static PyMethodDef def_release = {"__release__", py_release, METH_O, "close, or back to the pool with keep"};
+
+	if (!PyUnicode_Check(addr)) {
+		PyErr_Format(PyExc_TypeError, "addr must be str, not %.100s", Py_TYPE(addr)->tp_name);
+		return NULL;
+	}
+	s = PyUnicode_AsUTF8AndSize(addr, &len);
+	if (NULL == s) {
+		return NULL;
+	}
+	for (i = 0, slot = -1; i < MAX_SOCK_NUM; ++i) {
+		if (NULL == UPSTREAMS[(NEXT_SLOT + i) % MAX_SOCK_NUM]) {
+			slot = (NEXT_SLOT + i) % MAX_SOCK_NUM;
+			break;
+		}
+	}
+	if (slot < 0) {
+		errno = EMFILE;
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+	if (NULL == CLS_UPSTREAM) {
+		module = PyImport_ImportModule("sgeWeb.Upstream");
+		if (NULL == module) {
+			return NULL;
+		}
+		CLS_UPSTREAM = PyObject_GetAttrString(module, "Upstream");
+		Py_DECREF(module);
+		if (NULL == CLS_UPSTREAM) {
+			return NULL;
+		}
+	}
+	upstream = PyObject_CallFunctionObjArgs(CLS_UPSTREAM, READ_TIMEOUT ? READ_TIMEOUT : Py_None, NULL);
+	if (NULL == upstream) {
+		return NULL;
+	}
+	connected = PyObject_GetAttrString(upstream, "__connected__");
+	if (NULL == connected) {
+		Py_DECREF(upstream);
+		return NULL;
+	}
+
+	GENERATION = (GENERATION + 1) % MAX_GENERATION;
+	handle = (GENERATION << GENERATION_SHIFT) | slot;
+	NEXT_SLOT = slot + 1;
+	set_attr(upstream, "__handle__", PyLong_FromLong(handle));
+	set_attr(upstream, "send", PyCFunction_New(&def_send, upstream));
+	set_attr(upstream, "__release__", PyCFunction_New(&def_release, upstream));
+	UPSTREAMS[slot] = upstream;
+	HANDLES[slot] = handle;
+	sendto_server(CMD_CONNECT, handle, destroy_buffer, create_buffer_ex(s, len));
+	return connected;
+}
+
+// CMD_CONNECT, CMD_UPSTREAM_DATA and CMD_UPSTREAM_CLOSE from the reactor
+int
+on_upstream(sge_message* msg) {
+	size_t len;
+	const char* data;
+	int err = (intptr_t)msg->ud;
+	PyObject* upstream, *bytes, *ret = NULL;
+
+	if (msg->type == CMD_UPSTREAM_DATA) {
+		upstream = UPSTREAMS[UPSTREAM_SLOT(msg->id)];
+		if (NULL == upstream || HANDLES[UPSTREAM_SLOT(msg->id)] != msg->id) {
+			return SGE_OK;
+		}
+		data = buffer_data(msg->ud, &len);
+		bytes = PyBytes_FromStringAndSize(data, len);
+		if (bytes) {
+			ret = PyObject_CallMethod(upstream, "__on_data__", "O", bytes);
+			Py_DECREF(bytes);
+		}
+	} else if (msg->type == CMD_CONNECT && 0 == err) {
+		upstream = UPSTREAMS[UPSTREAM_SLOT(msg->id)];
+		if (NULL == upstream || HANDLES[UPSTREAM_SLOT(msg->id)] != msg->id) {
+			return SGE_OK;
+		}
+		ret = PyObject_CallMethod(upstream, "__on_connect__", "i", 0);
+	} else {
+		// the reactor has closed it, the handle is free again
+		upstream = take_upstream(msg->id);
+		if (NULL == upstream) {
+			return SGE_OK;
+		}
+		ret = PyObject_CallMethod(upstream, msg->type == CMD_CONNECT ? "__on_connect__" : "__on_close__", "i", err);
+		Py_DECREF(upstream);
+	}
+	Py_XDECREF(ret);
+	CHECK_SCRIPT_ERROR();
+	return SGE_OK;
+}
+
+void
+destroy_upstreams() {
+	int i;
+
+	for (i = 0; i < MAX_SOCK_NUM; ++i) {
+		Py_CLEAR(UPSTREAMS[i]);
+	}
+	Py_CLEAR(CLS_UPSTREAM);
+	Py_CLEAR(READ_TIMEOUT);
+}
+
+// str or bytes-like, copied once on its way to the reactor
+PyObject*
+py_send(PyObject* upstream, PyObject* data) {
+	Py_buffer view;
+	Py_ssize_t len;
+	const char* src;
+	sge_buffer* buf;
+	int handle = upstream_handle(upstream);
+
+	if (handle < 0) {
+		PyErr_SetString(PyExc_BrokenPipeError, "the upstream connection is closed.");
+		return NULL;
+	}
+	if (PyUnicode_Check(data)) {
+		src = PyUnicode_AsUTF8AndSize(data, &len);
+		if (NULL == src) {
+			return NULL;
+		}
+		buf = create_buffer_ex(src, len);
+	} else if (PyObject_CheckBuffer(data)) {
+		if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) < 0) {
+			return NULL;
+		}
+		buf = create_buffer_ex(view.buf, view.len);
+		PyBuffer_Release(&view);
+	} else {
+		PyErr_Format(PyExc_TypeError, "args 1 must be str or bytes-like object, not %.100s", Py_TYPE(data)->tp_name);
+		return NULL;
+	}
+	sendto_server(CMD_UPSTREAM_DATA, handle, destroy_chunk, create_chunk_buffer(buf));
+	Py_RETURN_NONE;
+}
+
+PyObject*
+py_release(PyObject* upstream, PyObject* keep) {
+	int handle = upstream_handle(upstream);
+	PyObject* taken;
+
+	if (handle < 0) {
+		Py_RETURN_FALSE;
+	}
+	taken = take_upstream(handle);
+	sendto_server(CMD_UPSTREAM_CLOSE, handle, NULL, (void*)(intptr_t)PyObject_IsTrue(keep));
+	Py_XDECREF(taken);
+	Py_RETURN_TRUE;
+}
+
+// -1 once the handle is released
+int
+upstream_handle(PyObject* upstream) {
+	PyObject* py_handle = PyObject_GetAttrString(upstream, "__handle__");
+	int handle = PyLong_AsLong(py_handle);
+
+	Py_DECREF(py_handle);
+	if (UPSTREAMS[UPSTREAM_SLOT(handle)] != upstream || HANDLES[UPSTREAM_SLOT(handle)] != handle) {
+		return -1;
+	}
+	return handle;
+}
+
+// the reference the slot held
+PyObject*
+take_upstream(int handle) {
+	PyObject* upstream = UPSTREAMS[UPSTREAM_SLOT(handle)];
+
+	if (NULL == upstream || HANDLES[UPSTREAM_SLOT(handle)] != handle) {
+		return NULL;
+	}
+	UPSTREAMS[UPSTREAM_SLOT(handle)] = NULL;
+	return upstream;
+}
+
@@ -0,0 +1,13 @@
+#ifndef UPSTREAM_H_
+#define UPSTREAM_H_
+
+#include <Python.h>
+
+#include "core/sge.h"
+
+void init_upstreams(size_t read_timeout);
+PyObject* py_connect(PyObject* self, PyObject* addr);
+int on_upstream(sge_message* msg);
+void destroy_upstreams();
+
+#endif
@@ -0,0 +1,159 @@
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "core/sge.h"
+#include "core/accesslog.h"
+
+/*
+ * sge-access: print the records of access log segments, one line per
+ * request, as text or json. segments are read through their header
+ * count, so the one the server is still writing can be read as well.
+ */
+
+static int JSON = 0;
+
+static void
+format_peer(const sge_access_record* r, char* buf, size_t size) {
+	char addr[INET6_ADDRSTRLEN];
+
+	if (r->family == AF_INET) {
+		inet_ntop(AF_INET, r->peer, addr, sizeof(addr));
+		snprintf(buf, size, "%s:%u", addr, r->port);
+	} else if (r->family == AF_INET6) {
+		inet_ntop(AF_INET6, r->peer, addr, sizeof(addr));
+		snprintf(buf, size, "[%s]:%u", addr, r->port);
+	} else {
+		snprintf(buf, size, "unix");
+	}
+}
+
+static void
+print_json_string(const char* s, size_t len) {
+	size_t i;
+
+	putchar('"');
+	for (i = 0; i < len; ++i) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\') {
+			printf("\\%c", c);
+		} else if (c < 0x20 || c >= 0x7f) {
+			printf("\\u%04x", c);
+		} else {
+			putchar(c);
+		}
+	}
+	putchar('"');
+}
+
+static void
+print_record(const sge_access_record* r) {
+	char date[32], peer[64];
+	time_t sec = r->time / 1000000000ULL;
+	struct tm tm;
+	size_t method_len = strnlen(r->method, ACCESS_METHOD_SIZE);
+
+	localtime_r(&sec, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+	format_peer(r, peer, sizeof(peer));
+
+	if (JSON) {
+		printf("{\"time\":%lu.%06lu,\"peer\":\"%s\",\"method\":",
+			(unsigned long)sec, (unsigned long)(r->time % 1000000000ULL / 1000), peer);
+		print_json_string(r->method, method_len);
+		printf(",\"path\":");
+		print_json_string(r->path, r->path_len);
+		printf(",\"status\":%u,\"bytes_in\":%lu,\"bytes_out\":%lu,"
+			"\"wait_us\":%.1f,\"write_us\":%.1f,\"total_us\":%.1f}\n",
+			r->status, (unsigned long)r->bytes_in, (unsigned long)r->bytes_out,
+			r->wait_ns / 1e3, r->write_ns / 1e3, r->total_ns / 1e3);
+	} else {
+		printf("%s.%06lu %s %.*s %.*s %u in=%lu out=%lu wait=%.3fms write=%.3fms total=%.3fms\n",
+			date, (unsigned long)(r->time % 1000000000ULL / 1000), peer,
+			(int)method_len, r->method, (int)r->path_len, r->path, r->status,
+			(unsigned long)r->bytes_in, (unsigned long)r->bytes_out,
+			r->wait_ns / 1e6, r->write_ns / 1e6, r->total_ns / 1e6);
+	}
+}
+
+static int
+decode_file(const char* name) {
+	int fd;
+	struct stat st;
+	const sge_access_header* header;
+	const sge_access_record* records;
+	uint64_t i, count;
+	void* base;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(name);
+		return SGE_ERR;
+	}
+	if ((size_t)st.st_size < sizeof(*header)) {
+		fprintf(stderr, "%s: too short for an access log\n", name);
+		close(fd);
+		return SGE_ERR;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		perror(name);
+		return SGE_ERR;
+	}
+
+	header = base;
+	if (memcmp(header->magic, ACCESS_LOG_MAGIC, sizeof(ACCESS_LOG_MAGIC)) != 0
+		|| header->version != ACCESS_LOG_VERSION || header->record_size != ACCESS_RECORD_SIZE) {
+		fprintf(stderr, "%s: not an access log of version %d\n", name, ACCESS_LOG_VERSION);
+		munmap(base, st.st_size);
+		return SGE_ERR;
+	}
+	count = __atomic_load_n(&header->count, __ATOMIC_ACQUIRE);
+	if (count > st.st_size / ACCESS_RECORD_SIZE - 1) {
+		count = st.st_size / ACCESS_RECORD_SIZE - 1;
+	}
+	records = (const sge_access_record*)(header + 1);
+	for (i = 0; i < count; ++i) {
+		print_record(&records[i]);
+	}
+	munmap(base, st.st_size);
+	return SGE_OK;
+}
+
+static void
+usage(const char* prog) {
+	fprintf(stderr,
+		"usage: %s [-j] segment...\n"
+		"  -j    one json object per record\n",
+		prog);
+}
+
+int
+main(int argc, char* argv[]) {
+	int c, i, ret = 0;
+
+	while ((c = getopt(argc, argv, "jh")) != -1) {
+		switch (c) {
+			case 'j': JSON = 1; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind == argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	for (i = optind; i < argc; ++i) {
+		if (decode_file(argv[i]) == SGE_ERR) {
+			ret = 1;
+		}
+	}
+	return ret;
+}
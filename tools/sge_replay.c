@@ -0,0 +1,534 @@
+#define _GNU_SOURCE
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "core/sge.h"
+#include "core/buffer.h"
+#include "core/capture.h"
+#include "core/histogram.h"
+
+/*
+ * sge-replay: play the connections of a capture against a server, each
+ * read of the original sent at its recorded time (scaled by -s), and
+ * compare latencies. an exchange is the first read after the previous
+ * response started until the next response byte: in the capture that
+ * is the next WRITE record of the connection, here the next bytes read.
+ * exchanges are matched by their position on their connection.
+ */
+
+#define MAX_EVENTS 256
+#define READ_SIZE 65536
+#define NS_PER_US 1000ULL
+#define NS_PER_MS 1000000ULL
+#define NS_PER_SEC 1000000000ULL
+
+typedef struct {
+	uint64_t* values;
+	size_t len;
+	size_t cap;
+} replay_array;
+
+typedef struct {
+	int fd;
+	int connecting;
+	int closing;
+	int done;
+	uint64_t pending;
+	size_t exchange;
+	sge_buffer* out;
+	replay_array original;
+} replay_conn;
+
+typedef struct {
+	const char* unix_path;
+	const char* addr;
+	double speed;
+	double grace;
+	int json;
+	struct sockaddr_storage sa;
+	socklen_t sa_len;
+} replay_option;
+
+static replay_option OPT;
+static int EPFD = -1;
+static replay_conn* CONNS = NULL;
+static uint32_t NCONN = 0;
+static int ACTIVE = 0;
+static sge_histogram* ORIGINAL = NULL;
+static sge_histogram* REPLAYED = NULL;
+static replay_array DELTAS;
+static uint64_t UNANSWERED = 0;
+static uint64_t ERRORS = 0;
+static uint64_t BYTES_OUT = 0;
+static uint64_t BYTES_IN = 0;
+static uint64_t FIRST = 0;
+
+static uint64_t now_ns();
+static void array_push(replay_array* a, uint64_t value);
+static int resolve(replay_option* opt);
+static int load_original(const char* base, size_t size);
+static int open_conn(replay_conn* conn);
+static void close_conn(replay_conn* conn);
+static int flush_conn(replay_conn* conn);
+static int on_readable(replay_conn* conn, uint64_t now);
+static void play(replay_conn* conn, const sge_capture_record* r, const char* data, uint64_t now);
+static int replay(const char* base, size_t size);
+static void report(const char* name, double elapsed);
+
+
+uint64_t
+now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+void
+array_push(replay_array* a, uint64_t value) {
+	if (a->len == a->cap) {
+		a->cap = a->cap ? a->cap * 2 : 16;
+		a->values = realloc(a->values, a->cap * sizeof(uint64_t));
+	}
+	a->values[a->len++] = value;
+}
+
+int
+resolve(replay_option* opt) {
+	if (opt->unix_path) {
+		struct sockaddr_un* un = (struct sockaddr_un*)&opt->sa;
+		memset(un, 0, sizeof(*un));
+		un->sun_family = AF_UNIX;
+		strncpy(un->sun_path, opt->unix_path, sizeof(un->sun_path) - 1);
+		opt->sa_len = sizeof(*un);
+		return SGE_OK;
+	}
+
+	char host[256];
+	const char* p = strrchr(opt->addr, ':');
+	struct addrinfo hints, *res;
+	if (NULL == p || (size_t)(p - opt->addr) >= sizeof(host)) {
+		fprintf(stderr, "bad address %s, expect host:port\n", opt->addr);
+		return SGE_ERR;
+	}
+	memcpy(host, opt->addr, p - opt->addr);
+	host[p - opt->addr] = '\0';
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, p + 1, &hints, &res) != 0) {
+		fprintf(stderr, "can't resolve %s\n", opt->addr);
+		return SGE_ERR;
+	}
+	memcpy(&opt->sa, res->ai_addr, res->ai_addrlen);
+	opt->sa_len = res->ai_addrlen;
+	freeaddrinfo(res);
+	return SGE_OK;
+}
+
+/*
+ * one pass over the capture: count the connections and work out the
+ * original latency of every exchange.
+ */
+int
+load_original(const char* base, size_t size) {
+	size_t off = sizeof(sge_capture_header);
+	sge_capture_record r;
+	uint64_t* pending = NULL;
+	replay_conn* conn;
+
+	while (off + sizeof(r) <= size) {
+		memcpy(&r, base + off, sizeof(r));
+		off += sizeof(r) + (r.type == CAPTURE_DATA ? r.len : 0);
+		if (r.conn == 0 || off > size) {
+			break;
+		}
+		if (NCONN == 0) {
+			FIRST = r.time;
+		}
+		if (r.conn > NCONN) {
+			CONNS = realloc(CONNS, r.conn * sizeof(replay_conn));
+			pending = realloc(pending, r.conn * sizeof(uint64_t));
+			memset(CONNS + NCONN, 0, (r.conn - NCONN) * sizeof(replay_conn));
+			memset(pending + NCONN, 0, (r.conn - NCONN) * sizeof(uint64_t));
+			NCONN = r.conn;
+		}
+		conn = &CONNS[r.conn - 1];
+		if (r.type == CAPTURE_DATA && pending[r.conn - 1] == 0) {
+			pending[r.conn - 1] = r.time + 1;
+		} else if (r.type == CAPTURE_WRITE && pending[r.conn - 1]) {
+			array_push(&conn->original, r.time + 1 - pending[r.conn - 1]);
+			pending[r.conn - 1] = 0;
+		}
+	}
+	free(pending);
+	if (off < size) {
+		fprintf(stderr, "capture truncated at offset %zu\n", off);
+	}
+	return NCONN > 0 ? SGE_OK : SGE_ERR;
+}
+
+int
+open_conn(replay_conn* conn) {
+	struct epoll_event ev;
+	int fd = socket(OPT.sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (fd < 0) {
+		perror("socket");
+		return SGE_ERR;
+	}
+	if (OPT.sa.ss_family != AF_UNIX) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	// a full unix socket backlog fails with EAGAIN, counted as an error
+	if (connect(fd, (struct sockaddr*)&OPT.sa, OPT.sa_len) < 0 && errno != EINPROGRESS) {
+		close(fd);
+		return SGE_ERR;
+	}
+	conn->fd = fd;
+	conn->connecting = 1;
+	conn->out = create_buffer(READ_SIZE);
+	ev.events = EPOLLOUT | EPOLLIN;
+	ev.data.ptr = conn;
+	epoll_ctl(EPFD, EPOLL_CTL_ADD, fd, &ev);
+	ACTIVE++;
+	return SGE_OK;
+}
+
+void
+close_conn(replay_conn* conn) {
+	if (conn->done) {
+		return;
+	}
+	if (conn->fd > 0) {
+		epoll_ctl(EPFD, EPOLL_CTL_DEL, conn->fd, NULL);
+		close(conn->fd);
+		ACTIVE--;
+	}
+	if (conn->out) {
+		destroy_buffer(conn->out);
+		conn->out = NULL;
+	}
+	if (conn->pending) {
+		UNANSWERED++;
+	}
+	conn->fd = -1;
+	conn->done = 1;
+}
+
+/*
+ * write what the capture had read so far. a closed capture connection
+ * is shut down for writing once its output is out, and kept until the
+ * server closes it too.
+ */
+int
+flush_conn(replay_conn* conn) {
+	size_t len;
+	ssize_t n;
+	const char* data = buffer_data(conn->out, &len);
+
+	if (len > 0) {
+		n = write(conn->fd, data, len);
+		if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			ERRORS++;
+			close_conn(conn);
+			return SGE_ERR;
+		}
+		if (n > 0) {
+			erase_buffer(conn->out, 0, n);
+			BYTES_OUT += n;
+			len -= n;
+		}
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | (len > 0 ? EPOLLOUT : 0);
+	ev.data.ptr = conn;
+	epoll_ctl(EPFD, EPOLL_CTL_MOD, conn->fd, &ev);
+	if (len == 0 && conn->closing == 1) {
+		shutdown(conn->fd, SHUT_WR);
+		conn->closing = 2;
+	}
+	return SGE_OK;
+}
+
+int
+on_readable(replay_conn* conn, uint64_t now) {
+	char buf[READ_SIZE];
+	ssize_t n;
+
+	while ((n = read(conn->fd, buf, sizeof(buf))) > 0) {
+		BYTES_IN += n;
+		if (conn->pending) {
+			uint64_t latency = now - conn->pending;
+			histogram_record(REPLAYED, latency / NS_PER_US);
+			if (conn->exchange < conn->original.len) {
+				uint64_t original = conn->original.values[conn->exchange];
+				histogram_record(ORIGINAL, original / NS_PER_US);
+				// stored with an offset so the array stays unsigned
+				array_push(&DELTAS, (uint64_t)((int64_t)latency - (int64_t)original) + (1ULL << 63));
+			}
+			conn->exchange++;
+			conn->pending = 0;
+		}
+	}
+	if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+		if (n < 0) {
+			ERRORS++;
+		}
+		close_conn(conn);
+		return SGE_ERR;
+	}
+	return SGE_OK;
+}
+
+void
+play(replay_conn* conn, const sge_capture_record* r, const char* data, uint64_t now) {
+	switch (r->type) {
+		case CAPTURE_OPEN:
+			if (open_conn(conn) == SGE_ERR) {
+				ERRORS++;
+				conn->done = 1;
+			}
+		break;
+		case CAPTURE_DATA:
+			if (conn->done || conn->fd <= 0 || conn->closing) {
+				break;
+			}
+			if (conn->pending == 0) {
+				conn->pending = now;
+			}
+			conn->out = append_buffer(conn->out, data, r->len);
+			if (!conn->connecting) {
+				flush_conn(conn);
+			}
+		break;
+		case CAPTURE_CLOSE:
+			if (conn->done || conn->fd <= 0 || conn->closing) {
+				break;
+			}
+			conn->closing = 1;
+			if (!conn->connecting) {
+				flush_conn(conn);
+			}
+		break;
+		default:
+		break;
+	}
+}
+
+int
+replay(const char* base, size_t size) {
+	struct epoll_event events[MAX_EVENTS];
+	size_t off = sizeof(sge_capture_header);
+	sge_capture_record r;
+	uint64_t start = now_ns(), now, due = 0, deadline = 0;
+	int i, n, timeout;
+	uint32_t j;
+
+	EPFD = epoll_create1(EPOLL_CLOEXEC);
+	while (1) {
+		now = now_ns();
+		// every record that is due, give or take a tenth of a millisecond
+		while (off + sizeof(r) <= size) {
+			memcpy(&r, base + off, sizeof(r));
+			if (r.conn == 0 || r.conn > NCONN || off + sizeof(r) + (r.type == CAPTURE_DATA ? r.len : 0) > size) {
+				off = size;
+				break;
+			}
+			due = start + (uint64_t)((r.time - FIRST) / OPT.speed);
+			if (due > now + 100 * NS_PER_US) {
+				break;
+			}
+			play(&CONNS[r.conn - 1], &r, base + off + sizeof(r), now);
+			off += sizeof(r) + (r.type == CAPTURE_DATA ? r.len : 0);
+		}
+
+		if (off + sizeof(r) > size) {
+			if (deadline == 0) {
+				deadline = now + (uint64_t)(OPT.grace * NS_PER_SEC);
+			}
+			if (ACTIVE == 0 || now >= deadline) {
+				break;
+			}
+			timeout = (deadline - now) / NS_PER_MS + 1;
+		} else {
+			timeout = due > now ? (due - now) / NS_PER_MS : 0;
+		}
+
+		n = epoll_wait(EPFD, events, MAX_EVENTS, timeout);
+		now = now_ns();
+		for (i = 0; i < n; ++i) {
+			replay_conn* conn = events[i].data.ptr;
+			if (conn->done) {
+				continue;
+			}
+			if (conn->connecting && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if (err) {
+					ERRORS++;
+					close_conn(conn);
+					continue;
+				}
+				conn->connecting = 0;
+			}
+			if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && on_readable(conn, now) == SGE_ERR) {
+				continue;
+			}
+			if (!conn->connecting) {
+				flush_conn(conn);
+			}
+		}
+	}
+
+	for (j = 0; j < NCONN; ++j) {
+		close_conn(&CONNS[j]);
+	}
+	close(EPFD);
+	return SGE_OK;
+}
+
+static int
+compare_delta(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static int64_t
+delta_percentile(double p) {
+	size_t i;
+
+	if (DELTAS.len == 0) {
+		return 0;
+	}
+	i = (size_t)(p / 100 * (DELTAS.len - 1) + 0.5);
+	return (int64_t)(DELTAS.values[i] - (1ULL << 63)) / (int64_t)NS_PER_US;
+}
+
+void
+report(const char* name, double elapsed) {
+	qsort(DELTAS.values, DELTAS.len, sizeof(uint64_t), compare_delta);
+
+	if (OPT.json) {
+		printf("{\"capture\":\"%s\",\"speed\":%.2f,\"connections\":%u,\"elapsed\":%.3f,"
+			"\"exchanges\":%lu,\"matched\":%zu,\"unanswered\":%lu,\"errors\":%lu,"
+			"\"bytes_sent\":%lu,\"bytes_read\":%lu,"
+			"\"original_us\":{\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"max\":%lu,\"mean\":%.1f},"
+			"\"replay_us\":{\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"max\":%lu,\"mean\":%.1f},"
+			"\"delta_us\":{\"p50\":%ld,\"p90\":%ld,\"p99\":%ld}}\n",
+			name, OPT.speed, NCONN, elapsed,
+			(unsigned long)histogram_count(REPLAYED), DELTAS.len, (unsigned long)UNANSWERED, (unsigned long)ERRORS,
+			(unsigned long)BYTES_OUT, (unsigned long)BYTES_IN,
+			histogram_percentile(ORIGINAL, 50), histogram_percentile(ORIGINAL, 90),
+			histogram_percentile(ORIGINAL, 99), histogram_max(ORIGINAL), histogram_mean(ORIGINAL),
+			histogram_percentile(REPLAYED, 50), histogram_percentile(REPLAYED, 90),
+			histogram_percentile(REPLAYED, 99), histogram_max(REPLAYED), histogram_mean(REPLAYED),
+			(long)delta_percentile(50), (long)delta_percentile(90), (long)delta_percentile(99));
+		return;
+	}
+	printf("replay: %s, %u connections at %.2fx, %.1fs\n", name, NCONN, OPT.speed, elapsed);
+	printf("  exchanges   %lu, matched %zu, unanswered %lu, errors %lu\n",
+		(unsigned long)histogram_count(REPLAYED), DELTAS.len, (unsigned long)UNANSWERED, (unsigned long)ERRORS);
+	printf("  original    p50 %luus  p90 %luus  p99 %luus  max %luus  mean %.1fus\n",
+		histogram_percentile(ORIGINAL, 50), histogram_percentile(ORIGINAL, 90),
+		histogram_percentile(ORIGINAL, 99), histogram_max(ORIGINAL), histogram_mean(ORIGINAL));
+	printf("  replay      p50 %luus  p90 %luus  p99 %luus  max %luus  mean %.1fus\n",
+		histogram_percentile(REPLAYED, 50), histogram_percentile(REPLAYED, 90),
+		histogram_percentile(REPLAYED, 99), histogram_max(REPLAYED), histogram_mean(REPLAYED));
+	printf("  delta       p50 %+ldus  p90 %+ldus  p99 %+ldus (replay - original, per exchange)\n",
+		(long)delta_percentile(50), (long)delta_percentile(90), (long)delta_percentile(99));
+}
+
+static void
+usage(const char* prog) {
+	fprintf(stderr,
+		"usage: %s (-u unix_path | -a host:port) [options] capture\n"
+		"  -s speed        1 plays at the recorded pace, 2 twice as fast (1)\n"
+		"  -g seconds      wait for responses after the last record (5)\n"
+		"  -j              print one json object instead of text\n",
+		prog);
+}
+
+int
+main(int argc, char* argv[]) {
+	int c, fd;
+	struct stat st;
+	const sge_capture_header* header;
+	void* base;
+	uint64_t start;
+
+	OPT.speed = 1;
+	OPT.grace = 5;
+	while ((c = getopt(argc, argv, "u:a:s:g:jh")) != -1) {
+		switch (c) {
+			case 'u': OPT.unix_path = optarg; break;
+			case 'a': OPT.addr = optarg; break;
+			case 's': OPT.speed = atof(optarg); break;
+			case 'g': OPT.grace = atof(optarg); break;
+			case 'j': OPT.json = 1; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if ((!OPT.unix_path && !OPT.addr) || optind != argc - 1 || OPT.speed <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (resolve(&OPT) == SGE_ERR) {
+		return 1;
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if ((size_t)st.st_size < sizeof(*header)) {
+		fprintf(stderr, "%s: too short for a capture\n", argv[optind]);
+		return 1;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		perror(argv[optind]);
+		return 1;
+	}
+	header = base;
+	if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 || header->version != CAPTURE_VERSION) {
+		fprintf(stderr, "%s: not a capture of version %d\n", argv[optind], CAPTURE_VERSION);
+		return 1;
+	}
+	if (load_original(base, st.st_size) == SGE_ERR) {
+		fprintf(stderr, "%s: no connections captured\n", argv[optind]);
+		return 1;
+	}
+
+	ORIGINAL = create_histogram();
+	REPLAYED = create_histogram();
+	start = now_ns();
+	replay(base, st.st_size);
+	report(argv[optind], (now_ns() - start) / (double)NS_PER_SEC);
+
+	destroy_histogram(ORIGINAL);
+	destroy_histogram(REPLAYED);
+	for (c = 0; c < (int)NCONN; ++c) {
+		free(CONNS[c].original.values);
+	}
+	free(CONNS);
+	free(DELTAS.values);
+	munmap(base, st.st_size);
+	return 0;
+}